@@ -0,0 +1,163 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+#include <sys/mman.h>
+
+// Allocators for the storage of arrays. Storage is aligned to cache lines
+// so that vector loads of rows never split a line.
+const size_t ALLOC_ALIGNMENT = 64;
+
+// Size of a transparent huge page on x86-64.
+const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+class Allocator {
+    public:
+    virtual ~Allocator() {}
+
+    virtual void* allocate(size_t bytes) = 0;
+    // The size has to be the one the storage was allocated with.
+    virtual void deallocate(void* ptr, size_t bytes) = 0;
+};
+
+// Aligned storage from the system allocator. With huge_pages storage of at
+// least a huge page is aligned to huge pages and backed by them when the
+// kernel allows, which cuts the TLB misses of walking large activations.
+class AlignedAllocator : public Allocator {
+    public:
+    bool huge_pages;
+
+    AlignedAllocator(bool _huge_pages = false) : huge_pages(_huge_pages) {}
+
+    void* allocate(size_t bytes) {
+        bool huge = huge_pages && bytes >= HUGE_PAGE_SIZE;
+        size_t align = huge ? HUGE_PAGE_SIZE : ALLOC_ALIGNMENT;
+        void* ptr = nullptr;
+        if (posix_memalign(&ptr, align,
+                           (bytes + align - 1)/align * align) != 0) {
+            throw std::bad_alloc();
+        }
+#ifdef MADV_HUGEPAGE
+        if (huge) {
+            madvise(ptr, bytes, MADV_HUGEPAGE);
+        }
+#endif
+        return ptr;
+    }
+
+    void deallocate(void* ptr, size_t) {
+        free(ptr);
+    }
+};
+
+// Keeps freed storage in size classes and hands it out again, so that
+// building and running graphs repeatedly does not go back to the system
+// for every array. Classes are an eighth of the next power of two apart,
+// which rounds a request up by less than a quarter. At most
+// max_cached_bytes are kept.
+class PoolAllocator : public Allocator {
+    public:
+    std::shared_ptr<Allocator> base;
+    size_t max_cached_bytes;
+
+    PoolAllocator(std::shared_ptr<Allocator> _base,
+                  size_t _max_cached_bytes = (size_t)1 << 30) :
+        base(_base), max_cached_bytes(_max_cached_bytes), cached_bytes(0) {}
+
+    ~PoolAllocator() {
+        trim();
+    }
+
+    static size_t size_class(size_t bytes) {
+        size_t size = ALLOC_ALIGNMENT;
+        while (size < bytes) {
+            size *= 2;
+        }
+        size_t step = std::max(ALLOC_ALIGNMENT, size/8);
+        return (bytes + step - 1)/step * step;
+    }
+
+    void* allocate(size_t bytes) {
+        size_t size = size_class(bytes);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto it = free_bufs.find(size);
+            if (it != free_bufs.end() && it->second.size() > 0) {
+                void* ptr = it->second.back();
+                it->second.pop_back();
+                cached_bytes -= size;
+                return ptr;
+            }
+        }
+        return base->allocate(size);
+    }
+
+    void deallocate(void* ptr, size_t bytes) {
+        size_t size = size_class(bytes);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (cached_bytes + size <= max_cached_bytes) {
+                free_bufs[size].push_back(ptr);
+                cached_bytes += size;
+                return;
+            }
+        }
+        base->deallocate(ptr, size);
+    }
+
+    // Return the cached storage to the base allocator.
+    void trim() {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto &bufs: free_bufs) {
+            for (void* ptr: bufs.second) {
+                base->deallocate(ptr, bufs.first);
+            }
+        }
+        free_bufs.clear();
+        cached_bytes = 0;
+    }
+
+    size_t get_cached_bytes() {
+        std::lock_guard<std::mutex> guard(lock);
+        return cached_bytes;
+    }
+
+    private:
+    std::mutex lock;
+    std::map<size_t, std::vector<void*>> free_bufs;
+    size_t cached_bytes;
+};
+
+inline std::shared_ptr<Allocator>& default_allocator() {
+    static std::shared_ptr<Allocator> allocator =
+        std::make_shared<PoolAllocator>(std::make_shared<AlignedAllocator>());
+    return allocator;
+}
+
+// Allocator of arrays created without one, a pool of aligned storage
+// unless replaced.
+inline std::shared_ptr<Allocator> get_default_allocator() {
+    return default_allocator();
+}
+
+inline void set_default_allocator(std::shared_ptr<Allocator> allocator) {
+    default_allocator() = allocator;
+}
+
+// Storage for count elements which goes back to the allocator when the
+// last reference to it is dropped.
+template <class T>
+std::shared_ptr<T> allocate_storage(size_t count,
+                                    std::shared_ptr<Allocator> allocator) {
+    size_t bytes = count * sizeof(T);
+    T* ptr = static_cast<T*>(allocator->allocate(bytes));
+    return std::shared_ptr<T>(ptr, [allocator, bytes](T* p) {
+                                       allocator->deallocate(p, bytes);
+                                   });
+}
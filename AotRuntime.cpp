@@ -0,0 +1,198 @@
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include "AotRuntime.h"
+#include "Op.h"
+
+struct HostPtrVisitor : public boost::static_visitor<void*> {
+    template <typename T>
+    void* operator()(NDArray<T>& arr) const {
+        return arr.host_alloc.get();
+    }
+};
+
+struct DimSizesVisitor : public boost::static_visitor<std::vector<int>> {
+    template <typename T>
+    std::vector<int> operator()(NDArray<T>& arr) const {
+        return arr.dim_sizes;
+    }
+};
+
+struct StridesVisitor : public boost::static_visitor<std::vector<size_t>> {
+    template <typename T>
+    std::vector<size_t> operator()(NDArray<T>& arr) const {
+        return arr.strides;
+    }
+};
+
+std::vector<int> get_dim_sizes(NDArray_t& arr) {
+    return boost::apply_visitor(DimSizesVisitor(), arr);
+}
+
+static halide_type_t get_halide_type(DataType type) {
+    halide_type_t t;
+    t.lanes = 1;
+    t.bits = get_type_size(type) * 8;
+    switch(type) {
+        case DataType::Float64:
+        case DataType::Float32:
+            t.code = halide_type_float;
+            break;
+        case DataType::Int64:
+        case DataType::Int32:
+        case DataType::Int16:
+        case DataType::Int8:
+            t.code = halide_type_int;
+            break;
+        default:
+            t.code = halide_type_uint;
+    }
+    return t;
+}
+
+void get_halide_raw_buffer(NDArray_t& arr, DataType type,
+                           std::vector<halide_dimension_t>& shape,
+                           halide_buffer_t& buf) {
+    std::vector<int> dim_sizes = get_dim_sizes(arr);
+    std::vector<size_t> strides = boost::apply_visitor(StridesVisitor(), arr);
+
+    shape.clear();
+    for (int d = dim_sizes.size() - 1; d >= 0; d--) {
+        halide_dimension_t dim;
+        dim.min = 0;
+        dim.extent = dim_sizes[d];
+        dim.stride = strides[d];
+        dim.flags = 0;
+        shape.push_back(dim);
+    }
+
+    buf = halide_buffer_t();
+    buf.host = static_cast<uint8_t*>(boost::apply_visitor(HostPtrVisitor(), arr));
+    buf.type = get_halide_type(type);
+    buf.dimensions = shape.size();
+    buf.dim = shape.data();
+}
+
+AotModel::AotModel(const std::string& manifest_path,
+                   const std::map<std::string, AotFunction>& functions) {
+    std::ifstream ifs(manifest_path);
+    if (!ifs.is_open()) {
+        std::cerr << "Could not open " << manifest_path << std::endl;
+        assert(0);
+    }
+
+    std::string header;
+    int version;
+    ifs >> header >> version;
+    assert(header == "dnncc_aot" && version == 1);
+
+    std::string tag;
+    while (ifs >> tag) {
+        if (tag == "group") {
+            AotGroup group;
+            ifs >> group.fn_name;
+            if (functions.find(group.fn_name) == functions.end()) {
+                std::cerr << "Missing function " << group.fn_name << std::endl;
+                assert(0);
+            }
+            group.fn = functions.at(group.fn_name);
+            groups.push_back(group);
+        } else if (tag == "arg") {
+            assert(groups.size() > 0);
+            AotArg arg;
+            std::string kind;
+            int type, dims;
+            ifs >> kind >> arg.op_name >> arg.param_index >> type >> dims;
+            arg.kind = kind == "input" ? AOT_INPUT :
+                       kind == "param" ? AOT_PARAM : AOT_OUTPUT;
+            arg.type = (DataType)type;
+            arg.dim_sizes.resize(dims);
+            for (int d = 0; d < dims; d++) {
+                ifs >> arg.dim_sizes[d];
+            }
+            groups.back().args.push_back(arg);
+        } else if (tag == "output") {
+            std::string op_name;
+            ifs >> op_name;
+            graph_outs.push_back(op_name);
+        } else {
+            std::cerr << "Unknown manifest entry " << tag << std::endl;
+            assert(0);
+        }
+    }
+
+    for (auto &g: groups) {
+        for (auto &arg: g.args) {
+            if (arg.kind == AOT_OUTPUT) {
+                op_outs[arg.op_name] = get_ndarray_t(arg.dim_sizes, arg.type);
+            }
+        }
+    }
+}
+
+void AotModel::set_params(std::map<std::string,
+                                   std::vector<NDArray_t>>& _params) {
+    for (auto &g: groups) {
+        for (auto &arg: g.args) {
+            if (arg.kind == AOT_PARAM) {
+                auto& op_params = _params.at(arg.op_name);
+                assert(arg.param_index < (int)op_params.size());
+                assert(get_dim_sizes(op_params[arg.param_index]) ==
+                       arg.dim_sizes);
+                params[arg.op_name] = op_params;
+            }
+        }
+    }
+}
+
+std::map<std::string, NDArray_t>
+AotModel::run(std::map<std::string, NDArray_t>& inputs) {
+    // The functions are compiled for any batch size up to the one in the
+    // manifest. Outputs are views of the first rows of the allocations.
+    int batch_size = 0;
+    for (auto &in: inputs) {
+        int in_batch = get_dim_sizes(in.second)[0];
+        assert(batch_size == 0 || batch_size == in_batch);
+        batch_size = in_batch;
+    }
+
+    std::map<std::string, NDArray_t> batch_outs;
+    for (auto &out: op_outs) {
+        batch_outs[out.first] = batch_size > 0 ?
+                                    get_batch_view(out.second, batch_size) :
+                                    out.second;
+    }
+
+    for (auto &g: groups) {
+        std::vector<std::vector<halide_dimension_t>> shapes(g.args.size());
+        std::vector<halide_buffer_t> bufs(g.args.size());
+        std::vector<void*> argv;
+
+        for (size_t a = 0; a < g.args.size(); a++) {
+            AotArg& arg = g.args[a];
+            NDArray_t* arr;
+            if (arg.kind == AOT_PARAM) {
+                arr = &params.at(arg.op_name)[arg.param_index];
+            } else if (batch_outs.find(arg.op_name) != batch_outs.end()) {
+                arr = &batch_outs.at(arg.op_name);
+            } else {
+                arr = &inputs.at(arg.op_name);
+            }
+            get_halide_raw_buffer(*arr, arg.type, shapes[a], bufs[a]);
+            argv.push_back(&bufs[a]);
+        }
+
+        int ret = g.fn(argv.data());
+        if (ret != 0) {
+            std::cerr << g.fn_name << " failed with error " << ret << std::endl;
+            assert(0);
+        }
+    }
+
+    std::map<std::string, NDArray_t> outputs;
+    for (auto &op: graph_outs) {
+        outputs[op] = batch_outs.at(op);
+    }
+
+    return outputs;
+}
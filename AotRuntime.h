@@ -0,0 +1,61 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include "HalideRuntime.h"
+#include "NDArray.h"
+
+// Lightweight runtime for graphs compiled ahead of time with
+// Graph::aot_output_dir. It runs the static libraries emitted for each
+// group and only depends on the Halide runtime, not on libHalide or LLVM.
+
+// Entry point generated for each group. The arguments are halide_buffer_t
+// pointers in the order listed in the manifest.
+typedef int (*AotFunction)(void**);
+
+enum AotArgKind { AOT_INPUT, AOT_PARAM, AOT_OUTPUT };
+
+struct AotArg {
+    AotArgKind kind;
+    std::string op_name;
+    // Index into the param list of the op for AOT_PARAM arguments.
+    int param_index;
+    DataType type;
+    // Sizes for the largest batch the functions were compiled for.
+    std::vector<int> dim_sizes;
+};
+
+struct AotGroup {
+    std::string fn_name;
+    AotFunction fn;
+    std::vector<AotArg> args;
+};
+
+class AotModel {
+    public:
+    std::vector<AotGroup> groups;
+    std::vector<std::string> graph_outs;
+
+    // Outputs of the groups and the params of the ops by name.
+    std::map<std::string, NDArray_t> op_outs;
+    std::map<std::string, std::vector<NDArray_t>> params;
+
+    // Load the manifest written along with the static libraries. The
+    // functions map the name of each group function to its entry point.
+    AotModel(const std::string& manifest_path,
+             const std::map<std::string, AotFunction>& functions);
+
+    void set_params(std::map<std::string, std::vector<NDArray_t>>& params);
+
+    std::map<std::string, NDArray_t>
+        run(std::map<std::string, NDArray_t>& inputs);
+};
+
+std::vector<int> get_dim_sizes(NDArray_t& arr);
+
+// Describe an array to Halide. The dims of the array are reversed since
+// the innermost Halide dimension comes first.
+void get_halide_raw_buffer(NDArray_t& arr, DataType type,
+                           std::vector<halide_dimension_t>& shape,
+                           halide_buffer_t& buf);
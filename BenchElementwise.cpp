@@ -0,0 +1,96 @@
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <vector>
+#include "Elementwise.h"
+#include "ThreadPool.h"
+
+// Times the vectorized and threaded elementwise operations against the
+// plain loops on one thread, for arrays from cache resident to well past
+// the last level cache. Reports the best of a few runs in GB/s of the
+// arrays read and written.
+
+static double best_time(const std::function<void()>& fn, int runs) {
+    fn();
+    double best = std::numeric_limits<double>::infinity();
+    for (int r = 0; r < runs; r++) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        auto end = std::chrono::steady_clock::now();
+        best = std::min(best,
+                        std::chrono::duration<double>(end - start).count());
+    }
+    return best;
+}
+
+struct Case {
+    std::string name;
+    // Arrays read and written by the operation.
+    int num_arrays;
+    std::function<void(size_t)> fast;
+    std::function<void(size_t)> plain;
+};
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        set_native_num_threads(std::atoi(argv[1]));
+    }
+    int num_threads = get_native_pool() ?
+                      get_native_pool()->num_threads() + 1 : 1;
+
+    size_t max_size = (size_t)1 << 24;
+    std::vector<float> a(max_size, 0.5f), b(max_size, -0.25f),
+                       c(max_size, 1.0f), y(max_size, 0.0f);
+    float* pa = a.data();
+    float* pb = b.data();
+    float* pc = c.data();
+    float* py = y.data();
+
+    // The plain loops are the templates, which the overloads for float
+    // take the place of.
+    std::vector<Case> cases = {
+        {"fill", 1,
+         [=](size_t n) { elementwise_fill(py, 1.0f, n); },
+         [=](size_t n) { elementwise_fill<float>(py, 1.0f, n); }},
+        {"copy", 2,
+         [=](size_t n) { elementwise_copy(pa, py, n); },
+         [=](size_t n) { elementwise_copy<float>(pa, py, n); }},
+        {"add", 3,
+         [=](size_t n) { elementwise_add(pa, py, n); },
+         [=](size_t n) { elementwise_add<float>(pa, py, n); }},
+        {"axpy", 3,
+         [=](size_t n) { elementwise_axpy(0.5f, pa, py, n); },
+         [=](size_t n) { elementwise_axpy<float>(0.5f, pa, py, n); }},
+        {"scale", 2,
+         [=](size_t n) { elementwise_scale(0.999f, py, n); },
+         [=](size_t n) { elementwise_scale<float>(0.999f, py, n); }},
+        {"relu", 2,
+         [=](size_t n) { elementwise_relu(pb, py, 0.1f, n); },
+         [=](size_t n) { elementwise_relu<float>(pb, py, 0.1f, n); }},
+        {"clamp", 2,
+         [=](size_t n) { elementwise_clamp(pb, py, 0.0f, 6.0f, n); },
+         [=](size_t n) { elementwise_clamp<float>(pb, py, 0.0f, 6.0f, n); }},
+        {"fma", 4,
+         [=](size_t n) { elementwise_fma(pa, pb, pc, py, n); },
+         [=](size_t n) { elementwise_fma<float>(pa, pb, pc, py, n); }},
+    };
+
+    std::cout << "threads " << num_threads << std::endl;
+    for (size_t n: {(size_t)1 << 12, (size_t)1 << 16, (size_t)1 << 20,
+                    max_size}) {
+        std::cout << n << " elements" << std::endl;
+        // Enough runs for the small arrays to be timed reliably.
+        int runs = std::max(3, (int)((1 << 24) / n));
+        for (auto &t: cases) {
+            double bytes = (double)t.num_arrays * n * sizeof(float);
+            double fast = best_time([&]() { t.fast(n); }, runs);
+            double plain = best_time([&]() { t.plain(n); }, runs);
+            std::cout << "  " << t.name << ": " << bytes / fast * 1e-9
+                      << " GB/s, plain " << bytes / plain * 1e-9
+                      << " GB/s, speedup " << plain / fast << std::endl;
+        }
+    }
+    return 0;
+}
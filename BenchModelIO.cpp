@@ -0,0 +1,90 @@
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <unistd.h>
+#include "ModelIO.h"
+
+// Times loading parameter files, such as those of vgg16, googlenet and
+// resnet50 written by caffe_convert. Files in the earlier format are also
+// converted into a container to compare the two. Every load reads all
+// the elements, so that mapped loads are not measured before the pages
+// are faulted in. The best of a few loads is reported, which is the time
+// with the file in the page cache.
+
+struct SumVisitor : public boost::static_visitor<double> {
+    template <class T>
+    double operator()(NDArray<T>& arr) const {
+        double sum = 0;
+        T* ptr = arr.host_alloc.get();
+        for (size_t i = 0; i < arr.buf_size; i++) {
+            sum += ptr[i];
+        }
+        return sum;
+    }
+};
+
+static size_t file_size(const std::string& path) {
+    std::ifstream ifs(path, std::ifstream::binary | std::ifstream::ate);
+    return ifs.tellg();
+}
+
+static void time_load(const std::string& label, const std::string& path,
+                      bool verify) {
+    double best = std::numeric_limits<double>::infinity();
+    double checksum = 0;
+    for (int r = 0; r < 3; r++) {
+        auto start = std::chrono::steady_clock::now();
+        Params params;
+        load_model_from_disk(path, params, verify);
+        checksum = 0;
+        for (auto &p: params) {
+            for (auto &arr: p.second) {
+                checksum += boost::apply_visitor(SumVisitor(), arr);
+            }
+        }
+        auto end = std::chrono::steady_clock::now();
+        best = std::min(best,
+                        std::chrono::duration<double>(end - start).count());
+    }
+    double mb = file_size(path) / (1024.0 * 1024.0);
+    std::cout << "  " << label << ": " << best * 1000 << " ms, "
+              << mb / best << " MB/s (sum " << checksum << ")" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <params_file> ..."
+                  << std::endl;
+        return 1;
+    }
+
+    for (int f = 1; f < argc; f++) {
+        std::string path = argv[f];
+        std::cout << path << " (" << file_size(path) / (1024 * 1024)
+                  << " MB)" << std::endl;
+        time_load("load", path, false);
+
+        if (is_params_container(path)) {
+            time_load("load and verify", path, true);
+            continue;
+        }
+
+        // Earlier format, compare with the file as a container.
+        Params params;
+        load_model_from_disk(path, params);
+        std::string converted = path + ".container_" +
+                                std::to_string(getpid());
+        auto start = std::chrono::steady_clock::now();
+        save_model_to_disk(converted, params, true);
+        auto end = std::chrono::steady_clock::now();
+        std::cout << "  save container: "
+                  << std::chrono::duration<double>(end - start).count() * 1000
+                  << " ms" << std::endl;
+        time_load("load container", converted, false);
+        time_load("load and verify container", converted, true);
+        std::remove(converted.c_str());
+    }
+    return 0;
+}
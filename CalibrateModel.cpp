@@ -0,0 +1,133 @@
+#include <cstdlib>
+#include <atomic>
+#include <fcntl.h>
+#include <thread>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "networks/Vgg.h"
+#include "networks/Googlenet.h"
+#include "networks/Resnet.h"
+#include "Graph.h"
+
+// Calibrates the scales of the quantized activations of a network over a
+// set of images and writes them next to the params of the model, from
+// where graphs with quantize_int8 load them, see
+// Graph::activation_scales_path.
+//
+// The images are preprocessed 3x224x224 float arrays stored one after the
+// other in a file. Each thread runs a float graph of its own over the
+// batches it takes, all of them adding to one calibrator.
+
+static bool build_network(Graph& g, const std::string& network,
+                          int batch_size) {
+    if (network == "vgg16") {
+        Vgg16(g, batch_size, 3, 224, 224);
+    } else if (network == "googlenet") {
+        Googlenet(g, batch_size, 3, 224, 224);
+    } else if (network == "resnet50") {
+        Resnet50(g, batch_size, 3, 224, 224);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 5) {
+        std::cerr << "Usage: " << argv[0]
+                  << " <network> <batch_size> <model> <images>"
+                  << " [minmax|percentile|kl] [num_threads]" << std::endl;
+        return 1;
+    }
+
+    std::string network = argv[1];
+    int batch_size = std::atoi(argv[2]);
+    std::string model_path = argv[3];
+    std::string images_path = argv[4];
+    std::string method_name = argc > 5 ? argv[5] : "kl";
+    int num_threads = argc > 6 ? std::atoi(argv[6]) :
+                      std::max(1u, std::thread::hardware_concurrency());
+
+    CalibrationMethod method;
+    if (method_name == "minmax") {
+        method = CALIBRATE_MINMAX;
+    } else if (method_name == "percentile") {
+        method = CALIBRATE_PERCENTILE;
+    } else if (method_name == "kl") {
+        method = CALIBRATE_KL;
+    } else {
+        std::cerr << "Unknown calibration method " << method_name
+                  << std::endl;
+        return 1;
+    }
+
+    int fd = open(images_path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        std::cerr << "Could not open " << images_path << std::endl;
+        return 1;
+    }
+    size_t image_size = 3 * 224 * 224;
+    int num_images = st.st_size / (image_size * sizeof(float));
+    int num_batches = (num_images + batch_size - 1) / batch_size;
+
+    Params params;
+    load_model_from_disk(model_path, params);
+
+    std::vector<std::unique_ptr<Graph>> graphs;
+    std::shared_ptr<Calibrator> calibrator;
+    for (int t = 0; t < num_threads; t++) {
+        std::unique_ptr<Graph> g(new Graph());
+        if (!build_network(*g, network, batch_size)) {
+            std::cerr << "Unknown network " << network << std::endl;
+            return 1;
+        }
+        if (!calibrator) {
+            calibrator = std::make_shared<Calibrator>(get_calibrated_ops(*g));
+        }
+        // The calibrated ops have to run as ops of their own.
+        for (size_t i = 0; i < g->groups.size(); i++) {
+            g->group_impl[i] = std::make_tuple(OpImpl::NATIVE,
+                                               TargetArch::CPU);
+        }
+        g->calibrator = calibrator;
+        g->build_forward({"prob"});
+        g->set_params(params);
+        graphs.push_back(std::move(g));
+    }
+
+    std::atomic<int> next_batch(0);
+    auto calibrate = [&](int t) {
+        Graph& g = *graphs[t];
+        for (int b = next_batch++; b < num_batches; b = next_batch++) {
+            int count = std::min(batch_size, num_images - b * batch_size);
+            NDArray<float> d({count, 3, 224, 224});
+            size_t bytes = count * image_size * sizeof(float);
+            off_t offset = (off_t)b * batch_size * image_size * sizeof(float);
+            if (pread(fd, d.host_alloc.get(), bytes, offset) !=
+                (ssize_t)bytes) {
+                std::cerr << "Could not read " << images_path << std::endl;
+                assert(0);
+            }
+            std::map<std::string, NDArray_t> ins;
+            ins["data"] = d;
+            g.run(ins);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++) {
+        threads.emplace_back(calibrate, t);
+    }
+    for (auto &t: threads) {
+        t.join();
+    }
+    close(fd);
+
+    ThreadPool pool(num_threads);
+    auto scales = calibrator->get_scales(method, 99.99f, &pool);
+    std::string scales_path = get_activation_scales_path(model_path);
+    save_activation_scales(scales_path, scales);
+    std::cout << "Calibrated " << scales.size() << " ops over " << num_images
+              << " images into " << scales_path << std::endl;
+    return 0;
+}
@@ -0,0 +1,269 @@
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+#include "Calibration.h"
+#include "Graph.h"
+#include "TextDB.h"
+
+// Levels of a quantized activation above zero.
+static const int QUANT_LEVELS = 255;
+
+static const std::string scales_header = "dnncc_activation_scales 1";
+
+float ActivationHistogram::range() const {
+    return std::ldexp(1.0f, range_exp);
+}
+
+void ActivationHistogram::grow(int exp) {
+    while (range_exp < exp) {
+        for (int b = 0; b < CALIBRATION_BINS/2; b++) {
+            counts[b] = counts[2*b] + counts[2*b + 1];
+        }
+        std::fill(counts.begin() + CALIBRATION_BINS/2, counts.end(), 0);
+        range_exp++;
+    }
+}
+
+void ActivationHistogram::add_values(const float* values, size_t count) {
+    float batch_max = 0.0f;
+    for (size_t i = 0; i < count; i++) {
+        batch_max = std::max(batch_max, values[i]);
+    }
+    max = std::max(max, batch_max);
+    if (batch_max >= range()) {
+        int exp;
+        std::frexp(batch_max, &exp);
+        grow(exp);
+    }
+
+    float bins_per_value = CALIBRATION_BINS / range();
+    for (size_t i = 0; i < count; i++) {
+        int b = (int)(std::max(values[i], 0.0f) * bins_per_value);
+        counts[std::min(b, CALIBRATION_BINS - 1)]++;
+    }
+}
+
+void ActivationHistogram::add(const ActivationHistogram& other) {
+    ActivationHistogram o = other;
+    grow(o.range_exp);
+    o.grow(range_exp);
+    for (int b = 0; b < CALIBRATION_BINS; b++) {
+        counts[b] += o.counts[b];
+    }
+    max = std::max(max, o.max);
+}
+
+// Probability given to the bins the quantized counts miss, so that the
+// divergence stays finite.
+static const double KL_SMOOTHING = 1e-4;
+
+// Divergence of the first bins quantized to the levels from the first bins
+// with the clipped counts added to the last, both normalized. The levels
+// are built from the counts before clipping, so clipping costs the
+// divergence of the clipped counts and quantizing the bins into fewer
+// levels the divergence of the counts merged within a level.
+static double clipped_divergence(const std::vector<uint64_t>& counts,
+                                 int bins, double clipped) {
+    std::vector<double> q(bins, 0.0);
+    double kept = 0.0;
+    for (int l = 0; l < QUANT_LEVELS; l++) {
+        int begin = (int64_t)l * bins / QUANT_LEVELS;
+        int end = (int64_t)(l + 1) * bins / QUANT_LEVELS;
+        double sum = 0.0;
+        int nonzero = 0;
+        for (int b = begin; b < end; b++) {
+            sum += counts[b];
+            nonzero += counts[b] > 0;
+        }
+        // A level stands for its nonzero bins in equal parts.
+        for (int b = begin; b < end; b++) {
+            if (counts[b] > 0) {
+                q[b] = sum / nonzero;
+            }
+        }
+        kept += sum;
+    }
+    if (kept == 0.0) {
+        return INFINITY;
+    }
+
+    double total = kept + clipped;
+    double divergence = 0.0;
+    for (int b = 0; b < bins; b++) {
+        double p = (counts[b] + (b == bins - 1 ? clipped : 0.0)) / total;
+        if (p > 0.0) {
+            double q_b = q[b] > 0.0 ? q[b] / kept : KL_SMOOTHING;
+            divergence += p * std::log(p / q_b);
+        }
+    }
+    return divergence;
+}
+
+float ActivationHistogram::threshold(CalibrationMethod method,
+                                     float percentile) const {
+    if (method == CALIBRATE_MINMAX || max == 0.0f) {
+        return max;
+    }
+
+    float bin_width = range() / CALIBRATION_BINS;
+    uint64_t total = 0;
+    int last = 0;
+    for (int b = 0; b < CALIBRATION_BINS; b++) {
+        total += counts[b];
+        if (counts[b] > 0) {
+            last = b;
+        }
+    }
+
+    if (method == CALIBRATE_PERCENTILE) {
+        uint64_t below = 0;
+        for (int b = 0; b <= last; b++) {
+            below += counts[b];
+            if (below >= percentile / 100.0 * total) {
+                return std::min(max, (b + 1) * bin_width);
+            }
+        }
+        return max;
+    }
+
+    // With no more bins than levels nothing is lost without clipping.
+    if (last < QUANT_LEVELS) {
+        return max;
+    }
+    int best_bins = last + 1;
+    double best = INFINITY;
+    double clipped = 0.0;
+    for (int bins = last + 1; bins >= QUANT_LEVELS; bins--) {
+        // The bins from bins on are clipped into the last kept bin. Ties
+        // go to the lower threshold, which has the finer steps.
+        double divergence = clipped_divergence(counts, bins, clipped);
+        if (divergence <= best) {
+            best = divergence;
+            best_bins = bins;
+        }
+        clipped += counts[bins - 1];
+    }
+    return std::min(max, best_bins * bin_width);
+}
+
+Calibrator::Calibrator(const std::vector<std::string>& op_names) {
+    for (auto &name: op_names) {
+        hists[name] = std::unique_ptr<OpHistogram>(new OpHistogram());
+    }
+}
+
+void Calibrator::observe(const std::string& op_name, NDArray_t& out) {
+    auto it = hists.find(op_name);
+    if (it == hists.end() || out.which() != DataType::Float32) {
+        return;
+    }
+
+    NDArray<float>& arr = get_ndarray<float>(out);
+    ActivationHistogram hist;
+    if (arr.is_contiguous()) {
+        hist.add_values(arr.host_alloc.get(), arr.buf_size);
+    } else {
+        // Slices of concatenated outputs, dense within each entry.
+        int batch_size = arr.dim_sizes[0];
+        size_t entry_size = arr.buf_size / batch_size;
+        for (int b = 0; b < batch_size; b++) {
+            hist.add_values(arr.host_alloc.get() + b * arr.strides[0],
+                            entry_size);
+        }
+    }
+
+    OpHistogram& op_hist = *it->second;
+    std::lock_guard<std::mutex> guard(op_hist.lock);
+    op_hist.hist.add(hist);
+    op_hist.num_observed++;
+}
+
+std::map<std::string, float>
+Calibrator::get_scales(CalibrationMethod method, float percentile,
+                       ThreadPool* pool) {
+    std::vector<std::string> names;
+    for (auto &h: hists) {
+        if (h.second->num_observed > 0 && h.second->hist.max > 0.0f) {
+            names.push_back(h.first);
+        }
+    }
+
+    std::vector<float> thresholds(names.size());
+    auto search = [&](int i) {
+        OpHistogram& op_hist = *hists.at(names[i]);
+        std::lock_guard<std::mutex> guard(op_hist.lock);
+        thresholds[i] = op_hist.hist.threshold(method, percentile);
+    };
+    if (pool) {
+        pool->parallel_for(0, names.size(), search);
+    } else {
+        for (size_t i = 0; i < names.size(); i++) {
+            search(i);
+        }
+    }
+
+    std::map<std::string, float> scales;
+    for (size_t i = 0; i < names.size(); i++) {
+        scales[names[i]] = thresholds[i] / QUANT_LEVELS;
+    }
+    return scales;
+}
+
+size_t Calibrator::num_observed(const std::string& op_name) {
+    OpHistogram& op_hist = *hists.at(op_name);
+    std::lock_guard<std::mutex> guard(op_hist.lock);
+    return op_hist.num_observed;
+}
+
+std::vector<std::string> get_calibrated_ops(Graph& g) {
+    std::vector<std::string> names;
+    for (auto &op: g.ops) {
+        auto relu = std::dynamic_pointer_cast<ReLUOp>(op.second);
+        if ((relu && relu->slope == 0.0f) ||
+            std::dynamic_pointer_cast<Pool2dOp>(op.second)) {
+            names.push_back(op.first);
+        }
+    }
+    return names;
+}
+
+std::string get_activation_scales_path(const std::string& model_path) {
+    return model_path + ".scales";
+}
+
+void save_activation_scales(const std::string& path,
+                            const std::map<std::string, float>& scales) {
+    save_text_db(path, scales_header, [&](std::ostream& os) {
+        // Enough digits for the scales to read back exactly.
+        os << std::setprecision(9);
+        for (auto &s: scales) {
+            os << s.first << " " << s.second << std::endl;
+        }
+    });
+}
+
+bool load_activation_scales(const std::string& path,
+                            std::map<std::string, float>& scales) {
+    std::ifstream ifs;
+    if (!open_text_db(path, scales_header, ifs)) {
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(ifs, line)) {
+        if (line.empty()) {
+            continue;
+        }
+        std::stringstream ss(line);
+        std::string name;
+        float scale;
+        ss >> name >> scale;
+        if (ss.fail() || !(scale > 0.0f)) {
+            std::cerr << "Malformed line in " << path << ": " << line
+                      << std::endl;
+            assert(0);
+        }
+        scales[name] = scale;
+    }
+    return true;
+}
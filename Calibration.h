@@ -0,0 +1,92 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "NDArray.h"
+#include "ThreadPool.h"
+
+class Graph;
+
+// Post-training calibration of the scales of quantized activations, see
+// Graph::plan_quantization. A graph running float kernels with a
+// calibrator adds the outputs of the calibrated ops to a histogram of
+// each op, from which the scale of the op is chosen.
+
+enum CalibrationMethod {
+    // The largest value is the largest step, nothing is clipped.
+    CALIBRATE_MINMAX,
+    // Clip the values above a percentile of the histogram.
+    CALIBRATE_PERCENTILE,
+    // Clip at the threshold which loses the least information, measured
+    // by the KL divergence of the quantized histogram from the original.
+    CALIBRATE_KL
+};
+
+// Counts of non-negative values in CALIBRATION_BINS bins spanning
+// [0, 2^range_exp). Negative values count as zeros, as quantized
+// activations are unsigned. The range only grows by powers of two, by
+// merging pairs of bins, so that histograms of different batches add up.
+const int CALIBRATION_BINS = 2048;
+
+struct ActivationHistogram {
+    int range_exp;
+    float max;
+    std::vector<uint64_t> counts;
+
+    ActivationHistogram() : range_exp(-24), max(0.0f),
+                            counts(CALIBRATION_BINS, 0) {}
+
+    float range() const;
+    void grow(int exp);
+    void add_values(const float* values, size_t count);
+    void add(const ActivationHistogram& other);
+
+    // Value above which the scale clips.
+    float threshold(CalibrationMethod method, float percentile) const;
+};
+
+class Calibrator {
+    public:
+    // Ops whose outputs are calibrated, the others are ignored.
+    Calibrator(const std::vector<std::string>& op_names);
+
+    // Add an output of the op. Safe to call from the inter-op threads of
+    // a graph and from graphs running in parallel: the histogram of the
+    // values is built without holding the lock of the op.
+    void observe(const std::string& op_name, NDArray_t& out);
+
+    // Scale of each op with values, the threshold mapped to 255. The
+    // thresholds of the ops are searched in parallel on the pool.
+    std::map<std::string, float>
+        get_scales(CalibrationMethod method, float percentile = 99.99f,
+                   ThreadPool* pool = nullptr);
+
+    size_t num_observed(const std::string& op_name);
+
+    private:
+    struct OpHistogram {
+        std::mutex lock;
+        ActivationHistogram hist;
+        size_t num_observed;
+
+        OpHistogram() : num_observed(0) {}
+    };
+    std::map<std::string, std::unique_ptr<OpHistogram>> hists;
+};
+
+// Ops of the graph that Graph::plan_quantization can quantize given a
+// scale: ReLUs without a slope and pools.
+std::vector<std::string> get_calibrated_ops(Graph& g);
+
+// Scales are saved one op per line after a header, in a file next to the
+// params of the model named by get_activation_scales_path. Graphs built
+// with quantize_int8 read them from Graph::activation_scales_path, and
+// entries already in Graph::activation_scales take precedence.
+std::string get_activation_scales_path(const std::string& model_path);
+void save_activation_scales(const std::string& path,
+                            const std::map<std::string, float>& scales);
+bool load_activation_scales(const std::string& path,
+                            std::map<std::string, float>& scales);
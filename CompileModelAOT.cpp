@@ -0,0 +1,39 @@
+#include <cstdlib>
+#include "networks/Vgg.h"
+#include "networks/Googlenet.h"
+#include "networks/Resnet.h"
+#include "Graph.h"
+
+// Compiles a network ahead of time into the given directory. The output
+// is linked into a serving binary along with aot_runtime.o, see the
+// classify_aot target.
+int main(int argc, char **argv) {
+    if (argc < 4) {
+        std::cerr << "Usage: " << argv[0] << " <network> <batch_size> <output_dir>"
+                  << std::endl;
+        return 1;
+    }
+
+    std::string network = argv[1];
+    int batch_size = std::atoi(argv[2]);
+
+    Graph g;
+    if (network == "vgg16") {
+        Vgg16(g, batch_size, 3, 224, 224);
+    } else if (network == "googlenet") {
+        Googlenet(g, batch_size, 3, 224, 224);
+    } else if (network == "resnet50") {
+        Resnet50(g, batch_size, 3, 224, 224);
+    } else {
+        std::cerr << "Unknown network " << network << std::endl;
+        return 1;
+    }
+
+    for (int i = 0; i < g.num_groups(); i++) {
+        g.group_impl[i] = std::make_tuple(OpImpl::HALIDE, TargetArch::CPU);
+    }
+
+    g.aot_output_dir = argv[3];
+    g.build_forward({"prob"});
+    return 0;
+}
@@ -0,0 +1,85 @@
+#include <sstream>
+#include "ConvTuning.h"
+#include "TextDB.h"
+
+// Each line after the header records the algorithm of one shape:
+// conv <batch> <in_w> <in_h> <in_c> <out_c> <f_w> <f_h> <stride> <algorithm>
+static const std::string tuning_header = "dnncc_conv_tuning 1";
+
+bool ConvTuning::load(const std::string& path) {
+    std::ifstream ifs;
+    if (!open_text_db(path, tuning_header, ifs)) {
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(ifs, line)) {
+        if (line.empty()) {
+            continue;
+        }
+        std::stringstream ss(line);
+        std::string tag, name;
+        int b, in_w, in_h, in_c, out_c, f_w, f_h, stride;
+        ss >> tag >> b >> in_w >> in_h >> in_c >> out_c >> f_w >> f_h
+           >> stride >> name;
+        if (ss.fail() || tag != "conv") {
+            std::cerr << "Malformed line in " << path << ": " << line
+                      << std::endl;
+            assert(0);
+        }
+        ConvLayerShape shape(b, in_w, in_h, in_c, out_c, f_w, f_h, stride);
+        algorithms[shape] = get_conv_algorithm(name);
+    }
+    return true;
+}
+
+void ConvTuning::save(const std::string& path) {
+    save_text_db(path, tuning_header, [this](std::ostream& os) {
+        for (auto &a: algorithms) {
+            const ConvLayerShape& s = a.first;
+            os << "conv " << s.batch_size << " " << s.input_width << " "
+               << s.input_height << " " << s.input_channels << " "
+               << s.output_channels << " " << s.filter_width << " "
+               << s.filter_height << " " << s.stride << " "
+               << get_conv_algorithm_name(a.second) << std::endl;
+        }
+    });
+}
+
+ConvLayerShape get_conv_layer_shape(Conv2dOp& op) {
+    return ConvLayerShape(op.batch_size, op.input_width, op.input_height,
+                          op.input_channels, op.output_channels,
+                          op.filter_width, op.filter_height, op.stride_h);
+}
+
+std::string get_conv_algorithm_name(ConvAlgorithm algorithm) {
+    switch (algorithm) {
+        case CONV_IM2COL:
+            return "im2col";
+        case CONV_WINOGRAD:
+            return "winograd";
+        case CONV_FFT:
+            return "fft";
+        case CONV_DIRECT:
+            return "direct";
+        default:
+            return "auto";
+    }
+}
+
+ConvAlgorithm get_conv_algorithm(const std::string& name) {
+    if (name == "im2col") {
+        return CONV_IM2COL;
+    } else if (name == "winograd") {
+        return CONV_WINOGRAD;
+    } else if (name == "fft") {
+        return CONV_FFT;
+    } else if (name == "direct") {
+        return CONV_DIRECT;
+    } else if (name == "auto") {
+        return CONV_AUTO;
+    }
+    std::cerr << "Unknown conv algorithm " << name << std::endl;
+    assert(0);
+    return CONV_AUTO;
+}
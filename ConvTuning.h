@@ -0,0 +1,27 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include "Op.h"
+#include "OpShapes.h"
+
+// Algorithms of native convs picked by timing them on the machine, keyed
+// by the shape of the conv. The table is kept in a text file so that later
+// builds reuse the choices instead of timing the convs again.
+class ConvTuning {
+    public:
+    std::map<ConvLayerShape, ConvAlgorithm> algorithms;
+
+    // Add the entries of a tuning file to the table. Returns false when
+    // there is no file.
+    bool load(const std::string& path);
+
+    // Write the table, replacing the file at once so that concurrent
+    // builds never read a partial table.
+    void save(const std::string& path);
+};
+
+ConvLayerShape get_conv_layer_shape(Conv2dOp& op);
+
+std::string get_conv_algorithm_name(ConvAlgorithm algorithm);
+ConvAlgorithm get_conv_algorithm(const std::string& name);
@@ -1,6 +1,12 @@
+#include <iostream>
 #include "LoadCaffeParams.h"
 
 int main(int argc, char **argv) {
+    if (argc < 4) {
+        std::cerr << "Usage: " << argv[0] << " <caffe_proto> <caffe_weights>"
+                  << " <dnncc_weights> [float16|bfloat16]" << std::endl;
+        return 1;
+    }
     std::string caffe_proto_file = argv[1];
     std::string caffe_weights_file = argv[2];
     std::string dnncc_weights_file = argv[3];
@@ -12,6 +18,19 @@ int main(int argc, char **argv) {
                       caffe_weights_file,
                       params);
 
+    // Optionally store the weights in 16 bits.
+    if (argc > 4) {
+        std::string type = argv[4];
+        if (type == "float16") {
+            narrow_params(params, DataType::Float16);
+        } else if (type == "bfloat16") {
+            narrow_params(params, DataType::BFloat16);
+        } else {
+            std::cerr << "Unknown weight type " << type << std::endl;
+            return 1;
+        }
+    }
+
     save_model_to_disk(dnncc_weights_file, params);
     return 0;
 }
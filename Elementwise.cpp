@@ -0,0 +1,194 @@
+#include <cstring>
+#include <functional>
+#include <immintrin.h>
+#include "Elementwise.h"
+#include "ThreadPool.h"
+
+// The operations are bound by memory bandwidth, so 8-wide AVX already
+// keeps up with the loads. Large arrays are split into a few chunks per
+// thread, of at least ELEMENTWISE_PARALLEL_SIZE/4 elements each and
+// multiples of a cache line.
+static void for_chunks(size_t n,
+                       const std::function<void(size_t, size_t)>& body) {
+    ThreadPool* pool = n >= ELEMENTWISE_PARALLEL_SIZE ? get_native_pool() :
+                                                        nullptr;
+    if (!pool) {
+        body(0, n);
+        return;
+    }
+
+    size_t num_chunks = std::min((size_t)(pool->num_threads() + 1) * 2,
+                                 n / (ELEMENTWISE_PARALLEL_SIZE/4));
+    size_t chunk = ((n + num_chunks - 1)/num_chunks + 15)/16 * 16;
+    pool->parallel_for(0, (n + chunk - 1)/chunk, [&](int c) {
+                           size_t begin = c * chunk;
+                           body(begin, std::min(n, begin + chunk));
+                       });
+}
+
+static void fill_chunk(float* y, float a, size_t begin, size_t end) {
+    size_t i = begin;
+#if defined(__AVX__)
+    __m256 va = _mm256_set1_ps(a);
+    for (; i + 8 <= end; i += 8) {
+        _mm256_storeu_ps(y + i, va);
+    }
+#endif
+    for (; i < end; i++) {
+        y[i] = a;
+    }
+}
+
+static void add_chunk(const float* x, float* y, size_t begin, size_t end) {
+    size_t i = begin;
+#if defined(__AVX__)
+    for (; i + 8 <= end; i += 8) {
+        _mm256_storeu_ps(y + i, _mm256_add_ps(_mm256_loadu_ps(y + i),
+                                              _mm256_loadu_ps(x + i)));
+    }
+#endif
+    for (; i < end; i++) {
+        y[i] += x[i];
+    }
+}
+
+static void axpy_chunk(float a, const float* x, float* y, size_t begin,
+                       size_t end) {
+    size_t i = begin;
+#if defined(__AVX__)
+    __m256 va = _mm256_set1_ps(a);
+    for (; i + 8 <= end; i += 8) {
+        __m256 vx = _mm256_loadu_ps(x + i);
+        __m256 vy = _mm256_loadu_ps(y + i);
+#if defined(__FMA__)
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(va, vx, vy));
+#else
+        _mm256_storeu_ps(y + i, _mm256_add_ps(_mm256_mul_ps(va, vx), vy));
+#endif
+    }
+#endif
+    for (; i < end; i++) {
+        y[i] += a * x[i];
+    }
+}
+
+static void scale_chunk(float a, float* y, size_t begin, size_t end) {
+    size_t i = begin;
+#if defined(__AVX__)
+    __m256 va = _mm256_set1_ps(a);
+    for (; i + 8 <= end; i += 8) {
+        _mm256_storeu_ps(y + i, _mm256_mul_ps(va, _mm256_loadu_ps(y + i)));
+    }
+#endif
+    for (; i < end; i++) {
+        y[i] *= a;
+    }
+}
+
+static void relu_chunk(const float* x, float* y, float slope, size_t begin,
+                       size_t end) {
+    size_t i = begin;
+#if defined(__AVX__)
+    __m256 vslope = _mm256_set1_ps(slope);
+    __m256 zero = _mm256_setzero_ps();
+    for (; i + 8 <= end; i += 8) {
+        __m256 vx = _mm256_loadu_ps(x + i);
+        __m256 positive = _mm256_cmp_ps(vx, zero, _CMP_GT_OQ);
+        _mm256_storeu_ps(y + i, _mm256_blendv_ps(_mm256_mul_ps(vslope, vx),
+                                                 vx, positive));
+    }
+#endif
+    for (; i < end; i++) {
+        y[i] = x[i] > 0 ? x[i] : slope * x[i];
+    }
+}
+
+static void clamp_chunk(const float* x, float* y, float lo, float hi,
+                        size_t begin, size_t end) {
+    size_t i = begin;
+#if defined(__AVX__)
+    __m256 vlo = _mm256_set1_ps(lo);
+    __m256 vhi = _mm256_set1_ps(hi);
+    for (; i + 8 <= end; i += 8) {
+        __m256 vx = _mm256_loadu_ps(x + i);
+        _mm256_storeu_ps(y + i, _mm256_min_ps(_mm256_max_ps(vx, vlo), vhi));
+    }
+#endif
+    for (; i < end; i++) {
+        y[i] = std::min(std::max(x[i], lo), hi);
+    }
+}
+
+static void fma_chunk(const float* a, const float* b, const float* c,
+                      float* y, size_t begin, size_t end) {
+    size_t i = begin;
+#if defined(__AVX__)
+    for (; i + 8 <= end; i += 8) {
+        __m256 va = _mm256_loadu_ps(a + i);
+        __m256 vb = _mm256_loadu_ps(b + i);
+        __m256 vc = _mm256_loadu_ps(c + i);
+#if defined(__FMA__)
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(va, vb, vc));
+#else
+        _mm256_storeu_ps(y + i, _mm256_add_ps(_mm256_mul_ps(va, vb), vc));
+#endif
+    }
+#endif
+    for (; i < end; i++) {
+        y[i] = a[i] * b[i] + c[i];
+    }
+}
+
+void elementwise_fill(float* y, float a, size_t n) {
+    for_chunks(n, [=](size_t begin, size_t end) {
+                      fill_chunk(y, a, begin, end);
+                  });
+}
+
+void elementwise_copy(const float* x, float* y, size_t n) {
+    if (x == y) {
+        return;
+    }
+    for_chunks(n, [=](size_t begin, size_t end) {
+                      std::memcpy(y + begin, x + begin,
+                                  (end - begin) * sizeof(float));
+                  });
+}
+
+void elementwise_add(const float* x, float* y, size_t n) {
+    for_chunks(n, [=](size_t begin, size_t end) {
+                      add_chunk(x, y, begin, end);
+                  });
+}
+
+void elementwise_axpy(float a, const float* x, float* y, size_t n) {
+    for_chunks(n, [=](size_t begin, size_t end) {
+                      axpy_chunk(a, x, y, begin, end);
+                  });
+}
+
+void elementwise_scale(float a, float* y, size_t n) {
+    for_chunks(n, [=](size_t begin, size_t end) {
+                      scale_chunk(a, y, begin, end);
+                  });
+}
+
+void elementwise_relu(const float* x, float* y, float slope, size_t n) {
+    for_chunks(n, [=](size_t begin, size_t end) {
+                      relu_chunk(x, y, slope, begin, end);
+                  });
+}
+
+void elementwise_clamp(const float* x, float* y, float lo, float hi,
+                       size_t n) {
+    for_chunks(n, [=](size_t begin, size_t end) {
+                      clamp_chunk(x, y, lo, hi, begin, end);
+                  });
+}
+
+void elementwise_fma(const float* a, const float* b, const float* c,
+                     float* y, size_t n) {
+    for_chunks(n, [=](size_t begin, size_t end) {
+                      fma_chunk(a, b, c, y, begin, end);
+                  });
+}
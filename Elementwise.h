@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <algorithm>
+
+// Elementwise operations over n consecutive elements, used by the arrays
+// and the reference kernels. The float versions are vectorized and split
+// large arrays over the native pool, see get_native_pool. Other types
+// take the plain loops. Outputs may alias inputs.
+
+// Arrays with fewer elements run on the calling thread alone.
+const size_t ELEMENTWISE_PARALLEL_SIZE = 1 << 16;
+
+template <class T>
+void elementwise_fill(T* y, T a, size_t n) {
+    std::fill(y, y + n, a);
+}
+
+template <class T>
+void elementwise_copy(const T* x, T* y, size_t n) {
+    std::copy(x, x + n, y);
+}
+
+// y += x
+template <class T>
+void elementwise_add(const T* x, T* y, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        y[i] += x[i];
+    }
+}
+
+// y += a * x
+template <class T>
+void elementwise_axpy(T a, const T* x, T* y, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        y[i] += a * x[i];
+    }
+}
+
+// y *= a
+template <class T>
+void elementwise_scale(T a, T* y, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        y[i] *= a;
+    }
+}
+
+// y = x > 0 ? x : slope * x
+template <class T>
+void elementwise_relu(const T* x, T* y, T slope, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        y[i] = x[i] > 0 ? x[i] : slope * x[i];
+    }
+}
+
+// y = min(max(x, lo), hi)
+template <class T>
+void elementwise_clamp(const T* x, T* y, T lo, T hi, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        y[i] = std::min(std::max(x[i], lo), hi);
+    }
+}
+
+// y = a * b + c
+template <class T>
+void elementwise_fma(const T* a, const T* b, const T* c, T* y, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        y[i] = a[i] * b[i] + c[i];
+    }
+}
+
+void elementwise_fill(float* y, float a, size_t n);
+void elementwise_copy(const float* x, float* y, size_t n);
+void elementwise_add(const float* x, float* y, size_t n);
+void elementwise_axpy(float a, const float* x, float* y, size_t n);
+void elementwise_scale(float a, float* y, size_t n);
+void elementwise_relu(const float* x, float* y, float slope, size_t n);
+void elementwise_clamp(const float* x, float* y, float lo, float hi,
+                       size_t n);
+void elementwise_fma(const float* a, const float* b, const float* c,
+                     float* y, size_t n);
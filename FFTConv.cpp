@@ -0,0 +1,436 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include "FFTConv.h"
+#include "Gemm.h"
+
+// Radix-2 FFT of size n applied along the outer dimension of a complex
+// array stored as separate real and imaginary planes. All the columns are
+// transformed together, so each butterfly is a loop over a row that the
+// compiler vectorizes.
+class FFTPlan {
+    public:
+    int n;
+    std::vector<int> rev;
+    std::vector<float> tw_re, tw_im;
+
+    FFTPlan(int _n) : n(_n), rev(_n), tw_re(_n/2), tw_im(_n/2) {
+        int bits = 0;
+        while ((1 << bits) < n) {
+            bits++;
+        }
+        for (int i = 0; i < n; i++) {
+            int r = 0;
+            for (int b = 0; b < bits; b++) {
+                r |= ((i >> b) & 1) << (bits - 1 - b);
+            }
+            rev[i] = r;
+        }
+        for (int i = 0; i < n/2; i++) {
+            double angle = -2.0 * M_PI * i / n;
+            tw_re[i] = std::cos(angle);
+            tw_im[i] = std::sin(angle);
+        }
+    }
+
+    // Unnormalized transform in place of the n x cols array. The inverse
+    // uses the conjugate twiddles.
+    void transform(float* re, float* im, int cols, bool inverse) const {
+        for (int i = 0; i < n; i++) {
+            if (i < rev[i]) {
+                std::swap_ranges(re + i * cols, re + (i + 1) * cols,
+                                 re + rev[i] * cols);
+                std::swap_ranges(im + i * cols, im + (i + 1) * cols,
+                                 im + rev[i] * cols);
+            }
+        }
+        for (int len = 2; len <= n; len <<= 1) {
+            int step = n/len;
+            for (int i = 0; i < n; i += len) {
+                for (int j = 0; j < len/2; j++) {
+                    float wr = tw_re[j * step];
+                    float wi = inverse ? -tw_im[j * step] : tw_im[j * step];
+                    float* __restrict__ ur = re + (i + j) * cols;
+                    float* __restrict__ ui = im + (i + j) * cols;
+                    float* __restrict__ vr = re + (i + j + len/2) * cols;
+                    float* __restrict__ vi = im + (i + j + len/2) * cols;
+                    for (int c = 0; c < cols; c++) {
+                        float tr = vr[c] * wr - vi[c] * wi;
+                        float ti = vr[c] * wi + vi[c] * wr;
+                        vr[c] = ur[c] - tr;
+                        vi[c] = ui[c] - ti;
+                        ur[c] += tr;
+                        ui[c] += ti;
+                    }
+                }
+            }
+        }
+    }
+};
+
+static const FFTPlan& get_plan(int n) {
+    static const FFTPlan plans[] = {FFTPlan(8), FFTPlan(16), FFTPlan(32)};
+    for (auto &p: plans) {
+        if (p.n == n) {
+            return p;
+        }
+    }
+    assert(0);
+    return plans[0];
+}
+
+// Tiles are transformed together in batches whose rows are this many
+// floats. The rows are long enough to fill the vector units while the
+// planes of a batch stay in L1.
+static const int BATCH_COLS = 128;
+
+// Transform b real n x n tiles at in + i * step with row stride ld to the
+// frequencies (k1, k2) with k2 <= n/2, the rest being the conjugates of
+// these. Frequency (k1, k2) of tile i is at k2 * b * n + i * n + k1 of
+// the re and im planes. The planes hold n * b * n floats.
+static void forward_2d(const FFTPlan& plan, const float* in, int ld,
+                       int step, int b, float* re, float* im,
+                       float* tmp_re, float* tmp_im) {
+    int n = plan.n;
+    int cols = b * n;
+    // Along the columns of the tiles, whose rows are copied as is.
+    for (int r = 0; r < n; r++) {
+        for (int i = 0; i < b; i++) {
+            std::copy(in + i * step + r * ld, in + i * step + r * ld + n,
+                      tmp_re + r * cols + i * n);
+        }
+    }
+    std::fill(tmp_im, tmp_im + n * cols, 0.0f);
+    plan.transform(tmp_re, tmp_im, cols, false);
+
+    // Along the rows, as columns of the transposed tiles.
+    for (int k1 = 0; k1 < n; k1++) {
+        for (int i = 0; i < b; i++) {
+            for (int c = 0; c < n; c++) {
+                re[c * cols + i * n + k1] = tmp_re[k1 * cols + i * n + c];
+                im[c * cols + i * n + k1] = tmp_im[k1 * cols + i * n + c];
+            }
+        }
+    }
+    plan.transform(re, im, cols, false);
+}
+
+// Unnormalized inverse of forward_2d, overwriting the frequencies. Value
+// (r, c) of tile i is at r * b * n + i * n + c of out_re.
+static void inverse_2d(const FFTPlan& plan, int b, float* re, float* im,
+                       float* out_re, float* out_im) {
+    int n = plan.n, h = n/2 + 1;
+    int cols = b * n;
+    // The transform of a real tile has Z(k1, k2) = conj(Z(-k1, -k2)).
+    for (int k2 = h; k2 < n; k2++) {
+        for (int i = 0; i < b; i++) {
+            const float* src_re = re + (n - k2) * cols + i * n;
+            const float* src_im = im + (n - k2) * cols + i * n;
+            float* dst_re = re + k2 * cols + i * n;
+            float* dst_im = im + k2 * cols + i * n;
+            dst_re[0] = src_re[0];
+            dst_im[0] = -src_im[0];
+            for (int k1 = 1; k1 < n; k1++) {
+                dst_re[k1] = src_re[n - k1];
+                dst_im[k1] = -src_im[n - k1];
+            }
+        }
+    }
+    plan.transform(re, im, cols, true);
+
+    for (int c = 0; c < n; c++) {
+        for (int i = 0; i < b; i++) {
+            for (int k1 = 0; k1 < n; k1++) {
+                out_re[k1 * cols + i * n + c] = re[c * cols + i * n + k1];
+                out_im[k1 * cols + i * n + c] = im[c * cols + i * n + k1];
+            }
+        }
+    }
+    plan.transform(out_re, out_im, cols, true);
+}
+
+// Sizes of the conv after splitting the input into phases.
+struct PhaseShape {
+    int channels;
+    int filter_h, filter_w;
+    int tile_h, tile_w;
+    int tiles_h, tiles_w;
+    int height, width;
+
+    PhaseShape(Conv2dOp& op, int n) {
+        channels = op.input_channels * op.stride_h * op.stride_w;
+        filter_h = (op.filter_height + op.stride_h - 1)/op.stride_h;
+        filter_w = (op.filter_width + op.stride_w - 1)/op.stride_w;
+        // Outputs computed from each tile.
+        tile_h = n - filter_h + 1;
+        tile_w = n - filter_w + 1;
+        tiles_h = tile_h > 0 ? (op.output_height + tile_h - 1)/tile_h : 0;
+        tiles_w = tile_w > 0 ? (op.output_width + tile_w - 1)/tile_w : 0;
+        height = (tiles_h - 1) * tile_h + n;
+        width = (tiles_w - 1) * tile_w + n;
+    }
+};
+
+// Tiles of all the images convolved together, which amortizes packing
+// the filters for the products at each frequency.
+static const int MIN_TILE_ROWS = 64;
+
+int fft_conv_images(Conv2dOp& op, int n) {
+    PhaseShape ps(op, n);
+    int tiles = ps.tiles_h * ps.tiles_w;
+    return std::max(1, std::min(op.batch_size,
+                                (MIN_TILE_ROWS + tiles - 1)/tiles));
+}
+
+double fft_conv_cost(Conv2dOp& op, int n) {
+    PhaseShape ps(op, n);
+    if (ps.tile_h < 1 || ps.tile_w < 1) {
+        return std::numeric_limits<double>::infinity();
+    }
+
+    double tiles = (double)ps.tiles_h * ps.tiles_w;
+    double freqs = (double)n * (n/2 + 1);
+    double filters = freqs * (2 * op.output_channels) * (2 * ps.channels);
+    // The products at each frequency are small and run at about two thirds
+    // of the rate of large ones. The transformed filters are read from
+    // memory once for each batch of images.
+    double gemm = 1.5 * 2.0 * filters * tiles +
+                  12.0 * filters/fft_conv_images(op, n);
+    // A complex FFT of size n takes about 5 n log2(n) flops and the 2-D
+    // transforms take about 1.5 n of them. Along with the copies in and
+    // out of the tiles they run at about a seventh of the rate of the
+    // matrix multiply.
+    double fft = 5.0 * n * std::log2(n) * (1.5 * n + 1);
+    double transforms = fft * tiles * (ps.channels + op.output_channels);
+    return gemm + 7.0 * transforms;
+}
+
+int fft_conv_tile_size(Conv2dOp& op) {
+    int best = FFT_CONV_MIN_TILE;
+    for (int n = FFT_CONV_MIN_TILE; n <= FFT_CONV_MAX_TILE; n *= 2) {
+        if (fft_conv_cost(op, n) < fft_conv_cost(op, best)) {
+            best = n;
+        }
+    }
+    return best;
+}
+
+NDArray<float> fft_conv_filter_transform(Conv2dOp& op, int n) {
+    const FFTPlan& plan = get_plan(n);
+    PhaseShape ps(op, n);
+    assert(ps.tile_h > 0 && ps.tile_w > 0);
+
+    int M = op.output_channels, C = ps.channels, h = n/2 + 1;
+    NDArray<float> U({h, n, 2 * C, 2 * M});
+    NDArray<float>& W = get_ndarray<float>(op.params[0]);
+
+    // The inverse transform is unnormalized.
+    float scale = 1.0f/(n * n);
+    std::vector<float> tile(n * n);
+    std::vector<float> freq_re(n * n), freq_im(n * n);
+    std::vector<float> tmp_re(n * n), tmp_im(n * n);
+    for (int m = 0; m < M; m++) {
+        for (int c = 0; c < op.input_channels; c++) {
+            for (int a = 0; a < op.stride_h; a++) {
+                for (int b = 0; b < op.stride_w; b++) {
+                    // Taps of the filter applied to the phase (a, b).
+                    std::fill(tile.begin(), tile.end(), 0.0f);
+                    for (int i = 0; i < ps.filter_h; i++) {
+                        for (int j = 0; j < ps.filter_w; j++) {
+                            int f_h = i * op.stride_h + a;
+                            int f_w = j * op.stride_w + b;
+                            if (f_h < op.filter_height &&
+                                f_w < op.filter_width) {
+                                tile[i * n + j] = W(m, c, f_h, f_w);
+                            }
+                        }
+                    }
+                    forward_2d(plan, tile.data(), n, 0, 1, freq_re.data(),
+                               freq_im.data(), tmp_re.data(), tmp_im.data());
+
+                    // The conv is a correlation, which multiplies by the
+                    // conjugate of the filter transform.
+                    int p = (c * op.stride_h + a) * op.stride_w + b;
+                    for (int f = 0; f < n * h; f++) {
+                        float re = freq_re[f] * scale;
+                        float im = freq_im[f] * scale;
+                        float* u = U.host_alloc.get() + (size_t)f * 4 * M * C;
+                        u[p * 2 * M + m] = re;
+                        u[(C + p) * 2 * M + m] = im;
+                        u[p * 2 * M + M + m] = -im;
+                        u[(C + p) * 2 * M + M + m] = re;
+                    }
+                }
+            }
+        }
+    }
+    return U;
+}
+
+size_t fft_conv_workspace_size(Conv2dOp& op, int n, int images) {
+    PhaseShape ps(op, n);
+    size_t tiles = (size_t)ps.tiles_h * ps.tiles_w * images;
+    size_t freqs = (size_t)n * (n/2 + 1);
+    return (size_t)images * ps.channels * ps.height * ps.width +
+           freqs * 2 * (ps.channels + op.output_channels) * tiles;
+}
+
+static void parallel_for(ThreadPool* pool, int num,
+                         const std::function<void(int)>& fn) {
+    if (pool && num > 1) {
+        pool->parallel_for(0, num, fn);
+    } else {
+        for (int i = 0; i < num; i++) {
+            fn(i);
+        }
+    }
+}
+
+// Channels transformed by a task. The frequencies of a strip of tiles
+// stay in cache while the task goes over its channels.
+static const int CHANNEL_BLOCK = 16;
+
+void fft_conv2d(Conv2dOp& op, const float* in, int images, NDArray<float>& U,
+                const float* bias, float* out, float* workspace,
+                ThreadPool* pool) {
+
+    int n = U.dim_sizes[1];
+    const FFTPlan& plan = get_plan(n);
+    PhaseShape ps(op, n);
+    int M = op.output_channels, C = ps.channels, h = n/2 + 1;
+    int freqs = n * h;
+    int tiles = ps.tiles_h * ps.tiles_w;
+    int T = tiles * images;
+    size_t phase_size = (size_t)ps.height * ps.width;
+    size_t in_size = (size_t)op.input_channels * op.input_height *
+                     op.input_width;
+    size_t out_size = (size_t)M * op.output_height * op.output_width;
+
+    // Padded phases of the input, images x C x height x width, the input
+    // tiles in the frequency domain, freqs x T x 2C, and their products
+    // with the filters, freqs x T x 2M. Real parts come before the
+    // imaginary ones. There are few tiles per image, so they are the rows
+    // of the products and the channels the columns.
+    float* X = workspace;
+    float* Xf = X + images * C * phase_size;
+    float* Yf = Xf + (size_t)freqs * T * 2 * C;
+
+    parallel_for(pool, images * C, [&](int ip) {
+        int p = ip % C;
+        int c = p / (op.stride_h * op.stride_w);
+        int a = (p / op.stride_w) % op.stride_h;
+        int b = p % op.stride_w;
+        const float* in_c = in + (ip / C) * in_size +
+                            (size_t)c * op.input_height * op.input_width;
+        float* x = X + ip * phase_size;
+        // Columns of the phase inside the input.
+        int v_begin = std::max(0, (op.pad_w - b + op.stride_w - 1)/
+                                  op.stride_w);
+        int v_end = std::min(ps.width, (op.input_width + op.pad_w - b +
+                                        op.stride_w - 1)/op.stride_w);
+        v_end = std::max(v_begin, v_end);
+        for (int u = 0; u < ps.height; u++) {
+            float* x_row = x + u * ps.width;
+            int y = u * op.stride_h + a - op.pad_h;
+            if (y < 0 || y >= op.input_height) {
+                std::fill(x_row, x_row + ps.width, 0.0f);
+                continue;
+            }
+            const float* in_row = in_c + y * op.input_width + b - op.pad_w;
+            std::fill(x_row, x_row + v_begin, 0.0f);
+            for (int v = v_begin; v < v_end; v++) {
+                x_row[v] = in_row[v * op.stride_w];
+            }
+            std::fill(x_row + v_end, x_row + ps.width, 0.0f);
+        }
+    });
+
+    // Tasks over strips of up to batch tiles along a row of tiles and
+    // blocks of channels.
+    int batch = std::max(1, BATCH_COLS/n);
+    int strips_w = (ps.tiles_w + batch - 1)/batch;
+    int strips = images * ps.tiles_h * strips_w;
+    size_t batch_size = (size_t)n * batch * n;
+
+    int in_blocks = (C + CHANNEL_BLOCK - 1)/CHANNEL_BLOCK;
+    parallel_for(pool, strips * in_blocks, [&](int task) {
+        int strip = task / in_blocks;
+        int img = strip / (ps.tiles_h * strips_w);
+        int ty = (strip / strips_w) % ps.tiles_h;
+        int tx = (strip % strips_w) * batch;
+        int b = std::min(batch, ps.tiles_w - tx);
+        int t0 = img * tiles + ty * ps.tiles_w + tx;
+        int p_begin = (task % in_blocks) * CHANNEL_BLOCK;
+        int p_end = std::min(C, p_begin + CHANNEL_BLOCK);
+
+        std::vector<float> re(batch_size), im(batch_size);
+        std::vector<float> tmp_re(batch_size), tmp_im(batch_size);
+        for (int p = p_begin; p < p_end; p++) {
+            const float* x = X + (img * C + p) * phase_size +
+                             ty * ps.tile_h * ps.width + tx * ps.tile_w;
+            forward_2d(plan, x, ps.width, ps.tile_w, b, re.data(), im.data(),
+                       tmp_re.data(), tmp_im.data());
+            for (int k2 = 0; k2 < h; k2++) {
+                for (int i = 0; i < b; i++) {
+                    for (int k1 = 0; k1 < n; k1++) {
+                        int f = k2 * n + k1;
+                        float* xf = Xf + ((size_t)f * T + t0 + i) * 2 * C;
+                        xf[p] = re[(k2 * b + i) * n + k1];
+                        xf[C + p] = im[(k2 * b + i) * n + k1];
+                    }
+                }
+            }
+        }
+    });
+
+    parallel_for(pool, freqs, [&](int f) {
+        sgemm(T, 2 * M, 2 * C, Xf + (size_t)f * T * 2 * C, 2 * C,
+              U.host_alloc.get() + (size_t)f * 4 * M * C, 2 * M, false,
+              Yf + (size_t)f * T * 2 * M, 2 * M, false);
+    });
+
+    int out_blocks = (M + CHANNEL_BLOCK - 1)/CHANNEL_BLOCK;
+    parallel_for(pool, strips * out_blocks, [&](int task) {
+        int strip = task / out_blocks;
+        int img = strip / (ps.tiles_h * strips_w);
+        int ty = (strip / strips_w) % ps.tiles_h;
+        int tx = (strip % strips_w) * batch;
+        int b = std::min(batch, ps.tiles_w - tx);
+        int t0 = img * tiles + ty * ps.tiles_w + tx;
+        int m_begin = (task % out_blocks) * CHANNEL_BLOCK;
+        int m_end = std::min(M, m_begin + CHANNEL_BLOCK);
+        int rows = std::min(ps.tile_h, op.output_height - ty * ps.tile_h);
+
+        std::vector<float> re(batch_size), im(batch_size);
+        std::vector<float> out_re(batch_size), out_im(batch_size);
+        for (int m = m_begin; m < m_end; m++) {
+            for (int k2 = 0; k2 < h; k2++) {
+                for (int i = 0; i < b; i++) {
+                    for (int k1 = 0; k1 < n; k1++) {
+                        int f = k2 * n + k1;
+                        float* yf = Yf + ((size_t)f * T + t0 + i) * 2 * M;
+                        re[(k2 * b + i) * n + k1] = yf[m];
+                        im[(k2 * b + i) * n + k1] = yf[M + m];
+                    }
+                }
+            }
+            inverse_2d(plan, b, re.data(), im.data(), out_re.data(),
+                       out_im.data());
+
+            float* out_m = out + img * out_size +
+                           (size_t)m * op.output_height * op.output_width;
+            float bias_m = bias ? bias[m] : 0.0f;
+            for (int i = 0; i < b; i++) {
+                int x0 = (tx + i) * ps.tile_w;
+                int cols = std::min(ps.tile_w, op.output_width - x0);
+                for (int r = 0; r < rows; r++) {
+                    float* row = out_m +
+                                 (ty * ps.tile_h + r) * op.output_width + x0;
+                    for (int c = 0; c < cols; c++) {
+                        row[c] = out_re[(r * b + i) * n + c] + bias_m;
+                    }
+                }
+            }
+        }
+    });
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include "NDArray.h"
+#include "Op.h"
+#include "ThreadPool.h"
+
+// Convolution in the frequency domain for large filters. The output is
+// split into tiles, each computed from an n x n tile of the input by
+// transforming the tile with a 2-D FFT, multiplying with the transformed
+// filters and transforming back. The products for each frequency form a
+// complex matrix multiply over the channels.
+//
+// Strided convs are decomposed into stride^2 phases of the input, each
+// convolved with the matching taps of the filters at unit stride, so a
+// 7x7 stride 2 conv becomes a 4x4 conv on four times the channels.
+
+// Tile sizes n, powers of two.
+const int FFT_CONV_MIN_TILE = 8;
+const int FFT_CONV_MAX_TILE = 32;
+
+// Estimated cost of the conv with tiles of size n in flops of a matrix
+// multiply. Infinite when the filter does not fit in the tile.
+double fft_conv_cost(Conv2dOp& op, int n);
+
+// Tile size with the lowest estimated cost.
+int fft_conv_tile_size(Conv2dOp& op);
+
+// Transform the filters of the conv for tiles of size n. The result has
+// dims (n/2 + 1) x n x 2C x 2M, where C counts the phases of the input,
+// and holds the matrix multiplying the real and imaginary parts of the
+// input at each frequency.
+NDArray<float> fft_conv_filter_transform(Conv2dOp& op, int n);
+
+// Images convolved together, which is enough for the tiles of all the
+// images to amortize reading the transformed filters.
+int fft_conv_images(Conv2dOp& op, int n);
+
+// Floats of workspace needed to convolve a number of images.
+size_t fft_conv_workspace_size(Conv2dOp& op, int n, int images);
+
+// Convolve images with filters transformed by fft_conv_filter_transform.
+// The bias may be null.
+void fft_conv2d(Conv2dOp& op, const float* in, int images, NDArray<float>& U,
+                const float* bias, float* out, float* workspace,
+                ThreadPool* pool);
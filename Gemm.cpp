@@ -0,0 +1,470 @@
+#include <vector>
+#include <algorithm>
+#include <immintrin.h>
+#include "Gemm.h"
+
+// Rows and columns of C computed by one call of the micro kernel.
+#if defined(__AVX512F__)
+static const int MR = 6;
+static const int NR = 32;
+#elif defined(__AVX2__) && defined(__FMA__)
+static const int MR = 6;
+static const int NR = 16;
+#else
+static const int MR = 4;
+static const int NR = 8;
+#endif
+
+// Depth of the packed panels, sized for the panel of B to stay in L1,
+// and the columns of B packed at once, sized for L3.
+static const int KC = 256;
+static const int NC = 3072;
+// Rows and columns of C in a parallel task.
+static const int MC = 16 * MR;
+static const int NT = 8 * NR;
+
+// Panels of MR rows of A, each stored column by column.
+static void pack_a(int mc, int kc, const float* A, int lda, float* Ap) {
+    for (int i = 0; i < mc; i += MR) {
+        int mr = std::min(MR, mc - i);
+        for (int k = 0; k < kc; k++) {
+            for (int r = 0; r < mr; r++) {
+                Ap[r] = A[(i + r) * lda + k];
+            }
+            for (int r = mr; r < MR; r++) {
+                Ap[r] = 0.0f;
+            }
+            Ap += MR;
+        }
+    }
+}
+
+// Panels of NR columns of B, each stored row by row.
+static void pack_b(int kc, int nc, const float* B, int ldb, bool trans_b,
+                   float* Bp) {
+    for (int j = 0; j < nc; j += NR) {
+        int nr = std::min(NR, nc - j);
+        for (int k = 0; k < kc; k++) {
+            if (trans_b) {
+                for (int c = 0; c < nr; c++) {
+                    Bp[c] = B[(j + c) * ldb + k];
+                }
+            } else {
+                const float* b = B + k * ldb + j;
+                for (int c = 0; c < nr; c++) {
+                    Bp[c] = b[c];
+                }
+            }
+            for (int c = nr; c < NR; c++) {
+                Bp[c] = 0.0f;
+            }
+            Bp += NR;
+        }
+    }
+}
+
+// Rows of 16-bit floats widened into buf. The conversions run in
+// registers, so the rows are read from memory at half the bytes of float.
+static const float* load_row(const float16* src, int n, float* buf) {
+    int i = 0;
+#if defined(__F16C__)
+    for (; i + 8 <= n; i += 8) {
+        __m128i h = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm256_storeu_ps(buf + i, _mm256_cvtph_ps(h));
+    }
+#endif
+    for (; i < n; i++) {
+        buf[i] = src[i];
+    }
+    return buf;
+}
+
+static const float* load_row(const bfloat16* src, int n, float* buf) {
+    int i = 0;
+#if defined(__AVX2__)
+    // A bfloat16 is the upper half of a float, which is all that the
+    // conversions of AVX-512 BF16 do as well.
+    for (; i + 8 <= n; i += 8) {
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + i));
+        __m256i w = _mm256_slli_epi32(_mm256_cvtepu16_epi32(b), 16);
+        _mm256_storeu_ps(buf + i, _mm256_castsi256_ps(w));
+    }
+#endif
+    for (; i < n; i++) {
+        buf[i] = src[i];
+    }
+    return buf;
+}
+
+// Packing of 16-bit matrices, widening a row at a time.
+template <class T>
+static void pack_a(int mc, int kc, const T* A, int lda, float* Ap) {
+    float buf[KC];
+    for (int i = 0; i < mc; i += MR) {
+        int mr = std::min(MR, mc - i);
+        for (int r = 0; r < MR; r++) {
+            if (r < mr) {
+                const float* a = load_row(A + (i + r) * lda, kc, buf);
+                for (int k = 0; k < kc; k++) {
+                    Ap[k * MR + r] = a[k];
+                }
+            } else {
+                for (int k = 0; k < kc; k++) {
+                    Ap[k * MR + r] = 0.0f;
+                }
+            }
+        }
+        Ap += kc * MR;
+    }
+}
+
+template <class T>
+static void pack_b(int kc, int nc, const T* B, int ldb, bool trans_b,
+                   float* Bp) {
+    float buf[KC > NR ? KC : NR];
+    for (int j = 0; j < nc; j += NR) {
+        int nr = std::min(NR, nc - j);
+        if (trans_b) {
+            for (int c = 0; c < NR; c++) {
+                if (c < nr) {
+                    const float* b = load_row(B + (j + c) * ldb, kc, buf);
+                    for (int k = 0; k < kc; k++) {
+                        Bp[k * NR + c] = b[k];
+                    }
+                } else {
+                    for (int k = 0; k < kc; k++) {
+                        Bp[k * NR + c] = 0.0f;
+                    }
+                }
+            }
+        } else {
+            for (int k = 0; k < kc; k++) {
+                const float* b = load_row(B + k * ldb + j, nr, buf);
+                for (int c = 0; c < NR; c++) {
+                    Bp[k * NR + c] = c < nr ? b[c] : 0.0f;
+                }
+            }
+        }
+        Bp += kc * NR;
+    }
+}
+
+// Computes the MR x NR tile ab = Ap * Bp of packed panels.
+static inline void micro_kernel(int kc, const float* Ap, const float* Bp,
+                                float* ab) {
+#if defined(__AVX512F__)
+    __m512 c[MR][2];
+    for (int r = 0; r < MR; r++) {
+        c[r][0] = _mm512_setzero_ps();
+        c[r][1] = _mm512_setzero_ps();
+    }
+    for (int k = 0; k < kc; k++) {
+        __m512 b0 = _mm512_loadu_ps(Bp);
+        __m512 b1 = _mm512_loadu_ps(Bp + 16);
+        for (int r = 0; r < MR; r++) {
+            __m512 a = _mm512_set1_ps(Ap[r]);
+            c[r][0] = _mm512_fmadd_ps(a, b0, c[r][0]);
+            c[r][1] = _mm512_fmadd_ps(a, b1, c[r][1]);
+        }
+        Ap += MR;
+        Bp += NR;
+    }
+    for (int r = 0; r < MR; r++) {
+        _mm512_storeu_ps(ab + r * NR, c[r][0]);
+        _mm512_storeu_ps(ab + r * NR + 16, c[r][1]);
+    }
+#elif defined(__AVX2__) && defined(__FMA__)
+    __m256 c[MR][2];
+    for (int r = 0; r < MR; r++) {
+        c[r][0] = _mm256_setzero_ps();
+        c[r][1] = _mm256_setzero_ps();
+    }
+    for (int k = 0; k < kc; k++) {
+        __m256 b0 = _mm256_loadu_ps(Bp);
+        __m256 b1 = _mm256_loadu_ps(Bp + 8);
+        for (int r = 0; r < MR; r++) {
+            __m256 a = _mm256_broadcast_ss(Ap + r);
+            c[r][0] = _mm256_fmadd_ps(a, b0, c[r][0]);
+            c[r][1] = _mm256_fmadd_ps(a, b1, c[r][1]);
+        }
+        Ap += MR;
+        Bp += NR;
+    }
+    for (int r = 0; r < MR; r++) {
+        _mm256_storeu_ps(ab + r * NR, c[r][0]);
+        _mm256_storeu_ps(ab + r * NR + 8, c[r][1]);
+    }
+#else
+    float c[MR][NR] = {};
+    for (int k = 0; k < kc; k++) {
+        for (int r = 0; r < MR; r++) {
+            for (int n = 0; n < NR; n++) {
+                c[r][n] += Ap[r] * Bp[n];
+            }
+        }
+        Ap += MR;
+        Bp += NR;
+    }
+    for (int r = 0; r < MR; r++) {
+        for (int n = 0; n < NR; n++) {
+            ab[r * NR + n] = c[r][n];
+        }
+    }
+#endif
+}
+
+// Updates the mc x nc block of C from packed panels of A and B.
+static void macro_kernel(int mc, int nc, int kc, const float* Ap,
+                         const float* Bp, float* C, int ldc,
+                         bool accumulate) {
+    float ab[MR * NR];
+    for (int j = 0; j < nc; j += NR) {
+        int nr = std::min(NR, nc - j);
+        for (int i = 0; i < mc; i += MR) {
+            int mr = std::min(MR, mc - i);
+            micro_kernel(kc, Ap + i * kc, Bp + j * kc, ab);
+            for (int r = 0; r < mr; r++) {
+                float* c = C + (i + r) * ldc + j;
+                if (accumulate) {
+                    for (int n = 0; n < nr; n++) {
+                        c[n] += ab[r * NR + n];
+                    }
+                } else {
+                    for (int n = 0; n < nr; n++) {
+                        c[n] = ab[r * NR + n];
+                    }
+                }
+            }
+        }
+    }
+}
+
+template <class TA, class TB>
+static void gemm(int M, int N, int K,
+                 const TA* A, int lda,
+                 const TB* B, int ldb, bool trans_b,
+                 float* C, int ldc, bool accumulate,
+                 ThreadPool* pool) {
+
+    // Panels are packed for at most KC of the depth.
+    int kc_max = std::min(K, KC);
+    int m_panels = (M + MR - 1)/MR;
+    std::vector<float> Ap(m_panels * MR * kc_max);
+    std::vector<float> Bp(((std::min(N, NC) + NR - 1)/NR) * NR * kc_max);
+
+    auto parallel_for = [pool](int num, const std::function<void(int)>& fn) {
+        if (pool && num > 1) {
+            pool->parallel_for(0, num, fn);
+        } else {
+            for (int i = 0; i < num; i++) {
+                fn(i);
+            }
+        }
+    };
+
+    for (int pc = 0; pc < K; pc += KC) {
+        int kc = std::min(KC, K - pc);
+        bool acc = accumulate || pc > 0;
+
+        // All of A for this depth, packed once and shared by the tasks.
+        int m_blocks = (M + MC - 1)/MC;
+        parallel_for(m_blocks, [&](int b) {
+            int ic = b * MC;
+            pack_a(std::min(MC, M - ic), kc, A + ic * lda + pc, lda,
+                   Ap.data() + ic * kc);
+        });
+
+        for (int jc = 0; jc < N; jc += NC) {
+            int nc = std::min(NC, N - jc);
+
+            int n_panels = (nc + NR - 1)/NR;
+            parallel_for(n_panels, [&](int p) {
+                int j = p * NR;
+                const TB* b = trans_b ? B + (jc + j) * ldb + pc :
+                                           B + pc * ldb + jc + j;
+                pack_b(kc, std::min(NR, nc - j), b, ldb, trans_b,
+                       Bp.data() + j * kc);
+            });
+
+            int n_tiles = (nc + NT - 1)/NT;
+            parallel_for(m_blocks * n_tiles, [&](int t) {
+                int ic = (t / n_tiles) * MC;
+                int jt = (t % n_tiles) * NT;
+                macro_kernel(std::min(MC, M - ic), std::min(NT, nc - jt), kc,
+                             Ap.data() + ic * kc, Bp.data() + jt * kc,
+                             C + ic * ldc + jc + jt, ldc, acc);
+            });
+        }
+    }
+}
+
+void sgemm(int M, int N, int K,
+           const float* A, int lda,
+           const float* B, int ldb, bool trans_b,
+           float* C, int ldc, bool accumulate,
+           ThreadPool* pool) {
+    gemm(M, N, K, A, lda, B, ldb, trans_b, C, ldc, accumulate, pool);
+}
+
+void sgemm(int M, int N, int K,
+           const float16* A, int lda,
+           const float* B, int ldb, bool trans_b,
+           float* C, int ldc, bool accumulate,
+           ThreadPool* pool) {
+    gemm(M, N, K, A, lda, B, ldb, trans_b, C, ldc, accumulate, pool);
+}
+
+void sgemm(int M, int N, int K,
+           const bfloat16* A, int lda,
+           const float* B, int ldb, bool trans_b,
+           float* C, int ldc, bool accumulate,
+           ThreadPool* pool) {
+    gemm(M, N, K, A, lda, B, ldb, trans_b, C, ldc, accumulate, pool);
+}
+
+void sgemm(int M, int N, int K,
+           const float* A, int lda,
+           const float16* B, int ldb, bool trans_b,
+           float* C, int ldc, bool accumulate,
+           ThreadPool* pool) {
+    gemm(M, N, K, A, lda, B, ldb, trans_b, C, ldc, accumulate, pool);
+}
+
+void sgemm(int M, int N, int K,
+           const float* A, int lda,
+           const bfloat16* B, int ldb, bool trans_b,
+           float* C, int ldc, bool accumulate,
+           ThreadPool* pool) {
+    gemm(M, N, K, A, lda, B, ldb, trans_b, C, ldc, accumulate, pool);
+}
+
+// Rows of A computed by one task and rows of B whose dot products with
+// the rows of a task are computed before moving on, sized for L2.
+static const int MB_U8 = 32;
+static const int NB_U8 = 64;
+
+// Computes the RA x RB block of C of the dot products of rows of A and B.
+template <int RA, int RB>
+static void dot_block_u8s8(int K, const uint8_t* A, int lda,
+                           const int8_t* B, int ldb, int32_t* C, int ldc) {
+    int32_t acc[RA][RB] = {};
+    int k = 0;
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__)
+    __m512i v[RA][RB];
+    for (int r = 0; r < RA; r++) {
+        for (int c = 0; c < RB; c++) {
+            v[r][c] = _mm512_setzero_si512();
+        }
+    }
+    for (; k < K; k += 64) {
+        __mmask64 mask = K - k >= 64 ? ~0ULL : (1ULL << (K - k)) - 1;
+        __m512i a[RA];
+        for (int r = 0; r < RA; r++) {
+            a[r] = _mm512_maskz_loadu_epi8(mask, A + r * lda + k);
+        }
+        for (int c = 0; c < RB; c++) {
+            __m512i b = _mm512_maskz_loadu_epi8(mask, B + c * ldb + k);
+            for (int r = 0; r < RA; r++) {
+                v[r][c] = _mm512_dpbusd_epi32(v[r][c], a[r], b);
+            }
+        }
+    }
+    for (int r = 0; r < RA; r++) {
+        for (int c = 0; c < RB; c++) {
+            int32_t lanes[16];
+            _mm512_storeu_si512(lanes, v[r][c]);
+            for (int l = 0; l < 16; l++) {
+                acc[r][c] += lanes[l];
+            }
+        }
+    }
+#elif defined(__AVX2__)
+    // The multiply-adds of pmaddubsw saturate pairs of products in 16
+    // bits, so the operands are widened to 16 bits for pmaddwd instead.
+    __m256i v[RA][RB];
+    for (int r = 0; r < RA; r++) {
+        for (int c = 0; c < RB; c++) {
+            v[r][c] = _mm256_setzero_si256();
+        }
+    }
+    for (; k + 16 <= K; k += 16) {
+        __m256i a[RA];
+        for (int r = 0; r < RA; r++) {
+            a[r] = _mm256_cvtepu8_epi16(
+                _mm_loadu_si128((const __m128i*)(A + r * lda + k)));
+        }
+        for (int c = 0; c < RB; c++) {
+            __m256i b = _mm256_cvtepi8_epi16(
+                _mm_loadu_si128((const __m128i*)(B + c * ldb + k)));
+            for (int r = 0; r < RA; r++) {
+                v[r][c] = _mm256_add_epi32(v[r][c],
+                                           _mm256_madd_epi16(a[r], b));
+            }
+        }
+    }
+    for (int r = 0; r < RA; r++) {
+        for (int c = 0; c < RB; c++) {
+            int32_t lanes[8];
+            _mm256_storeu_si256((__m256i*)lanes, v[r][c]);
+            for (int l = 0; l < 8; l++) {
+                acc[r][c] += lanes[l];
+            }
+        }
+    }
+#endif
+    for (; k < K; k++) {
+        for (int r = 0; r < RA; r++) {
+            for (int c = 0; c < RB; c++) {
+                acc[r][c] += (int32_t)A[r * lda + k] * B[c * ldb + k];
+            }
+        }
+    }
+    for (int r = 0; r < RA; r++) {
+        for (int c = 0; c < RB; c++) {
+            C[r * ldc + c] = acc[r][c];
+        }
+    }
+}
+
+typedef void (*DotBlockU8S8)(int, const uint8_t*, int, const int8_t*, int,
+                             int32_t*, int);
+
+void gemm_u8s8(int M, int N, int K,
+               const uint8_t* A, int lda,
+               const int8_t* B, int ldb,
+               int32_t* C, int ldc,
+               ThreadPool* pool) {
+
+    // Blocks of 2 rows of A and 4 of B, with the smaller ones at the
+    // edges.
+    static const DotBlockU8S8 blocks[2][4] = {
+        {dot_block_u8s8<1, 1>, dot_block_u8s8<1, 2>, dot_block_u8s8<1, 3>,
+         dot_block_u8s8<1, 4>},
+        {dot_block_u8s8<2, 1>, dot_block_u8s8<2, 2>, dot_block_u8s8<2, 3>,
+         dot_block_u8s8<2, 4>}};
+
+    auto compute_rows = [&](int t) {
+        int i_end = std::min(M, (t + 1) * MB_U8);
+        for (int jb = 0; jb < N; jb += NB_U8) {
+            int j_end = std::min(N, jb + NB_U8);
+            for (int i = t * MB_U8; i < i_end; i += 2) {
+                int ra = std::min(2, i_end - i);
+                for (int j = jb; j < j_end; j += 4) {
+                    int rb = std::min(4, j_end - j);
+                    blocks[ra - 1][rb - 1](K, A + (size_t)i * lda, lda,
+                                           B + (size_t)j * ldb, ldb,
+                                           C + (size_t)i * ldc + j, ldc);
+                }
+            }
+        }
+    };
+
+    int tasks = (M + MB_U8 - 1)/MB_U8;
+    if (pool && tasks > 1) {
+        pool->parallel_for(0, tasks, compute_rows);
+    } else {
+        for (int t = 0; t < tasks; t++) {
+            compute_rows(t);
+        }
+    }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include "ThreadPool.h"
+#include "Half.h"
+
+// Single precision matrix multiply on row major matrices
+//
+//   C = A * B        when accumulate is false
+//   C = C + A * B    when accumulate is true
+//
+// where A is M x K and B is K x N, or N x K when trans_b is set. The
+// product is computed in cache sized blocks packed for a register
+// blocked micro kernel, using AVX-512 or AVX2 when the build targets
+// them. Blocks of C are distributed over the pool when one is given.
+void sgemm(int M, int N, int K,
+           const float* A, int lda,
+           const float* B, int ldb, bool trans_b,
+           float* C, int ldc, bool accumulate,
+           ThreadPool* pool = nullptr);
+
+// The same with A or B stored as 16-bit floats, which are widened to
+// float as the blocks are packed. The product is accumulated in float.
+void sgemm(int M, int N, int K,
+           const float16* A, int lda,
+           const float* B, int ldb, bool trans_b,
+           float* C, int ldc, bool accumulate,
+           ThreadPool* pool = nullptr);
+
+void sgemm(int M, int N, int K,
+           const bfloat16* A, int lda,
+           const float* B, int ldb, bool trans_b,
+           float* C, int ldc, bool accumulate,
+           ThreadPool* pool = nullptr);
+
+void sgemm(int M, int N, int K,
+           const float* A, int lda,
+           const float16* B, int ldb, bool trans_b,
+           float* C, int ldc, bool accumulate,
+           ThreadPool* pool = nullptr);
+
+void sgemm(int M, int N, int K,
+           const float* A, int lda,
+           const bfloat16* B, int ldb, bool trans_b,
+           float* C, int ldc, bool accumulate,
+           ThreadPool* pool = nullptr);
+
+// Integer matrix multiply of unsigned 8-bit A with signed 8-bit B
+//
+//   C[i][j] = sum_k A[i][k] * B[j][k]
+//
+// accumulated in 32 bits, where A is M x K and B is N x K, so both are
+// read along rows. Products are summed without saturating, using the dot
+// products of AVX-512 VNNI or the 16-bit multiply-adds of AVX2. Rows of
+// A are distributed over the pool when one is given.
+void gemm_u8s8(int M, int N, int K,
+               const uint8_t* A, int lda,
+               const int8_t* B, int ldb,
+               int32_t* C, int ldc,
+               ThreadPool* pool = nullptr);
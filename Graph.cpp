@@ -1,21 +1,110 @@
+#include <fstream>
+#include <set>
 #include "Graph.h"
 
-void Graph::set_params(Params& params) {
+// Whether the kernel of an op reads its weights, the first param, stored
+// as 16-bit floats. Other params are widened when they are set.
+static bool reads_narrow_weights(std::shared_ptr<Op> op, OpImpl impl) {
+    return impl == OpImpl::NATIVE &&
+           (std::dynamic_pointer_cast<Conv2dOp>(op) ||
+            std::dynamic_pointer_cast<AffineOp>(op));
+}
+
+void Graph::set_params(Params& model_params) {
+    Params folded;
+    if (folded_ops.size() > 0) {
+        folded = model_params;
+        fold_params(folded);
+    }
+    Params& params = folded_ops.size() > 0 ? folded : model_params;
+    if (stream_params) {
+        param_streamer = std::make_shared<ParamStreamer>(groups.size());
+    }
+
     for (size_t i = 0; i < groups.size(); i++) {
+        OpImpl impl = std::get<0>(group_impl[i]);
         for (auto &op: groups[i]) {
             if (op.second->params.size() > 0) {
                 assert(params[op.first].size() == op.second->params.size());
                 for (size_t p = 0; p < params[op.first].size(); p++) {
                     op.second->params[p] = params[op.first][p];
-                    OpImpl impl = std::get<0>(group_impl[i]);
+                    if (is_narrow_float(op.second->params[p]) &&
+                        !(p == 0 && reads_narrow_weights(op.second, impl))) {
+                        op.second->params[p] =
+                            cast_ndarray(op.second->params[p],
+                                         DataType::Float32);
+                    }
                     if (impl == OpImpl::HALIDE) {
                         Buffer<> buf =
-                            get_halide_buffer(params[op.first][p],
+                            get_halide_buffer(op.second->params[p],
                                               op.second->type);
                         halide_ops[op.first]->params[p].set(buf);
                     }
                 }
+
+                auto& hooks = KernelRegistry<ParamsHook>::get();
+                if (hooks.has(*op.second, impl)) {
+                    hooks.lookup(*op.second, impl)(op.second);
+                }
+                if (param_streamer) {
+                    for (auto &p: op.second->params) {
+                        param_streamer->add_param(i, p);
+                    }
+                }
+            }
+        }
+        if (param_streamer) {
+            param_streamer->release(i);
+        }
+    }
+}
+
+void Graph::fold_params(Params& params) {
+    for (auto &f: folded_ops) {
+        auto& conv_params = params.at(f.first);
+        auto& bn_params = params.at(f.second.bn_name);
+        assert(bn_params.size() == 3);
+        if (is_narrow_float(conv_params[0])) {
+            conv_params[0] = cast_ndarray(conv_params[0], DataType::Float32);
+        }
+
+        NDArray<float>& W = get_ndarray<float>(conv_params[0]);
+        NDArray<float>& mean = get_ndarray<float>(bn_params[0]);
+        NDArray<float>& var = get_ndarray<float>(bn_params[1]);
+        float factor = get_ndarray<float>(bn_params[2])(0);
+        // Caffe stores the moving averages scaled by the factor.
+        float scale = factor == 0.0f ? 0.0f : 1.0f/factor;
+
+        int out_channels = W.dim_sizes[0];
+        int filter_size = W.buf_size/out_channels;
+        NDArray<float> W_f(W.dim_sizes);
+        NDArray<float> b_f({out_channels});
+
+        for (int o = 0; o < out_channels; o++) {
+            // y = gamma * (x - mean)/sqrt(var + epsilon) + beta
+            float a = 1.0f/std::sqrt(var(o) * scale + f.second.epsilon);
+            float b = conv_params.size() > 1 ?
+                          get_ndarray<float>(conv_params[1])(o) : 0.0f;
+            b = (b - mean(o) * scale) * a;
+            if (!f.second.scale_name.empty()) {
+                auto& scale_params = params.at(f.second.scale_name);
+                assert(scale_params.size() == 2);
+                float gamma = get_ndarray<float>(scale_params[0])(o);
+                a *= gamma;
+                b = b * gamma + get_ndarray<float>(scale_params[1])(o);
+            }
+
+            for (int k = 0; k < filter_size; k++) {
+                W_f.host_alloc.get()[o * filter_size + k] =
+                    W.host_alloc.get()[o * filter_size + k] * a;
             }
+            b_f(o) = b;
+        }
+
+        conv_params = {W_f, b_f};
+        params.erase(f.second.bn_name);
+        if (!f.second.scale_name.empty()) {
+            params.erase(f.second.scale_name);
         }
     }
 }
@@ -49,15 +138,94 @@ void Graph::add_op(std::string name, std::shared_ptr<Op> op, int group_id) {
     op_name_map[op] = name;
 }
 
+void Graph::plan_halide_fusion(unsigned int group_id,
+                               std::map<std::string, std::string>& inlined,
+                               std::map<std::string, std::string>& computed_at) {
+
+    std::map<std::string, std::vector<std::string>> consumers;
+    for (auto &op: groups[group_id]) {
+        for (auto &in_op: op.second->input_ops) {
+            consumers[op_name_map.at(in_op)].push_back(op.first);
+        }
+    }
+    auto& outs = group_outs[group_id];
+
+    // The single consumer of an op within the group, empty when the op
+    // is read more than once or outside the group.
+    auto single_consumer = [&](const std::string& name) {
+        if (consumers[name].size() != 1 ||
+            std::find(outs.begin(), outs.end(), name) != outs.end()) {
+            return std::string();
+        }
+        return consumers[name][0];
+    };
+
+    for (auto &op: groups[group_id]) {
+        if (!std::dynamic_pointer_cast<Conv2dOp>(op.second)) {
+            continue;
+        }
+        std::string out = op.first;
+        std::string next = single_consumer(out);
+        if (!next.empty() &&
+            std::dynamic_pointer_cast<ReLUOp>(ops.at(next))) {
+            inlined[op.first] = next;
+            out = next;
+            next = single_consumer(out);
+        }
+        if (!next.empty() &&
+            std::dynamic_pointer_cast<Pool2dOp>(ops.at(next))) {
+            computed_at[op.first] = next;
+        }
+    }
+}
+
+void Graph::fuse_halide_ops(unsigned int group_id,
+                            std::map<std::string, std::string>& inlined,
+                            std::map<std::string, std::string>& computed_at) {
+
+    for (auto &op_name: order[group_id]) {
+        auto op_impl = halide_ops.at(op_name);
+        if (!op_impl->schedule_root) {
+            continue;
+        }
+
+        Func f = op_impl->output;
+        if (inlined.find(op_name) != inlined.end()) {
+            f.compute_inline();
+            f = halide_ops.at(inlined[op_name])->output;
+        }
+
+        if (computed_at.find(op_name) != computed_at.end()) {
+            auto consumer = halide_ops.at(computed_at[op_name]);
+            op_impl->schedule_at(f, consumer->output, consumer->tile_loop);
+        } else {
+            op_impl->schedule_root(f);
+        }
+    }
+}
+
 void Graph::build_forward_halide(unsigned int group_id) {
 
     halide_op_ins[group_id] = std::map<std::string, ImageParam>();
     TargetArch arch = std::get<1>(group_impl[group_id]);
 
+    // The outermost dimension of every input is the batch. Inputs are
+    // named after their ops, as are the params of the kernels, so that the
+    // lowered pipeline and with it the cache key is the same on every build.
+    Expr batch_size;
     for (auto &in: group_ins[group_id]) {
         assert(ops.at(in)->num_dims() <= 4);
         halide_op_ins[group_id][in] =
-            ImageParam(Float(32), ops.at(in)->num_dims());
+            ImageParam(Float(32), ops.at(in)->num_dims(), in + "_in");
+        if (!batch_size.defined()) {
+            batch_size = halide_op_ins[group_id][in].
+                            dim(ops.at(in)->num_dims() - 1).extent();
+        }
+    }
+
+    std::map<std::string, std::string> inlined, computed_at;
+    if (halide_fusion && arch == TargetArch::CPU) {
+        plan_halide_fusion(group_id, inlined, computed_at);
     }
 
     for (auto &op_name: order[group_id]) {
@@ -82,135 +250,743 @@ void Graph::build_forward_halide(unsigned int group_id) {
 
         halide_ops[op_name] = std::make_shared<OpHalideImpl>();
 
-        if (std::dynamic_pointer_cast<SumOp>(op) != nullptr) {
+        // Source ops read directly from an input of the group.
+        if (op->input_ops.size() == 0) {
+            assert(ins.size() == 0);
+            halide_op_ins[group_id][op_name] =
+                ImageParam(Float(32), op->num_dims(), op_name + "_in");
+            ins.push_back(halide_op_ins[group_id][op_name]);
+            if (!batch_size.defined()) {
+                batch_size = halide_op_ins[group_id][op_name].
+                                dim(op->num_dims() - 1).extent();
+            }
+        }
+        halide_ops[op_name]->batch_size = batch_size;
+
+        auto conv = std::dynamic_pointer_cast<Conv2dOp>(op);
+        if (conv && conv->stride_h == conv->stride_w) {
+            auto s = halide_schedules.convs.find(get_conv_layer_shape(*conv));
+            if (s != halide_schedules.convs.end()) {
+                halide_ops[op_name]->conv_schedule =
+                    std::make_shared<ConvSchedule>(s->second);
+            }
+        }
 
-            auto op_cast = std::dynamic_pointer_cast<SumOp>(op);
-            sum_forward_halide(op_name, op_cast, ins,
-                               halide_ops[op_name], arch);
+        for (auto &f: computed_at) {
+            if (f.second == op_name) {
+                halide_ops[op_name]->fuse_producer = true;
+            }
+        }
 
-        } else if (std::dynamic_pointer_cast<AffineOp>(op) != nullptr) {
+        auto& builder = KernelRegistry<HalideKernelBuilder>::get().
+                            lookup(*op, OpImpl::HALIDE);
+        builder(op_name, op, ins, halide_ops[op_name], arch);
+    }
 
-            assert(ins.size() == 1);
-            auto op_cast = std::dynamic_pointer_cast<AffineOp>(op);
-            affine_forward_halide(op_name, op_cast, ins[0],
-                                  halide_ops[op_name], arch);
+    fuse_halide_ops(group_id, inlined, computed_at);
 
-        } else if (std::dynamic_pointer_cast<Conv2dOp>(op) != nullptr) {
+    std::vector<Func> outs;
 
-            assert(ins.size() == 1);
-            auto op_cast = std::dynamic_pointer_cast<Conv2dOp>(op);
-            conv2d_forward_halide(op_name, op_cast, ins[0],
-                                  halide_ops[op_name], arch);
+    for (auto &out_name: group_outs[group_id]) {
+        allocate_op_out(out_name);
+    }
 
-        } else if (std::dynamic_pointer_cast<Pool2dOp>(op) != nullptr) {
+    for (auto &out_name: group_outs[group_id]) {
+        assert(groups[group_id][out_name]->num_dims() <= 4);
+        outs.push_back(halide_ops[out_name]->output);
+    }
+    set_halide_group_outputs(group_id);
 
-            assert(ins.size() == 1);
-            auto op_cast = std::dynamic_pointer_cast<Pool2dOp>(op);
-            pool2d_forward_halide(op_name, op_cast, ins[0],
-                                  halide_ops[op_name], arch);
+    Target target = get_target_from_environment();
+    if (arch == TargetArch::GPU) {
+        target.set_feature(Target::CUDA);
+        target.set_feature(Target::CUDACapability50);
+    }
+    if (profile_halide) {
+        target.set_feature(Target::Profile);
+    }
 
-        } else if (std::dynamic_pointer_cast<ReLUOp>(op) != nullptr) {
+    Pipeline p(outs);
+    halide_pipelines[group_id] = p;
 
-            assert(ins.size() == 1);
-            auto op_cast = std::dynamic_pointer_cast<ReLUOp>(op);
-            relu_forward_halide(op_name, op_cast, ins[0],
-                                halide_ops[op_name], arch);
+    if (!aot_output_dir.empty()) {
+        emit_aot_group(group_id, target);
+        return;
+    }
 
-        } else if (std::dynamic_pointer_cast<SoftMaxOp>(op) != nullptr) {
+    auto start = std::chrono::steady_clock::now();
+    bool cached = false;
+    if (!halide_cache_dir.empty()) {
+        HalideCache cache(halide_cache_dir);
+        cached = cache.load_or_compile(halide_pipelines[group_id], target,
+                                       halide_compiled[group_id]);
+        if (cached) {
+            bind_compiled_args(group_id);
+        } else {
+            halide_compiled.erase(group_id);
+        }
+    }
 
-            assert(ins.size() == 1);
-            auto op_cast = std::dynamic_pointer_cast<SoftMaxOp>(op);
-            softmax_forward_halide(op_name, op_cast, ins[0],
-                                   halide_ops[op_name], arch);
+    if (!cached) {
+        halide_pipelines[group_id].compile_jit(target);
+    }
+    auto end = std::chrono::steady_clock::now();
+    std::cout << "Group " << group_id << " compile time: " <<
+        std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
+        << "ms" << (cached && halide_compiled[group_id].cache_hit ?
+                    " (cache hit)" : "") << std::endl;
+}
 
-        } else if (std::dynamic_pointer_cast<LRNOp>(op) != nullptr) {
+void Graph::bind_compiled_args(unsigned int group_id) {
+    // Inputs of the group and parameters of its ops by name.
+    std::map<std::string, ImageParam> params;
+    for (auto &in: halide_op_ins.at(group_id)) {
+        params[in.second.name()] = in.second;
+    }
+    for (auto &op: groups[group_id]) {
+        for (auto &p: halide_ops.at(op.first)->params) {
+            params[p.name()] = p;
+        }
+    }
 
-            assert(ins.size() == 1);
-            auto op_cast = std::dynamic_pointer_cast<LRNOp>(op);
-            lrn_forward_halide(op_name, op_cast, ins[0],
-                               halide_ops[op_name], arch);
+    halide_compiled_params[group_id].clear();
+    for (auto &arg: halide_compiled.at(group_id).args) {
+        assert(arg.is_buffer());
+        halide_compiled_params[group_id].push_back(params.at(arg.name));
+    }
+}
 
-        } else if (std::dynamic_pointer_cast<ConcatOp>(op) != nullptr) {
+void Graph::emit_aot_group(unsigned int group_id, const Target& target) {
+    // Arrays bound to the inputs of the group and the params of its ops.
+    std::map<std::string, AotArg> bindings;
+    for (auto &in: halide_op_ins.at(group_id)) {
+        auto op = ops.at(in.first);
+        AotArg arg;
+        arg.kind = AOT_INPUT;
+        arg.op_name = in.first;
+        arg.param_index = -1;
+        arg.type = op->type;
+        for (int d = 0; d < op->num_dims(); d++) {
+            arg.dim_sizes.push_back(op->out_size(d));
+        }
+        bindings[in.second.name()] = arg;
+    }
+    for (auto &op: groups[group_id]) {
+        auto& params = halide_ops.at(op.first)->params;
+        for (size_t p = 0; p < params.size(); p++) {
+            AotArg arg;
+            arg.kind = AOT_PARAM;
+            arg.op_name = op.first;
+            arg.param_index = p;
+            arg.type = op.second->type;
+            arg.dim_sizes = get_dim_sizes(op.second->params[p]);
+            bindings[params[p].name()] = arg;
+        }
+    }
 
-            auto op_cast = std::dynamic_pointer_cast<ConcatOp>(op);
-            concat_forward_halide(op_name, op_cast, ins,
-                                  halide_ops[op_name], arch);
+    std::vector<Argument> args = halide_pipelines[group_id].infer_arguments();
+    aot_args[group_id].clear();
+    for (auto &arg: args) {
+        assert(arg.is_buffer());
+        aot_args[group_id].push_back(bindings.at(arg.name));
+    }
+    for (auto &out_name: group_outs[group_id]) {
+        auto op = ops.at(out_name);
+        AotArg arg;
+        arg.kind = AOT_OUTPUT;
+        arg.op_name = out_name;
+        arg.param_index = -1;
+        arg.type = op->type;
+        for (int d = 0; d < op->num_dims(); d++) {
+            arg.dim_sizes.push_back(op->out_size(d));
+        }
+        aot_args[group_id].push_back(arg);
+    }
 
-        } else if (std::dynamic_pointer_cast<FlattenOp>(op) != nullptr) {
+    // The runtime is compiled once for all the groups.
+    std::string fn_name = aot_model_name + "_group" + std::to_string(group_id);
+    auto start = std::chrono::steady_clock::now();
+    halide_pipelines[group_id].
+        compile_to_static_library(aot_output_dir + "/" + fn_name, args,
+                                  fn_name,
+                                  target.with_feature(Target::NoRuntime));
+    auto end = std::chrono::steady_clock::now();
+    std::cout << "Group " << group_id << " compile time: " <<
+        std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
+        << "ms (aot)" << std::endl;
+}
 
-            assert(ins.size() == 1);
-            auto op_cast = std::dynamic_pointer_cast<FlattenOp>(op);
-            flatten_forward_halide(op_name, op_cast, ins[0],
-                                   halide_ops[op_name], arch);
+void Graph::write_aot_model(const Target& target) {
+    std::string prefix = aot_output_dir + "/" + aot_model_name;
+    compile_standalone_runtime(aot_output_dir + "/halide_runtime.o", target);
+
+    std::ofstream manifest(prefix + ".manifest");
+    manifest << "dnncc_aot 1" << std::endl;
+    for (auto &g: aot_args) {
+        manifest << "group " << aot_model_name << "_group" << g.first
+                 << std::endl;
+        for (auto &arg: g.second) {
+            manifest << "arg " << (arg.kind == AOT_INPUT ? "input" :
+                                   arg.kind == AOT_PARAM ? "param" : "output")
+                     << " " << arg.op_name << " " << arg.param_index << " "
+                     << (int)arg.type << " " << arg.dim_sizes.size();
+            for (auto &s: arg.dim_sizes) {
+                manifest << " " << s;
+            }
+            manifest << std::endl;
+        }
+    }
+    for (auto &out: graph_outs) {
+        manifest << "output " << out << std::endl;
+    }
 
-        } else if (std::dynamic_pointer_cast<DataOp>(op) != nullptr) {
+    std::string functions = aot_model_name + "_aot_functions";
+
+    std::ofstream header(prefix + "_aot.h");
+    header << "#pragma once" << std::endl << std::endl
+           << "#include <map>" << std::endl
+           << "#include <string>" << std::endl
+           << "#include \"AotRuntime.h\"" << std::endl << std::endl
+           << "std::map<std::string, AotFunction> " << functions << "();"
+           << std::endl;
+
+    std::ofstream source(prefix + "_aot.cpp");
+    source << "#include \"" << aot_model_name << "_aot.h\"" << std::endl;
+    for (auto &g: aot_args) {
+        source << "#include \"" << aot_model_name << "_group" << g.first
+               << ".h\"" << std::endl;
+    }
+    source << std::endl
+           << "std::map<std::string, AotFunction> " << functions << "() {"
+           << std::endl
+           << "    std::map<std::string, AotFunction> functions;" << std::endl;
+    for (auto &g: aot_args) {
+        std::string fn_name = aot_model_name + "_group" +
+                              std::to_string(g.first);
+        source << "    functions[\"" << fn_name << "\"] = " << fn_name
+               << "_argv;" << std::endl;
+    }
+    source << "    return functions;" << std::endl << "}" << std::endl;
+}
 
-            assert(ins.size() == 0);
-            halide_op_ins[group_id][op_name] =
-                ImageParam(Float(32), groups[group_id][op_name]->num_dims());
-            auto op_cast = std::dynamic_pointer_cast<DataOp>(op);
-            data_forward_halide(op_name, op_cast, halide_op_ins[group_id][op_name],
-                                halide_ops[op_name], arch);
+void Graph::build_forward_ref(unsigned int group_id) {
+    // Concats are allocated before the ops writing into their slices.
+    for (auto &op: groups[group_id]) {
+        if (concat_slices.find(op.first) == concat_slices.end()) {
+            allocate_op_out(op.first);
+        }
+    }
+    for (auto &op: groups[group_id]) {
+        if (concat_slices.find(op.first) != concat_slices.end()) {
+            allocate_op_out(op.first);
+        }
+    }
 
-        } else {
-            std::cerr << "Unknown op" << std::endl;
-            assert(0);
+    // Resolve the kernel and the arrays of each op up front so that
+    // running the group is a flat sequence of kernel calls.
+    OpImpl impl = std::get<0>(group_impl[group_id]);
+    for (auto &op_name: order[group_id]) {
+        auto op = groups[group_id].at(op_name);
+        std::vector<NDArray_t*> op_ins;
+        if (op->input_ops.size() == 0) {
+            // Source ops copy from the inputs passed to run.
+            op_ins.push_back(&input_slots[op_name]);
+        }
+        for (auto &in_op: op->input_ops) {
+            op_ins.push_back(&op_outs.at(op_name_map.at(in_op)));
         }
+
+        // Ops without a native kernel use the reference one.
+        auto& registry = KernelRegistry<KernelFactory>::get();
+        OpImpl op_impl = impl;
+        if (impl == OpImpl::NATIVE && !registry.has(*op, impl)) {
+            op_impl = OpImpl::REF;
+        }
+        auto& factory = registry.lookup(*op, op_impl);
+        ref_kernels[group_id].push_back(factory(op, op_ins,
+                                                &op_outs.at(op_name)));
+    }
+}
+
+void Graph::allocate_op_out(const std::string& op_name) {
+    auto op = ops.at(op_name);
+    std::vector<int> buf_sizes;
+    for (int d = 0; d < op->num_dims(); d++) {
+        buf_sizes.push_back(op->out_size(d));
+    }
+    buf_sizes = get_layout_dims(buf_sizes, op->layout);
+
+    auto slice = concat_slices.find(op_name);
+    if (slice != concat_slices.end()) {
+        int channel = slice->second.second;
+        op_out_allocs[op_name] =
+            get_slice_view(op_out_allocs.at(slice->second.first), 1,
+                           channel, channel + op->out_size(1));
+    } else if (memory_planning) {
+        int slab = memory_plan.slab_ids.at(op_name);
+        op_out_allocs[op_name] = get_ndarray_t(buf_sizes, op->type,
+                                               slabs[slab]);
+    } else {
+        size_t size = get_type_size(op->type) * op->num_out_elems();
+        op_out_allocs[op_name] =
+            get_ndarray_t(buf_sizes, op->type,
+                          allocate_storage<uint8_t>(size,
+                                                    activation_allocator));
     }
+    set_layout(op_out_allocs[op_name], op->layout);
+    op_outs[op_name] = op_out_allocs[op_name];
+}
 
-    std::vector<Func> outs;
+void Graph::set_batch_size(int batch_size) {
+    if (batch_size < 1 || batch_size > max_batch_size) {
+        std::cerr << "Batch size " << batch_size << " is not in [1, "
+                  << max_batch_size << "]" << std::endl;
+        assert(0);
+    }
 
-    for (auto &out_name: group_outs[group_id]) {
-        auto op = groups[group_id][out_name];
-        std::vector<int> buf_sizes;
-        for (int d = 0; d < op->num_dims(); d++) {
-            buf_sizes.push_back(op->out_size(d));
+    for (auto &alloc: op_out_allocs) {
+        op_outs[alloc.first] = get_batch_view(alloc.second, batch_size);
+    }
+
+    for (size_t g = 0; g < groups.size(); g++) {
+        if (std::get<0>(group_impl[g]) == OpImpl::HALIDE) {
+            set_halide_group_outputs(g);
         }
-        op_outs[out_name] = get_ndarray_t(buf_sizes, op->type);
     }
 
+    curr_batch_size = batch_size;
+}
+
+void Graph::set_halide_group_outputs(unsigned int group_id) {
+    halide_op_outs[group_id].clear();
     for (auto &out_name: group_outs[group_id]) {
-        auto op = groups[group_id][out_name];
-        assert(op->num_dims() <= 4);
-        // TODO: Not very certain about what happens when you copy Halide
-        // Buffers around. Need to test this.
         halide_op_outs[group_id].
             push_back(get_halide_buffer(op_outs.at(out_name),
-                                        op->type));
-        outs.push_back(halide_ops[out_name]->output);
+                                        ops.at(out_name)->type));
     }
+}
 
-    Target target = get_target_from_environment();
-    if (arch == TargetArch::GPU) {
-        target.set_feature(Target::CUDA);
-        target.set_feature(Target::CUDACapability50);
+void Graph::plan_quantization() {
+    std::map<std::string, int> op_groups;
+    for (size_t g = 0; g < groups.size(); g++) {
+        for (auto &op: groups[g]) {
+            op_groups[op.first] = g;
+        }
+    }
+    std::map<std::string, std::vector<std::string>> consumers;
+    for (auto &op: ops) {
+        for (auto &in_op: op.second->input_ops) {
+            consumers[op_name_map.at(in_op)].push_back(op.first);
+        }
     }
 
-    Pipeline p(outs);
-    halide_pipelines[group_id] = p;
+    auto native_nchw = [&](const std::string& name) {
+        int g = op_groups.at(name);
+        return std::get<0>(group_impl[g]) == OpImpl::NATIVE &&
+               std::get<1>(group_impl[g]) == TargetArch::CPU &&
+               ops.at(name)->layout == LAYOUT_NCHW;
+    };
+
+    // ReLUs quantize their output, pools and flattens keep it quantized.
+    // Quantized outputs are non-negative and need no zero point.
+    std::set<std::string> quantized;
+    for (auto &op: ops) {
+        if (!native_nchw(op.first)) {
+            continue;
+        }
+        auto relu = std::dynamic_pointer_cast<ReLUOp>(op.second);
+        auto scale = activation_scales.find(op.first);
+        if ((relu && relu->slope == 0.0f &&
+             scale != activation_scales.end() && scale->second > 0.0f) ||
+            std::dynamic_pointer_cast<Pool2dOp>(op.second) ||
+            std::dynamic_pointer_cast<FlattenOp>(op.second)) {
+            quantized.insert(op.first);
+        }
+    }
 
-    auto start = std::chrono::steady_clock::now();
-    halide_pipelines[group_id].compile_jit(target);
-    auto end = std::chrono::steady_clock::now();
-    std::cout << "Group " << group_id << " compile time: " <<
-        std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
-        << "ms" << std::endl;
+    // Drop outputs until the kernels reading each quantized output have
+    // a quantized variant.
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (auto it = quantized.begin(); it != quantized.end();) {
+            auto op = ops.at(*it);
+            bool relu = (bool)std::dynamic_pointer_cast<ReLUOp>(op);
+            bool in_quantized =
+                quantized.count(op_name_map.at(op->input_ops[0])) > 0;
+            bool keep = relu != in_quantized &&
+                        std::find(graph_outs.begin(), graph_outs.end(),
+                                  *it) == graph_outs.end();
+            for (auto &c: consumers[*it]) {
+                auto c_op = ops.at(c);
+                bool reads_quantized =
+                    quantized.count(c) > 0 ||
+                    ((std::dynamic_pointer_cast<Conv2dOp>(c_op) ||
+                      std::dynamic_pointer_cast<AffineOp>(c_op)) &&
+                     native_nchw(c));
+                keep = keep && reads_quantized;
+            }
+            if (keep) {
+                it++;
+            } else {
+                it = quantized.erase(it);
+                changed = true;
+            }
+        }
+    }
+
+    // Pools requantize to their own scale when they have one, flattens
+    // and other pools keep the scale of their input.
+    std::function<float(const std::string&)> get_scale =
+        [&](const std::string& name) {
+            auto op = ops.at(name);
+            if (op->quant_scale == 0.0f) {
+                auto scale = activation_scales.find(name);
+                if (!std::dynamic_pointer_cast<FlattenOp>(op) &&
+                    scale != activation_scales.end() && scale->second > 0.0f) {
+                    op->quant_scale = scale->second;
+                } else {
+                    op->quant_scale =
+                        get_scale(op_name_map.at(op->input_ops[0]));
+                }
+            }
+            return op->quant_scale;
+        };
+    for (auto &name: quantized) {
+        ops.at(name)->type = DataType::UInt8;
+        get_scale(name);
+    }
 }
 
-void Graph::build_forward_ref(unsigned int group_id) {
-    for (auto &op: groups[group_id]) {
-        std::vector<int> buf_sizes;
-        for (int d = 0; d < op.second->num_dims(); d++) {
-            buf_sizes.push_back(op.second->out_size(d));
+void Graph::plan_concat_slices() {
+    std::map<std::string, int> num_uses;
+    for (auto &op: ops) {
+        for (auto &in_op: op.second->input_ops) {
+            num_uses[op_name_map.at(in_op)]++;
+        }
+    }
+
+    for (size_t g = 0; g < groups.size(); g++) {
+        OpImpl impl = std::get<0>(group_impl[g]);
+        if (impl != OpImpl::REF && impl != OpImpl::NATIVE) {
+            continue;
+        }
+        auto& outs = group_outs[g];
+        for (auto &op: groups[g]) {
+            auto concat = std::dynamic_pointer_cast<ConcatOp>(op.second);
+            if (!concat) {
+                continue;
+            }
+            int channel = 0;
+            for (auto &in_op: concat->input_ops) {
+                std::string in_name = op_name_map.at(in_op);
+                // Only kernels which write each entry of the batch at the
+                // stride of the output can write into a slice. The native
+                // conv kernels assume dense outputs.
+                bool strided = std::dynamic_pointer_cast<ReLUOp>(in_op) ||
+                               std::dynamic_pointer_cast<Pool2dOp>(in_op) ||
+                               (std::dynamic_pointer_cast<Conv2dOp>(in_op) &&
+                                impl == OpImpl::REF);
+                if (strided && groups[g].find(in_name) != groups[g].end() &&
+                    num_uses[in_name] == 1 &&
+                    std::find(outs.begin(), outs.end(), in_name) ==
+                        outs.end()) {
+                    concat_slices[in_name] = std::make_pair(op.first, channel);
+                }
+                channel += in_op->out_size(1);
+            }
         }
-        op_outs[op.first] = get_ndarray_t(buf_sizes, op.second->type);
     }
 }
 
-void Graph::build_forward_group(unsigned int group_id,
-                                const std::vector<std::string>& output_ops) {
+void Graph::plan_buffers() {
+    // Step at which each op executes. Ops in a Halide group all execute
+    // in a single step and only the outputs of the group are
+    // materialized, whereas every op in a reference group is a step of
+    // its own and has its output materialized.
+    std::map<std::string, int> op_steps;
+    std::vector<std::string> materialized;
+    int step = 0;
+    for (size_t g = 0; g < groups.size(); g++) {
+        OpImpl impl = std::get<0>(group_impl[g]);
+        if (impl == OpImpl::HALIDE) {
+            for (auto &op_name: order[g]) {
+                op_steps[op_name] = step;
+            }
+            for (auto &out_name: group_outs[g]) {
+                if (std::find(materialized.begin(), materialized.end(),
+                              out_name) == materialized.end()) {
+                    materialized.push_back(out_name);
+                }
+            }
+            step++;
+        } else {
+            for (auto &op_name: order[g]) {
+                op_steps[op_name] = step++;
+                if (concat_slices.find(op_name) == concat_slices.end()) {
+                    materialized.push_back(op_name);
+                }
+            }
+        }
+    }
+
+    // The output of a concat is live from the first op writing into it.
+    std::map<std::string, int> first_step;
+    for (auto &op_name: materialized) {
+        first_step[op_name] = op_steps.at(op_name);
+    }
+    for (auto &s: concat_slices) {
+        first_step[s.second.first] = std::min(first_step.at(s.second.first),
+                                              op_steps.at(s.first));
+    }
+
+    std::map<std::string, int> last_use;
+    for (auto &op_name: materialized) {
+        last_use[op_name] = op_steps.at(op_name);
+    }
+
+    for (auto &op: ops) {
+        for (auto &in_op: op.second->input_ops) {
+            auto in_name = op_name_map.at(in_op);
+            if (last_use.find(in_name) != last_use.end()) {
+                last_use[in_name] = std::max(last_use[in_name],
+                                             op_steps.at(op.first));
+            }
+        }
+    }
+
+    // Outputs of the graph are handed back to the caller after the run
+    // so they stay live until the very end.
+    for (auto &out_name: graph_outs) {
+        if (last_use.find(out_name) != last_use.end()) {
+            last_use[out_name] = step;
+        }
+    }
+
+    std::vector<LiveInterval> intervals;
+    for (auto &op_name: materialized) {
+        auto op = ops.at(op_name);
+        size_t size = get_type_size(op->type);
+        for (int d = 0; d < op->num_dims(); d++) {
+            size *= op->out_size(d);
+        }
+        intervals.push_back(LiveInterval(op_name, size, first_step.at(op_name),
+                                         last_use.at(op_name)));
+    }
+
+    memory_plan = plan_memory(intervals);
+
+    slabs.clear();
+    for (auto &size: memory_plan.slab_sizes) {
+        slabs.push_back(allocate_storage<uint8_t>(size, activation_allocator));
+    }
+
+    if (profiler) {
+        std::cout << "Activation memory: " <<
+            memory_plan.planned_size()/(1024 * 1024) << "MB in " <<
+            memory_plan.slab_sizes.size() << " slabs (" <<
+            memory_plan.unplanned_size()/(1024 * 1024) << "MB unplanned)" <<
+            std::endl;
+    }
+}
+
+void Graph::remove_op(const std::string& name) {
+    auto op = ops.at(name);
+    for (auto &g: groups) {
+        g.erase(name);
+    }
+    op_name_map.erase(op);
+    ops.erase(name);
+}
+
+// Whether an op has a native kernel for a layout with blocks of channels.
+static bool has_blocked_kernel(std::shared_ptr<Op> op, int block) {
+    if (auto conv = std::dynamic_pointer_cast<Conv2dOp>(op)) {
+        return conv->input_channels % block == 0 &&
+               conv->output_channels % block == 0;
+    } else if (auto pool = std::dynamic_pointer_cast<Pool2dOp>(op)) {
+        return pool->input_channels % block == 0;
+    }
+    // Elementwise ops apply to any layout.
+    bool elementwise = std::dynamic_pointer_cast<ReLUOp>(op) ||
+                       std::dynamic_pointer_cast<SumOp>(op);
+    return elementwise && op->num_dims() == 4 && op->out_size(1) % block == 0;
+}
+
+void Graph::plan_layouts() {
+    int native_block = get_layout_block(native_layout);
+    for (size_t g = 0; g < groups.size(); g++) {
+        OpImpl impl = std::get<0>(group_impl[g]);
+        TargetArch arch = std::get<1>(group_impl[g]);
+        if (group_layout.find(g) != group_layout.end()) {
+            if (group_layout[g] != LAYOUT_NCHW && impl != OpImpl::NATIVE) {
+                std::cerr << "Group " << g << " has to be native to compute "
+                          << "in " << get_layout_name(group_layout[g])
+                          << std::endl;
+                assert(0);
+            }
+        } else {
+            group_layout[g] = LAYOUT_NCHW;
+            if (native_block == 0 || impl != OpImpl::NATIVE ||
+                arch != TargetArch::CPU) {
+                continue;
+            }
+            // Groups with convs are worth reordering into, other groups
+            // only compute in the layout when their inputs are in it.
+            bool supported = true;
+            bool has_conv = false;
+            bool ins_blocked = true;
+            for (auto &op: groups[g]) {
+                if (op.second->input_ops.size() == 0) {
+                    continue;
+                }
+                supported = supported &&
+                            has_blocked_kernel(op.second, native_block) &&
+                            std::find(graph_outs.begin(), graph_outs.end(),
+                                      op.first) == graph_outs.end();
+                has_conv = has_conv ||
+                           std::dynamic_pointer_cast<Conv2dOp>(op.second);
+                for (auto &in_op: op.second->input_ops) {
+                    if (groups[g].find(op_name_map.at(in_op)) ==
+                            groups[g].end() &&
+                        in_op->layout != native_layout) {
+                        ins_blocked = false;
+                    }
+                }
+            }
+            if (supported && (has_conv || ins_blocked)) {
+                group_layout[g] = native_layout;
+            }
+        }
+
+        int block = get_layout_block(group_layout[g]);
+        for (auto &op: groups[g]) {
+            if (op.second->input_ops.size() == 0) {
+                continue;
+            }
+            if (group_layout[g] != LAYOUT_NCHW &&
+                (block == 0 || !has_blocked_kernel(op.second, block))) {
+                std::cerr << "No kernel for " << op.first << " in "
+                          << get_layout_name(group_layout[g]) << std::endl;
+                assert(0);
+            }
+            op.second->layout = group_layout[g];
+        }
+    }
+
+    std::map<std::string, int> op_groups;
+    for (size_t g = 0; g < groups.size(); g++) {
+        for (auto &op: groups[g]) {
+            op_groups[op.first] = g;
+        }
+    }
+
+    std::map<std::pair<std::string, Layout>, std::shared_ptr<Op>> reorders;
+    for (size_t g = 0; g < groups.size(); g++) {
+        std::vector<std::shared_ptr<Op>> group_ops;
+        for (auto &op: groups[g]) {
+            group_ops.push_back(op.second);
+        }
+        for (auto &op: group_ops) {
+            for (auto &in_op: op->input_ops) {
+                if (in_op->layout == op->layout) {
+                    continue;
+                }
+                std::string in_name = op_name_map.at(in_op);
+                auto key = std::make_pair(in_name, op->layout);
+                if (reorders.find(key) == reorders.end()) {
+                    auto reorder = std::make_shared<ReorderOp>(op->layout,
+                                                               in_op);
+                    std::string name = in_name + "_" +
+                                       get_layout_name(op->layout);
+                    assert(ops.find(name) == ops.end());
+                    int group_id = op->layout != LAYOUT_NCHW ?
+                                   g : op_groups.at(in_name);
+                    ops[name] = reorder;
+                    groups[group_id][name] = reorder;
+                    op_name_map[reorder] = name;
+                    reorders[key] = reorder;
+                }
+                in_op = reorders.at(key);
+            }
+        }
+    }
+}
+
+void Graph::fold_batch_norm_ops(const std::vector<std::string>& output_ops) {
+    std::map<std::string, std::vector<std::string>> consumers;
+    for (auto &op: ops) {
+        for (auto &in_op: op.second->input_ops) {
+            consumers[op_name_map.at(in_op)].push_back(op.first);
+        }
+    }
+
+    // Ops whose outputs are requested by the caller have to stay.
+    auto foldable = [&](const std::string& name) {
+        return consumers[name].size() == 1 &&
+               std::find(output_ops.begin(), output_ops.end(), name) ==
+                    output_ops.end();
+    };
+
+    std::vector<std::string> convs;
+    for (auto &op: ops) {
+        if (std::dynamic_pointer_cast<Conv2dOp>(op.second)) {
+            convs.push_back(op.first);
+        }
+    }
+
+    for (auto &conv_name: convs) {
+        if (!foldable(conv_name)) {
+            continue;
+        }
+
+        std::string bn_name = consumers[conv_name][0];
+        auto bn = std::dynamic_pointer_cast<BNCaffeOp>(ops.at(bn_name));
+        if (!bn || std::find(output_ops.begin(), output_ops.end(), bn_name) !=
+                        output_ops.end()) {
+            continue;
+        }
+
+        std::string scale_name;
+        if (foldable(bn_name) &&
+            std::dynamic_pointer_cast<ScaleCaffeOp>(
+                ops.at(consumers[bn_name][0]))) {
+            scale_name = consumers[bn_name][0];
+            if (std::find(output_ops.begin(), output_ops.end(), scale_name) !=
+                    output_ops.end()) {
+                continue;
+            }
+        }
+
+        // Consumers of the last folded op read the conv instead.
+        auto conv = std::static_pointer_cast<Conv2dOp>(ops.at(conv_name));
+        std::string last = scale_name.empty() ? bn_name : scale_name;
+        for (auto &user: consumers[last]) {
+            for (auto &in_op: ops.at(user)->input_ops) {
+                if (in_op == ops.at(last)) {
+                    in_op = conv;
+                }
+            }
+        }
+        consumers[conv_name] = consumers[last];
+
+        if (!conv->bias) {
+            conv->bias = true;
+            conv->params.push_back(get_ndarray_t({conv->output_channels},
+                                                 conv->type));
+        }
+
+        folded_ops[conv_name] = {bn_name, scale_name, bn->epsilon};
+        remove_op(bn_name);
+        if (!scale_name.empty()) {
+            remove_op(scale_name);
+        }
+    }
+}
+
+void Graph::order_group(unsigned int group_id,
+                        const std::vector<std::string>& output_ops) {
 
-    OpImpl impl = std::get<0>(group_impl[group_id]);
     std::map<std::string, int> num_prods;
 
     // Find a valid execution order for the ops.
@@ -237,7 +1013,7 @@ void Graph::build_forward_group(unsigned int group_id,
     for (auto &dep: num_prods) {
         if (dep.second == 0) {
             auto op = ops[dep.first];
-            if (std::dynamic_pointer_cast<DataOp>(op) != nullptr) {
+            if (op->input_ops.size() == 0) {
                 if (in_set.find(dep.first) == in_set.end()) {
                     in_set.insert(dep.first);
                 }
@@ -302,8 +1078,47 @@ void Graph::build_forward_group(unsigned int group_id,
             }
         }
     }
+}
+
+void Graph::tune_conv_algorithms() {
+    ConvTuning tuning;
+    tuning.load(conv_tuning_path);
+
+    bool updated = false;
+    for (size_t g = 0; g < groups.size(); g++) {
+        if (std::get<0>(group_impl[g]) != OpImpl::NATIVE) {
+            continue;
+        }
+        for (auto &op: groups[g]) {
+            auto conv = std::dynamic_pointer_cast<Conv2dOp>(op.second);
+            // The shapes record a single stride. Convs in blocked layouts
+            // and convs of quantized inputs have a single algorithm.
+            if (!conv || conv->stride_h != conv->stride_w ||
+                conv->layout != LAYOUT_NCHW ||
+                conv->input_ops[0]->type == DataType::UInt8) {
+                continue;
+            }
+            ConvLayerShape shape = get_conv_layer_shape(*conv);
+            auto entry = tuning.algorithms.find(shape);
+            if (entry != tuning.algorithms.end()) {
+                conv->algorithm = entry->second;
+            } else if (tune_convs) {
+                conv->algorithm = time_conv_algorithms(conv);
+                tuning.algorithms[shape] = conv->algorithm;
+                updated = true;
+            }
+        }
+    }
+
+    if (updated) {
+        tuning.save(conv_tuning_path);
+    }
+}
+
+void Graph::build_forward_group(unsigned int group_id) {
 
-    if (impl == OpImpl::REF) {
+    OpImpl impl = std::get<0>(group_impl[group_id]);
+    if (impl == OpImpl::REF || impl == OpImpl::NATIVE) {
         // Create input and output buffers for each op.
         build_forward_ref(group_id);
     } else if (impl == OpImpl::HALIDE) {
@@ -325,9 +1140,81 @@ void Graph::build_forward(const std::vector<std::string>& output_ops) {
         graph_outs.push_back(op);
     }
 
+    if (fold_batch_norm) {
+        fold_batch_norm_ops(output_ops);
+    }
+
+    plan_layouts();
+
+    if (quantize_int8) {
+        if (!activation_scales_path.empty()) {
+            std::map<std::string, float> scales;
+            if (!load_activation_scales(activation_scales_path, scales)) {
+                std::cerr << "No activation scales in "
+                          << activation_scales_path << std::endl;
+            }
+            activation_scales.insert(scales.begin(), scales.end());
+        }
+        plan_quantization();
+    }
+
     for (size_t g = 0; g < groups.size(); g++) {
-        build_forward_group(g, output_ops);
+        order_group(g, output_ops);
+    }
+
+    // The batch size of the inputs is the largest the graph can run.
+    for (auto &op: ops) {
+        if (op.second->input_ops.size() == 0 && op.second->num_dims() > 0) {
+            max_batch_size = std::max(max_batch_size,
+                                      op.second->out_size(0));
+        }
     }
+    curr_batch_size = max_batch_size;
+
+    for (size_t g = 0; g < groups.size() && !aot_output_dir.empty(); g++) {
+        if (std::get<0>(group_impl[g]) != OpImpl::HALIDE) {
+            std::cerr << "AOT compilation needs every group to use "
+                      << "the Halide implementation" << std::endl;
+            assert(0);
+        }
+    }
+
+    if (concat_in_place) {
+        plan_concat_slices();
+    }
+
+    if (!conv_tuning_path.empty()) {
+        tune_conv_algorithms();
+    }
+
+    if (!halide_schedule_path.empty()) {
+        HalideScheduleDB db;
+        db.load(halide_schedule_path);
+        halide_schedules.convs.insert(db.convs.begin(), db.convs.end());
+    }
+
+    if (memory_planning) {
+        plan_buffers();
+    }
+
+    ref_kernels.assign(groups.size(), std::vector<OpKernel>());
+    for (size_t g = 0; g < groups.size(); g++) {
+        build_forward_group(g);
+    }
+
+    if (!aot_output_dir.empty()) {
+        Target target = get_target_from_environment();
+        for (size_t g = 0; g < groups.size(); g++) {
+            if (std::get<1>(group_impl[g]) == TargetArch::GPU) {
+                target.set_feature(Target::CUDA);
+                target.set_feature(Target::CUDACapability50);
+            }
+        }
+        write_aot_model(target);
+        return;
+    }
+
+    build_task_graph();
 }
 
 void Graph::display_ops() {
@@ -341,7 +1228,7 @@ void Graph::display_ops() {
 void Graph::set_halide_group_inputs(unsigned int group_id,
                                     std::map<std::string, NDArray_t>& inputs) {
     // TODO: Handle GPU -> CPU transfers when needed
-   for (auto &in: halide_op_ins[group_id]) {
+   for (auto &in: halide_op_ins.at(group_id)) {
        auto op_in = ops.at(in.first);
        Buffer<> buf;
        if (op_outs.find(in.first) != op_outs.end()) {
@@ -353,136 +1240,242 @@ void Graph::set_halide_group_inputs(unsigned int group_id,
    }
 }
 
-std::map<std::string, NDArray_t>
-Graph::run(std::map<std::string, NDArray_t>& inputs) {
-    // Run each group in the graph
+void Graph::run_halide_group(unsigned int group_id,
+                             std::map<std::string, NDArray_t>& inputs) {
+    int64_t start = profiler ? profiler->now_us() : 0;
+
+    // Set the Halide input buffers from corresponding NDArray buffers
+    set_halide_group_inputs(group_id, inputs);
+    if (halide_compiled.find(group_id) != halide_compiled.end()) {
+        halide_compiled.at(group_id).run(halide_compiled_params.at(group_id),
+                                         halide_op_outs.at(group_id));
+    } else {
+        halide_pipelines.at(group_id).
+            realize(Realization(halide_op_outs.at(group_id)));
+    }
+
+    if (profiler) {
+        profiler->record("group" + std::to_string(group_id), "group", start,
+                         group_bytes(group_id), group_flops(group_id));
+    }
+}
+
+void Graph::run_ref_kernel(unsigned int group_id, size_t op_index) {
+    if (!profiler && !calibrator) {
+        ref_kernels[group_id][op_index]();
+        return;
+    }
+
+    const std::string& op_name = order[group_id][op_index];
+    int64_t start = profiler ? profiler->now_us() : 0;
+    ref_kernels[group_id][op_index]();
+    if (profiler) {
+        profiler->record(op_name, "op", start, op_bytes(op_name),
+                         op_flops(op_name));
+    }
+    if (calibrator) {
+        calibrator->observe(op_name, op_outs.at(op_name));
+    }
+}
+
+size_t Graph::out_bytes(const std::string& op_name) {
+    auto op = ops.at(op_name);
+    double batch_fraction = max_batch_size > 0 ?
+                                (double)curr_batch_size/max_batch_size : 1.0;
+    return get_type_size(op->type) * op->num_out_elems() * batch_fraction;
+}
+
+static size_t param_bytes(std::shared_ptr<Op> op) {
+    size_t bytes = 0;
+    for (auto &p: op->params) {
+        size_t size = get_type_size(op->type);
+        for (auto &s: get_dim_sizes(p)) {
+            size *= s;
+        }
+        bytes += size;
+    }
+    return bytes;
+}
+
+size_t Graph::op_bytes(const std::string& op_name) {
+    auto op = ops.at(op_name);
+    size_t bytes = out_bytes(op_name) + param_bytes(op);
+    if (op->input_ops.size() == 0) {
+        // Source ops read an input of the same size.
+        bytes += out_bytes(op_name);
+    }
+    for (auto &in_op: op->input_ops) {
+        bytes += out_bytes(op_name_map.at(in_op));
+    }
+    return bytes;
+}
+
+size_t Graph::group_bytes(unsigned int group_id) {
+    size_t bytes = 0;
+    for (auto &in: group_ins[group_id]) {
+        bytes += out_bytes(in);
+    }
+    for (auto &out: group_outs[group_id]) {
+        bytes += out_bytes(out);
+    }
+    for (auto &op: groups[group_id]) {
+        bytes += param_bytes(op.second);
+        if (op.second->input_ops.size() == 0) {
+            bytes += out_bytes(op.first);
+        }
+    }
+    return bytes;
+}
+
+double Graph::op_flops(const std::string& op_name) {
+    double batch_fraction = max_batch_size > 0 ?
+                                (double)curr_batch_size/max_batch_size : 1.0;
+    return ops.at(op_name)->flops() * batch_fraction;
+}
+
+double Graph::group_flops(unsigned int group_id) {
+    double flops = 0;
+    for (auto &op_name: order[group_id]) {
+        flops += op_flops(op_name);
+    }
+    return flops;
+}
+
+void Graph::set_num_threads(int inter_op_threads, int intra_op_threads) {
+    num_inter_op_threads = std::max(inter_op_threads, 1);
+    num_intra_op_threads = intra_op_threads;
+    inter_op_pool.reset();
+
+    // The Halide runtime sizes its thread pool on first use from the
+    // environment, so this only has an effect before the first run.
+    if (num_intra_op_threads > 0) {
+        setenv("HL_NUM_THREADS",
+               std::to_string(num_intra_op_threads).c_str(), 1);
+        set_native_num_threads(num_intra_op_threads);
+    }
+}
+
+void Graph::build_task_graph() {
+    task_graph = TaskGraph();
+
+    // A Halide group runs as a single task whereas every op in a
+    // reference group is a task of its own.
+    std::map<std::string, int> op_tasks;
     for (size_t g = 0; g < groups.size(); g++) {
         OpImpl impl = std::get<0>(group_impl[g]);
         if (impl == OpImpl::HALIDE) {
-            // Set the Halide input buffers from corresponding NDArray buffers
-            set_halide_group_inputs(g, inputs);
-            halide_pipelines[g].
-                realize(Realization(halide_op_outs.at(g)));
-
-        } else if (impl == OpImpl::REF) {
-            // TODO: Get rid of the giant switch case
+            int t = task_graph.add_task([this, g]() {
+                        run_halide_group(g, *run_inputs);
+                    });
             for (auto &op_name: order[g]) {
-                auto op = groups[g][op_name];
-                if (std::dynamic_pointer_cast<SumOp>(op) != nullptr) {
-
-                    auto op_cast = std::dynamic_pointer_cast<SumOp>(op);
-                    std::vector<NDArray<float>> op_ins;
-                    for (size_t in = 0; in < op->input_ops.size(); in++) {
-                        auto in_op_name = op_name_map[op->input_ops[in]];
-                        op_ins.push_back(get_ndarray<float>(op_outs.at(in_op_name)));
-                    }
-
-                    NDArray<float>& op_out =
-                        get_ndarray<float>(op_outs.at(op_name));
-
-                    sum_forward_ref(op_cast, op_ins, op_out);
-
-                } else if (std::dynamic_pointer_cast<AffineOp>(op) != nullptr) {
-
-                    auto in_op_name = op_name_map[op->input_ops[0]];
-                    auto op_cast = std::dynamic_pointer_cast<AffineOp>(op);
-                    NDArray<float>& op_in =
-                        get_ndarray<float>(op_outs.at(in_op_name));
-                    NDArray<float>& op_out =
-                        get_ndarray<float>(op_outs.at(op_name));
-                    affine_forward_ref(op_cast, op_in, op_out);
-
-                } else if (std::dynamic_pointer_cast<Conv2dOp>(op) != nullptr) {
-
-                    auto in_op_name = op_name_map[op->input_ops[0]];
-                    auto op_cast = std::dynamic_pointer_cast<Conv2dOp>(op);
-                    NDArray<float>& op_in =
-                        get_ndarray<float>(op_outs.at(in_op_name));
-                    NDArray<float>& op_out =
-                        get_ndarray<float>(op_outs.at(op_name));
-                    conv2d_forward_ref(op_cast, op_in, op_out);
-
-                } else if (std::dynamic_pointer_cast<Pool2dOp>(op) != nullptr) {
-
-                    auto in_op_name = op_name_map[op->input_ops[0]];
-                    auto op_cast = std::dynamic_pointer_cast<Pool2dOp>(op);
-                    NDArray<float>& op_in =
-                        get_ndarray<float>(op_outs.at(in_op_name));
-                    NDArray<float>& op_out =
-                        get_ndarray<float>(op_outs.at(op_name));
-                    pool2d_forward_ref(op_cast, op_in, op_out);
-
-                } else if (std::dynamic_pointer_cast<ReLUOp>(op) != nullptr) {
-
-                    auto in_op_name = op_name_map[op->input_ops[0]];
-                    auto op_cast = std::dynamic_pointer_cast<ReLUOp>(op);
-                    NDArray<float>& op_in =
-                        get_ndarray<float>(op_outs.at(in_op_name));
-                    NDArray<float>& op_out =
-                        get_ndarray<float>(op_outs.at(op_name));
-                    relu_forward_ref(op_cast, op_in, op_out);
-
-                } else if (std::dynamic_pointer_cast<SoftMaxOp>(op) != nullptr) {
-
-                    auto in_op_name = op_name_map[op->input_ops[0]];
-                    auto op_cast = std::dynamic_pointer_cast<SoftMaxOp>(op);
-                    NDArray<float>& op_in =
-                        get_ndarray<float>(op_outs.at(in_op_name));
-                    NDArray<float>& op_out =
-                        get_ndarray<float>(op_outs.at(op_name));
-                    softmax_forward_ref(op_cast, op_in, op_out);
-
-                } else if (std::dynamic_pointer_cast<LRNOp>(op) != nullptr) {
-
-                    auto in_op_name = op_name_map[op->input_ops[0]];
-                    auto op_cast = std::dynamic_pointer_cast<LRNOp>(op);
-                    NDArray<float>& op_in =
-                        get_ndarray<float>(op_outs.at(in_op_name));
-                    NDArray<float>& op_out =
-                        get_ndarray<float>(op_outs.at(op_name));
-                    lrn_forward_ref(op_cast, op_in, op_out);
-
-                } else if (std::dynamic_pointer_cast<ConcatOp>(op) != nullptr) {
-
-                    auto op_cast = std::dynamic_pointer_cast<ConcatOp>(op);
-                    std::vector<NDArray<float>> op_ins;
-                    for (size_t in = 0; in < op->input_ops.size(); in++) {
-                        auto in_op_name = op_name_map[op->input_ops[in]];
-                        op_ins.push_back(get_ndarray<float>(op_outs.at(in_op_name)));
-                    }
-
-                    NDArray<float>& op_out =
-                        get_ndarray<float>(op_outs.at(op_name));
+                op_tasks[op_name] = t;
+            }
+        } else {
+            for (size_t k = 0; k < order[g].size(); k++) {
+                op_tasks[order[g][k]] = task_graph.add_task([this, g, k]() {
+                                            run_ref_kernel(g, k);
+                                        });
+            }
+        }
+    }
 
-                    concat_forward_ref(op_cast, op_ins, op_out);
+    std::set<std::pair<int, int>> deps;
+    std::map<std::string, std::vector<std::string>> consumers;
+    for (auto &op: ops) {
+        for (auto &in_op: op.second->input_ops) {
+            auto in_name = op_name_map.at(in_op);
+            consumers[in_name].push_back(op.first);
+            deps.insert(std::make_pair(op_tasks.at(in_name),
+                                       op_tasks.at(op.first)));
+        }
+    }
 
-                } else if (std::dynamic_pointer_cast<FlattenOp>(op) != nullptr) {
+    // Outputs which share a slab are ordered by the memory plan. Every
+    // task writing the next output in a slab, which for a concat includes
+    // the ops writing into its slices, has to wait for every task
+    // touching the previous one.
+    if (memory_planning) {
+        std::map<std::string, std::vector<std::string>> writers;
+        for (auto &s: concat_slices) {
+            writers[s.second.first].push_back(s.first);
+        }
+        for (auto &slab: memory_plan.slab_buffers) {
+            for (size_t b = 1; b < slab.size(); b++) {
+                std::vector<std::string> succs = writers[slab[b].name];
+                succs.push_back(slab[b].name);
+                std::vector<std::string> users = consumers[slab[b - 1].name];
+                users.push_back(slab[b - 1].name);
+                for (auto &succ: succs) {
+                    for (auto &user: users) {
+                        deps.insert(std::make_pair(op_tasks.at(user),
+                                                   op_tasks.at(succ)));
+                    }
+                }
+            }
+        }
+    }
 
-                    auto in_op_name = op_name_map[op->input_ops[0]];
-                    auto op_cast = std::dynamic_pointer_cast<FlattenOp>(op);
-                    NDArray<float>& op_in =
-                        get_ndarray<float>(op_outs.at(in_op_name));
-                    NDArray<float>& op_out =
-                        get_ndarray<float>(op_outs.at(op_name));
-                    flatten_forward_ref(op_cast, op_in, op_out);
+    for (auto &d: deps) {
+        if (d.first != d.second) {
+            task_graph.add_dependency(d.first, d.second);
+        }
+    }
+}
 
-                } else if (std::dynamic_pointer_cast<DataOp>(op) != nullptr) {
+std::map<std::string, NDArray_t>
+Graph::run(std::map<std::string, NDArray_t>& inputs) {
+    // Every input has to have the same batch size.
+    int batch_size = 0;
+    for (auto &in: inputs) {
+        int in_batch = get_dim_sizes(in.second)[0];
+        assert(batch_size == 0 || batch_size == in_batch);
+        batch_size = in_batch;
+    }
+    if (batch_size > 0 && batch_size != curr_batch_size) {
+        set_batch_size(batch_size);
+    }
 
-                    auto op_cast = std::dynamic_pointer_cast<DataOp>(op);
-                    NDArray<float>& op_in =
-                        get_ndarray<float>(inputs.at(op_name));
-                    NDArray<float>& op_out =
-                        get_ndarray<float>(op_outs.at(op_name));
-                    data_forward_ref(op_cast, op_in, op_out);
+    for (auto &slot: input_slots) {
+        slot.second = inputs.at(slot.first);
+    }
 
-                } else {
-                    std::cerr << "Unknown op" << std::endl;
-                    assert(0);
+    if (num_inter_op_threads > 1 && !param_streamer) {
+        // Run ops and groups as soon as their inputs are ready
+        if (!inter_op_pool) {
+            inter_op_pool =
+                std::make_shared<ThreadPool>(num_inter_op_threads);
+        }
+        run_inputs = &inputs;
+        task_graph.run(*inter_op_pool);
+        run_inputs = nullptr;
+    } else {
+        // Run each group in the graph
+        for (size_t g = 0; g < groups.size(); g++) {
+            if (param_streamer) {
+                param_streamer->acquire(g);
+                if (g + 1 < groups.size()) {
+                    param_streamer->prefetch(g + 1);
                 }
             }
-        } else {
-            std::cerr << "Unknown implementation" << std::endl;
-            assert(0);
+            OpImpl impl = std::get<0>(group_impl[g]);
+            if (impl == OpImpl::HALIDE) {
+                run_halide_group(g, inputs);
+            } else if (impl == OpImpl::REF || impl == OpImpl::NATIVE) {
+                int64_t start = profiler ? profiler->now_us() : 0;
+                for (size_t k = 0; k < ref_kernels[g].size(); k++) {
+                    run_ref_kernel(g, k);
+                }
+                if (profiler) {
+                    profiler->record("group" + std::to_string(g), "group",
+                                     start, group_bytes(g), group_flops(g));
+                }
+            } else {
+                std::cerr << "Unknown implementation" << std::endl;
+                assert(0);
+            }
+            if (param_streamer) {
+                param_streamer->release(g);
+            }
         }
     }
 
@@ -2,6 +2,7 @@
 
 #include <vector>
 #include <tuple>
+#include <algorithm>
 #include <memory>
 #include <iostream>
 #include "ModelIO.h"
@@ -9,6 +10,23 @@
 #include "OpRef.h"
 #include "OpImpl.h"
 #include "OpHalide.h"
+#include "OpNative.h"
+#include "MemoryPlanner.h"
+#include "ThreadPool.h"
+#include "HalideCache.h"
+#include "AotRuntime.h"
+#include "Profiler.h"
+#include "ConvTuning.h"
+#include "ParamStreamer.h"
+#include "Calibration.h"
+
+// Batch norm and the optional scale following it which were folded into
+// the weights and bias of a conv.
+struct FoldedBatchNorm {
+    std::string bn_name;
+    std::string scale_name;
+    float epsilon;
+};
 
 class Graph {
     public:
@@ -25,21 +43,150 @@ class Graph {
     std::map<int, std::map<std::string, ImageParam>> halide_op_ins;
 
     std::map<int, std::vector<Buffer<>>> halide_op_outs;
+
+    // Directory of the compiled pipeline cache, when empty every group
+    // is JIT compiled. Groups loaded from the cache run through the
+    // compiled function with the parameters bound in argument order.
+    std::string halide_cache_dir;
+    std::map<int, CompiledPipeline> halide_compiled;
+    std::map<int, std::vector<ImageParam>> halide_compiled_params;
     std::map<std::string, NDArray_t> op_outs;
 
+    // Op outputs are allocated for the batch size the graph is built
+    // with. Runs with a smaller batch use views of the first rows of the
+    // allocations, so the graph is never rebuilt for a new batch size.
+    std::map<std::string, NDArray_t> op_out_allocs;
+    int max_batch_size;
+    int curr_batch_size;
+
+    // When set build_forward compiles every group ahead of time into a
+    // static library in this directory instead of JIT compiling it. The
+    // libraries are run with AotModel, see write_aot_model for the files.
+    std::string aot_output_dir;
+    std::string aot_model_name;
+    std::map<int, std::vector<AotArg>> aot_args;
+
+    // Kernels of the ops in each reference group in execution order and
+    // the arrays source ops copy the inputs of a run from.
+    std::vector<std::vector<OpKernel>> ref_kernels;
+    std::map<std::string, NDArray_t> input_slots;
+
     std::map<int, std::vector<std::string>> order;
     std::map<int, std::vector<std::string>> group_ins;
     std::map<int, std::vector<std::string>> group_outs;
 
     std::vector<std::string> graph_outs;
 
-    Graph() {}
+    // When enabled batch norm and scale ops following a conv are removed
+    // from the graph when it is built and folded into the conv params by
+    // set_params. Folded ops are recorded by the name of the conv.
+    bool fold_batch_norm;
+    std::map<std::string, FoldedBatchNorm> folded_ops;
+
+    // When enabled convs in Halide groups on the CPU are fused with
+    // their consumers. An elementwise consumer is inlined into the conv
+    // and a pool consuming the result computes it for each of its tiles
+    // instead of reading it from memory.
+    bool halide_fusion;
+
+    // Layout the ops of each group compute in. Native groups on the CPU
+    // which are missing from the map compute in native_layout when every
+    // op in them has a kernel for it, see plan_layouts. Data ops always
+    // produce NCHW and graph outputs are returned in NCHW.
+    std::map<int, Layout> group_layout;
+    Layout native_layout;
+
+    // When enabled ops in reference and native groups whose only use is
+    // a concat write their output straight into their channel slice of
+    // the output of the concat, which then skips copying them. Sliced
+    // ops are recorded with the concat and their first channel.
+    bool concat_in_place;
+    std::map<std::string, std::pair<std::string, int>> concat_slices;
+
+    // When enabled op outputs with disjoint lifetimes share storage.
+    bool memory_planning;
+    MemoryPlan memory_plan;
+    std::vector<std::shared_ptr<void>> slabs;
+    // Allocator of the slabs and of the op outputs when they are not
+    // planned. An AlignedAllocator with huge pages suits large networks.
+    std::shared_ptr<Allocator> activation_allocator;
+
+    // When set every run records the time of each group and reference
+    // op, and building reports the activation memory. With profile_halide
+    // the groups are compiled with Halide's profiler, which reports the
+    // time of each Func on exit.
+    std::shared_ptr<Profiler> profiler;
+    bool profile_halide;
+
+    // Schedules of the Halide ops are read from this database when it
+    // records their shape, see tune_halide. Entries added to
+    // halide_schedules before the graph is built take precedence.
+    std::string halide_schedule_path;
+    HalideScheduleDB halide_schedules;
+
+    // Algorithms of the native convs are read from the tuning file when
+    // it records their shape. With tune_convs the other convs are timed
+    // with each algorithm when the graph is built and the fastest is
+    // added to the file.
+    std::string conv_tuning_path;
+    bool tune_convs;
+
+    // When enabled the outputs of ReLUs with a scale in activation_scales
+    // are quantized to UInt8 when every consumer of them can read that,
+    // and pools and flattens of quantized outputs stay quantized. Native
+    // convs and affine ops reading quantized inputs multiply them with
+    // their weights quantized to Int8 for each output channel, summing
+    // in 32 bits. Only native groups in NCHW are quantized. The scales
+    // are the value of a step of the output, found by calibrating the
+    // float graph. Building reads the scales saved by calibrate from
+    // activation_scales_path, see get_activation_scales_path. Entries
+    // added to activation_scales before the graph is built take
+    // precedence.
+    bool quantize_int8;
+    std::map<std::string, float> activation_scales;
+    std::string activation_scales_path;
+
+    // When set every run adds the output of each reference and native op
+    // to the calibrator, which gathers the activation_scales of the ops.
+    // Outputs computed by Halide groups are not calibrated.
+    std::shared_ptr<Calibrator> calibrator;
+
+    // When set before set_params, the params mapped from a container by
+    // load_mapped_model are streamed: each run pages in the params of a
+    // group just before it runs, those of the next group in the
+    // background while it runs, and drops them after. Groups then run
+    // one after the other. The params must not be written to.
+    bool stream_params;
+    std::shared_ptr<ParamStreamer> param_streamer;
+
+    // Threads used for running independent ops and groups concurrently
+    // and threads used within each op.
+    int num_inter_op_threads;
+    int num_intra_op_threads;
+    std::shared_ptr<ThreadPool> inter_op_pool;
+    TaskGraph task_graph;
+    std::map<std::string, NDArray_t>* run_inputs;
+
+    Graph() : max_batch_size(0), curr_batch_size(0),
+              aot_model_name("dnncc"), fold_batch_norm(true),
+              halide_fusion(true), native_layout(LAYOUT_NCHW),
+              concat_in_place(true), memory_planning(true),
+              activation_allocator(get_default_allocator()),
+              profile_halide(false), tune_convs(false), quantize_int8(false),
+              stream_params(false),
+              num_inter_op_threads(1), num_intra_op_threads(0),
+              run_inputs(nullptr) {}
 
     // Initialize the parameters of operations in the graph using the
     // values from params. The params are matched to ops by name and
-    // the order in the op's param list.
+    // the order in the op's param list. Params of folded ops are folded
+    // into a copy, params itself is left as is.
     void set_params(Params& params);
 
+    // Replace the params of folded batch norm and scale ops by the
+    // weights and bias of the conv they were folded into.
+    void fold_params(Params& params);
+
     // Extract parameters from all the op's in the graph. The params are
     // stored by op name and the order in the op's param list.
     void get_params(Params& params);
@@ -54,15 +201,98 @@ class Graph {
     void set_halide_group_inputs(unsigned int group_id,
                                  std::map<std::string, NDArray_t>& inputs);
 
+    // Find the convs of the group which are fused with their consumers:
+    // inlined maps a conv to the elementwise op inlined into it and
+    // computed_at to the pool computing it within its tiles.
+    void plan_halide_fusion(unsigned int group_id,
+                            std::map<std::string, std::string>& inlined,
+                            std::map<std::string, std::string>& computed_at);
+
+    // Schedule the outputs the builders of the group left unscheduled
+    // according to the plan.
+    void fuse_halide_ops(unsigned int group_id,
+                         std::map<std::string, std::string>& inlined,
+                         std::map<std::string, std::string>& computed_at);
+
     void build_forward_halide(unsigned int group_id);
 
+    void bind_compiled_args(unsigned int group_id);
+
+    // Compile the group into <aot_model_name>_group<id>.a and .h and
+    // record the arrays bound to each argument of the function.
+    void emit_aot_group(unsigned int group_id, const Target& target);
+
+    // Write the Halide runtime shared by the groups, the manifest read by
+    // AotModel and <aot_model_name>_aot.h/.cpp which map the function
+    // names in the manifest to their entry points.
+    void write_aot_model(const Target& target);
+
     void build_forward_ref(unsigned int group_id);
 
-    void build_forward_group(unsigned int group_id,
-                             const std::vector<std::string>& output_ops);
+    // Rewire the consumers of conv -> batch norm [-> scale] chains to
+    // read the conv directly and remove the batch norm and scale ops.
+    void fold_batch_norm_ops(const std::vector<std::string>& output_ops);
+
+    void remove_op(const std::string& name);
+
+    // Pick the layout of each group and insert a reorder for each op and
+    // layout it is read in other than its own. Reorders to a blocked
+    // layout go into the group reading them and reorders to NCHW into
+    // the group of the op, so that only native groups see blocked arrays.
+    void plan_layouts();
+
+    // Pick the ops with quantized outputs and set their type and scale.
+    void plan_quantization();
+
+    // Find an execution order for the ops in the group along with the
+    // inputs and outputs of the group.
+    void order_group(unsigned int group_id,
+                     const std::vector<std::string>& output_ops);
+
+    // Find the inputs of concats which can be computed in place.
+    void plan_concat_slices();
+
+    // Compute the lifetime of every op output which is materialized
+    // and assign the outputs to shared slabs.
+    void plan_buffers();
+
+    void allocate_op_out(const std::string& op_name);
+
+    // Point the op outputs and the Halide output buffers at views for
+    // the batch size.
+    void set_batch_size(int batch_size);
+
+    void set_halide_group_outputs(unsigned int group_id);
+
+    // Set the algorithms of the convs in native groups from the tuning
+    // file, timing the convs it does not record when tune_convs is set.
+    void tune_conv_algorithms();
+
+    void build_forward_group(unsigned int group_id);
 
     void build_forward(const std::vector<std::string>& output_ops);
 
+    // Split the cores between inter-op and intra-op parallelism. With
+    // more than one inter-op thread independent ops and groups run
+    // concurrently. Has to be called before the first run.
+    void set_num_threads(int inter_op_threads, int intra_op_threads);
+
+    // Build the tasks and their dependencies for the inter-op scheduler.
+    void build_task_graph();
+
+    void run_halide_group(unsigned int group_id,
+                          std::map<std::string, NDArray_t>& inputs);
+
+    void run_ref_kernel(unsigned int group_id, size_t op_index);
+
+    // Bytes read and written and floating point operations of an op or
+    // a group at the current batch size.
+    size_t out_bytes(const std::string& op_name);
+    size_t op_bytes(const std::string& op_name);
+    size_t group_bytes(unsigned int group_id);
+    double op_flops(const std::string& op_name);
+    double group_flops(unsigned int group_id);
+
     std::map<std::string, NDArray_t>
         run(std::map<std::string, NDArray_t>& inputs);
 
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+// 16-bit floating point types for storing params. Values convert to and
+// from float, arithmetic is done in float.
+//
+// float16 is IEEE half precision: 5 exponent and 10 mantissa bits, which
+// covers weights well but overflows past 65504. bfloat16 keeps the 8
+// exponent bits of float and 7 of its mantissa bits, so it has the range
+// of float with less precision.
+
+inline uint32_t float_bits(float f) {
+    uint32_t u;
+    std::memcpy(&u, &f, sizeof(u));
+    return u;
+}
+
+inline float bits_float(uint32_t u) {
+    float f;
+    std::memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+// Rounds to the nearest half, ties to even.
+inline uint16_t float_to_half(float f) {
+    uint32_t u = float_bits(f);
+    uint16_t sign = (u >> 16) & 0x8000;
+    uint32_t abs = u & 0x7fffffff;
+    if (abs >= 0x7f800000) {
+        // Infinity, or a quiet NaN.
+        return sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0);
+    }
+    if (abs >= 0x477ff000) {
+        // Rounds past the largest half.
+        return sign | 0x7c00;
+    }
+    if (abs < 0x38800000) {
+        // Subnormal half, adding 0.5 shifts the mantissa into place and
+        // rounds it.
+        float r = bits_float(abs) + 0.5f;
+        return sign | (uint16_t)(float_bits(r) - 0x3f000000);
+    }
+    uint32_t odd = (abs >> 13) & 1;
+    abs += 0xc8000fff + odd;
+    return sign | (uint16_t)(abs >> 13);
+}
+
+inline float half_to_float(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    if (exp == 0x1f) {
+        return bits_float(sign | 0x7f800000 | (mant << 13));
+    }
+    if (exp == 0) {
+        // Zero or subnormal, mant * 2^-24.
+        float f = (float)mant * bits_float(0x33800000);
+        return bits_float(sign | float_bits(f));
+    }
+    return bits_float(sign | ((exp + 112) << 23) | (mant << 13));
+}
+
+// Rounds to the nearest bfloat16, ties to even.
+inline uint16_t float_to_bfloat16(float f) {
+    uint32_t u = float_bits(f);
+    if ((u & 0x7fffffff) > 0x7f800000) {
+        return (uint16_t)((u >> 16) | 0x40);
+    }
+    u += 0x7fff + ((u >> 16) & 1);
+    return (uint16_t)(u >> 16);
+}
+
+inline float bfloat16_to_float(uint16_t b) {
+    return bits_float((uint32_t)b << 16);
+}
+
+struct float16 {
+    uint16_t bits;
+
+    float16() : bits(0) {}
+    float16(float f) : bits(float_to_half(f)) {}
+
+    operator float() const {
+        return half_to_float(bits);
+    }
+};
+
+struct bfloat16 {
+    uint16_t bits;
+
+    bfloat16() : bits(0) {}
+    bfloat16(float f) : bits(float_to_bfloat16(f)) {}
+
+    operator float() const {
+        return bfloat16_to_float(bits);
+    }
+};
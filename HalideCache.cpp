@@ -0,0 +1,109 @@
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <dlfcn.h>
+#include <unistd.h>
+#include "HalideCache.h"
+
+uint64_t fnv1a_hash(const std::string& str) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (auto &c: str) {
+        hash ^= (uint8_t)c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+void CompiledPipeline::run(std::vector<ImageParam>& params,
+                           std::vector<Buffer<>>& outs) {
+    assert(params.size() + outs.size() == args.size());
+
+    // Keep the buffers alive for the duration of the call.
+    std::vector<Buffer<>> bufs;
+    for (auto &p: params) {
+        bufs.push_back(p.get());
+    }
+
+    std::vector<void*> argv;
+    for (auto &b: bufs) {
+        argv.push_back(b.raw_buffer());
+    }
+    for (auto &b: outs) {
+        argv.push_back(b.raw_buffer());
+    }
+
+    int ret = argv_fn(argv.data());
+    if (ret != 0) {
+        std::cerr << "Compiled pipeline failed with error " << ret << std::endl;
+        assert(0);
+    }
+}
+
+std::string HalideCache::get_key(Pipeline& p, const Target& target) {
+    std::string stmt_path = cache_dir + "/lowered_" +
+                            std::to_string(getpid()) + ".stmt";
+    p.compile_to_lowered_stmt(stmt_path, p.infer_arguments(),
+                              StmtOutputFormat::Text, target);
+
+    std::ifstream ifs(stmt_path);
+    std::stringstream stmt;
+    stmt << ifs.rdbuf();
+    ifs.close();
+    std::remove(stmt_path.c_str());
+
+    std::stringstream key;
+    key << std::hex << fnv1a_hash(stmt.str() + target.to_string());
+    return key.str();
+}
+
+bool HalideCache::load_or_compile(Pipeline& p, const Target& target,
+                                  CompiledPipeline& compiled) {
+    std::string key = get_key(p, target);
+    std::string fn_name = "dnncc_" + key;
+    std::string so_path = cache_dir + "/" + fn_name + ".so";
+
+    compiled.args = p.infer_arguments();
+
+    compiled.cache_hit = access(so_path.c_str(), R_OK) == 0;
+    if (!compiled.cache_hit) {
+        // Compile and link under a name private to this process and move
+        // the result into place, so that concurrent builds never see a
+        // partially written entry.
+        std::string tmp = cache_dir + "/" + fn_name + "_" +
+                          std::to_string(getpid());
+        p.compile_to_object(tmp + ".o", compiled.args, fn_name, target);
+
+        std::string link_cmd = "cc -shared -o " + tmp + ".so " + tmp + ".o";
+        int ret = std::system(link_cmd.c_str());
+        std::remove((tmp + ".o").c_str());
+        if (ret != 0 || std::rename((tmp + ".so").c_str(),
+                                    so_path.c_str()) != 0) {
+            std::cerr << "Could not link " << so_path << std::endl;
+            std::remove((tmp + ".so").c_str());
+            return false;
+        }
+    }
+
+    void* handle = dlopen(so_path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (handle == nullptr) {
+        std::cerr << "Could not load " << so_path << ": " << dlerror()
+                  << std::endl;
+        return false;
+    }
+    compiled.handle = std::shared_ptr<void>(handle, [](void* h) {
+                                                dlclose(h);
+                                            });
+
+    compiled.argv_fn = reinterpret_cast<int (*)(void**)>(
+                            dlsym(handle, (fn_name + "_argv").c_str()));
+    if (compiled.argv_fn == nullptr) {
+        std::cerr << "Missing " << fn_name << "_argv in " << so_path
+                  << std::endl;
+        compiled.handle.reset();
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include "Halide.h"
+
+using namespace Halide;
+
+// Pipeline compiled ahead of time into a shared object and loaded with
+// dlopen. Arguments are passed in the order of infer_arguments followed
+// by the output buffers.
+class CompiledPipeline {
+    public:
+    std::shared_ptr<void> handle;
+    int (*argv_fn)(void**);
+    std::vector<Argument> args;
+    // Whether the shared object was already in the cache.
+    bool cache_hit;
+
+    CompiledPipeline() : argv_fn(nullptr), cache_hit(false) {}
+
+    void run(std::vector<ImageParam>& params, std::vector<Buffer<>>& outs);
+};
+
+// On disk cache of compiled group pipelines. Entries are keyed by a hash
+// of the lowered pipeline, which captures the ops, their shapes and the
+// schedule, together with the target. The key is stable across processes
+// only if the params, vars and reduction domains of the pipeline are named
+// deterministically rather than after global counters. A hit only lowers
+// the pipeline and skips LLVM code generation completely.
+class HalideCache {
+    public:
+    std::string cache_dir;
+
+    HalideCache(const std::string& _cache_dir) : cache_dir(_cache_dir) {}
+
+    // Key identifying the compiled code of the pipeline for the target.
+    std::string get_key(Pipeline& p, const Target& target);
+
+    // Load the compiled pipeline from the cache, compiling and storing it
+    // on a miss. Returns false if the pipeline could not be compiled into
+    // a shared object, in which case the caller has to JIT compile it.
+    bool load_or_compile(Pipeline& p, const Target& target,
+                         CompiledPipeline& compiled);
+};
+
+// 64 bit FNV-1a hash of a string. Unlike std::hash it is stable across
+// builds, which matters for keys that are persisted.
+uint64_t fnv1a_hash(const std::string& str);
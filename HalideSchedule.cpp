@@ -0,0 +1,68 @@
+#include <sstream>
+#include "HalideSchedule.h"
+#include "TextDB.h"
+
+// Each line after the header records the schedule of one conv shape:
+// conv <batch> <in_w> <in_h> <in_c> <out_c> <f_w> <f_h> <stride>
+//      <tile_x> <tile_y> <channel_block> <vector_width> <unroll>
+//      <rows_outside_taps> <input_at_tile>
+static const std::string schedule_header = "dnncc_halide_schedules 1";
+
+ConvSchedule default_conv_schedule(Conv2dOp& op) {
+    ConvSchedule s;
+    s.tile_x = op.output_width;
+    s.tile_y = op.output_height;
+    s.channel_block = 1;
+    s.vector_width = 8;
+    s.unroll = 1;
+    s.rows_outside_taps = false;
+    s.input_at_tile = false;
+    return s;
+}
+
+bool HalideScheduleDB::load(const std::string& path) {
+    std::ifstream ifs;
+    if (!open_text_db(path, schedule_header, ifs)) {
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(ifs, line)) {
+        if (line.empty()) {
+            continue;
+        }
+        std::stringstream ss(line);
+        std::string tag;
+        int b, in_w, in_h, in_c, out_c, f_w, f_h, stride;
+        ConvSchedule s;
+        ss >> tag >> b >> in_w >> in_h >> in_c >> out_c >> f_w >> f_h
+           >> stride >> s.tile_x >> s.tile_y >> s.channel_block
+           >> s.vector_width >> s.unroll >> s.rows_outside_taps
+           >> s.input_at_tile;
+        if (ss.fail() || tag != "conv") {
+            std::cerr << "Malformed line in " << path << ": " << line
+                      << std::endl;
+            assert(0);
+        }
+        ConvLayerShape shape(b, in_w, in_h, in_c, out_c, f_w, f_h, stride);
+        convs[shape] = s;
+    }
+    return true;
+}
+
+void HalideScheduleDB::save(const std::string& path) {
+    save_text_db(path, schedule_header, [this](std::ostream& os) {
+        for (auto &c: convs) {
+            const ConvLayerShape& shape = c.first;
+            const ConvSchedule& s = c.second;
+            os << "conv " << shape.batch_size << " " << shape.input_width
+               << " " << shape.input_height << " " << shape.input_channels
+               << " " << shape.output_channels << " " << shape.filter_width
+               << " " << shape.filter_height << " " << shape.stride << " "
+               << s.tile_x << " " << s.tile_y << " " << s.channel_block
+               << " " << s.vector_width << " " << s.unroll << " "
+               << s.rows_outside_taps << " " << s.input_at_tile
+               << std::endl;
+        }
+    });
+}
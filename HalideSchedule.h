@@ -0,0 +1,42 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include "Op.h"
+#include "OpShapes.h"
+
+// Schedule of a conv built with Halide for the CPU. Each task computes a
+// tile of the output for a block of output channels, accumulating the
+// tile in a buffer of its own.
+struct ConvSchedule {
+    // Output columns and rows in a tile and output channels in a block.
+    int tile_x;
+    int tile_y;
+    int channel_block;
+    int vector_width;
+    // Output channels of the block accumulated together.
+    int unroll;
+    // Loop over the rows of the tile outside the filter taps instead of
+    // inside them.
+    bool rows_outside_taps;
+    // Pad the input for each tile instead of once for the whole input.
+    bool input_at_tile;
+};
+
+// Schedule used for convs missing from the database. It computes whole
+// images for each output channel.
+ConvSchedule default_conv_schedule(Conv2dOp& op);
+
+// Schedules of the Halide ops found by tune_halide, keyed by the shape of
+// the op. Builders fall back to the default schedule for other shapes.
+class HalideScheduleDB {
+    public:
+    std::map<ConvLayerShape, ConvSchedule> convs;
+
+    // Add the schedules in a database file. Returns false when there is
+    // no file.
+    bool load(const std::string& path);
+
+    // Write the database, replacing the file at once.
+    void save(const std::string& path);
+};
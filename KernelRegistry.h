@@ -0,0 +1,81 @@
+#pragma once
+
+#include <map>
+#include <cassert>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <iostream>
+#include <typeinfo>
+#include <typeindex>
+#include <functional>
+#include "Op.h"
+#include "OpImpl.h"
+
+// Kernel bound to an op along with the arrays holding its inputs and
+// output. Running the graph is a sequence of calls to bound kernels.
+typedef std::function<void()> OpKernel;
+
+// Creates the kernel for an op. The input and output arrays are resolved
+// when the graph is built but only read when the kernel runs, so they
+// can be re-pointed between runs.
+typedef std::function<OpKernel(std::shared_ptr<Op> op,
+                               std::vector<NDArray_t*> inputs,
+                               NDArray_t* output)> KernelFactory;
+
+// Prepares the kernel params of an op once its params are set, so that
+// kernels do not transform the params on every run.
+typedef std::function<void(std::shared_ptr<Op> op)> ParamsHook;
+
+// Registry of kernels keyed by the type of the op and the implementation.
+// Ops resolve their kernels once when the graph is built, which keeps
+// type checks off the path of running the graph.
+template <typename Factory>
+class KernelRegistry {
+    public:
+    static KernelRegistry& get() {
+        static KernelRegistry registry;
+        return registry;
+    }
+
+    void add(std::type_index op_type, OpImpl impl, Factory factory) {
+        auto key = std::make_pair(op_type, impl);
+        assert(factories.find(key) == factories.end());
+        factories[key] = factory;
+    }
+
+    bool has(const Op& op, OpImpl impl) {
+        return factories.find(std::make_pair(std::type_index(typeid(op)),
+                                             impl)) != factories.end();
+    }
+
+    Factory& lookup(const Op& op, OpImpl impl) {
+        auto key = std::make_pair(std::type_index(typeid(op)), impl);
+        if (factories.find(key) == factories.end()) {
+            std::cerr << "No kernel registered for " << typeid(op).name()
+                      << " with implementation " << impl << std::endl;
+            assert(0);
+        }
+        return factories.at(key);
+    }
+
+    private:
+    std::map<std::pair<std::type_index, OpImpl>, Factory> factories;
+};
+
+template <typename Factory>
+struct KernelRegistrar {
+    KernelRegistrar(std::type_index op_type, OpImpl impl, Factory factory) {
+        KernelRegistry<Factory>::get().add(op_type, impl, factory);
+    }
+};
+
+#define KERNEL_CONCAT_IMPL(a, b) a##b
+#define KERNEL_CONCAT(a, b) KERNEL_CONCAT_IMPL(a, b)
+
+// Registers a factory for an op class and implementation at static
+// initialization time.
+#define REGISTER_KERNEL(factory_type, op_class, impl, factory)            \
+    static KernelRegistrar<factory_type>                                  \
+        KERNEL_CONCAT(kernel_registrar_, __LINE__)(                       \
+            std::type_index(typeid(op_class)), impl, factory)
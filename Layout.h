@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cassert>
+#include <string>
+#include <vector>
+
+// Orders of the elements of 4-D activations, which ops see as NCHW.
+// LAYOUT_NCHW<n>c splits the channels into blocks of n stored innermost,
+// so that a vector register holds one pixel of a block. The storage of a
+// blocked array has dimensions {N, C/n, H, W, n}, that of an NHWC array
+// {N, H, W, C}.
+enum Layout { LAYOUT_NCHW, LAYOUT_NHWC, LAYOUT_NCHW8c, LAYOUT_NCHW16c };
+
+// Channels in a block of the layout, 0 when the channels are not blocked.
+inline int get_layout_block(Layout layout) {
+    switch (layout) {
+        case LAYOUT_NCHW8c:
+            return 8;
+        case LAYOUT_NCHW16c:
+            return 16;
+        default:
+            return 0;
+    }
+}
+
+inline std::string get_layout_name(Layout layout) {
+    switch (layout) {
+        case LAYOUT_NHWC:
+            return "nhwc";
+        case LAYOUT_NCHW8c:
+            return "nchw8c";
+        case LAYOUT_NCHW16c:
+            return "nchw16c";
+        default:
+            return "nchw";
+    }
+}
+
+// Dimensions of the storage of an array with the NCHW dimensions dims in
+// the layout. Arrays of other ranks are only stored as NCHW.
+inline std::vector<int> get_layout_dims(const std::vector<int>& dims,
+                                        Layout layout) {
+    if (layout == LAYOUT_NCHW) {
+        return dims;
+    }
+    assert(dims.size() == 4);
+    if (layout == LAYOUT_NHWC) {
+        return {dims[0], dims[2], dims[3], dims[1]};
+    }
+    int block = get_layout_block(layout);
+    assert(dims[1] % block == 0);
+    return {dims[0], dims[1]/block, dims[2], dims[3], block};
+}
+
+// NCHW dimensions of an array stored in the layout.
+inline std::vector<int> get_nchw_dims(const std::vector<int>& dims,
+                                      Layout layout) {
+    if (layout == LAYOUT_NCHW) {
+        return dims;
+    }
+    if (layout == LAYOUT_NHWC) {
+        assert(dims.size() == 4);
+        return {dims[0], dims[3], dims[1], dims[2]};
+    }
+    assert(dims.size() == 5);
+    return {dims[0], dims[1] * dims[4], dims[2], dims[3]};
+}
@@ -0,0 +1,78 @@
+#include <algorithm>
+#include <cassert>
+#include "MemoryPlanner.h"
+
+size_t MemoryPlan::planned_size() const {
+    size_t size = 0;
+    for (auto &s: slab_sizes) {
+        size += s;
+    }
+    return size;
+}
+
+size_t MemoryPlan::unplanned_size() const {
+    size_t size = 0;
+    for (auto &slab: slab_buffers) {
+        for (auto &buf: slab) {
+            size += buf.size;
+        }
+    }
+    return size;
+}
+
+MemoryPlan plan_memory(std::vector<LiveInterval> intervals) {
+    // Visit the largest buffers first so that the slabs are sized by
+    // them and smaller buffers fill in the gaps in their lifetimes.
+    std::sort(intervals.begin(), intervals.end(),
+              [](const LiveInterval& a, const LiveInterval& b) {
+                  if (a.size != b.size) {
+                      return a.size > b.size;
+                  }
+                  if (a.start != b.start) {
+                      return a.start < b.start;
+                  }
+                  return a.name < b.name;
+              });
+
+    MemoryPlan plan;
+    for (auto &buf: intervals) {
+        assert(buf.start <= buf.end);
+        assert(plan.slab_ids.find(buf.name) == plan.slab_ids.end());
+
+        int best_slab = -1;
+        for (size_t s = 0; s < plan.slab_sizes.size(); s++) {
+            bool conflict = false;
+            for (auto &other: plan.slab_buffers[s]) {
+                if (other.overlaps(buf)) {
+                    conflict = true;
+                    break;
+                }
+            }
+            if (!conflict && (best_slab < 0 ||
+                        plan.slab_sizes[s] < plan.slab_sizes[best_slab])) {
+                best_slab = s;
+            }
+        }
+
+        if (best_slab < 0) {
+            plan.slab_sizes.push_back(buf.size);
+            plan.slab_buffers.push_back(std::vector<LiveInterval>());
+            best_slab = plan.slab_sizes.size() - 1;
+        }
+
+        // Sizes are visited in decreasing order so an existing slab is
+        // always large enough.
+        assert(plan.slab_sizes[best_slab] >= buf.size);
+        plan.slab_buffers[best_slab].push_back(buf);
+        plan.slab_ids[buf.name] = best_slab;
+    }
+
+    for (auto &slab: plan.slab_buffers) {
+        std::sort(slab.begin(), slab.end(),
+                  [](const LiveInterval& a, const LiveInterval& b) {
+                      return a.start < b.start;
+                  });
+    }
+
+    return plan;
+}
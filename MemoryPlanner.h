@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+
+// Lifetime of a buffer in the linear execution order of the graph. A
+// buffer is live from the step which produces it until the last step
+// which reads it, both inclusive.
+struct LiveInterval {
+    std::string name;
+    size_t size;
+    int start;
+    int end;
+
+    LiveInterval(std::string _name, size_t _size, int _start, int _end) :
+        name(_name), size(_size), start(_start), end(_end) {}
+
+    bool overlaps(const LiveInterval& other) const {
+        return start <= other.end && other.start <= end;
+    }
+};
+
+// Assignment of buffers to a small set of shared slabs. Buffers which
+// share a slab have disjoint live intervals, so a slab only has to be
+// as large as the largest buffer assigned to it.
+class MemoryPlan {
+    public:
+    // Size in bytes of each slab.
+    std::vector<size_t> slab_sizes;
+    // Slab assigned to each buffer.
+    std::map<std::string, int> slab_ids;
+    // Buffers assigned to each slab ordered by the start of their
+    // live intervals.
+    std::vector<std::vector<LiveInterval>> slab_buffers;
+
+    // Total bytes allocated for all the slabs.
+    size_t planned_size() const;
+
+    // Total bytes required when every buffer gets its own allocation.
+    size_t unplanned_size() const;
+};
+
+// Greedy by size assignment of buffers to slabs. Buffers are visited in
+// decreasing order of size and placed in the smallest existing slab
+// whose buffers do not overlap with it, otherwise a new slab is created.
+MemoryPlan plan_memory(std::vector<LiveInterval> intervals);
@@ -1,180 +1,463 @@
 #include <iostream>
 #include <fstream>
+#include <cstdio>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "ModelIO.h"
+#include "ThreadPool.h"
 
-// TODO: Current assumption is all the parameters are of type float.
-// This has to change going forward.
-// TODO: Document the serialization format
-void save_model_to_disk(std::string weight_file_name, Params &params) {
-    std::ofstream ofs;
-    ofs.open(weight_file_name, std::ofstream::out | std::ofstream::trunc |
-                               std::ofstream::binary);
+// Layout of a container, integers are in the byte order of the host:
+//   char[8]  magic
+//   uint32   version
+//   uint32   number of arrays
+//   index, for each array in the order of the params:
+//     uint32 name length, name, uint32 data type, uint32 rank,
+//     int32 sizes[rank], uint64 offset of the payload from the start of
+//     the file, uint64 bytes of the payload, uint64 checksum of the
+//     payload or 0 when it was saved without one (from version 2)
+//   payloads, each at an offset aligned to ALLOC_ALIGNMENT
+static const char container_magic[8] = {'D', 'N', 'N', 'C', 'C', 'P', 'R',
+                                        'M'};
+static const uint32_t container_version = 2;
 
-    size_t num_params = params.size();
-    ofs.write(reinterpret_cast<char*>(&num_params), sizeof(num_params));
+// Run fn for the indices [0, n) on the native pool.
+static void parallel_for_each(size_t n,
+                              const std::function<void(size_t)>& fn) {
+    ThreadPool* pool = get_native_pool();
+    if (!pool) {
+        for (size_t i = 0; i < n; i++) {
+            fn(i);
+        }
+        return;
+    }
+    pool->parallel_for(0, n, [&](int i) { fn(i); });
+}
+
+uint64_t payload_checksum(const char* data, size_t bytes) {
+    // FNV-1a over 8 byte words and then the remaining bytes. Never 0, which
+    // marks a payload without a checksum.
+    const uint64_t prime = 1099511628211ull;
+    uint64_t hash = 14695981039346656037ull;
+    size_t words = bytes / sizeof(uint64_t);
+    for (size_t w = 0; w < words; w++) {
+        uint64_t word;
+        std::copy(data + w * sizeof(word), data + (w + 1) * sizeof(word),
+                  reinterpret_cast<char*>(&word));
+        hash = (hash ^ word) * prime;
+    }
+    for (size_t b = words * sizeof(uint64_t); b < bytes; b++) {
+        hash = (hash ^ (uint8_t)data[b]) * prime;
+    }
+    return hash == 0 ? 1 : hash;
+}
+
+// The alternatives of NDArray_t are in the order of DataType.
+static DataType get_data_type(NDArray_t& arr) {
+    return (DataType)arr.which();
+}
+
+struct DenseVisitor : public boost::static_visitor<NDArray_t> {
+    template <class T>
+    NDArray_t operator()(NDArray<T>& arr) const {
+        if (arr.is_contiguous()) {
+            return arr;
+        }
+        NDArray<T> dense(arr.dim_sizes);
+        dense.copy(arr);
+        return dense;
+    }
+};
+
+struct PayloadVisitor :
+    public boost::static_visitor<std::pair<const char*, size_t>> {
+    template <class T>
+    std::pair<const char*, size_t> operator()(NDArray<T>& arr) const {
+        return std::make_pair(reinterpret_cast<const char*>(
+                                  arr.host_alloc.get()),
+                              arr.buf_size * sizeof(T));
+    }
+};
+
+struct SizesVisitor : public boost::static_visitor<std::vector<int>> {
+    template <class T>
+    std::vector<int> operator()(NDArray<T>& arr) const {
+        return arr.dim_sizes;
+    }
+};
+
+template <typename V>
+static void write_value(std::ofstream& ofs, V val) {
+    ofs.write(reinterpret_cast<char*>(&val), sizeof(val));
+}
+
+static size_t align_offset(size_t offset) {
+    return (offset + ALLOC_ALIGNMENT - 1)/ALLOC_ALIGNMENT * ALLOC_ALIGNMENT;
+}
+
+void save_model_to_disk(std::string weight_file_name, Params &params,
+                        bool checksums) {
+    std::vector<std::string> names;
+    std::vector<NDArray_t> arrays;
     for (auto &w: params) {
-        size_t name_len = w.first.size();
-        ofs.write(reinterpret_cast<char*>(&name_len), sizeof(name_len));
-        ofs.write(const_cast<char*>(w.first.c_str()), name_len);
-
-        size_t num_params = w.second.size();
-        ofs.write(reinterpret_cast<char*>(&num_params), sizeof(num_params));
-
-        for (size_t i = 0; i < w.second.size(); i++) {
-            NDArray<float> param = get_ndarray<float>(w.second[i]);
-            int dims = param.dimensions();
-            ofs.write(reinterpret_cast<char*>(&dims), sizeof(dims));
-            switch (param.dimensions()) {
-                case 1: {
-                    int d0 = param.extent(0);
-                    ofs.write(reinterpret_cast<char*>(&d0), sizeof(d0));
-                    for (int i = 0; i < param.extent(0); i++) {
-                        ofs.write(reinterpret_cast<char*>(&param(i)), sizeof(float));
-                    }
-                    break;
-                }
-                case 2: {
-                    int d0 = param.extent(0);
-                    ofs.write(reinterpret_cast<char*>(&d0), sizeof(d0));
-                    int d1 = param.extent(1);
-                    ofs.write(reinterpret_cast<char*>(&d1), sizeof(d1));
-                    for (int i = 0; i < param.extent(0); i++) {
-                        for (int j = 0; j < param.extent(1); j++) {
-                            ofs.write(reinterpret_cast<char*>(&param(i, j)), sizeof(float));
-                        }
-                    }
-                    break;
-                }
-                case 3: {
-                    int d0 = param.extent(0);
-                    ofs.write(reinterpret_cast<char*>(&d0), sizeof(d0));
-                    int d1 = param.extent(1);
-                    ofs.write(reinterpret_cast<char*>(&d1), sizeof(d1));
-                    int d2 = param.extent(2);
-                    ofs.write(reinterpret_cast<char*>(&d2), sizeof(d2));
-                    for (int i = 0; i < param.extent(0); i++) {
-                        for (int j = 0; j < param.extent(1); j++) {
-                            for (int k = 0; k < param.extent(2); k++) {
-                                ofs.write(reinterpret_cast<char*>(&param(i, j, k)), sizeof(float));
-                            }
-                        }
-                    }
-                    break;
-                }
-                case 4: {
-                    int d0 = param.extent(0);
-                    ofs.write(reinterpret_cast<char*>(&d0), sizeof(d0));
-                    int d1 = param.extent(1);
-                    ofs.write(reinterpret_cast<char*>(&d1), sizeof(d1));
-                    int d2 = param.extent(2);
-                    ofs.write(reinterpret_cast<char*>(&d2), sizeof(d2));
-                    int d3 = param.extent(3);
-                    ofs.write(reinterpret_cast<char*>(&d3), sizeof(d3));
-                    for (int i = 0; i < param.extent(0); i++) {
-                        for (int j = 0; j < param.extent(1); j++) {
-                            for (int k = 0; k < param.extent(2); k++) {
-                                for (int l = 0; l < param.extent(3); l++) {
-                                    ofs.write(reinterpret_cast<char*>(&param(i, j, k, l)), sizeof(float));
-                                }
-                            }
-                        }
-                    }
-                    break;
-                }
-            }
+        for (auto &p: w.second) {
+            names.push_back(w.first);
+            arrays.push_back(boost::apply_visitor(DenseVisitor(), p));
         }
     }
+
+    size_t index_size = sizeof(container_magic) + 2 * sizeof(uint32_t);
+    for (size_t a = 0; a < arrays.size(); a++) {
+        size_t rank = boost::apply_visitor(SizesVisitor(), arrays[a]).size();
+        index_size += 3 * sizeof(uint32_t) + names[a].size() +
+                      rank * sizeof(int32_t) + 3 * sizeof(uint64_t);
+    }
+    std::vector<uint64_t> offsets;
+    size_t end = index_size;
+    for (auto &arr: arrays) {
+        offsets.push_back(align_offset(end));
+        end = offsets.back() +
+              boost::apply_visitor(PayloadVisitor(), arr).second;
+    }
+
+    std::vector<uint64_t> sums(arrays.size(), 0);
+    if (checksums) {
+        parallel_for_each(arrays.size(), [&](size_t a) {
+            auto payload = boost::apply_visitor(PayloadVisitor(), arrays[a]);
+            sums[a] = payload_checksum(payload.first, payload.second);
+        });
+    }
+
+    // Write under a name private to this process and move the file into
+    // place, so that a process mapping the file never sees it half written.
+    std::string tmp = weight_file_name + "_" + std::to_string(getpid());
+    std::ofstream ofs(tmp, std::ofstream::out | std::ofstream::trunc |
+                           std::ofstream::binary);
+    ofs.write(container_magic, sizeof(container_magic));
+    write_value<uint32_t>(ofs, container_version);
+    write_value<uint32_t>(ofs, arrays.size());
+    for (size_t a = 0; a < arrays.size(); a++) {
+        std::vector<int> sizes = boost::apply_visitor(SizesVisitor(),
+                                                      arrays[a]);
+        write_value<uint32_t>(ofs, names[a].size());
+        ofs.write(names[a].c_str(), names[a].size());
+        write_value<uint32_t>(ofs, get_data_type(arrays[a]));
+        write_value<uint32_t>(ofs, sizes.size());
+        for (int s: sizes) {
+            write_value<int32_t>(ofs, s);
+        }
+        write_value<uint64_t>(ofs, offsets[a]);
+        write_value<uint64_t>(ofs,
+            boost::apply_visitor(PayloadVisitor(), arrays[a]).second);
+        write_value<uint64_t>(ofs, sums[a]);
+    }
+
+    size_t pos = index_size;
+    for (size_t a = 0; a < arrays.size(); a++) {
+        auto payload = boost::apply_visitor(PayloadVisitor(), arrays[a]);
+        std::vector<char> padding(offsets[a] - pos, 0);
+        ofs.write(padding.data(), padding.size());
+        ofs.write(payload.first, payload.second);
+        pos = offsets[a] + payload.second;
+    }
+    ofs.close();
+
+    if (ofs.fail() || std::rename(tmp.c_str(), weight_file_name.c_str()) != 0) {
+        std::cerr << "Could not write " << weight_file_name << std::endl;
+        std::remove(tmp.c_str());
+    }
 }
 
-void load_model_from_disk(std::string weight_file_name, Params &params) {
+// Start and size of the live mappings of containers.
+static std::mutex mappings_lock;
+static std::map<char*, size_t> mappings;
 
-    boost::filesystem::exists(weight_file_name);
-    std::ifstream ifs;
+bool is_mapped_param(const void* ptr) {
+    const char* p = static_cast<const char*>(ptr);
+    std::lock_guard<std::mutex> guard(mappings_lock);
+    auto it = mappings.upper_bound(const_cast<char*>(p));
+    if (it == mappings.begin()) {
+        return false;
+    }
+    it--;
+    return p < it->first + it->second;
+}
 
-    ifs.open(weight_file_name, std::ifstream::in | std::ofstream::binary);
+template <class T>
+static NDArray_t wrap_payload(const std::vector<int>& sizes,
+                              std::shared_ptr<void> mapping, char* payload) {
+    // Aliasing constructor keeps the mapping alive as long as the array.
+    return NDArray<T>(sizes, std::shared_ptr<T>(mapping,
+                                 reinterpret_cast<T*>(payload)));
+}
 
-    size_t num_params;
-    ifs.read(reinterpret_cast<char*>(&num_params), sizeof(num_params));
-    for (size_t w = 0; w < num_params; w++) {
-        size_t name_len;
-        ifs.read(reinterpret_cast<char*>(&name_len), sizeof(name_len));
+static NDArray_t wrap_payload(DataType type, const std::vector<int>& sizes,
+                              std::shared_ptr<void> mapping, char* payload) {
+    switch (type) {
+        case DataType::Float64:
+            return wrap_payload<double>(sizes, mapping, payload);
+        case DataType::Float32:
+            return wrap_payload<float>(sizes, mapping, payload);
+        case DataType::Int64:
+            return wrap_payload<int64_t>(sizes, mapping, payload);
+        case DataType::Int32:
+            return wrap_payload<int32_t>(sizes, mapping, payload);
+        case DataType::Int16:
+            return wrap_payload<int16_t>(sizes, mapping, payload);
+        case DataType::Int8:
+            return wrap_payload<int8_t>(sizes, mapping, payload);
+        case DataType::UInt64:
+            return wrap_payload<uint64_t>(sizes, mapping, payload);
+        case DataType::UInt32:
+            return wrap_payload<uint32_t>(sizes, mapping, payload);
+        case DataType::UInt16:
+            return wrap_payload<uint16_t>(sizes, mapping, payload);
+        case DataType::UInt8:
+            return wrap_payload<uint8_t>(sizes, mapping, payload);
+        case DataType::Float16:
+            return wrap_payload<float16>(sizes, mapping, payload);
+        case DataType::BFloat16:
+            return wrap_payload<bfloat16>(sizes, mapping, payload);
+        default:
+            assert(0);
+            return NDArray_t();
+    }
+}
 
-        std::string layer_name;
-        layer_name.resize(name_len);
-        ifs.read(const_cast<char*>(&layer_name[0]), name_len);
+// Reads a value of the index, failing when it runs past the end.
+template <typename V>
+static V read_value(const char* base, size_t size, size_t& pos,
+                    const std::string& path) {
+    if (pos + sizeof(V) > size) {
+        std::cerr << "Truncated index in " << path << std::endl;
+        assert(0);
+    }
+    V val;
+    std::copy(base + pos, base + pos + sizeof(V),
+              reinterpret_cast<char*>(&val));
+    pos += sizeof(V);
+    return val;
+}
 
-        size_t num_params;
-        ifs.read(reinterpret_cast<char*>(&num_params), sizeof(num_params));
+bool load_mapped_model(std::string weight_file_name, Params &params,
+                       bool verify) {
+    int fd = open(weight_file_name.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        std::cerr << "Could not open " << weight_file_name << std::endl;
+        assert(0);
+    }
+    size_t size = st.st_size;
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                      fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        std::cerr << "Could not map " << weight_file_name << std::endl;
+        assert(0);
+    }
+    {
+        std::lock_guard<std::mutex> guard(mappings_lock);
+        mappings[static_cast<char*>(addr)] = size;
+    }
+    std::shared_ptr<void> mapping(addr, [size](void* p) {
+                                            {
+                                                std::lock_guard<std::mutex>
+                                                    guard(mappings_lock);
+                                                mappings.erase(
+                                                    static_cast<char*>(p));
+                                            }
+                                            munmap(p, size);
+                                        });
+
+    char* base = static_cast<char*>(addr);
+    size_t pos = sizeof(container_magic);
+    if (size < pos || !std::equal(container_magic, container_magic + pos,
+                                  base)) {
+        std::cerr << weight_file_name << " is not a params container"
+                  << std::endl;
+        assert(0);
+    }
+    auto version = read_value<uint32_t>(base, size, pos, weight_file_name);
+    if (version < 1 || version > container_version) {
+        std::cerr << "Unknown version " << version << " of "
+                  << weight_file_name << std::endl;
+        assert(0);
+    }
+
+    auto num_arrays = read_value<uint32_t>(base, size, pos, weight_file_name);
+    Params loaded;
+    std::vector<std::string> names;
+    std::vector<std::pair<uint64_t, uint64_t>> payloads;
+    std::vector<uint64_t> sums;
+    for (uint32_t a = 0; a < num_arrays; a++) {
+        auto name_len = read_value<uint32_t>(base, size, pos,
+                                             weight_file_name);
+        if (pos + name_len > size) {
+            std::cerr << "Truncated index in " << weight_file_name
+                      << std::endl;
+            assert(0);
+        }
+        std::string name(base + pos, name_len);
+        pos += name_len;
+
+        auto type = read_value<uint32_t>(base, size, pos, weight_file_name);
+        auto rank = read_value<uint32_t>(base, size, pos, weight_file_name);
+        std::vector<int> sizes;
+        for (uint32_t d = 0; d < rank; d++) {
+            sizes.push_back(read_value<int32_t>(base, size, pos,
+                                                weight_file_name));
+        }
+        auto offset = read_value<uint64_t>(base, size, pos, weight_file_name);
+        auto bytes = read_value<uint64_t>(base, size, pos, weight_file_name);
+        uint64_t sum = 0;
+        if (version >= 2) {
+            sum = read_value<uint64_t>(base, size, pos, weight_file_name);
+        }
+
+        if (type > DataType::BFloat16 || offset % ALLOC_ALIGNMENT != 0 ||
+            offset + bytes > size) {
+            std::cerr << "Bad entry for " << name << " in "
+                      << weight_file_name << std::endl;
+            assert(0);
+        }
+        NDArray_t arr = wrap_payload((DataType)type, sizes, mapping,
+                                     base + offset);
+        if (boost::apply_visitor(PayloadVisitor(), arr).second != bytes) {
+            std::cerr << "Size of " << name << " does not match its shape in "
+                      << weight_file_name << std::endl;
+            assert(0);
+        }
+        loaded[name].push_back(arr);
+        names.push_back(name);
+        payloads.push_back(std::make_pair(offset, bytes));
+        sums.push_back(sum);
+    }
 
-        for (size_t i = 0; i < num_params; i++) {
-            int dims;
+    // Checking the payloads reads them, so the pages are faulted in by
+    // several threads at once.
+    if (verify) {
+        std::vector<char> valid(num_arrays);
+        parallel_for_each(num_arrays, [&](size_t a) {
+            valid[a] = sums[a] == 0 ||
+                       payload_checksum(base + payloads[a].first,
+                                        payloads[a].second) == sums[a];
+        });
+        for (uint32_t a = 0; a < num_arrays; a++) {
+            if (!valid[a]) {
+                std::cerr << "Checksum of " << names[a] << " does not match "
+                          << "in " << weight_file_name << std::endl;
+                return false;
+            }
+        }
+    }
+
+    for (auto &l: loaded) {
+        auto &arrays = params[l.first];
+        arrays.insert(arrays.end(), l.second.begin(), l.second.end());
+    }
+    return true;
+}
+
+// Files written before the container format: the number of layers and
+// for each layer its name, the number of params and each param as its
+// rank, sizes and float elements. The headers are read first, skipping
+// over the elements, which are then read into the arrays in parallel.
+static void load_legacy_model(std::string weight_file_name, Params &params) {
+    std::ifstream ifs(weight_file_name, std::ifstream::in |
+                                        std::ifstream::binary);
+    if (!ifs.is_open()) {
+        std::cerr << "Could not open " << weight_file_name << std::endl;
+        assert(0);
+    }
+
+    std::vector<NDArray<float>> arrays;
+    std::vector<std::streamoff> offsets;
+    size_t num_layers = 0;
+    ifs.read(reinterpret_cast<char*>(&num_layers), sizeof(num_layers));
+    for (size_t l = 0; l < num_layers && ifs.good(); l++) {
+        size_t name_len = 0;
+        ifs.read(reinterpret_cast<char*>(&name_len), sizeof(name_len));
+        std::string layer_name(name_len, ' ');
+        ifs.read(&layer_name[0], name_len);
+
+        size_t num_params = 0;
+        ifs.read(reinterpret_cast<char*>(&num_params), sizeof(num_params));
+        for (size_t i = 0; i < num_params && ifs.good(); i++) {
+            int dims = 0;
             ifs.read(reinterpret_cast<char*>(&dims), sizeof(dims));
-            switch (dims) {
-                case 1: {
-                    int d0;
-                    ifs.read(reinterpret_cast<char*>(&d0), sizeof(d0));
-                    NDArray<float> param({d0});
-                    for (int i = 0; i < d0; i++) {
-                        ifs.read(reinterpret_cast<char*>(&param(i)), sizeof(float));
-                    }
-                    params[layer_name].push_back(param);
-                    break;
-                }
-                case 2: {
-                    int d0;
-                    ifs.read(reinterpret_cast<char*>(&d0), sizeof(d0));
-                    int d1;
-                    ifs.read(reinterpret_cast<char*>(&d1), sizeof(d1));
-                    NDArray<float> param({d0, d1});
-                    for (int i = 0; i < d0; i++) {
-                        for (int j = 0; j < d1; j++) {
-                            ifs.read(reinterpret_cast<char*>(&param(i, j)), sizeof(float));
-                        }
-                    }
-                    params[layer_name].push_back(param);
-                    break;
-                }
-                case 3: {
-                    int d0;
-                    ifs.read(reinterpret_cast<char*>(&d0), sizeof(d0));
-                    int d1;
-                    ifs.read(reinterpret_cast<char*>(&d1), sizeof(d1));
-                    int d2;
-                    ifs.read(reinterpret_cast<char*>(&d2), sizeof(d2));
-                    NDArray<float> param({d0, d1, d2});
-                    for (int i = 0; i < d0; i++) {
-                        for (int j = 0; j < d1; j++) {
-                            for (int k = 0; k < d2; k++) {
-                                ifs.read(reinterpret_cast<char*>(&param(i, j, k)), sizeof(float));
-                            }
-                        }
-                    }
-                    params[layer_name].push_back(param);
-                    break;
-                }
-                case 4: {
-                    int d0;
-                    ifs.read(reinterpret_cast<char*>(&d0), sizeof(d0));
-                    int d1;
-                    ifs.read(reinterpret_cast<char*>(&d1), sizeof(d1));
-                    int d2;
-                    ifs.read(reinterpret_cast<char*>(&d2), sizeof(d2));
-                    int d3;
-                    ifs.read(reinterpret_cast<char*>(&d3), sizeof(d3));
-                    NDArray<float> param({d0, d1, d2, d3});
-                    for (int i = 0; i < d0; i++) {
-                        for (int j = 0; j < d1; j++) {
-                            for (int k = 0; k < d2; k++) {
-                                for (int l = 0; l < d3; l++) {
-                                    ifs.read(reinterpret_cast<char*>(&param(i, j, k, l)), sizeof(float));
-                                }
-                            }
-                        }
-                    }
-                    params[layer_name].push_back(param);
-                    break;
-                }
+            std::vector<int> sizes(dims);
+            ifs.read(reinterpret_cast<char*>(sizes.data()),
+                     dims * sizeof(int));
+
+            NDArray<float> param(sizes);
+            params[layer_name].push_back(param);
+            arrays.push_back(param);
+            offsets.push_back(ifs.tellg());
+            ifs.seekg(param.buf_size * sizeof(float), std::ios_base::cur);
+        }
+    }
+    if (!ifs.good()) {
+        std::cerr << "Truncated params in " << weight_file_name << std::endl;
+        assert(0);
+    }
+    ifs.close();
+
+    int fd = open(weight_file_name.c_str(), O_RDONLY);
+    std::vector<char> complete(arrays.size(), 0);
+    parallel_for_each(arrays.size(), [&](size_t a) {
+        char* dst = reinterpret_cast<char*>(arrays[a].host_alloc.get());
+        size_t bytes = arrays[a].buf_size * sizeof(float);
+        size_t done = 0;
+        while (done < bytes) {
+            ssize_t r = pread(fd, dst + done, bytes - done,
+                              offsets[a] + done);
+            if (r <= 0) {
+                return;
             }
+            done += r;
+        }
+        complete[a] = 1;
+    });
+    close(fd);
+
+    if (std::find(complete.begin(), complete.end(), 0) != complete.end()) {
+        std::cerr << "Could not read " << weight_file_name << std::endl;
+        assert(0);
+    }
+}
+
+void narrow_params(Params& params, DataType type) {
+    assert(type == DataType::Float16 || type == DataType::BFloat16);
+    for (auto &layer: params) {
+        for (auto &p: layer.second) {
+            if (p.which() == DataType::Float32 &&
+                get_ndarray<float>(p).dimensions() >= 2) {
+                p = cast_ndarray(p, type);
+            }
+        }
+    }
+}
+
+bool is_params_container(std::string weight_file_name) {
+    std::ifstream ifs(weight_file_name, std::ifstream::in |
+                                        std::ifstream::binary);
+    char magic[sizeof(container_magic)] = {};
+    ifs.read(magic, sizeof(magic));
+    return ifs.good() && std::equal(magic, magic + sizeof(magic),
+                                    container_magic);
+}
+
+void load_model_from_disk(std::string weight_file_name, Params &params,
+                          bool verify) {
+    if (is_params_container(weight_file_name)) {
+        if (!load_mapped_model(weight_file_name, params, verify)) {
+            assert(0);
         }
+    } else {
+        load_legacy_model(weight_file_name, params);
     }
 }
@@ -1,9 +1,45 @@
 #include <string>
+#include <cstdint>
 #include <map>
 #include <boost/filesystem.hpp>
 #include "NDArray.h"
 
 typedef std::map<std::string, std::vector<NDArray_t>> Params;
 
-void save_model_to_disk(std::string model_path, Params &params);
-void load_model_from_disk(std::string model_path, Params &params);
+// Params are saved in a versioned container: a header, an index with the
+// name, type and shape of each array and the offset of its payload, and
+// the payloads aligned to ALLOC_ALIGNMENT. Each payload is written in one
+// piece. With checksums the index records a checksum of every payload.
+void save_model_to_disk(std::string model_path, Params &params,
+                        bool checksums = false);
+
+// Loads containers with load_mapped_model and files in the earlier format
+// by reading the arrays in parallel.
+void load_model_from_disk(std::string model_path, Params &params,
+                          bool verify = false);
+
+// Maps the container into memory and wraps the payloads as arrays without
+// copying them. The mapping is private, so processes loading the same file
+// share its pages in the page cache until they write to a param. It is
+// unmapped when the last array is released. With verify the payloads
+// saved with a checksum are checked in parallel, and if one does not match
+// none of the arrays are added and false is returned.
+bool load_mapped_model(std::string model_path, Params &params,
+                       bool verify = false);
+
+// Whether the storage is part of a container mapped by load_mapped_model.
+// Such storage can be dropped from memory and is read back from the file
+// when it is touched again.
+bool is_mapped_param(const void* ptr);
+
+// Store the weights, the float params with two or more dimensions, as
+// Float16 or BFloat16. Biases and other vectors are left in float. Native
+// convs and affine ops compute from the 16-bit weights, other kernels
+// are given widened copies.
+void narrow_params(Params& params, DataType type);
+
+// Whether the file starts like a container.
+bool is_params_container(std::string model_path);
+
+// Checksum of a payload as recorded in the index of a container.
+uint64_t payload_checksum(const char* data, size_t bytes);
@@ -2,35 +2,135 @@
 
 #include <memory>
 #include <vector>
+#include <algorithm>
 #include <cassert>
 #include "boost/variant.hpp"
+#include "Allocator.h"
+#include "Layout.h"
+#include "Half.h"
+#include "Elementwise.h"
 
 // TODO
 // 1) Handle multiple devices
 // 2) Write more tests
 
+template <class T>
+class NDArray;
+
+// Elementwise expressions, see NDArrayExpr.h.
+template <class E>
+class NDExpr;
+
+template <class T, class E>
+void assign_expr(NDArray<T>& out, const NDExpr<E>& e);
+
 template <class T>
 class NDArray {
     public:
+    // First element of the array, which is offset into the storage for
+    // views created by slice.
     std::shared_ptr<T> host_alloc;
     std::vector<int> dim_sizes;
+    // Number of elements in the array.
     size_t buf_size;
+    // Elements between consecutive indices along each dimension. Arrays
+    // own row-major storage with dense strides, views may have gaps.
+    std::vector<size_t> strides;
+    // Order of the elements of an activation, dim_sizes and strides are
+    // those of the storage, see get_layout_dims.
+    Layout layout;
 
-    NDArray() {
+    NDArray() : layout(LAYOUT_NCHW) {
         buf_size = 0;
     }
 
-    NDArray(std::vector<int> _dim_sizes) : dim_sizes(_dim_sizes) {
+    NDArray(std::vector<int> _dim_sizes,
+            std::shared_ptr<Allocator> allocator = get_default_allocator()) :
+        dim_sizes(_dim_sizes), layout(LAYOUT_NCHW) {
         if (dim_sizes.size() >= 1) {
             buf_size = 1;
             for (auto& s: dim_sizes) {
                 buf_size *= s;
             }
-            T* host_ptr = new T[buf_size];
-            host_alloc.reset(host_ptr);
+            host_alloc = allocate_storage<T>(buf_size, allocator);
         } else {
             buf_size = 0;
         }
+        set_dense_strides();
+    }
+
+    // Wraps existing storage instead of allocating. The array shares
+    // ownership of the storage but the contents are not initialized.
+    NDArray(std::vector<int> _dim_sizes, std::shared_ptr<T> _host_alloc) :
+        host_alloc(_host_alloc), dim_sizes(_dim_sizes), layout(LAYOUT_NCHW) {
+        buf_size = 1;
+        for (auto& s: dim_sizes) {
+            buf_size *= s;
+        }
+        set_dense_strides();
+    }
+
+    void set_dense_strides() {
+        strides.assign(dim_sizes.size(), 1);
+        for (int d = (int)dim_sizes.size() - 2; d >= 0; d--) {
+            strides[d] = strides[d + 1] * dim_sizes[d + 1];
+        }
+    }
+
+    // Whether the elements are laid out without gaps in row-major order.
+    bool is_contiguous() const {
+        size_t stride = 1;
+        for (int d = (int)dim_sizes.size() - 1; d >= 0; d--) {
+            if (dim_sizes[d] > 1 && strides[d] != stride) {
+                return false;
+            }
+            stride *= dim_sizes[d];
+        }
+        return true;
+    }
+
+    // Elements in the innermost dimensions stored without gaps, which
+    // elementwise operations process in one piece.
+    size_t dense_run() const {
+        size_t run = 1;
+        for (int d = (int)dim_sizes.size() - 1; d >= 0; d--) {
+            if (dim_sizes[d] > 1 && strides[d] != run) {
+                break;
+            }
+            run *= dim_sizes[d];
+        }
+        return run;
+    }
+
+    // View of the indices [begin, end) along a dimension. The view shares
+    // the storage of the array and keeps its strides, so slicing any but
+    // the outermost dimension leaves gaps between the rows of the view.
+    NDArray<T> slice(int dim, int begin, int end) const {
+        assert(dim < (int)dim_sizes.size());
+        assert(0 <= begin && begin <= end && end <= dim_sizes[dim]);
+        NDArray<T> view;
+        view.dim_sizes = dim_sizes;
+        view.dim_sizes[dim] = end - begin;
+        view.strides = strides;
+        view.layout = layout;
+        view.buf_size = 1;
+        for (auto& s: view.dim_sizes) {
+            view.buf_size *= s;
+        }
+        // Aliasing constructor keeps the storage alive as long as the view.
+        view.host_alloc = std::shared_ptr<T>(host_alloc, host_alloc.get() +
+                                                         begin * strides[dim]);
+        return view;
+    }
+
+    // Offset from host_alloc of the i-th element in row-major order.
+    size_t offset(size_t i) const {
+        size_t off = 0;
+        for (int d = (int)dim_sizes.size() - 1; d >= 0; d--) {
+            off += (i % dim_sizes[d]) * strides[d];
+            i /= dim_sizes[d];
+        }
+        return off;
     }
 
     int dimensions() { return dim_sizes.size(); }
@@ -41,87 +141,134 @@ class NDArray {
     }
 
     void initialize(T val) {
+        if (buf_size == 0) {
+            return;
+        }
         T* host_ptr = host_alloc.get();
-        for (size_t i = 0; i < buf_size; i++) {
-            host_ptr[i] = val;
+        size_t run = dense_run();
+        for (size_t i = 0; i < buf_size; i += run) {
+            elementwise_fill(host_ptr + offset(i), val, run);
         }
     }
 
+    // Generators are called in order, so the values do not depend on the
+    // threads.
     template <typename F>
     void initialize(F& op) {
         T* host_ptr = host_alloc.get();
+        bool dense = is_contiguous();
         for (size_t i = 0; i < buf_size; i++) {
-            host_ptr[i] = op();
+            host_ptr[dense ? i : offset(i)] = op();
         }
     }
 
     inline T& operator()(int d1) {
         assert(dim_sizes.size() == 1);
-        return host_alloc.get()[d1];
+        return host_alloc.get()[d1 * strides[0]];
     }
 
     inline T& operator()(int d1, int d2) {
         assert(dim_sizes.size() == 2);
-        int offset = d1 * dim_sizes[1] + d2;
-        return host_alloc.get()[offset];
+        return host_alloc.get()[d1 * strides[0] + d2 * strides[1]];
     }
 
     inline T& operator()(int d1, int d2, int d3) {
         assert(dim_sizes.size() == 3);
-        int offset = d1 * dim_sizes[1] * dim_sizes[2] + d2 * dim_sizes[2] + d3;
-        return host_alloc.get()[offset];
+        return host_alloc.get()[d1 * strides[0] + d2 * strides[1] +
+                                d3 * strides[2]];
     }
 
     inline T& operator()(int d1, int d2, int d3, int d4) {
         assert(dim_sizes.size() == 4);
-        int offset = d1 * dim_sizes[1] * dim_sizes[2] * dim_sizes[3] +
-                     d2 * dim_sizes[2] * dim_sizes[3] + d3 * dim_sizes[3] + d4;
-        return host_alloc.get()[offset];
+        return host_alloc.get()[d1 * strides[0] + d2 * strides[1] +
+                                d3 * strides[2] + d4 * strides[3]];
     }
 
     inline const T& operator()(int d1) const {
         assert(dim_sizes.size() == 1);
-        return host_alloc.get()[d1];
+        return host_alloc.get()[d1 * strides[0]];
     }
 
     inline const T& operator()(int d1, int d2) const {
         assert(dim_sizes.size() == 2);
-        int offset = d1 * dim_sizes[1] + d2;
-        return host_alloc.get()[offset];
+        return host_alloc.get()[d1 * strides[0] + d2 * strides[1]];
     }
 
     inline const T& operator()(int d1, int d2, int d3) const {
         assert(dim_sizes.size() == 3);
-        int offset = d1 * dim_sizes[1] * dim_sizes[2] + d2 * dim_sizes[2] + d3;
-        return host_alloc.get()[offset];
+        return host_alloc.get()[d1 * strides[0] + d2 * strides[1] +
+                                d3 * strides[2]];
     }
 
     inline const T& operator()(int d1, int d2, int d3, int d4) const {
         assert(dim_sizes.size() == 4);
-        int offset = d1 * dim_sizes[1] * dim_sizes[2] * dim_sizes[3] +
-                     d2 * dim_sizes[2] * dim_sizes[3] + d3 * dim_sizes[3] + d4;
-        return host_alloc.get()[offset];
+        return host_alloc.get()[d1 * strides[0] + d2 * strides[1] +
+                                d3 * strides[2] + d4 * strides[3]];
     }
 
-    void copy(const NDArray<T>& other) {
+    // Element at an NCHW index of an activation in any layout.
+    inline T& at_nchw(int n, int c, int h, int w) {
+        T* ptr = host_alloc.get() + n * strides[0];
+        if (layout == LAYOUT_NCHW) {
+            return ptr[c * strides[1] + h * strides[2] + w * strides[3]];
+        } else if (layout == LAYOUT_NHWC) {
+            return ptr[h * strides[1] + w * strides[2] + c * strides[3]];
+        }
+        int block = dim_sizes[4];
+        return ptr[(c / block) * strides[1] + h * strides[2] +
+                   w * strides[3] + (c % block) * strides[4]];
+    }
+
+    // Apply fn(other_run, run, n) to the runs of elements stored without
+    // gaps in both arrays.
+    template <typename F>
+    void apply_runs(const NDArray<T>& other, F fn) {
         for (size_t d = 0; d < dim_sizes.size(); d++) {
             assert(dim_sizes[d] == other.dim_sizes[d]);
         }
+        if (buf_size == 0) {
+            return;
+        }
         T* host_ptr = host_alloc.get();
-        for (size_t i = 0; i < buf_size; i++) {
-            host_ptr[i] = other.host_alloc.get()[i];
+        const T* other_ptr = other.host_alloc.get();
+        size_t run = std::min(dense_run(), other.dense_run());
+        for (size_t i = 0; i < buf_size; i += run) {
+            fn(other_ptr + other.offset(i), host_ptr + offset(i), run);
         }
     }
 
+    void copy(const NDArray<T>& other) {
+        apply_runs(other, [](const T* x, T* y, size_t n) {
+                              elementwise_copy(x, y, n);
+                          });
+    }
+
+    // Evaluate an expression into the storage of the array, whereas
+    // assigning an array shares its storage.
+    template <class E>
+    NDArray<T>& operator=(const NDExpr<E>& e) {
+        assign_expr(*this, e);
+        return *this;
+    }
+
     /* Simple inplace arithmetic operations. */
     void add(const NDArray<T>& other) {
-        for (size_t d = 0; d < dim_sizes.size(); d++) {
-            assert(dim_sizes[d] == other.dim_sizes[d]);
-        }
-        T* host_ptr = host_alloc.get();
-        for (size_t i = 0; i < buf_size; i++) {
-            host_ptr[i] += other.host_alloc.get()[i];
-        }
+        apply_runs(other, [](const T* x, T* y, size_t n) {
+                              elementwise_add(x, y, n);
+                          });
+    }
+
+    // this += a * other
+    void axpy(T a, const NDArray<T>& other) {
+        apply_runs(other, [a](const T* x, T* y, size_t n) {
+                              elementwise_axpy(a, x, y, n);
+                          });
+    }
+
+    void scale(T a) {
+        apply_runs(*this, [a](const T*, T* y, size_t n) {
+                              elementwise_scale(a, y, n);
+                          });
     }
 };
 
@@ -134,13 +281,87 @@ using NDArray_t = boost::variant<NDArray<double>,
                                  NDArray<uint64_t>,
                                  NDArray<uint32_t>,
                                  NDArray<uint16_t>,
-                                 NDArray<uint8_t>>;
+                                 NDArray<uint8_t>,
+                                 NDArray<float16>,
+                                 NDArray<bfloat16>>;
 
 template <class T>
 NDArray<T>& get_ndarray(NDArray_t& arr) {
     return boost::get<NDArray<T>>(arr);
 }
 
+struct SliceVisitor : public boost::static_visitor<NDArray_t> {
+    int dim;
+    int begin;
+    int end;
+
+    SliceVisitor(int _dim, int _begin, int _end) :
+        dim(_dim), begin(_begin), end(_end) {}
+
+    template <class T>
+    NDArray_t operator()(NDArray<T>& arr) const {
+        return arr.slice(dim, begin, end);
+    }
+};
+
+// View of the indices [begin, end) along a dimension of the array.
+inline NDArray_t get_slice_view(NDArray_t& arr, int dim, int begin, int end) {
+    return boost::apply_visitor(SliceVisitor(dim, begin, end), arr);
+}
+
+// View of the first batch_size entries along the outermost dimension of
+// the array. The view shares the storage of the array.
+inline NDArray_t get_batch_view(NDArray_t& arr, int batch_size) {
+    return get_slice_view(arr, 0, 0, batch_size);
+}
+
+// Copy an activation into an array holding it in another layout.
+template <class T>
+void reorder_layout(NDArray<T>& in, NDArray<T>& out) {
+    if (in.layout == out.layout) {
+        out.copy(in);
+        return;
+    }
+    std::vector<int> dims = get_nchw_dims(in.dim_sizes, in.layout);
+    assert(dims == get_nchw_dims(out.dim_sizes, out.layout));
+    for (int n = 0; n < dims[0]; n++) {
+        for (int c = 0; c < dims[1]; c++) {
+            for (int h = 0; h < dims[2]; h++) {
+                for (int w = 0; w < dims[3]; w++) {
+                    out.at_nchw(n, c, h, w) = in.at_nchw(n, c, h, w);
+                }
+            }
+        }
+    }
+}
+
+struct GetLayoutVisitor : public boost::static_visitor<Layout> {
+    template <class T>
+    Layout operator()(NDArray<T>& arr) const {
+        return arr.layout;
+    }
+};
+
+struct SetLayoutVisitor : public boost::static_visitor<> {
+    Layout layout;
+
+    SetLayoutVisitor(Layout _layout) : layout(_layout) {}
+
+    template <class T>
+    void operator()(NDArray<T>& arr) const {
+        arr.layout = layout;
+    }
+};
+
+inline Layout get_layout(NDArray_t& arr) {
+    return boost::apply_visitor(GetLayoutVisitor(), arr);
+}
+
+// Tag the array with a layout matching its dimensions.
+inline void set_layout(NDArray_t& arr, Layout layout) {
+    boost::apply_visitor(SetLayoutVisitor(layout), arr);
+}
+
 enum DataType {
     Float64,
     Float32,
@@ -151,5 +372,53 @@ enum DataType {
     UInt64,
     UInt32,
     UInt16,
-    UInt8
+    UInt8,
+    Float16,
+    BFloat16
+};
+
+struct CastVisitor : public boost::static_visitor<NDArray_t> {
+    DataType type;
+
+    CastVisitor(DataType _type) : type(_type) {}
+
+    template <class U, class T>
+    static NDArray<U> cast(NDArray<T>& arr) {
+        NDArray<U> out(arr.dim_sizes);
+        out.layout = arr.layout;
+        const T* in_ptr = arr.host_alloc.get();
+        U* out_ptr = out.host_alloc.get();
+        bool dense = arr.is_contiguous();
+        for (size_t i = 0; i < arr.buf_size; i++) {
+            out_ptr[i] = U((float)in_ptr[dense ? i : arr.offset(i)]);
+        }
+        return out;
+    }
+
+    template <class T>
+    NDArray_t operator()(NDArray<T>& arr) const {
+        switch (type) {
+            case DataType::Float32:
+                return cast<float>(arr);
+            case DataType::Float16:
+                return cast<float16>(arr);
+            case DataType::BFloat16:
+                return cast<bfloat16>(arr);
+            default:
+                assert(0);
+                return NDArray_t();
+        }
+    }
 };
+
+// Copy of the array with the elements converted through float to one of
+// the floating point types. Used to store params in 16 bits and to widen
+// them for kernels which compute on float params.
+inline NDArray_t cast_ndarray(NDArray_t& arr, DataType type) {
+    return boost::apply_visitor(CastVisitor(type), arr);
+}
+
+inline bool is_narrow_float(NDArray_t& arr) {
+    return arr.which() == DataType::Float16 ||
+           arr.which() == DataType::BFloat16;
+}
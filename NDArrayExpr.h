@@ -0,0 +1,297 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+#include "NDArray.h"
+#include "ThreadPool.h"
+
+// Lazy elementwise arithmetic on arrays. Operators on arrays, scalars and
+// expressions build a tree of nodes instead of computing, and assigning
+// an expression to an array evaluates it in a single loop without
+// temporaries:
+//
+//     NDArray<float> out(a.dim_sizes);
+//     out = relu(a + b * 0.5f);
+//
+// Operands have the dimensions of the array assigned to and may be views,
+// or the array itself. They are referenced, not copied, so they have to
+// outlive the expression. Evaluation walks the runs of elements dense in
+// the output and every operand, in which the operands are read at
+// consecutive indices and the compiler vectorizes the loop. Large arrays
+// are split over the native pool.
+
+template <class E>
+class NDExpr {
+    public:
+    const E& self() const { return static_cast<const E&>(*this); }
+};
+
+// Nodes implement:
+//   value_type
+//   seek(i)        position at the i-th element in row-major order
+//   operator[](j)  element j after the position
+//   dense_run()    elements in the innermost dimensions without gaps
+//   check_dims(d)  assert the operands have dimensions d
+
+template <class T>
+class ArrayExpr : public NDExpr<ArrayExpr<T>> {
+    public:
+    typedef T value_type;
+
+    ArrayExpr(const NDArray<T>& _arr) : arr(&_arr),
+                                        ptr(_arr.host_alloc.get()) {}
+
+    void seek(size_t i) { ptr = arr->host_alloc.get() + arr->offset(i); }
+    T operator[](size_t j) const { return ptr[j]; }
+    size_t dense_run() const { return arr->dense_run(); }
+    void check_dims(const std::vector<int>& dims) const {
+        assert(arr->dim_sizes == dims);
+    }
+
+    private:
+    const NDArray<T>* arr;
+    const T* ptr;
+};
+
+template <class T>
+class ScalarExpr : public NDExpr<ScalarExpr<T>> {
+    public:
+    typedef T value_type;
+
+    ScalarExpr(T _val) : val(_val) {}
+
+    void seek(size_t) {}
+    T operator[](size_t) const { return val; }
+    size_t dense_run() const { return SIZE_MAX; }
+    void check_dims(const std::vector<int>&) const {}
+
+    private:
+    T val;
+};
+
+template <class F, class E>
+class UnaryExpr : public NDExpr<UnaryExpr<F, E>> {
+    public:
+    typedef typename E::value_type value_type;
+
+    UnaryExpr(F _f, const E& _e) : f(_f), e(_e) {}
+
+    void seek(size_t i) { e.seek(i); }
+    value_type operator[](size_t j) const { return f(e[j]); }
+    size_t dense_run() const { return e.dense_run(); }
+    void check_dims(const std::vector<int>& dims) const {
+        e.check_dims(dims);
+    }
+
+    private:
+    F f;
+    E e;
+};
+
+template <class F, class L, class R>
+class BinaryExpr : public NDExpr<BinaryExpr<F, L, R>> {
+    public:
+    typedef typename L::value_type value_type;
+
+    BinaryExpr(const L& _l, const R& _r) : l(_l), r(_r) {}
+
+    void seek(size_t i) {
+        l.seek(i);
+        r.seek(i);
+    }
+    value_type operator[](size_t j) const { return F::apply(l[j], r[j]); }
+    size_t dense_run() const {
+        return std::min(l.dense_run(), r.dense_run());
+    }
+    void check_dims(const std::vector<int>& dims) const {
+        l.check_dims(dims);
+        r.check_dims(dims);
+    }
+
+    private:
+    L l;
+    R r;
+};
+
+struct AddFn {
+    template <class T> static T apply(T a, T b) { return a + b; }
+};
+
+struct SubFn {
+    template <class T> static T apply(T a, T b) { return a - b; }
+};
+
+struct MulFn {
+    template <class T> static T apply(T a, T b) { return a * b; }
+};
+
+struct DivFn {
+    template <class T> static T apply(T a, T b) { return a / b; }
+};
+
+struct MinFn {
+    template <class T> static T apply(T a, T b) { return std::min(a, b); }
+};
+
+struct MaxFn {
+    template <class T> static T apply(T a, T b) { return std::max(a, b); }
+};
+
+template <class T>
+struct NegFn {
+    T operator()(T x) const { return -x; }
+};
+
+// Without branches, which keeps the loops vectorizable without
+// instructions for blending vectors.
+template <class T>
+struct ReLUFn {
+    T slope;
+    T operator()(T x) const {
+        return std::max(x, T(0)) + slope * std::min(x, T(0));
+    }
+};
+
+template <class T>
+struct ClampFn {
+    T lo;
+    T hi;
+    T operator()(T x) const { return std::min(std::max(x, lo), hi); }
+};
+
+// Arrays and expressions are operands, arrays are read through an
+// ArrayExpr.
+template <class X>
+struct IsExprOperand : std::is_base_of<NDExpr<X>, X> {};
+
+template <class T>
+struct IsExprOperand<NDArray<T>> : std::true_type {};
+
+template <class X>
+struct ExprOf {
+    typedef X type;
+    static const X& make(const X& x) { return x; }
+};
+
+template <class T>
+struct ExprOf<NDArray<T>> {
+    typedef ArrayExpr<T> type;
+    static type make(const NDArray<T>& arr) { return type(arr); }
+};
+
+// Binary operators of two operands, or of an operand and a scalar of its
+// element type.
+#define DNNCC_EXPR_BINARY_OP(name, fn)                                       \
+template <class L, class R>                                                  \
+typename std::enable_if<IsExprOperand<L>::value && IsExprOperand<R>::value,  \
+                        BinaryExpr<fn, typename ExprOf<L>::type,             \
+                                   typename ExprOf<R>::type>>::type          \
+name(const L& l, const R& r) {                                               \
+    return BinaryExpr<fn, typename ExprOf<L>::type,                          \
+                      typename ExprOf<R>::type>(ExprOf<L>::make(l),          \
+                                                ExprOf<R>::make(r));         \
+}                                                                            \
+                                                                             \
+template <class L>                                                           \
+typename std::enable_if<IsExprOperand<L>::value,                             \
+    BinaryExpr<fn, typename ExprOf<L>::type,                                 \
+               ScalarExpr<typename ExprOf<L>::type::value_type>>>::type      \
+name(const L& l, typename ExprOf<L>::type::value_type r) {                   \
+    typedef typename ExprOf<L>::type::value_type T;                          \
+    return BinaryExpr<fn, typename ExprOf<L>::type,                          \
+                      ScalarExpr<T>>(ExprOf<L>::make(l), ScalarExpr<T>(r));  \
+}                                                                            \
+                                                                             \
+template <class R>                                                           \
+typename std::enable_if<IsExprOperand<R>::value,                             \
+    BinaryExpr<fn, ScalarExpr<typename ExprOf<R>::type::value_type>,         \
+               typename ExprOf<R>::type>>::type                              \
+name(typename ExprOf<R>::type::value_type l, const R& r) {                   \
+    typedef typename ExprOf<R>::type::value_type T;                          \
+    return BinaryExpr<fn, ScalarExpr<T>,                                     \
+                      typename ExprOf<R>::type>(ScalarExpr<T>(l),            \
+                                                ExprOf<R>::make(r));         \
+}
+
+DNNCC_EXPR_BINARY_OP(operator+, AddFn)
+DNNCC_EXPR_BINARY_OP(operator-, SubFn)
+DNNCC_EXPR_BINARY_OP(operator*, MulFn)
+DNNCC_EXPR_BINARY_OP(operator/, DivFn)
+DNNCC_EXPR_BINARY_OP(min, MinFn)
+DNNCC_EXPR_BINARY_OP(max, MaxFn)
+
+#undef DNNCC_EXPR_BINARY_OP
+
+template <class X>
+typename std::enable_if<IsExprOperand<X>::value,
+    UnaryExpr<NegFn<typename ExprOf<X>::type::value_type>,
+              typename ExprOf<X>::type>>::type
+operator-(const X& x) {
+    typedef typename ExprOf<X>::type::value_type T;
+    return UnaryExpr<NegFn<T>, typename ExprOf<X>::type>(NegFn<T>(),
+                                                         ExprOf<X>::make(x));
+}
+
+// x > 0 ? x : slope * x
+template <class X>
+typename std::enable_if<IsExprOperand<X>::value,
+    UnaryExpr<ReLUFn<typename ExprOf<X>::type::value_type>,
+              typename ExprOf<X>::type>>::type
+relu(const X& x, typename ExprOf<X>::type::value_type slope = 0) {
+    typedef typename ExprOf<X>::type::value_type T;
+    ReLUFn<T> f = {slope};
+    return UnaryExpr<ReLUFn<T>, typename ExprOf<X>::type>(f,
+                                                          ExprOf<X>::make(x));
+}
+
+// min(max(x, lo), hi)
+template <class X>
+typename std::enable_if<IsExprOperand<X>::value,
+    UnaryExpr<ClampFn<typename ExprOf<X>::type::value_type>,
+              typename ExprOf<X>::type>>::type
+clamp(const X& x, typename ExprOf<X>::type::value_type lo,
+      typename ExprOf<X>::type::value_type hi) {
+    typedef typename ExprOf<X>::type::value_type T;
+    ClampFn<T> f = {lo, hi};
+    return UnaryExpr<ClampFn<T>, typename ExprOf<X>::type>(f,
+                                                           ExprOf<X>::make(x));
+}
+
+template <class T, class E>
+void assign_expr(NDArray<T>& out, const NDExpr<E>& e) {
+    const E& expr = e.self();
+    expr.check_dims(out.dim_sizes);
+    if (out.buf_size == 0) {
+        return;
+    }
+
+    size_t run = std::min(out.dense_run(), expr.dense_run());
+    // Each range takes a copy of the expression to seek in.
+    auto eval_range = [&](size_t begin, size_t end) {
+        E local = expr;
+        while (begin < end) {
+            size_t n = std::min(end, (begin / run + 1) * run) - begin;
+            local.seek(begin);
+            T* y = out.host_alloc.get() + out.offset(begin);
+            for (size_t j = 0; j < n; j++) {
+                y[j] = local[j];
+            }
+            begin += n;
+        }
+    };
+
+    ThreadPool* pool = out.buf_size >= ELEMENTWISE_PARALLEL_SIZE ?
+                       get_native_pool() : nullptr;
+    if (!pool) {
+        eval_range(0, out.buf_size);
+        return;
+    }
+    size_t num_chunks = (size_t)(pool->num_threads() + 1) * 2;
+    size_t chunk = ((out.buf_size + num_chunks - 1)/num_chunks + 15)/16 * 16;
+    pool->parallel_for(0, (out.buf_size + chunk - 1)/chunk, [&](int c) {
+                           size_t begin = c * chunk;
+                           eval_range(begin,
+                                      std::min(out.buf_size, begin + chunk));
+                       });
+}
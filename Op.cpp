@@ -24,11 +24,81 @@ NDArray_t get_ndarray_t(const std::vector<int>& sizes, DataType type) {
             return NDArray<uint16_t>(sizes);
         case DataType::UInt8:
             return NDArray<uint8_t>(sizes);
+        case DataType::Float16:
+            return NDArray<float16>(sizes);
+        case DataType::BFloat16:
+            return NDArray<bfloat16>(sizes);
         default:
             assert(0);
     }
 }
 
+template <class T>
+NDArray<T> wrap_storage(const std::vector<int>& sizes,
+                        std::shared_ptr<void> storage) {
+    // Aliasing constructor keeps the storage alive as long as the array.
+    return NDArray<T>(sizes, std::shared_ptr<T>(storage,
+                                static_cast<T*>(storage.get())));
+}
+
+NDArray_t get_ndarray_t(const std::vector<int>& sizes, DataType type,
+                        std::shared_ptr<void> storage) {
+
+    switch(type) {
+        case DataType::Float64:
+            return wrap_storage<double>(sizes, storage);
+        case DataType::Float32:
+            return wrap_storage<float>(sizes, storage);
+        case DataType::Int64:
+            return wrap_storage<int64_t>(sizes, storage);
+        case DataType::Int32:
+            return wrap_storage<int32_t>(sizes, storage);
+        case DataType::Int16:
+            return wrap_storage<int16_t>(sizes, storage);
+        case DataType::Int8:
+            return wrap_storage<int8_t>(sizes, storage);
+        case DataType::UInt64:
+            return wrap_storage<uint64_t>(sizes, storage);
+        case DataType::UInt32:
+            return wrap_storage<uint32_t>(sizes, storage);
+        case DataType::UInt16:
+            return wrap_storage<uint16_t>(sizes, storage);
+        case DataType::UInt8:
+            return wrap_storage<uint8_t>(sizes, storage);
+        case DataType::Float16:
+            return wrap_storage<float16>(sizes, storage);
+        case DataType::BFloat16:
+            return wrap_storage<bfloat16>(sizes, storage);
+        default:
+            assert(0);
+    }
+}
+
+size_t get_type_size(DataType type) {
+
+    switch(type) {
+        case DataType::Float64:
+        case DataType::Int64:
+        case DataType::UInt64:
+            return 8;
+        case DataType::Float32:
+        case DataType::Int32:
+        case DataType::UInt32:
+            return 4;
+        case DataType::Int16:
+        case DataType::UInt16:
+        case DataType::Float16:
+        case DataType::BFloat16:
+            return 2;
+        case DataType::Int8:
+        case DataType::UInt8:
+            return 1;
+        default:
+            assert(0);
+    }
+    return 0;
+}
+
 AffineOp::AffineOp(int _num_units, std::shared_ptr<Op> _input_op)
                    : Op({_input_op}), num_units(_num_units)
 {
@@ -55,7 +125,8 @@ Conv2dOp::Conv2dOp(int _output_channels,
                     filter_width(_filter_width),
                     stride_h(_stride_h),
                     stride_w(_stride_w),
-                    bias(_bias)
+                    bias(_bias),
+                    algorithm(CONV_AUTO)
 {
     assert(_input_op->num_dims() == 4);
 
@@ -157,6 +228,12 @@ BNCaffeOp::BNCaffeOp(float _epsilon, std::shared_ptr<Op> _input_op)
     output_height = _input_op->out_size(2);
     output_width = _input_op->out_size(3);
     type = DataType::Float32;
+
+    // Running mean, running variance and the scale factor of both, in
+    // the order Caffe stores them.
+    params.push_back(get_ndarray_t({output_channels}, type));
+    params.push_back(get_ndarray_t({output_channels}, type));
+    params.push_back(get_ndarray_t({1}, type));
 }
 
 ScaleCaffeOp::ScaleCaffeOp(std::shared_ptr<Op> _input_op)
@@ -168,6 +245,10 @@ ScaleCaffeOp::ScaleCaffeOp(std::shared_ptr<Op> _input_op)
     output_height = _input_op->out_size(2);
     output_width = _input_op->out_size(3);
     type = DataType::Float32;
+
+    // Scale and bias per channel.
+    params.push_back(get_ndarray_t({output_channels}, type));
+    params.push_back(get_ndarray_t({output_channels}, type));
 }
 
 ConcatOp::ConcatOp(std::vector<std::shared_ptr<Op>>& _input_ops)
@@ -230,3 +311,11 @@ SumOp::SumOp(std::vector<std::shared_ptr<Op>>& _input_ops)
         }
     }
 }
+
+ReorderOp::ReorderOp(Layout _layout, std::shared_ptr<Op> _input_op)
+                     : Op({_input_op}) {
+
+    assert(_layout == LAYOUT_NCHW || _input_op->num_dims() == 4);
+    layout = _layout;
+    type = _input_op->type;
+}
@@ -14,15 +14,29 @@ class Op {
     // Ordered list of learnable parameters of the op.
     std::vector<NDArray_t> params;
 
+    // Forms of the params prepared for a kernel when the params are set,
+    // such as transformed filters. Empty when the kernel uses params as is.
+    std::vector<NDArray_t> kernel_params;
+
     // Ordered list of parameter gradients of the op.
     std::vector<NDArray_t> param_grads;
 
     // Data type of params, inputs, and output of the op.
     DataType type;
 
-    Op() {}
+    // Layout of the output. Ops compute in NCHW unless Graph::plan_layouts
+    // picks a blocked layout for their group.
+    Layout layout;
+
+    // Value of a step of the output when its type is UInt8, which
+    // Graph::plan_quantization sets. The output stands for
+    // quant_scale * q.
+    float quant_scale;
 
-    Op(const std::vector<std::shared_ptr<Op>>& _input_ops) {
+    Op() : layout(LAYOUT_NCHW), quant_scale(0.0f) {}
+
+    Op(const std::vector<std::shared_ptr<Op>>& _input_ops) :
+        layout(LAYOUT_NCHW), quant_scale(0.0f) {
         for (size_t i = 0; i < _input_ops.size(); i++) {
             input_ops.push_back(_input_ops[i]);
         }
@@ -31,7 +45,20 @@ class Op {
     virtual ~Op() {}
 
     virtual int num_dims() = 0;
+    // Size of the output along a dimension. The outermost dimension is
+    // the batch and its size is the largest batch the op is run with.
     virtual int out_size(int dim_id) = 0;
+
+    // Floating point operations in a forward pass at the largest batch.
+    virtual double flops() { return 0; }
+
+    double num_out_elems() {
+        double elems = 1;
+        for (int d = 0; d < num_dims(); d++) {
+            elems *= out_size(d);
+        }
+        return elems;
+    }
 };
 
 class AffineOp: public Op {
@@ -53,9 +80,16 @@ class AffineOp: public Op {
         return size;
     }
 
+    double flops() { return 2.0 * batch_size * num_units * num_inputs; }
+
     AffineOp(int _num_units, std::shared_ptr<Op> _input_op);
 };
 
+// Algorithms for computing convs with the native kernels.
+// CONV_DIRECT loops over the filter taps without lowering the conv.
+enum ConvAlgorithm { CONV_AUTO, CONV_IM2COL, CONV_WINOGRAD, CONV_FFT,
+                     CONV_DIRECT };
+
 class Conv2dOp: public Op {
     public:
     int batch_size;
@@ -72,6 +106,9 @@ class Conv2dOp: public Op {
     int pad_h;
     int pad_w;
     bool bias;
+    // CONV_AUTO is replaced by the algorithm estimated to be fastest for
+    // the shape when the params are set.
+    ConvAlgorithm algorithm;
 
     int num_dims() { return 4; }
 
@@ -90,6 +127,11 @@ class Conv2dOp: public Op {
         return size;
     }
 
+    double flops() {
+        return 2.0 * num_out_elems() * input_channels *
+               filter_height * filter_width;
+    }
+
     Conv2dOp(int _output_channels,
              int _filter_height,
              int _filter_width,
@@ -134,6 +176,8 @@ class Pool2dOp: public Op {
         return size;
     }
 
+    double flops() { return num_out_elems() * pool_height * pool_width; }
+
     Pool2dOp(int _pool_height,
              int _pool_width,
              int _stride_h,
@@ -155,6 +199,8 @@ class ReLUOp: public Op {
         return input_ops[0]->out_size(dim_id);
     }
 
+    double flops() { return num_out_elems(); }
+
     ReLUOp(float _slope, std::shared_ptr<Op> _input_op);
 };
 
@@ -176,6 +222,9 @@ class SoftMaxOp: public Op {
         return size;
     }
 
+    // Max, exponent, sum and division per element.
+    double flops() { return 4.0 * num_out_elems(); }
+
     SoftMaxOp(std::shared_ptr<Op> _input_op);
 };
 
@@ -204,6 +253,8 @@ class BNCaffeOp: public Op {
         return size;
     }
 
+    double flops() { return 2.0 * num_out_elems(); }
+
     BNCaffeOp(float _epsilon, std::shared_ptr<Op> _input_op);
 };
 
@@ -231,6 +282,8 @@ class ScaleCaffeOp: public Op {
         return size;
     }
 
+    double flops() { return 2.0 * num_out_elems(); }
+
     ScaleCaffeOp(std::shared_ptr<Op> _input_op);
 };
 
@@ -261,6 +314,9 @@ class LRNOp: public Op {
         return size;
     }
 
+    // Sum of squares over the window followed by the normalization.
+    double flops() { return (2.0 * window_size + 3) * num_out_elems(); }
+
     LRNOp(int _window_size, float _alpha, float _beta,
           std::shared_ptr<Op> _input_op);
 };
@@ -338,7 +394,33 @@ class SumOp: public Op {
         return dim_sizes[dim_id];
     }
 
+    double flops() { return (input_ops.size() - 1) * num_out_elems(); }
+
     SumOp(std::vector<std::shared_ptr<Op>>& _input_ops);
 };
 
+// Copies its input into the layout of the op. Inserted by the graph
+// between ops computing in different layouts.
+class ReorderOp: public Op {
+    public:
+    int num_dims() {
+        return input_ops[0]->num_dims();
+    }
+
+    int out_size(int dim_id) {
+        assert(dim_id < input_ops[0]->num_dims());
+        return input_ops[0]->out_size(dim_id);
+    }
+
+    ReorderOp(Layout _layout, std::shared_ptr<Op> _input_op);
+};
+
 NDArray_t get_ndarray_t(const std::vector<int>& sizes, DataType type);
+
+// Creates an array of the given type which uses existing storage. The
+// storage has to hold at least the product of sizes elements.
+NDArray_t get_ndarray_t(const std::vector<int>& sizes, DataType type,
+                        std::shared_ptr<void> storage);
+
+// Size in bytes of a single element of the given type.
+size_t get_type_size(DataType type);
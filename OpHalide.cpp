@@ -1,11 +1,15 @@
+#include <algorithm>
 #include "OpHalide.h"
 
-std::vector<int> get_buf_sizes(std::vector<int>& ndarray_sizes) {
-    std::vector<int> halide_sizes;
-    for (int i = ndarray_sizes.size() - 1; i >= 0; i--) {
-        halide_sizes.push_back(ndarray_sizes[i]);
+// Buffer over the elements of an array, which may be a view with gaps.
+// Halide orders the dimensions from the innermost.
+template <class T>
+static Buffer<T> get_strided_buffer(NDArray<T>& arr) {
+    std::vector<halide_dimension_t> shape;
+    for (int d = arr.dimensions() - 1; d >= 0; d--) {
+        shape.push_back({0, arr.dim_sizes[d], (int32_t)arr.strides[d], 0});
     }
-    return halide_sizes;
+    return Buffer<T>(arr.host_alloc.get(), (int)shape.size(), shape.data());
 }
 
 Buffer<> get_halide_buffer(NDArray_t& arr,
@@ -19,57 +23,50 @@ Buffer<> get_halide_buffer(NDArray_t& arr,
         case DataType::Float32:
             {
                 NDArray<float>& buf = get_ndarray<float>(arr);
-                return Buffer<float>(buf.host_alloc.get(),
-                                     get_buf_sizes(buf.dim_sizes));
+                return get_strided_buffer(buf);
             }
         case DataType::Int64:
             {
                 NDArray<int64_t>& buf = get_ndarray<int64_t>(arr);
-                return Buffer<int64_t>(buf.host_alloc.get(),
-                                       get_buf_sizes(buf.dim_sizes));
+                return get_strided_buffer(buf);
             }
         case DataType::Int32:
             {
                 NDArray<int32_t>& buf = get_ndarray<int32_t>(arr);
-                return Buffer<int32_t>(buf.host_alloc.get(),
-                                       get_buf_sizes(buf.dim_sizes));
+                return get_strided_buffer(buf);
             }
         case DataType::Int16:
             {
                 NDArray<int16_t>& buf = get_ndarray<int16_t>(arr);
-                return Buffer<int16_t>(buf.host_alloc.get(),
-                                       get_buf_sizes(buf.dim_sizes));
+                return get_strided_buffer(buf);
             }
         case DataType::Int8:
             {
                 NDArray<int8_t>& buf = get_ndarray<int8_t>(arr);
-                return Buffer<int8_t>(buf.host_alloc.get(),
-                                      get_buf_sizes(buf.dim_sizes));
+                return get_strided_buffer(buf);
             }
         case DataType::UInt64:
             {
                 NDArray<uint64_t>& buf = get_ndarray<uint64_t>(arr);
-                return Buffer<uint64_t>(buf.host_alloc.get(),
-                                        get_buf_sizes(buf.dim_sizes));
+                return get_strided_buffer(buf);
             }
         case DataType::UInt32:
             {
                 NDArray<uint32_t>& buf = get_ndarray<uint32_t>(arr);
-                return Buffer<uint32_t>(buf.host_alloc.get(),
-                                        get_buf_sizes(buf.dim_sizes));
+                return get_strided_buffer(buf);
             }
         case DataType::UInt16:
             {
                 NDArray<uint16_t>& buf = get_ndarray<uint16_t>(arr);
-                return Buffer<uint16_t>(buf.host_alloc.get(),
-                                        get_buf_sizes(buf.dim_sizes));
+                return get_strided_buffer(buf);
             }
         case DataType::UInt8:
             {
                 NDArray<uint8_t>& buf = get_ndarray<uint8_t>(arr);
-                return Buffer<uint8_t>(buf.host_alloc.get(),
-                                       get_buf_sizes(buf.dim_sizes));
+                return get_strided_buffer(buf);
             }
+        default:
+            // 16-bit float params are widened before they reach Halide.
             assert(0);
     }
     return Buffer<>();
@@ -84,6 +81,16 @@ void check_defined(Func f)
     }
 }
 
+// Common batch sizes get a code path of their own in which the extent
+// of the batch loop is a constant.
+void specialize_batch(Func f, Expr batch_size) {
+    if (batch_size.defined()) {
+        for (int b: {1, 8, 32}) {
+            f.specialize(batch_size == b);
+        }
+    }
+}
+
 void affine_forward_halide(std::string name,
                            std::shared_ptr<AffineOp> op,
                            Func input,
@@ -93,15 +100,15 @@ void affine_forward_halide(std::string name,
     check_defined(input);
     Func forward(name + "_forward");
 
-    ImageParam W(Float(32), 2);
-    ImageParam b(Float(32), 1);
+    ImageParam W(Float(32), 2, name + "_w0");
+    ImageParam b(Float(32), 1, name + "_w1");
 
     op_impl->params.push_back(W);
     op_impl->params.push_back(b);
 
-    RDom r(0, op->num_inputs);
+    RDom r(0, op->num_inputs, "r");
 
-    Var unit_dim, n;
+    Var unit_dim("unit_dim"), n("n");
     forward(unit_dim, n) = b(unit_dim);
     forward(unit_dim, n) = input(r.x, n) * W(r.x, unit_dim);
 
@@ -115,8 +122,8 @@ void affine_forward_halide(std::string name,
         assert(0);
     }
 
-    forward.bound(unit_dim, 0, op->num_units)
-           .bound(n, 0, op->batch_size);
+    forward.bound(unit_dim, 0, op->num_units);
+    specialize_batch(forward, op_impl->batch_size);
 
     op_impl->output = forward;
 }
@@ -133,10 +140,10 @@ void conv2d_forward_halide(std::string name,
                                                      0, op->input_width,
                                                      0, op->input_height);
 
-    ImageParam W(Float(32), 4);
+    ImageParam W(Float(32), 4, name + "_w0");
     op_impl->params.push_back(W);
 
-    ImageParam b(Float(32), 1);
+    ImageParam b(Float(32), 1, name + "_w1");
     if (op->bias) {
         op_impl->params.push_back(b);
     }
@@ -153,9 +160,9 @@ void conv2d_forward_halide(std::string name,
 
     RDom r(0, op->filter_width,
            0, op->filter_height,
-           0, op->input_channels);
+           0, op->input_channels, "r");
 
-    Var x, y, z, n;
+    Var x("x"), y("y"), z("z"), n("n");
     W_f(x, y, z, n) = W(x, y, z, n);
 
     if (op->bias) {
@@ -172,30 +179,96 @@ void conv2d_forward_halide(std::string name,
     forward(x, y, z, n) = stage(x, y, z, n);
 
     if (arch == TargetArch::CPU) {
-        in_bound.compute_root();
-        forward.compute_root();
-        if (op->batch_size > 1) {
-            forward.parallel(n);
-        }
-
-        if (op->output_channels > 1) {
-            forward.parallel(z);
-        }
+        ConvSchedule s = op_impl->conv_schedule ? *op_impl->conv_schedule :
+                                                  default_conv_schedule(*op);
+        // Splits larger than the output would compute past its bounds.
+        int tile_x = std::min(s.tile_x, op->output_width);
+        int tile_y = std::min(s.tile_y, op->output_height);
+        int channel_block = std::min(s.channel_block, op->output_channels);
+        int unroll = std::min(s.unroll, channel_block);
+
+        // The accumulators of a tile stay in the stage buffer, the
+        // unrolled channels of each vector of columns in registers.
+        auto schedule_stage = [=](Func f, Var at) {
+            Var zb("zb"), zu("zu");
+            Func acc = stage;
+            acc.compute_at(f, at).vectorize(x, s.vector_width);
+            Stage update = acc.update();
+            update.split(z, zb, zu, unroll)
+                  .vectorize(x, s.vector_width)
+                  .unroll(zu);
+            if (s.rows_outside_taps) {
+                update.reorder(x, zu, r.x, r.y, r.z, y, zb, n);
+            } else {
+                update.reorder(x, zu, y, r.x, r.y, r.z, zb, n);
+            }
+        };
+
+        // The output is scheduled by the group once it is known whether
+        // an elementwise consumer is inlined into it or whether it is
+        // computed within the tiles of a consumer.
+        int out_w = op->output_width;
+        int out_h = op->output_height;
+        int out_c = op->output_channels;
+        bool batched = op->batch_size > 1;
+        Expr batch_size = op_impl->batch_size;
+        op_impl->schedule_root = [=](Func f) {
+            std::vector<Var> v = f.args();
+            Func pad = in_bound;
+            Var xo("xo"), yo("yo"), zo("zo"), xi("xi"), yi("yi"), zi("zi");
+            f.compute_root();
+            f.tile(v[0], v[1], xo, yo, xi, yi, tile_x, tile_y)
+             .split(v[2], zo, zi, channel_block)
+             .reorder(xi, yi, zi, xo, yo, zo, v[3])
+             .vectorize(xi, s.vector_width);
+            if (batched) {
+                f.parallel(v[3]);
+            }
+            if (out_c > channel_block) {
+                f.parallel(zo);
+            }
+            if (out_h > tile_y) {
+                f.parallel(yo);
+            }
 
-        forward.vectorize(x, 8);
+            if (s.input_at_tile) {
+                pad.compute_at(f, xo);
+            } else {
+                pad.compute_root();
+            }
+            schedule_stage(f, xo);
+
+            f.bound(v[0], 0, out_w)
+             .bound(v[1], 0, out_h)
+             .bound(v[2], 0, out_c);
+            specialize_batch(f, batch_size);
+        };
+
+        // Consumers compute one channel of a tile at a time.
+        op_impl->schedule_at = [=](Func f, Func consumer, Var loop) {
+            std::vector<Var> v = f.args();
+            Func pad = in_bound;
+            f.compute_at(consumer, loop).vectorize(v[0], s.vector_width);
+            if (s.input_at_tile) {
+                pad.compute_at(consumer, loop);
+            } else {
+                pad.compute_root();
+            }
+            schedule_stage(f, v[1]);
+        };
 
     } else if (arch == TargetArch::GPU) {
         assert(0);
     }
 
-    forward.bound(x, 0, op->output_width)
-           .bound(y, 0, op->output_height)
-           .bound(z, 0, op->output_channels)
-           .bound(n, 0, op->batch_size);
-
     op_impl->output = forward;
 }
 
+// Rows of the output of a pool in a strip computed together with its
+// fused producer, small enough for the strip of the producer to stay in
+// the L1 cache for common widths.
+static const int FUSED_POOL_ROWS = 8;
+
 void pool2d_forward_halide(std::string name,
                            std::shared_ptr<Pool2dOp> op,
                            Func input,
@@ -220,9 +293,9 @@ void pool2d_forward_halide(std::string name,
     Func forward(name + "_forward");
     Func stage(name + "_stage");
 
-    Var x, y, z, n;
+    Var x("x"), y("y"), z("z"), n("n");
 
-    RDom r(0, p_w, 0, p_h);
+    RDom r(0, p_w, 0, p_h, "r");
     if (op->pool_type == PoolType::MAX) {
         stage(x, y, z, n) = Float(32).min();
         stage(x, y, z, n) = max(in_bound(x * stride_w + r.x - pad_w,
@@ -247,6 +320,16 @@ void pool2d_forward_halide(std::string name,
             forward.vectorize(x, vec_len);
         }
 
+        // The producer fused into the pool is computed for strips of
+        // rows of each channel.
+        if (op_impl->fuse_producer) {
+            Var yo("yo"), yi("yi");
+            forward.split(y, yo, yi,
+                          std::min(FUSED_POOL_ROWS, op->output_height))
+                   .parallel(z);
+            op_impl->tile_loop = yo;
+        }
+
         forward.compute_root();
     } else if (arch == TargetArch::GPU) {
         assert(0);
@@ -254,8 +337,8 @@ void pool2d_forward_halide(std::string name,
 
     forward.bound(x, 0, op->output_width)
            .bound(y, 0, op->output_height)
-           .bound(z, 0, op->input_channels)
-           .bound(n, 0, op->batch_size);
+           .bound(z, 0, op->input_channels);
+    specialize_batch(forward, op_impl->batch_size);
 
     op_impl->output = forward;
 }
@@ -267,7 +350,7 @@ void relu_forward_halide(std::string name,
                          TargetArch arch) {
 
     check_defined(input);
-    Var x, y, z, w;
+    Var x("x"), y("y"), z("z"), w("w");
     Func forward(name + "_forward");
     float slope = op->slope;
     switch(op->input_ops[0]->num_dims()) {
@@ -324,9 +407,9 @@ void softmax_forward_halide(std::string name,
     Func expo(name + "_expo");
     Func normalizer(name + "_normalizer");
 
-    Var in_dim, n;
+    Var in_dim("in_dim"), n("n");
 
-    RDom r(0, op->num_classes);
+    RDom r(0, op->num_classes, "r");
 
     exp_max(n) = maximum(input(r.x, n));
     expo(in_dim, n) = exp(input(in_dim, n) - exp_max(n));
@@ -363,11 +446,11 @@ void lrn_forward_halide(std::string name,
     float alpha = op->alpha;
     float beta = op->beta;
 
-    RDom r(0, w_size);
+    RDom r(0, w_size, "r");
     Func square_sum(name + "_square_sum");
     Func forward(name + "_forward");
 
-    Var x, y, z, n;
+    Var x("x"), y("y"), z("z"), n("n");
     square_sum(x, y, z, n) = 0.0f;
     Expr val = in_bound(x, y, z + r.x - w_size/2, n);
     square_sum(x, y, z, n) += val * val;
@@ -387,8 +470,10 @@ void lrn_forward_halide(std::string name,
 
     forward.bound(x, 0, op->input_width)
            .bound(y, 0, op->input_height)
-           .bound(z, 0, op->input_channels)
-           .bound(n, 0, op->batch_size);
+           .bound(z, 0, op->input_channels);
+    if (op->batch_size > 1) {
+        specialize_batch(forward, op_impl->batch_size);
+    }
 
     op_impl->output = forward;
 }
@@ -403,7 +488,7 @@ void concat_forward_halide(std::string name,
         check_defined(in);
     }
 
-    Var x, y, z, n;
+    Var x("x"), y("y"), z("z"), n("n");
     Func forward(name + "_forward");
 
     forward(x, y, z, n) = 0.0f;
@@ -412,7 +497,7 @@ void concat_forward_halide(std::string name,
     std::vector<RDom> rdoms;
     for (size_t l = 0; l < inputs.size(); l++) {
         int in_size = op->input_ops[l]->out_size(1);
-        rdoms.push_back(RDom(0, in_size));
+        rdoms.push_back(RDom(0, in_size, "r" + std::to_string(l)));
         forward(x, y, curr_size + rdoms[l].x, n) = inputs[l](x, y, rdoms[l].x, n);
         curr_size += in_size;
     }
@@ -428,8 +513,8 @@ void concat_forward_halide(std::string name,
 
         forward.bound(x, 0, op->input_width)
                .bound(y, 0, op->input_height)
-               .bound(z, 0, op->output_channels)
-               .bound(n, 0, op->batch_size);
+               .bound(z, 0, op->output_channels);
+        specialize_batch(forward, op_impl->batch_size);
     } else if (arch == TargetArch::GPU) {
         assert(0);
     }
@@ -446,7 +531,7 @@ void flatten_forward_halide(std::string name,
     check_defined(input);
     Func forward(name + "_forward");
 
-    Var x, n;
+    Var x("x"), n("n");
 
     if (op->input_ops[0]->num_dims() == 2) {
         forward(x, n) = input(x, n);
@@ -473,7 +558,7 @@ void data_forward_halide(std::string name,
                          Func input,
                          std::shared_ptr<OpHalideImpl> op_impl,
                          TargetArch arch) {
-    Var x, y, z, n;
+    Var x("x"), y("y"), z("z"), n("n");
     Func forward(name + "_forward");
     switch(op->num_dims()) {
         case 1:
@@ -500,7 +585,7 @@ void sum_forward_halide(std::string name,
                         std::vector<Func> inputs,
                         std::shared_ptr<OpHalideImpl> op_impl,
                         TargetArch arch) {
-    Var x, y, z, n;
+    Var x("x"), y("y"), z("z"), n("n");
     Func forward(name + "_forward");
     std::vector<Var> vars;
     switch(op->num_dims()) {
@@ -535,3 +620,55 @@ void sum_forward_halide(std::string name,
 
     op_impl->output = forward;
 }
+
+// Builders for ops which take a single input pass it as is, the others
+// get the list of inputs.
+template <typename OpType>
+HalideKernelBuilder halide_builder(void (*builder)(std::string,
+                                                   std::shared_ptr<OpType>,
+                                                   Func,
+                                                   std::shared_ptr<OpHalideImpl>,
+                                                   TargetArch)) {
+    return [builder](std::string name, std::shared_ptr<Op> op,
+                     std::vector<Func>& inputs,
+                     std::shared_ptr<OpHalideImpl> op_impl, TargetArch arch) {
+        assert(inputs.size() == 1);
+        builder(name, std::static_pointer_cast<OpType>(op), inputs[0],
+                op_impl, arch);
+    };
+}
+
+template <typename OpType>
+HalideKernelBuilder halide_builder(void (*builder)(std::string,
+                                                   std::shared_ptr<OpType>,
+                                                   std::vector<Func>,
+                                                   std::shared_ptr<OpHalideImpl>,
+                                                   TargetArch)) {
+    return [builder](std::string name, std::shared_ptr<Op> op,
+                     std::vector<Func>& inputs,
+                     std::shared_ptr<OpHalideImpl> op_impl, TargetArch arch) {
+        builder(name, std::static_pointer_cast<OpType>(op), inputs,
+                op_impl, arch);
+    };
+}
+
+REGISTER_KERNEL(HalideKernelBuilder, SumOp, OpImpl::HALIDE,
+                halide_builder<SumOp>(sum_forward_halide));
+REGISTER_KERNEL(HalideKernelBuilder, AffineOp, OpImpl::HALIDE,
+                halide_builder<AffineOp>(affine_forward_halide));
+REGISTER_KERNEL(HalideKernelBuilder, Conv2dOp, OpImpl::HALIDE,
+                halide_builder<Conv2dOp>(conv2d_forward_halide));
+REGISTER_KERNEL(HalideKernelBuilder, Pool2dOp, OpImpl::HALIDE,
+                halide_builder<Pool2dOp>(pool2d_forward_halide));
+REGISTER_KERNEL(HalideKernelBuilder, ReLUOp, OpImpl::HALIDE,
+                halide_builder<ReLUOp>(relu_forward_halide));
+REGISTER_KERNEL(HalideKernelBuilder, SoftMaxOp, OpImpl::HALIDE,
+                halide_builder<SoftMaxOp>(softmax_forward_halide));
+REGISTER_KERNEL(HalideKernelBuilder, LRNOp, OpImpl::HALIDE,
+                halide_builder<LRNOp>(lrn_forward_halide));
+REGISTER_KERNEL(HalideKernelBuilder, ConcatOp, OpImpl::HALIDE,
+                halide_builder<ConcatOp>(concat_forward_halide));
+REGISTER_KERNEL(HalideKernelBuilder, FlattenOp, OpImpl::HALIDE,
+                halide_builder<FlattenOp>(flatten_forward_halide));
+REGISTER_KERNEL(HalideKernelBuilder, DataOp, OpImpl::HALIDE,
+                halide_builder<DataOp>(data_forward_halide));
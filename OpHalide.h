@@ -5,23 +5,57 @@
 #include "Halide.h"
 #include "OpImpl.h"
 #include "Op.h"
+#include "KernelRegistry.h"
+#include "HalideSchedule.h"
 
 using namespace Halide;
 
 // Sanity check to make sure the halide function is defined.
 void check_defined(Func f);
 
+// Specialize the schedule of f for common values of the batch size.
+void specialize_batch(Func f, Expr batch_size);
+
 class OpHalideImpl {
     public:
     Func output;
+    // Extent of the batch dimension of the group inputs. It is set before
+    // the op is built and is only known when the group runs.
+    Expr batch_size;
     // Ordered list of learnable parameters of the op.
     std::vector<ImageParam> params;
     // Ordered list of learnable parameters of the op.
     std::vector<Func> param_grads;
     // Ordered list of gradient inputs to the op.
     std::vector<Func> input_grads;
+    // Schedule of a conv found by tune_halide, null when the conv uses
+    // the default schedule.
+    std::shared_ptr<ConvSchedule> conv_schedule;
+
+    // Builders of ops which can be fused with their consumers leave the
+    // output unscheduled and define how to schedule it, see
+    // Graph::fuse_halide_ops. f is the output of the op or of an
+    // elementwise consumer inlined into it. schedule_root computes f at
+    // the root and schedule_at within a loop of a consumer.
+    std::function<void(Func f)> schedule_root;
+    std::function<void(Func f, Func consumer, Var loop)> schedule_at;
+
+    // Set before the op is built when its producer is computed within
+    // its tiles. The builder sets tile_loop to the loop over the tiles.
+    bool fuse_producer;
+    Var tile_loop;
+
+    OpHalideImpl() : fuse_producer(false) {}
 };
 
+// Defines the Halide function computing an op from the functions of its
+// inputs. Builders are registered per op type with OpImpl::HALIDE.
+typedef std::function<void(std::string name,
+                           std::shared_ptr<Op> op,
+                           std::vector<Func>& inputs,
+                           std::shared_ptr<OpHalideImpl> op_impl,
+                           TargetArch arch)> HalideKernelBuilder;
+
 void sum_forward_halide(std::string name,
                         std::shared_ptr<SumOp> op,
                         std::vector<Func> inputs,
@@ -1,7 +1,7 @@
 #pragma once
 // TODO: consolidate into a class
 // Enumeration of possible implementations of each op node.
-enum OpImpl { REF, HALIDE, CUDNN };
+enum OpImpl { REF, HALIDE, CUDNN, NATIVE };
 
 // Enumeration of target architecture for each op implementation.
 // Currently supports coarse level granularity of CPU/GPU specific
@@ -0,0 +1,901 @@
+#include <limits>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include "OpNative.h"
+#include "Gemm.h"
+#include "Winograd.h"
+#include "FFTConv.h"
+#include "OpRef.h"
+#include "Utils.h"
+
+static void im2col(const float* in, int channels, int height, int width,
+                   int filter_h, int filter_w, int stride_h, int stride_w,
+                   int pad_h, int pad_w, int out_h, int out_w, float* col,
+                   ThreadPool* pool) {
+    auto unroll_channel = [&](int c) {
+        const float* in_c = in + c * height * width;
+        for (int f_h = 0; f_h < filter_h; f_h++) {
+            for (int f_w = 0; f_w < filter_w; f_w++) {
+                float* row = col + ((c * filter_h + f_h) * filter_w + f_w) *
+                                   out_h * out_w;
+                for (int y = 0; y < out_h; y++) {
+                    int in_y = y * stride_h + f_h - pad_h;
+                    float* row_y = row + y * out_w;
+                    if (in_y < 0 || in_y >= height) {
+                        std::fill(row_y, row_y + out_w, 0.0f);
+                        continue;
+                    }
+                    const float* in_row = in_c + in_y * width;
+                    for (int x = 0; x < out_w; x++) {
+                        int in_x = x * stride_w + f_w - pad_w;
+                        row_y[x] = (in_x >= 0 && in_x < width) ?
+                                       in_row[in_x] : 0.0f;
+                    }
+                }
+            }
+        }
+    };
+
+    if (pool) {
+        pool->parallel_for(0, channels, unroll_channel);
+    } else {
+        for (int c = 0; c < channels; c++) {
+            unroll_channel(c);
+        }
+    }
+}
+
+// Costs of the algorithms for one image in flops of a matrix multiply.
+// The transforms of tiles run as scalar code at a fraction of the rate.
+static const double scalar_cost = 8.0;
+
+static double im2col_cost(Conv2dOp& op) {
+    double pixels = (double)op.output_height * op.output_width;
+    double K = (double)op.input_channels * op.filter_height * op.filter_width;
+    return 2.0 * op.output_channels * K * pixels + scalar_cost * K * pixels;
+}
+
+static double winograd_cost(Conv2dOp& op) {
+    double tiles = (double)((op.output_height + 3)/4) *
+                   ((op.output_width + 3)/4);
+    // Transforming an input tile takes about 180 flops and transforming
+    // back a tile of the products about 120.
+    return 2.0 * WINOGRAD_TILE * op.output_channels * op.input_channels *
+           tiles + scalar_cost * tiles * (180.0 * op.input_channels +
+                                          120.0 * op.output_channels);
+}
+
+bool conv_algorithm_applies(Conv2dOp& op, ConvAlgorithm algorithm) {
+    switch (algorithm) {
+        case CONV_WINOGRAD:
+            return op.filter_height == 3 && op.filter_width == 3 &&
+                   op.stride_h == 1 && op.stride_w == 1;
+        case CONV_FFT:
+            return fft_conv_cost(op, FFT_CONV_MAX_TILE) <
+                   std::numeric_limits<double>::infinity();
+        default:
+            return true;
+    }
+}
+
+// Looping over the filter taps runs far below the rate of a matrix
+// multiply.
+static const double direct_cost = 10.0;
+
+static double conv_algorithm_cost(Conv2dOp& op, ConvAlgorithm algorithm) {
+    switch (algorithm) {
+        case CONV_WINOGRAD:
+            return winograd_cost(op);
+        case CONV_FFT:
+            return fft_conv_cost(op, fft_conv_tile_size(op));
+        case CONV_DIRECT:
+            return direct_cost * op.flops() / op.batch_size;
+        default:
+            return im2col_cost(op);
+    }
+}
+
+ConvAlgorithm choose_conv_algorithm(Conv2dOp& op) {
+    ConvAlgorithm best = CONV_IM2COL;
+    double best_cost = im2col_cost(op);
+    if (conv_algorithm_applies(op, CONV_WINOGRAD) &&
+        winograd_cost(op) < best_cost) {
+        best = CONV_WINOGRAD;
+        best_cost = winograd_cost(op);
+    }
+    // Small filters are left to the other algorithms, whose costs are
+    // better known.
+    if (std::max(op.filter_height, op.filter_width) >= 5 &&
+        conv_algorithm_applies(op, CONV_FFT) &&
+        fft_conv_cost(op, fft_conv_tile_size(op)) < best_cost) {
+        best = CONV_FFT;
+    }
+    return best;
+}
+
+ConvAlgorithm time_conv_algorithms(std::shared_ptr<Conv2dOp> op) {
+    // Time a copy of the op so that its params are left alone.
+    auto conv = std::make_shared<Conv2dOp>(*op);
+    GaussianGenerator<float> rgen(0.0f, 0.1f);
+    conv->params.clear();
+    NDArray<float> W({conv->output_channels, conv->input_channels,
+                      conv->filter_height, conv->filter_width});
+    W.initialize(rgen);
+    conv->params.push_back(W);
+    if (conv->bias) {
+        NDArray<float> bias({conv->output_channels});
+        bias.initialize(rgen);
+        conv->params.push_back(bias);
+    }
+
+    NDArray<float> input({conv->batch_size, conv->input_channels,
+                          conv->input_height, conv->input_width});
+    input.initialize(rgen);
+    NDArray<float> output({conv->batch_size, conv->output_channels,
+                           conv->output_height, conv->output_width});
+    std::vector<float> workspace;
+
+    const ConvAlgorithm candidates[] = { CONV_IM2COL, CONV_WINOGRAD,
+                                         CONV_FFT, CONV_DIRECT };
+    double best_estimate = std::numeric_limits<double>::infinity();
+    for (ConvAlgorithm a: candidates) {
+        if (conv_algorithm_applies(*conv, a)) {
+            best_estimate = std::min(best_estimate,
+                                     conv_algorithm_cost(*conv, a));
+        }
+    }
+
+    ConvAlgorithm best = CONV_IM2COL;
+    double best_time = std::numeric_limits<double>::infinity();
+    for (ConvAlgorithm a: candidates) {
+        // Algorithms far off the best estimate are not worth timing.
+        if (!conv_algorithm_applies(*conv, a) ||
+            conv_algorithm_cost(*conv, a) > 4 * best_estimate) {
+            continue;
+        }
+        conv->algorithm = a;
+        prepare_conv2d_native(conv);
+
+        // The first run warms up the caches and sizes the workspace.
+        conv2d_forward_native(conv, input, output, workspace);
+        double time = std::numeric_limits<double>::infinity();
+        for (int r = 0; r < 3; r++) {
+            auto start = std::chrono::steady_clock::now();
+            conv2d_forward_native(conv, input, output, workspace);
+            auto end = std::chrono::steady_clock::now();
+            time = std::min(time,
+                            std::chrono::duration<double>(end - start).count());
+        }
+        if (time < best_time) {
+            best = a;
+            best_time = time;
+        }
+    }
+    return best;
+}
+
+// Filters {O, I, KH, KW} of a conv computing in blocks of channels
+// rearranged into {O/block, I, KH, KW, block}, so that the filters of the
+// output channels of a block are contiguous for each tap.
+static NDArray<float> pack_conv_filters(Conv2dOp& op, int block) {
+    NDArray<float>& W = get_ndarray<float>(op.params[0]);
+    NDArray<float> P({op.output_channels/block, op.input_channels,
+                      op.filter_height, op.filter_width, block});
+    size_t filter_size = (size_t)op.input_channels * op.filter_height *
+                         op.filter_width;
+    const float* w = W.host_alloc.get();
+    float* p = P.host_alloc.get();
+    for (int o = 0; o < op.output_channels; o++) {
+        float* p_block = p + (o / block) * filter_size * block + o % block;
+        for (size_t k = 0; k < filter_size; k++) {
+            p_block[k * block] = w[o * filter_size + k];
+        }
+    }
+    return P;
+}
+
+// Whether the op reads activations quantized by Graph::plan_quantization.
+static bool reads_quantized(Op& op) {
+    return op.input_ops.size() > 0 &&
+           op.input_ops[0]->type == DataType::UInt8;
+}
+
+// Weights with a row for each output channel quantized to Int8, each row
+// with the scale mapping its largest magnitude to 127. The kernel params
+// are the quantized weights and the scales.
+static void quantize_weights(NDArray_t& weights, int rows,
+                             std::vector<NDArray_t>& kernel_params) {
+    NDArray_t widened = weights.which() == DataType::Float32 ?
+                        weights : cast_ndarray(weights, DataType::Float32);
+    NDArray<float>& W = get_ndarray<float>(widened);
+    int cols = W.buf_size / rows;
+    NDArray<int8_t> Q({rows, cols});
+    NDArray<float> scales({rows});
+    for (int r = 0; r < rows; r++) {
+        const float* w = W.host_alloc.get() + (size_t)r * cols;
+        float max = 0.0f;
+        for (int k = 0; k < cols; k++) {
+            max = std::max(max, std::abs(w[k]));
+        }
+        float scale = max > 0.0f ? max / 127.0f : 1.0f;
+        int8_t* q = Q.host_alloc.get() + (size_t)r * cols;
+        for (int k = 0; k < cols; k++) {
+            q[k] = (int8_t)std::lrint(std::min(127.0f, std::max(-127.0f,
+                                                        w[k] / scale)));
+        }
+        scales(r) = scale;
+    }
+    kernel_params = {Q, scales};
+}
+
+void prepare_conv2d_native(std::shared_ptr<Op> op) {
+    auto conv = std::static_pointer_cast<Conv2dOp>(op);
+    conv->kernel_params.clear();
+
+    if (reads_quantized(*conv)) {
+        quantize_weights(conv->params[0], conv->output_channels,
+                         conv->kernel_params);
+        return;
+    }
+
+    int block = get_layout_block(conv->layout);
+    if (block == 0) {
+        if (conv->algorithm == CONV_AUTO) {
+            conv->algorithm = choose_conv_algorithm(*conv);
+        } else if (!conv_algorithm_applies(*conv, conv->algorithm)) {
+            conv->algorithm = CONV_IM2COL;
+        }
+    }
+
+    // Only the gemm of im2col reads 16-bit filters, the other algorithms
+    // compute from widened ones.
+    if (is_narrow_float(conv->params[0]) &&
+        (block > 0 || conv->algorithm != CONV_IM2COL)) {
+        conv->params[0] = cast_ndarray(conv->params[0], DataType::Float32);
+    }
+
+    if (block > 0) {
+        conv->kernel_params.push_back(pack_conv_filters(*conv, block));
+        return;
+    }
+
+    if (conv->algorithm == CONV_WINOGRAD) {
+        NDArray<float> U({WINOGRAD_TILE, conv->output_channels,
+                          conv->input_channels});
+        winograd_filter_transform(
+            get_ndarray<float>(conv->params[0]).host_alloc.get(),
+            conv->output_channels, conv->input_channels, U.host_alloc.get());
+        conv->kernel_params.push_back(U);
+    } else if (conv->algorithm == CONV_FFT) {
+        conv->kernel_params.push_back(
+            fft_conv_filter_transform(*conv, fft_conv_tile_size(*conv)));
+    }
+}
+
+static void conv2d_winograd_native(std::shared_ptr<Conv2dOp> op,
+                                   NDArray<float>& input,
+                                   NDArray<float>& output,
+                                   std::vector<float>& workspace) {
+
+    int batch_size = input.dim_sizes[0];
+    int in_size = op->input_channels * op->input_height * op->input_width;
+    int out_size = op->output_channels * op->output_height *
+                   op->output_width;
+    size_t ws_size = winograd_workspace_size(op->output_channels,
+                                             op->input_channels,
+                                             op->output_height,
+                                             op->output_width);
+    if (workspace.size() < ws_size) {
+        workspace.resize(ws_size);
+    }
+
+    const float* U = get_ndarray<float>(op->kernel_params[0]).host_alloc.get();
+    const float* bias = op->bias ?
+                        get_ndarray<float>(op->params[1]).host_alloc.get() :
+                        nullptr;
+    for (int b = 0; b < batch_size; b++) {
+        winograd_conv2d(input.host_alloc.get() + (size_t)b * in_size,
+                        op->input_channels, op->input_height,
+                        op->input_width, op->pad_h, op->pad_w,
+                        U, bias, op->output_channels,
+                        output.host_alloc.get() + (size_t)b * out_size,
+                        op->output_height, op->output_width,
+                        workspace.data(), get_native_pool());
+    }
+}
+
+static void conv2d_fft_native(std::shared_ptr<Conv2dOp> op,
+                              NDArray<float>& input,
+                              NDArray<float>& output,
+                              std::vector<float>& workspace) {
+
+    int batch_size = input.dim_sizes[0];
+    int in_size = op->input_channels * op->input_height * op->input_width;
+    int out_size = op->output_channels * op->output_height *
+                   op->output_width;
+    NDArray<float>& U = get_ndarray<float>(op->kernel_params[0]);
+    int n = U.dim_sizes[1];
+    int images = std::min(batch_size, fft_conv_images(*op, n));
+    size_t ws_size = fft_conv_workspace_size(*op, n, images);
+    if (workspace.size() < ws_size) {
+        workspace.resize(ws_size);
+    }
+
+    const float* bias = op->bias ?
+                        get_ndarray<float>(op->params[1]).host_alloc.get() :
+                        nullptr;
+    for (int b = 0; b < batch_size; b += images) {
+        fft_conv2d(*op, input.host_alloc.get() + (size_t)b * in_size,
+                   std::min(images, batch_size - b), U, bias,
+                   output.host_alloc.get() + (size_t)b * out_size,
+                   workspace.data(), get_native_pool());
+    }
+}
+
+// Direct conv of activations with blocked channels. Each task computes a
+// block of output channels of an image a row at a time. For every input
+// channel and tap the row accumulates the input pixels times the vector
+// of filters of the block.
+template <int B>
+static void conv2d_nchwc(Conv2dOp& op, NDArray<float>& input,
+                         NDArray<float>& output) {
+    assert(input.layout == output.layout && output.dim_sizes[4] == B);
+    int batch_size = output.dim_sizes[0];
+    int out_blocks = op.output_channels / B;
+    int in_w = op.input_width;
+    int in_h = op.input_height;
+    int out_w = op.output_width;
+    int out_h = op.output_height;
+    int f_h = op.filter_height;
+    int f_w = op.filter_width;
+    size_t filter_size = (size_t)op.input_channels * f_h * f_w;
+
+    const float* P = get_ndarray<float>(op.kernel_params[0]).host_alloc.get();
+    const float* bias = op.bias ?
+                        get_ndarray<float>(op.params[1]).host_alloc.get() :
+                        nullptr;
+
+    auto compute_block = [&](int task) {
+        int b = task / out_blocks;
+        int ob = task % out_blocks;
+        const float* in = input.host_alloc.get() + b * input.strides[0];
+        float* out = output.host_alloc.get() + b * output.strides[0] +
+                     ob * output.strides[1];
+        const float* filters = P + ob * filter_size * B;
+
+        for (int y = 0; y < out_h; y++) {
+            float* row = out + (size_t)y * out_w * B;
+            for (int x = 0; x < out_w; x++) {
+                for (int l = 0; l < B; l++) {
+                    row[x * B + l] = bias ? bias[ob * B + l] : 0.0f;
+                }
+            }
+
+            for (int ic = 0; ic < op.input_channels; ic++) {
+                const float* in_c = in + (ic / B) * input.strides[1] + ic % B;
+                for (int k_h = 0; k_h < f_h; k_h++) {
+                    int in_y = y * op.stride_h + k_h - op.pad_h;
+                    if (in_y < 0 || in_y >= in_h) {
+                        continue;
+                    }
+                    const float* in_row = in_c + (size_t)in_y * in_w * B;
+                    for (int k_w = 0; k_w < f_w; k_w++) {
+                        const float* w = filters +
+                                         ((ic * f_h + k_h) * f_w + k_w) * B;
+                        // Columns of the row reading inside the input.
+                        int s = op.stride_w;
+                        int x_begin = std::max(0, (op.pad_w - k_w + s - 1)/s);
+                        int x_end = std::min(out_w,
+                                             (in_w + op.pad_w - k_w + s - 1)/s);
+                        for (int x = x_begin; x < x_end; x++) {
+                            float v = in_row[(x * s + k_w - op.pad_w) * B];
+                            float* acc = row + x * B;
+                            for (int l = 0; l < B; l++) {
+                                acc[l] += v * w[l];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    };
+
+    ThreadPool* pool = get_native_pool();
+    if (pool) {
+        pool->parallel_for(0, batch_size * out_blocks, compute_block);
+    } else {
+        for (int t = 0; t < batch_size * out_blocks; t++) {
+            compute_block(t);
+        }
+    }
+}
+
+// sgemm with A or B a param stored as float or as 16-bit floats.
+static void sgemm_param_a(int M, int N, int K, NDArray_t& A, int lda,
+                          const float* B, int ldb, bool trans_b,
+                          float* C, int ldc, bool accumulate,
+                          ThreadPool* pool) {
+    switch (A.which()) {
+        case DataType::Float16:
+            sgemm(M, N, K, get_ndarray<float16>(A).host_alloc.get(), lda,
+                  B, ldb, trans_b, C, ldc, accumulate, pool);
+            break;
+        case DataType::BFloat16:
+            sgemm(M, N, K, get_ndarray<bfloat16>(A).host_alloc.get(), lda,
+                  B, ldb, trans_b, C, ldc, accumulate, pool);
+            break;
+        default:
+            sgemm(M, N, K, get_ndarray<float>(A).host_alloc.get(), lda,
+                  B, ldb, trans_b, C, ldc, accumulate, pool);
+    }
+}
+
+static void sgemm_param_b(int M, int N, int K, const float* A, int lda,
+                          NDArray_t& B, int ldb, bool trans_b,
+                          float* C, int ldc, bool accumulate,
+                          ThreadPool* pool) {
+    switch (B.which()) {
+        case DataType::Float16:
+            sgemm(M, N, K, A, lda, get_ndarray<float16>(B).host_alloc.get(),
+                  ldb, trans_b, C, ldc, accumulate, pool);
+            break;
+        case DataType::BFloat16:
+            sgemm(M, N, K, A, lda, get_ndarray<bfloat16>(B).host_alloc.get(),
+                  ldb, trans_b, C, ldc, accumulate, pool);
+            break;
+        default:
+            sgemm(M, N, K, A, lda, get_ndarray<float>(B).host_alloc.get(),
+                  ldb, trans_b, C, ldc, accumulate, pool);
+    }
+}
+
+void conv2d_forward_native(std::shared_ptr<Conv2dOp> op,
+                           NDArray<float>& input,
+                           NDArray<float>& output,
+                           std::vector<float>& workspace) {
+
+    int block = get_layout_block(op->layout);
+    if (block == 8) {
+        conv2d_nchwc<8>(*op, input, output);
+        return;
+    } else if (block == 16) {
+        conv2d_nchwc<16>(*op, input, output);
+        return;
+    }
+
+    if (op->algorithm == CONV_DIRECT) {
+        conv2d_forward_ref<float>(op, input, output);
+        return;
+    }
+
+    // The filters are transformed when the params are set.
+    if (op->kernel_params.size() > 0) {
+        if (op->algorithm == CONV_WINOGRAD) {
+            conv2d_winograd_native(op, input, output, workspace);
+        } else {
+            conv2d_fft_native(op, input, output, workspace);
+        }
+        return;
+    }
+
+    ThreadPool* pool = get_native_pool();
+    int batch_size = input.dim_sizes[0];
+    int in_size = op->input_channels * op->input_height * op->input_width;
+    int out_pixels = op->output_height * op->output_width;
+    int K = op->input_channels * op->filter_height * op->filter_width;
+    int M = op->output_channels;
+
+    bool direct = op->filter_height == 1 && op->filter_width == 1 &&
+                  op->stride_h == 1 && op->stride_w == 1 &&
+                  op->pad_h == 0 && op->pad_w == 0;
+    if (!direct && workspace.size() < (size_t)K * out_pixels) {
+        workspace.resize((size_t)K * out_pixels);
+    }
+
+    for (int b = 0; b < batch_size; b++) {
+        const float* in = input.host_alloc.get() + (size_t)b * in_size;
+        float* out = output.host_alloc.get() + (size_t)b * M * out_pixels;
+
+        const float* cols = in;
+        if (!direct) {
+            im2col(in, op->input_channels, op->input_height, op->input_width,
+                   op->filter_height, op->filter_width, op->stride_h,
+                   op->stride_w, op->pad_h, op->pad_w, op->output_height,
+                   op->output_width, workspace.data(), pool);
+            cols = workspace.data();
+        }
+
+        if (op->bias) {
+            NDArray<float>& bias = get_ndarray<float>(op->params[1]);
+            for (int m = 0; m < M; m++) {
+                std::fill(out + m * out_pixels, out + (m + 1) * out_pixels,
+                          bias(m));
+            }
+        }
+
+        sgemm_param_a(M, out_pixels, K, op->params[0], K, cols, out_pixels,
+                      false, out, out_pixels, op->bias, pool);
+    }
+}
+
+void affine_forward_native(std::shared_ptr<AffineOp> op,
+                           NDArray<float>& input,
+                           NDArray<float>& output,
+                           std::vector<float>& workspace) {
+
+    int batch_size = input.dim_sizes[0];
+    NDArray<float>& bias = get_ndarray<float>(op->params[1]);
+
+    float* out = output.host_alloc.get();
+    for (int n = 0; n < batch_size; n++) {
+        for (int u = 0; u < op->num_units; u++) {
+            out[n * op->num_units + u] = bias(u);
+        }
+    }
+
+    // The weights are stored one unit per row, so the product is with
+    // their transpose. 16-bit weights are widened as they are packed.
+    sgemm_param_b(batch_size, op->num_units, op->num_inputs,
+                  input.host_alloc.get(), op->num_inputs,
+                  op->params[0], op->num_inputs, true,
+                  out, op->num_units, true, get_native_pool());
+}
+
+void prepare_affine_native(std::shared_ptr<Op> op) {
+    auto affine = std::static_pointer_cast<AffineOp>(op);
+    affine->kernel_params.clear();
+    if (reads_quantized(*affine)) {
+        quantize_weights(affine->params[0], affine->num_units,
+                         affine->kernel_params);
+    }
+}
+
+// Rounds a non-negative value in steps to the nearest UInt8.
+static inline uint8_t saturate_u8(float v) {
+    return (uint8_t)(std::min(v, 255.0f) + 0.5f);
+}
+
+// Output of a conv or affine op from the 32-bit sums of the products of
+// its quantized input and weights.
+static inline float dequantize(int32_t sum, float scale, float bias) {
+    return sum * scale + bias;
+}
+
+void conv2d_int8_native(std::shared_ptr<Conv2dOp> op,
+                        NDArray<uint8_t>& input,
+                        NDArray<float>& output,
+                        std::vector<float>& workspace) {
+
+    ThreadPool* pool = get_native_pool();
+    int batch_size = input.dim_sizes[0];
+    int in_c = op->input_channels;
+    int in_h = op->input_height;
+    int in_w = op->input_width;
+    int out_h = op->output_height;
+    int out_w = op->output_width;
+    int out_pixels = out_h * out_w;
+    int K = in_c * op->filter_height * op->filter_width;
+    int M = op->output_channels;
+
+    // The patches of an image and the sums of the products with them
+    // share the workspace.
+    size_t patch_words = ((size_t)out_pixels * K + 3)/4;
+    size_t ws_size = patch_words + (size_t)out_pixels * M;
+    if (workspace.size() < ws_size) {
+        workspace.resize(ws_size);
+    }
+    uint8_t* patches = reinterpret_cast<uint8_t*>(workspace.data());
+    int32_t* sums = reinterpret_cast<int32_t*>(workspace.data() +
+                                               patch_words);
+
+    const int8_t* Q =
+        get_ndarray<int8_t>(op->kernel_params[0]).host_alloc.get();
+    NDArray<float>& w_scales = get_ndarray<float>(op->kernel_params[1]);
+    float in_scale = op->input_ops[0]->quant_scale;
+    const float* bias = op->bias ?
+                        get_ndarray<float>(op->params[1]).host_alloc.get() :
+                        nullptr;
+
+    for (int b = 0; b < batch_size; b++) {
+        const uint8_t* in = input.host_alloc.get() + b * input.strides[0];
+        float* out = output.host_alloc.get() + b * output.strides[0];
+
+        // Each patch is a row, so that every output is the dot product of
+        // a patch with a filter. Zero is the quantized padding.
+        auto unroll_row = [&](int y) {
+            for (int x = 0; x < out_w; x++) {
+                uint8_t* patch = patches + ((size_t)y * out_w + x) * K;
+                for (int c = 0; c < in_c; c++) {
+                    for (int k_h = 0; k_h < op->filter_height; k_h++) {
+                        int y_in = y * op->stride_h + k_h - op->pad_h;
+                        for (int k_w = 0; k_w < op->filter_width; k_w++) {
+                            int x_in = x * op->stride_w + k_w - op->pad_w;
+                            bool inside = y_in >= 0 && y_in < in_h &&
+                                          x_in >= 0 && x_in < in_w;
+                            *patch++ = inside ?
+                                in[((size_t)c * in_h + y_in) * in_w + x_in] :
+                                0;
+                        }
+                    }
+                }
+            }
+        };
+        if (pool) {
+            pool->parallel_for(0, out_h, unroll_row);
+        } else {
+            for (int y = 0; y < out_h; y++) {
+                unroll_row(y);
+            }
+        }
+
+        gemm_u8s8(out_pixels, M, K, patches, K, Q, K, sums, M, pool);
+
+        auto output_channel = [&](int m) {
+            float scale = in_scale * w_scales(m);
+            float bias_m = bias ? bias[m] : 0.0f;
+            float* out_m = out + (size_t)m * out_pixels;
+            for (int p = 0; p < out_pixels; p++) {
+                out_m[p] = dequantize(sums[(size_t)p * M + m], scale, bias_m);
+            }
+        };
+        if (pool) {
+            pool->parallel_for(0, M, output_channel);
+        } else {
+            for (int m = 0; m < M; m++) {
+                output_channel(m);
+            }
+        }
+    }
+}
+
+void affine_int8_native(std::shared_ptr<AffineOp> op,
+                        NDArray<uint8_t>& input,
+                        NDArray<float>& output,
+                        std::vector<float>& workspace) {
+
+    int batch_size = input.dim_sizes[0];
+    int N = op->num_units;
+    if (workspace.size() < (size_t)batch_size * N) {
+        workspace.resize((size_t)batch_size * N);
+    }
+    int32_t* sums = reinterpret_cast<int32_t*>(workspace.data());
+
+    const int8_t* Q =
+        get_ndarray<int8_t>(op->kernel_params[0]).host_alloc.get();
+    NDArray<float>& w_scales = get_ndarray<float>(op->kernel_params[1]);
+    NDArray<float>& bias = get_ndarray<float>(op->params[1]);
+    float in_scale = op->input_ops[0]->quant_scale;
+
+    gemm_u8s8(batch_size, N, op->num_inputs,
+              input.host_alloc.get(), input.strides[0],
+              Q, op->num_inputs, sums, N, get_native_pool());
+
+    float* out = output.host_alloc.get();
+    for (int n = 0; n < batch_size; n++) {
+        for (int u = 0; u < N; u++) {
+            out[n * N + u] = dequantize(sums[n * N + u],
+                                        in_scale * w_scales(u), bias(u));
+        }
+    }
+}
+
+void relu_int8_native(std::shared_ptr<ReLUOp> op,
+                      NDArray<float>& input,
+                      NDArray<uint8_t>& output,
+                      std::vector<float>& workspace) {
+
+    float inv_scale = 1.0f / op->quant_scale;
+    int batch_size = output.dim_sizes[0];
+    size_t entry_size = output.buf_size / batch_size;
+    for (int b = 0; b < batch_size; b++) {
+        const float* in = input.host_alloc.get() + b * input.strides[0];
+        uint8_t* out = output.host_alloc.get() + b * output.strides[0];
+        for (size_t i = 0; i < entry_size; i++) {
+            out[i] = saturate_u8(std::max(in[i], 0.0f) * inv_scale);
+        }
+    }
+}
+
+void pool2d_int8_native(std::shared_ptr<Pool2dOp> op,
+                        NDArray<uint8_t>& input,
+                        NDArray<uint8_t>& output,
+                        std::vector<float>& workspace) {
+
+    // Steps of the input in steps of the output.
+    float rescale = op->input_ops[0]->quant_scale / op->quant_scale;
+    int batch_size = input.dim_sizes[0];
+    int channels = op->input_channels;
+    int in_h = op->input_height;
+    int in_w = op->input_width;
+    int out_h = op->output_height;
+    int out_w = op->output_width;
+    bool avg = op->pool_type == PoolType::AVG;
+    float avg_scale = rescale / (op->pool_height * op->pool_width);
+
+    // Like the reference kernel the padding counts as zeros.
+    auto pool_channel = [&](int task) {
+        int b = task / channels;
+        int c = task % channels;
+        const uint8_t* in = input.host_alloc.get() + b * input.strides[0] +
+                            (size_t)c * in_h * in_w;
+        uint8_t* out = output.host_alloc.get() + b * output.strides[0] +
+                       (size_t)c * out_h * out_w;
+        for (int y = 0; y < out_h; y++) {
+            for (int x = 0; x < out_w; x++) {
+                int acc = 0;
+                for (int k_h = 0; k_h < op->pool_height; k_h++) {
+                    int y_in = y * op->stride_h + k_h - op->pad_h;
+                    for (int k_w = 0; k_w < op->pool_width; k_w++) {
+                        int x_in = x * op->stride_w + k_w - op->pad_w;
+                        int v = (y_in >= 0 && y_in < in_h &&
+                                 x_in >= 0 && x_in < in_w) ?
+                                in[y_in * in_w + x_in] : 0;
+                        acc = avg ? acc + v : std::max(acc, v);
+                    }
+                }
+                out[y * out_w + x] = saturate_u8(acc * (avg ? avg_scale :
+                                                               rescale));
+            }
+        }
+    };
+
+    ThreadPool* pool = get_native_pool();
+    if (pool) {
+        pool->parallel_for(0, batch_size * channels, pool_channel);
+    } else {
+        for (int t = 0; t < batch_size * channels; t++) {
+            pool_channel(t);
+        }
+    }
+}
+
+void flatten_int8_native(std::shared_ptr<FlattenOp> op,
+                         NDArray<uint8_t>& input,
+                         NDArray<uint8_t>& output,
+                         std::vector<float>& workspace) {
+    assert(input.buf_size == output.buf_size);
+    std::copy(input.host_alloc.get(), input.host_alloc.get() + input.buf_size,
+              output.host_alloc.get());
+}
+
+// Pool of activations with blocked channels, computing the pixels of a
+// block of channels together. Like the reference kernel it counts the
+// padding as zeros.
+template <int B>
+static void pool2d_nchwc(Pool2dOp& op, NDArray<float>& input,
+                         NDArray<float>& output) {
+    assert(input.layout == output.layout && output.dim_sizes[4] == B);
+    int batch_size = output.dim_sizes[0];
+    int blocks = op.input_channels / B;
+    int in_w = op.input_width;
+    int in_h = op.input_height;
+    int out_w = op.output_width;
+    int out_h = op.output_height;
+    bool max_pool = op.pool_type == PoolType::MAX;
+    float area = op.pool_height * op.pool_width;
+
+    auto pool_block = [&](int task) {
+        int b = task / blocks;
+        int cb = task % blocks;
+        const float* in = input.host_alloc.get() + b * input.strides[0] +
+                          cb * input.strides[1];
+        float* out = output.host_alloc.get() + b * output.strides[0] +
+                     cb * output.strides[1];
+
+        for (int y = 0; y < out_h; y++) {
+            for (int x = 0; x < out_w; x++) {
+                float acc[B];
+                for (int l = 0; l < B; l++) {
+                    acc[l] = max_pool ? std::numeric_limits<float>::lowest() :
+                                        0.0f;
+                }
+                for (int k_h = 0; k_h < op.pool_height; k_h++) {
+                    for (int k_w = 0; k_w < op.pool_width; k_w++) {
+                        int in_y = y * op.stride_h + k_h - op.pad_h;
+                        int in_x = x * op.stride_w + k_w - op.pad_w;
+                        bool inside = in_x >= 0 && in_x < in_w &&
+                                      in_y >= 0 && in_y < in_h;
+                        const float* v = inside ?
+                            in + ((size_t)in_y * in_w + in_x) * B : nullptr;
+                        for (int l = 0; l < B; l++) {
+                            float val = inside ? v[l] : 0.0f;
+                            acc[l] = max_pool ? std::max(acc[l], val) :
+                                                acc[l] + val;
+                        }
+                    }
+                }
+                float* o = out + ((size_t)y * out_w + x) * B;
+                for (int l = 0; l < B; l++) {
+                    o[l] = max_pool ? acc[l] : acc[l]/area;
+                }
+            }
+        }
+    };
+
+    ThreadPool* pool = get_native_pool();
+    if (pool) {
+        pool->parallel_for(0, batch_size * blocks, pool_block);
+    } else {
+        for (int t = 0; t < batch_size * blocks; t++) {
+            pool_block(t);
+        }
+    }
+}
+
+void pool2d_forward_native(std::shared_ptr<Pool2dOp> op,
+                           NDArray<float>& input,
+                           NDArray<float>& output,
+                           std::vector<float>& workspace) {
+
+    int block = get_layout_block(op->layout);
+    if (block == 8) {
+        pool2d_nchwc<8>(*op, input, output);
+    } else if (block == 16) {
+        pool2d_nchwc<16>(*op, input, output);
+    } else {
+        pool2d_forward_ref<float>(op, input, output);
+    }
+}
+
+// Binds a native kernel to an op along with a workspace owned by the
+// kernel and reused across runs.
+template <typename OpType, typename TIn, typename TOut>
+KernelFactory native_kernel(void (*kernel)(std::shared_ptr<OpType>,
+                                           NDArray<TIn>&,
+                                           NDArray<TOut>&,
+                                           std::vector<float>&)) {
+    return [kernel](std::shared_ptr<Op> op, std::vector<NDArray_t*> ins,
+                    NDArray_t* out) -> OpKernel {
+        assert(ins.size() == 1);
+        auto op_cast = std::static_pointer_cast<OpType>(op);
+        NDArray_t* in = ins[0];
+        auto workspace = std::make_shared<std::vector<float>>();
+        return [kernel, op_cast, in, out, workspace]() {
+            kernel(op_cast, get_ndarray<TIn>(*in), get_ndarray<TOut>(*out),
+                   *workspace);
+        };
+    };
+}
+
+// Binds the quantized kernel of ops reading or writing UInt8 activations
+// and the float kernel of other ops.
+static KernelFactory quantized_or(KernelFactory quantized,
+                                  KernelFactory other) {
+    return [quantized, other](std::shared_ptr<Op> op,
+                              std::vector<NDArray_t*> ins,
+                              NDArray_t* out) -> OpKernel {
+        if (op->type == DataType::UInt8 || reads_quantized(*op)) {
+            return quantized(op, ins, out);
+        }
+        return other(op, ins, out);
+    };
+}
+
+// Reference kernel, for ops whose native kernels are only quantized.
+static OpKernel ref_kernel_of(std::shared_ptr<Op> op,
+                              std::vector<NDArray_t*> ins, NDArray_t* out) {
+    return KernelRegistry<KernelFactory>::get().lookup(*op, OpImpl::REF)(
+        op, ins, out);
+}
+
+REGISTER_KERNEL(KernelFactory, Conv2dOp, OpImpl::NATIVE,
+                quantized_or(native_kernel<Conv2dOp>(conv2d_int8_native),
+                             native_kernel<Conv2dOp>(conv2d_forward_native)));
+REGISTER_KERNEL(KernelFactory, Pool2dOp, OpImpl::NATIVE,
+                quantized_or(native_kernel<Pool2dOp>(pool2d_int8_native),
+                             native_kernel<Pool2dOp>(pool2d_forward_native)));
+REGISTER_KERNEL(KernelFactory, AffineOp, OpImpl::NATIVE,
+                quantized_or(native_kernel<AffineOp>(affine_int8_native),
+                             native_kernel<AffineOp>(affine_forward_native)));
+REGISTER_KERNEL(KernelFactory, ReLUOp, OpImpl::NATIVE,
+                quantized_or(native_kernel<ReLUOp>(relu_int8_native),
+                             ref_kernel_of));
+REGISTER_KERNEL(KernelFactory, FlattenOp, OpImpl::NATIVE,
+                quantized_or(native_kernel<FlattenOp>(flatten_int8_native),
+                             ref_kernel_of));
+REGISTER_KERNEL(ParamsHook, Conv2dOp, OpImpl::NATIVE,
+                prepare_conv2d_native);
+REGISTER_KERNEL(ParamsHook, AffineOp, OpImpl::NATIVE,
+                prepare_affine_native);
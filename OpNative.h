@@ -0,0 +1,90 @@
+#pragma once
+
+#include "NDArray.h"
+#include "Op.h"
+#include "ThreadPool.h"
+#include "KernelRegistry.h"
+
+// Optimized CPU kernels registered with OpImpl::NATIVE. Ops without a
+// native kernel fall back to the reference one. Kernels split their work
+// over the native pool, see get_native_pool.
+
+// Whether an algorithm can compute a conv. Winograd F(4x4, 3x3) needs
+// 3x3 filters with unit stride.
+bool conv_algorithm_applies(Conv2dOp& op, ConvAlgorithm algorithm);
+
+// Algorithm with the lowest estimated cost for the shape of the conv.
+ConvAlgorithm choose_conv_algorithm(Conv2dOp& op);
+
+// Run the conv with each algorithm that applies, on random params and
+// inputs of its shape, and return the fastest. Algorithms estimated to
+// cost several times the cheapest are not run.
+ConvAlgorithm time_conv_algorithms(std::shared_ptr<Conv2dOp> op);
+
+// Resolve the algorithm of a conv and transform its filters into
+// kernel_params for Winograd and FFT. Called when the params are set.
+// Algorithms that do not apply to the conv are replaced by im2col.
+// Convs computing in a blocked layout get their filters packed in blocks
+// of output channels instead.
+void prepare_conv2d_native(std::shared_ptr<Op> op);
+
+// Convs using Winograd or FFT multiply transformed tiles of the input.
+// Other convs are lowered to a matrix multiply of the weights with the
+// patches of each image, which are unrolled into workspace by im2col.
+// 1x1 convs with unit stride multiply the input directly. Convs in a
+// blocked layout are computed directly, a vector of channels at a time.
+void conv2d_forward_native(std::shared_ptr<Conv2dOp> op,
+                           NDArray<float>& input,
+                           NDArray<float>& output,
+                           std::vector<float>& workspace);
+
+// Pools in a blocked layout reduce a vector of channels at a time, other
+// pools use the reference kernel.
+void pool2d_forward_native(std::shared_ptr<Pool2dOp> op,
+                           NDArray<float>& input,
+                           NDArray<float>& output,
+                           std::vector<float>& workspace);
+
+void affine_forward_native(std::shared_ptr<AffineOp> op,
+                           NDArray<float>& input,
+                           NDArray<float>& output,
+                           std::vector<float>& workspace);
+
+// Quantized kernels, bound in place of the float ones to ops reading or
+// writing UInt8 activations, see Graph::plan_quantization. An activation
+// q stands for q times the quant_scale of the op producing it.
+
+// Quantize the weights of convs and affine ops reading quantized
+// activations to Int8, with a scale for each output channel, into
+// kernel_params. Called when the params are set.
+void prepare_affine_native(std::shared_ptr<Op> op);
+
+// Convs and affine ops multiply the quantized input with the quantized
+// weights, summing in 32 bits, and scale the sums back to float. Convs
+// unroll the patches of each image into rows of workspace.
+void conv2d_int8_native(std::shared_ptr<Conv2dOp> op,
+                        NDArray<uint8_t>& input,
+                        NDArray<float>& output,
+                        std::vector<float>& workspace);
+
+void affine_int8_native(std::shared_ptr<AffineOp> op,
+                        NDArray<uint8_t>& input,
+                        NDArray<float>& output,
+                        std::vector<float>& workspace);
+
+// ReLUs quantize their float input and pools requantize their input to
+// their own scale, rounding to nearest and saturating.
+void relu_int8_native(std::shared_ptr<ReLUOp> op,
+                      NDArray<float>& input,
+                      NDArray<uint8_t>& output,
+                      std::vector<float>& workspace);
+
+void pool2d_int8_native(std::shared_ptr<Pool2dOp> op,
+                        NDArray<uint8_t>& input,
+                        NDArray<uint8_t>& output,
+                        std::vector<float>& workspace);
+
+void flatten_int8_native(std::shared_ptr<FlattenOp> op,
+                         NDArray<uint8_t>& input,
+                         NDArray<uint8_t>& output,
+                         std::vector<float>& workspace);
@@ -1,4 +1,8 @@
+#include <limits>
+#include <cmath>
+#include <algorithm>
 #include "OpRef.h"
+#include "NDArrayExpr.h"
 
 template <typename T>
 void sum_forward_ref(std::shared_ptr<SumOp> op,
@@ -7,9 +11,14 @@ void sum_forward_ref(std::shared_ptr<SumOp> op,
     int num_ins = op->input_ops.size();
     assert((int)inputs.size() == num_ins);
 
-    // initialize output to zero
-    output.initialize(T(0));
-    for (int in = 0; in < num_ins; in++) {
+    // Sums of two inputs, the residuals of resnets, take a single pass.
+    if (num_ins == 2) {
+        output = inputs[0] + inputs[1];
+        return;
+    }
+    // Start from the first input rather than zero to save a pass.
+    output.copy(inputs[0]);
+    for (int in = 1; in < num_ins; in++) {
         output.add(inputs[in]);
     }
 }
@@ -19,6 +28,22 @@ void affine_forward_ref(std::shared_ptr<AffineOp> op,
                         NDArray<T>& input,
                         NDArray<T>& output) {
 
+    int batch_size = input.dim_sizes[0];
+    int num_inputs = op->num_inputs;
+    int num_units = op->num_units;
+
+    NDArray<T>& weights = get_ndarray<T>(op->params[0]);
+    NDArray<T>& bias = get_ndarray<T>(op->params[1]);
+
+    for (int b = 0; b < batch_size; b++) {
+        for (int u = 0; u < num_units; u++) {
+            T val = bias(u);
+            for (int i = 0; i < num_inputs; i++) {
+                val += input(b, i) * weights(u, i);
+            }
+            output(b, u) = val;
+        }
+    }
 }
 
 template <typename T>
@@ -26,7 +51,7 @@ void conv2d_forward_ref(std::shared_ptr<Conv2dOp> op,
                         NDArray<T>& input,
                         NDArray<T>& output) {
 
-    int batch_size = op->batch_size;
+    int batch_size = input.dim_sizes[0];
     int input_channels = op->input_channels;
     int input_height = op->input_height;
     int input_width = op->input_width;
@@ -82,7 +107,7 @@ void pool2d_forward_ref(std::shared_ptr<Pool2dOp> op,
                         NDArray<T>& output) {
 
     PoolType pool_type = op->pool_type;
-    int batch_size = op->batch_size;
+    int batch_size = input.dim_sizes[0];
     int input_channels = op->input_channels;
     int input_height = op->input_height;
     int input_width = op->input_width;
@@ -119,7 +144,9 @@ void pool2d_forward_ref(std::shared_ptr<Pool2dOp> op,
                     } else if (pool_type == PoolType::MAX) {
                         // TODO: CUDNN has other modes where the boundary values
                         // are not taken into account when doing the max.
-                        T max = input(b, ch, h * stride_h, w * stride_w);
+                        // The window can start past the input when the
+                        // output is rounded up.
+                        T max = std::numeric_limits<T>::lowest();
                         for(int k_h = 0; k_h < pool_height; k_h++) {
                             for(int k_w = 0; k_w < pool_width; k_w++) {
                                 int in_w = w * stride_w + k_w - pad_w;
@@ -144,37 +171,123 @@ template <typename T>
 void relu_forward_ref(std::shared_ptr<ReLUOp> op,
                       NDArray<T>& input,
                       NDArray<T>& output) {
+    T slope = op->slope;
+    // The output may be a slice of the output of a concat, in which the
+    // entries of the batch are further apart.
+    int batch_size = output.dim_sizes[0];
+    size_t entry_size = output.buf_size / batch_size;
+    for (int b = 0; b < batch_size; b++) {
+        T* in = input.host_alloc.get() + b * input.strides[0];
+        T* out = output.host_alloc.get() + b * output.strides[0];
+        elementwise_relu(in, out, slope, entry_size);
+    }
 }
 
 template <typename T>
 void softmax_forward_ref(std::shared_ptr<SoftMaxOp> op,
                          NDArray<T>& input,
                          NDArray<T>& output) {
+    int batch_size = input.dim_sizes[0];
+    int num_classes = op->num_classes;
+
+    for (int b = 0; b < batch_size; b++) {
+        T max_val = input(b, 0);
+        for (int c = 1; c < num_classes; c++) {
+            max_val = std::max(max_val, input(b, c));
+        }
+
+        T sum = 0;
+        for (int c = 0; c < num_classes; c++) {
+            output(b, c) = std::exp(input(b, c) - max_val);
+            sum += output(b, c);
+        }
+
+        for (int c = 0; c < num_classes; c++) {
+            output(b, c) = output(b, c)/sum;
+        }
+    }
 }
 
 template <typename T>
 void lrn_forward_ref(std::shared_ptr<LRNOp> op,
                      NDArray<T>& input,
                      NDArray<T>& output) {
+    int batch_size = input.dim_sizes[0];
+    int input_channels = op->input_channels;
+    int input_height = op->input_height;
+    int input_width = op->input_width;
+    int w_size = op->window_size;
+    T alpha = op->alpha;
+    T beta = op->beta;
+
+    for (int b = 0; b < batch_size; b++) {
+        for (int ch = 0; ch < input_channels; ch++) {
+            for (int h = 0; h < input_height; h++) {
+                for (int w = 0; w < input_width; w++) {
+                    // Channels outside the input are zero.
+                    T square_sum = 0;
+                    for (int k = 0; k < w_size; k++) {
+                        int in_ch = ch + k - w_size/2;
+                        if (in_ch >= 0 && in_ch < input_channels) {
+                            T val = input(b, in_ch, h, w);
+                            square_sum += val * val;
+                        }
+                    }
+                    T norm = std::pow(1 + (alpha/w_size) * square_sum, beta);
+                    output(b, ch, h, w) = input(b, ch, h, w)/norm;
+                }
+            }
+        }
+    }
 }
 
 template <typename T>
 void concat_forward_ref(std::shared_ptr<ConcatOp> op,
                         std::vector<NDArray<T>>& inputs,
                         NDArray<T>& output) {
+    int batch_size = output.dim_sizes[0];
+    int plane_size = op->input_height * op->input_width;
+
+    size_t offset = 0;
+    for (auto &in: inputs) {
+        size_t in_size = (size_t)in.dim_sizes[1] * plane_size;
+        // Inputs written in place into their slice of the output are
+        // skipped.
+        if (in.host_alloc.get() != output.host_alloc.get() + offset) {
+            for (int b = 0; b < batch_size; b++) {
+                T* in_ptr = in.host_alloc.get() + b * in.strides[0];
+                std::copy(in_ptr, in_ptr + in_size,
+                          output.host_alloc.get() + b * output.strides[0] +
+                          offset);
+            }
+        }
+        offset += in_size;
+    }
 }
 
 template <typename T>
 void flatten_forward_ref(std::shared_ptr<FlattenOp> op,
                          NDArray<T>& input,
                          NDArray<T>& output) {
+    // Flattening keeps the order of the elements.
+    assert(input.buf_size == output.buf_size);
+    std::copy(input.host_alloc.get(), input.host_alloc.get() + input.buf_size,
+              output.host_alloc.get());
 }
 
 template <typename T>
 void data_forward_ref(std::shared_ptr<DataOp> op,
                       NDArray<T>& input,
                       NDArray<T>& output) {
-    output.copy(input);
+    // Inputs may be passed in any layout.
+    reorder_layout(input, output);
+}
+
+template <typename T>
+void reorder_forward_ref(std::shared_ptr<ReorderOp> op,
+                         NDArray<T>& input,
+                         NDArray<T>& output) {
+    reorder_layout(input, output);
 }
 
 template
@@ -224,3 +337,64 @@ template
 void data_forward_ref<float>(std::shared_ptr<DataOp> op,
                       NDArray<float>& input,
                       NDArray<float>& output);
+template
+void reorder_forward_ref<float>(std::shared_ptr<ReorderOp> op,
+                         NDArray<float>& input,
+                         NDArray<float>& output);
+
+// Factories binding the float reference kernels to an op. Ops with a
+// single input pass it as is, the others get the list of inputs.
+template <typename OpType>
+KernelFactory ref_kernel(void (*kernel)(std::shared_ptr<OpType>,
+                                        NDArray<float>&,
+                                        NDArray<float>&)) {
+    return [kernel](std::shared_ptr<Op> op, std::vector<NDArray_t*> ins,
+                    NDArray_t* out) -> OpKernel {
+        assert(ins.size() == 1);
+        auto op_cast = std::static_pointer_cast<OpType>(op);
+        NDArray_t* in = ins[0];
+        return [kernel, op_cast, in, out]() {
+            kernel(op_cast, get_ndarray<float>(*in), get_ndarray<float>(*out));
+        };
+    };
+}
+
+template <typename OpType>
+KernelFactory ref_kernel(void (*kernel)(std::shared_ptr<OpType>,
+                                        std::vector<NDArray<float>>&,
+                                        NDArray<float>&)) {
+    return [kernel](std::shared_ptr<Op> op, std::vector<NDArray_t*> ins,
+                    NDArray_t* out) -> OpKernel {
+        auto op_cast = std::static_pointer_cast<OpType>(op);
+        return [kernel, op_cast, ins, out]() {
+            std::vector<NDArray<float>> op_ins;
+            for (auto &in: ins) {
+                op_ins.push_back(get_ndarray<float>(*in));
+            }
+            kernel(op_cast, op_ins, get_ndarray<float>(*out));
+        };
+    };
+}
+
+REGISTER_KERNEL(KernelFactory, SumOp, OpImpl::REF,
+                ref_kernel<SumOp>(sum_forward_ref<float>));
+REGISTER_KERNEL(KernelFactory, AffineOp, OpImpl::REF,
+                ref_kernel<AffineOp>(affine_forward_ref<float>));
+REGISTER_KERNEL(KernelFactory, Conv2dOp, OpImpl::REF,
+                ref_kernel<Conv2dOp>(conv2d_forward_ref<float>));
+REGISTER_KERNEL(KernelFactory, Pool2dOp, OpImpl::REF,
+                ref_kernel<Pool2dOp>(pool2d_forward_ref<float>));
+REGISTER_KERNEL(KernelFactory, ReLUOp, OpImpl::REF,
+                ref_kernel<ReLUOp>(relu_forward_ref<float>));
+REGISTER_KERNEL(KernelFactory, SoftMaxOp, OpImpl::REF,
+                ref_kernel<SoftMaxOp>(softmax_forward_ref<float>));
+REGISTER_KERNEL(KernelFactory, LRNOp, OpImpl::REF,
+                ref_kernel<LRNOp>(lrn_forward_ref<float>));
+REGISTER_KERNEL(KernelFactory, ConcatOp, OpImpl::REF,
+                ref_kernel<ConcatOp>(concat_forward_ref<float>));
+REGISTER_KERNEL(KernelFactory, FlattenOp, OpImpl::REF,
+                ref_kernel<FlattenOp>(flatten_forward_ref<float>));
+REGISTER_KERNEL(KernelFactory, DataOp, OpImpl::REF,
+                ref_kernel<DataOp>(data_forward_ref<float>));
+REGISTER_KERNEL(KernelFactory, ReorderOp, OpImpl::REF,
+                ref_kernel<ReorderOp>(reorder_forward_ref<float>));
@@ -1,5 +1,6 @@
 #include "NDArray.h"
 #include "Op.h"
+#include "KernelRegistry.h"
 
 template <typename T>
 void sum_forward_ref(std::shared_ptr<SumOp> op,
@@ -48,3 +49,7 @@ template <typename T>
 void data_forward_ref(std::shared_ptr<DataOp> op,
                       NDArray<T>& input,
                       NDArray<T>& output);
+template <typename T>
+void reorder_forward_ref(std::shared_ptr<ReorderOp> op,
+                         NDArray<T>& input,
+                         NDArray<T>& output);
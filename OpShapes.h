@@ -1,3 +1,6 @@
+#pragma once
+
+#include <tuple>
 #include <iostream>
 #include <assert.h>
 
@@ -23,6 +26,16 @@ struct ConvLayerShape {
         filter_height(_filter_height),
         stride(_stride) {}
 
+    // Orders shapes by their fields so that they can key a map.
+    bool operator<(const ConvLayerShape& s) const {
+        return std::tie(batch_size, input_width, input_height, input_channels,
+                        output_channels, filter_width, filter_height,
+                        stride) <
+               std::tie(s.batch_size, s.input_width, s.input_height,
+                        s.input_channels, s.output_channels, s.filter_width,
+                        s.filter_height, s.stride);
+    }
+
     friend std::ostream& operator<<(std::ostream& os, const ConvLayerShape& s) {
         os << "batch_size:" << s.batch_size << ",";
         os << "input_width:" << s.input_width << ",";
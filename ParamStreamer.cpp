@@ -0,0 +1,75 @@
+#include <unistd.h>
+#include <sys/mman.h>
+#include "ParamStreamer.h"
+#include "ModelIO.h"
+
+struct StorageVisitor :
+    public boost::static_visitor<std::pair<char*, size_t>> {
+    template <class T>
+    std::pair<char*, size_t> operator()(NDArray<T>& arr) const {
+        return std::make_pair(reinterpret_cast<char*>(arr.host_alloc.get()),
+                              arr.buf_size * sizeof(T));
+    }
+};
+
+ParamStreamer::ParamStreamer(int num_groups) :
+    ranges(num_groups), bytes(num_groups, 0), prefetches(num_groups),
+    prefetch_pool(1) {}
+
+void ParamStreamer::add_param(int group_id, NDArray_t& param) {
+    auto storage = boost::apply_visitor(StorageVisitor(), param);
+    if (storage.second == 0 || !is_mapped_param(storage.first)) {
+        return;
+    }
+    // Pages shared with a neighbouring param are read back from the file
+    // as well when they are dropped.
+    size_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t begin = (uintptr_t)storage.first / page * page;
+    uintptr_t end = ((uintptr_t)storage.first + storage.second + page - 1) /
+                    page * page;
+    ranges[group_id].push_back(std::make_pair((char*)begin, end - begin));
+    bytes[group_id] += storage.second;
+}
+
+void ParamStreamer::page_in(int group_id) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    for (auto &r: ranges[group_id]) {
+        madvise(r.first, r.second, MADV_WILLNEED);
+        // Touch every page so that the group does not take the faults.
+        volatile char sink = 0;
+        for (size_t off = 0; off < r.second; off += page) {
+            sink += r.first[off];
+        }
+        (void)sink;
+    }
+}
+
+void ParamStreamer::prefetch(int group_id) {
+    if (ranges[group_id].empty() || prefetches[group_id].valid()) {
+        return;
+    }
+    auto done = std::make_shared<std::promise<void>>();
+    prefetches[group_id] = done->get_future();
+    prefetch_pool.submit([this, group_id, done]() {
+                             page_in(group_id);
+                             done->set_value();
+                         });
+}
+
+void ParamStreamer::acquire(int group_id) {
+    if (prefetches[group_id].valid()) {
+        prefetches[group_id].get();
+    } else {
+        page_in(group_id);
+    }
+}
+
+void ParamStreamer::release(int group_id) {
+    for (auto &r: ranges[group_id]) {
+        madvise(r.first, r.second, MADV_DONTNEED);
+    }
+}
+
+size_t ParamStreamer::streamed_bytes(int group_id) {
+    return bytes[group_id];
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <future>
+#include <vector>
+#include "NDArray.h"
+#include "ThreadPool.h"
+
+// Pages the params of each group in before the group runs and advises
+// them away after, so that only the params of the running group and the
+// one after it are resident. Only params mapped from a container are
+// streamed, the kernel reads them back from the file when needed. Other
+// params, such as folded or transformed filters, stay resident.
+class ParamStreamer {
+    public:
+    ParamStreamer(int num_groups);
+
+    // Add an array to the params of a group. Arrays which are not mapped
+    // from a container are ignored.
+    void add_param(int group_id, NDArray_t& param);
+
+    // Start paging in the params of the group on a background thread.
+    void prefetch(int group_id);
+
+    // Wait until the params of the group are paged in. Params which were
+    // not prefetched are paged in on the calling thread.
+    void acquire(int group_id);
+
+    // Drop the pages of the params of the group from the process.
+    void release(int group_id);
+
+    // Bytes of the params of the group which are streamed.
+    size_t streamed_bytes(int group_id);
+
+    private:
+    void page_in(int group_id);
+
+    // Page aligned ranges covering the params of each group.
+    std::vector<std::vector<std::pair<char*, size_t>>> ranges;
+    std::vector<size_t> bytes;
+    std::vector<std::future<void>> prefetches;
+    ThreadPool prefetch_pool;
+};
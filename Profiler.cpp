@@ -0,0 +1,106 @@
+#include <map>
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include "Profiler.h"
+
+int get_thread_id() {
+    static std::atomic<int> next_id(0);
+    thread_local int id = next_id++;
+    return id;
+}
+
+void Profiler::record(const std::string& name, const std::string& category,
+                      int64_t start_us, size_t bytes, double flops) {
+    ProfileEvent e;
+    e.name = name;
+    e.category = category;
+    e.thread = get_thread_id();
+    e.start_us = start_us;
+    e.dur_us = now_us() - start_us;
+    e.bytes = bytes;
+    e.flops = flops;
+
+    std::lock_guard<std::mutex> guard(lock);
+    events.push_back(e);
+}
+
+void Profiler::clear() {
+    std::lock_guard<std::mutex> guard(lock);
+    events.clear();
+}
+
+void Profiler::write_chrome_trace(const std::string& path) {
+    std::lock_guard<std::mutex> guard(lock);
+    std::ofstream out(path);
+    if (!out.is_open()) {
+        std::cerr << "Could not open " << path << std::endl;
+        return;
+    }
+
+    out << "{\"traceEvents\": [" << std::endl;
+    for (size_t i = 0; i < events.size(); i++) {
+        auto& e = events[i];
+        out << "  {\"name\": \"" << e.name << "\", \"cat\": \"" << e.category
+            << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << e.thread
+            << ", \"ts\": " << e.start_us << ", \"dur\": " << e.dur_us
+            << ", \"args\": {\"bytes\": " << e.bytes
+            << ", \"flops\": " << e.flops << "}}"
+            << (i + 1 < events.size() ? "," : "") << std::endl;
+    }
+    out << "]}" << std::endl;
+}
+
+void Profiler::print_summary(std::ostream& out) {
+    struct Summary {
+        std::string name;
+        std::string category;
+        int calls;
+        int64_t total_us;
+        size_t bytes;
+        double flops;
+    };
+
+    std::vector<Summary> rows;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        std::map<std::string, size_t> row_ids;
+        for (auto &e: events) {
+            std::string key = e.category + ":" + e.name;
+            if (row_ids.find(key) == row_ids.end()) {
+                row_ids[key] = rows.size();
+                rows.push_back({e.name, e.category, 0, 0, 0, 0});
+            }
+            Summary& r = rows[row_ids[key]];
+            r.calls++;
+            r.total_us += e.dur_us;
+            r.bytes += e.bytes;
+            r.flops += e.flops;
+        }
+    }
+
+    std::sort(rows.begin(), rows.end(), [](const Summary& a, const Summary& b) {
+                  return a.total_us > b.total_us;
+              });
+
+    out << std::left << std::setw(32) << "name" << std::setw(8) << "type"
+        << std::right << std::setw(8) << "calls" << std::setw(12) << "total ms"
+        << std::setw(12) << "mean ms" << std::setw(10) << "GFLOP/s"
+        << std::setw(10) << "GB/s" << std::endl;
+
+    for (auto &r: rows) {
+        double secs = r.total_us * 1e-6;
+        double gflops = secs > 0 ? r.flops/secs * 1e-9 : 0;
+        double gbytes = secs > 0 ? r.bytes/secs * 1e-9 : 0;
+        out << std::left << std::setw(32) << r.name << std::setw(8)
+            << r.category << std::right << std::setw(8) << r.calls
+            << std::fixed << std::setprecision(3)
+            << std::setw(12) << r.total_us * 1e-3
+            << std::setw(12) << r.total_us * 1e-3/r.calls
+            << std::setprecision(2)
+            << std::setw(10) << gflops << std::setw(10) << gbytes
+            << std::endl;
+    }
+    out.unsetf(std::ios_base::floatfield);
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+
+// Timing of a single execution of an op or a group.
+struct ProfileEvent {
+    std::string name;
+    // Either "op" or "group".
+    std::string category;
+    int thread;
+    int64_t start_us;
+    int64_t dur_us;
+    size_t bytes;
+    double flops;
+};
+
+// Collects events from concurrently running ops and groups. The graph
+// only calls into the profiler when one is attached, so running without
+// profiling costs a single pointer check per op.
+class Profiler {
+    public:
+    std::vector<ProfileEvent> events;
+
+    Profiler() : origin(std::chrono::steady_clock::now()) {}
+
+    // Microseconds since the profiler was created.
+    int64_t now_us() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - origin).count();
+    }
+
+    void record(const std::string& name, const std::string& category,
+                int64_t start_us, size_t bytes, double flops);
+
+    void clear();
+
+    // Trace in the Chrome trace event format, which can be opened in
+    // chrome://tracing or Perfetto.
+    void write_chrome_trace(const std::string& path);
+
+    // Table of the total time, calls, throughput and bandwidth of every
+    // op and group, sorted by total time.
+    void print_summary(std::ostream& out = std::cout);
+
+    private:
+    std::mutex lock;
+    std::chrono::steady_clock::time_point origin;
+};
+
+// Small integer identifying the calling thread.
+int get_thread_id();
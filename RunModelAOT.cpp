@@ -0,0 +1,62 @@
+#include <chrono>
+#include <iostream>
+#include "AotRuntime.h"
+#include "ModelIO.h"
+#include "Op.h"
+
+// Generated by aot_compile into $(AOT_DIR)/dnncc_aot.cpp.
+std::map<std::string, AotFunction> dnncc_aot_functions();
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <aot_dir> [params]" << std::endl;
+        return 1;
+    }
+
+    std::string aot_dir = argv[1];
+    AotModel model(aot_dir + "/dnncc.manifest", dnncc_aot_functions());
+
+    if (argc > 2) {
+        Params params;
+        load_model_from_disk(argv[2], params);
+        model.set_params(params);
+    } else {
+        // Zero params for benchmarking without a model.
+        Params params;
+        for (auto &g: model.groups) {
+            for (auto &arg: g.args) {
+                if (arg.kind == AOT_PARAM) {
+                    auto& op_params = params[arg.op_name];
+                    if ((int)op_params.size() <= arg.param_index) {
+                        op_params.resize(arg.param_index + 1);
+                    }
+                    op_params[arg.param_index] =
+                        get_ndarray_t(arg.dim_sizes, arg.type);
+                }
+            }
+        }
+        model.set_params(params);
+    }
+
+    // Inputs are the arguments which are not produced by any group.
+    std::map<std::string, NDArray_t> ins;
+    for (auto &g: model.groups) {
+        for (auto &arg: g.args) {
+            if (arg.kind == AOT_INPUT &&
+                model.op_outs.find(arg.op_name) == model.op_outs.end()) {
+                NDArray<float> d(arg.dim_sizes);
+                d.initialize(0.0f);
+                ins[arg.op_name] = d;
+            }
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::map<std::string, NDArray_t> outs = model.run(ins);
+    auto end = std::chrono::steady_clock::now();
+    std::cout << "Runtime: " <<
+        std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
+        << "ms" << std::endl;
+
+    return 0;
+}
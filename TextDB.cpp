@@ -0,0 +1,36 @@
+#include <cassert>
+#include <cstdio>
+#include <iostream>
+#include <unistd.h>
+#include "TextDB.h"
+
+bool open_text_db(const std::string& path, const std::string& header,
+                  std::ifstream& ifs) {
+    ifs.open(path);
+    if (!ifs.is_open()) {
+        return false;
+    }
+
+    std::string line;
+    std::getline(ifs, line);
+    if (line != header) {
+        std::cerr << "Unknown header in " << path << ": " << line
+                  << std::endl;
+        assert(0);
+    }
+    return true;
+}
+
+void save_text_db(const std::string& path, const std::string& header,
+                  const std::function<void(std::ostream&)>& write_entries) {
+    std::string tmp = path + "_" + std::to_string(getpid());
+    std::ofstream ofs(tmp, std::ofstream::out | std::ofstream::trunc);
+    ofs << header << std::endl;
+    write_entries(ofs);
+    ofs.close();
+
+    if (ofs.fail() || std::rename(tmp.c_str(), path.c_str()) != 0) {
+        std::cerr << "Could not write " << path << std::endl;
+        std::remove(tmp.c_str());
+    }
+}
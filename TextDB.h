@@ -0,0 +1,19 @@
+#pragma once
+
+#include <fstream>
+#include <functional>
+#include <string>
+
+// Tables kept in text files which start with a header line naming the
+// format and its version, such as the conv tunings and the schedules.
+
+// Open the file at path and check its header. Returns false when there is
+// no file, otherwise the entries follow in ifs.
+bool open_text_db(const std::string& path, const std::string& header,
+                  std::ifstream& ifs);
+
+// Write the header and the entries under a name private to this process
+// and move the file into place, so that concurrent builds never read a
+// partial table.
+void save_text_db(const std::string& path, const std::string& header,
+                  const std::function<void(std::ostream&)>& write_entries);
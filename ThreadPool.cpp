@@ -0,0 +1,226 @@
+#include <cassert>
+#include <algorithm>
+#include "ThreadPool.h"
+
+// Pool and queue of the worker running on the current thread, used to
+// keep tasks spawned by a worker local to it.
+static thread_local ThreadPool* curr_pool = nullptr;
+static thread_local int curr_worker = -1;
+
+ThreadPool::ThreadPool(int num_threads) : pending(0), next_queue(0),
+                                          done(false) {
+    assert(num_threads > 0);
+    for (int i = 0; i < num_threads; i++) {
+        queues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue()));
+    }
+    for (int i = 0; i < num_threads; i++) {
+        workers.push_back(std::thread(&ThreadPool::worker_loop, this, i));
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> guard(sleep_lock);
+        done = true;
+    }
+    wake.notify_all();
+    for (auto &w: workers) {
+        w.join();
+    }
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    int q;
+    if (curr_pool == this) {
+        q = curr_worker;
+    } else {
+        q = next_queue++ % queues.size();
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(queues[q]->lock);
+        queues[q]->tasks.push_back(std::move(task));
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(sleep_lock);
+        pending++;
+    }
+    wake.notify_one();
+}
+
+void ThreadPool::parallel_for(int begin, int end,
+                              const std::function<void(int)>& fn) {
+    int num = end - begin;
+    if (num <= 0) {
+        return;
+    }
+
+    struct ParallelFor {
+        std::atomic<int> next;
+        std::atomic<int> finished;
+        std::mutex lock;
+        std::condition_variable all_done;
+    };
+
+    auto state = std::make_shared<ParallelFor>();
+    state->next = begin;
+    state->finished = 0;
+
+    // Helpers which start after all the iterations are taken return
+    // without touching fn, which may be gone by then.
+    auto work = [state, end, num, &fn]() {
+        int i;
+        while ((i = state->next++) < end) {
+            fn(i);
+            if (++state->finished == num) {
+                std::lock_guard<std::mutex> guard(state->lock);
+                state->all_done.notify_all();
+            }
+        }
+    };
+
+    int num_helpers = std::min<int>(workers.size(), num - 1);
+    for (int h = 0; h < num_helpers; h++) {
+        submit(work);
+    }
+    work();
+
+    std::unique_lock<std::mutex> guard(state->lock);
+    state->all_done.wait(guard, [&state, num]() {
+                             return state->finished == num;
+                         });
+}
+
+bool ThreadPool::pop_or_steal(int worker_id, std::function<void()>& task) {
+    // Most recently queued task of the worker first, it is the most
+    // likely to have its inputs in cache.
+    {
+        WorkQueue& q = *queues[worker_id];
+        std::lock_guard<std::mutex> guard(q.lock);
+        if (!q.tasks.empty()) {
+            task = std::move(q.tasks.back());
+            q.tasks.pop_back();
+            return true;
+        }
+    }
+
+    for (size_t i = 1; i < queues.size(); i++) {
+        WorkQueue& q = *queues[(worker_id + i) % queues.size()];
+        std::lock_guard<std::mutex> guard(q.lock);
+        if (!q.tasks.empty()) {
+            task = std::move(q.tasks.front());
+            q.tasks.pop_front();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void ThreadPool::worker_loop(int worker_id) {
+    curr_pool = this;
+    curr_worker = worker_id;
+
+    while (true) {
+        std::function<void()> task;
+        if (pop_or_steal(worker_id, task)) {
+            pending--;
+            task();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(sleep_lock);
+        wake.wait(guard, [this]() { return pending > 0 || done; });
+        if (done && pending == 0) {
+            return;
+        }
+    }
+}
+
+int TaskGraph::add_task(std::function<void()> fn) {
+    fns.push_back(fn);
+    succs.push_back(std::vector<int>());
+    num_preds.push_back(0);
+    return fns.size() - 1;
+}
+
+void TaskGraph::add_dependency(int pred, int succ) {
+    assert(pred != succ);
+    assert(pred < (int)fns.size() && succ < (int)fns.size());
+    succs[pred].push_back(succ);
+    num_preds[succ] += 1;
+}
+
+void TaskGraph::run(ThreadPool& pool) {
+    int num = fns.size();
+    if (num == 0) {
+        return;
+    }
+
+    std::unique_ptr<std::atomic<int>[]> counts(new std::atomic<int>[num]);
+    for (int t = 0; t < num; t++) {
+        counts[t] = num_preds[t];
+    }
+
+    int remaining = num;
+    std::mutex done_lock;
+    std::condition_variable finished;
+
+    std::function<void(int)> launch = [&](int t) {
+        pool.submit([&, t]() {
+            fns[t]();
+            for (auto &s: succs[t]) {
+                if (--counts[s] == 0) {
+                    launch(s);
+                }
+            }
+            // The count is only touched with the lock held so that the
+            // waiting thread cannot return while this task still uses
+            // the lock.
+            std::lock_guard<std::mutex> guard(done_lock);
+            if (--remaining == 0) {
+                finished.notify_all();
+            }
+        });
+    };
+
+    int num_roots = 0;
+    for (int t = 0; t < num; t++) {
+        if (num_preds[t] == 0) {
+            launch(t);
+            num_roots++;
+        }
+    }
+    // A graph without roots has a cycle and would never finish.
+    assert(num_roots > 0);
+
+    std::unique_lock<std::mutex> guard(done_lock);
+    finished.wait(guard, [&]() { return remaining == 0; });
+}
+
+static std::mutex native_pool_lock;
+static std::shared_ptr<ThreadPool> native_pool;
+static bool native_pool_init = false;
+
+void set_native_num_threads(int num_threads) {
+    std::lock_guard<std::mutex> guard(native_pool_lock);
+    // The calling thread does its share of the work.
+    native_pool.reset();
+    if (num_threads > 1) {
+        native_pool = std::make_shared<ThreadPool>(num_threads - 1);
+    }
+    native_pool_init = true;
+}
+
+ThreadPool* get_native_pool() {
+    std::lock_guard<std::mutex> guard(native_pool_lock);
+    if (!native_pool_init) {
+        int num_threads = std::thread::hardware_concurrency();
+        if (num_threads > 1) {
+            native_pool = std::make_shared<ThreadPool>(num_threads - 1);
+        }
+        native_pool_init = true;
+    }
+    return native_pool.get();
+}
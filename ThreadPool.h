@@ -0,0 +1,77 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <condition_variable>
+
+// Pool of worker threads with a task queue per worker. Workers take
+// tasks from the back of their own queue and steal from the front of
+// the other queues when they run out of work.
+class ThreadPool {
+    public:
+    ThreadPool(int num_threads);
+    ~ThreadPool();
+
+    int num_threads() { return workers.size(); }
+
+    // Queue a task for execution. Tasks queued from a worker go to the
+    // queue of that worker, others are distributed round robin.
+    void submit(std::function<void()> task);
+
+    // Run fn(i) for every i in [begin, end) and wait for all of them.
+    // The calling thread takes part in the work, so it is safe to call
+    // from a task running on any pool.
+    void parallel_for(int begin, int end, const std::function<void(int)>& fn);
+
+    private:
+    struct WorkQueue {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+
+    std::mutex sleep_lock;
+    std::condition_variable wake;
+    std::atomic<int> pending;
+    std::atomic<unsigned int> next_queue;
+    bool done;
+
+    bool pop_or_steal(int worker_id, std::function<void()>& task);
+    void worker_loop(int worker_id);
+};
+
+// Threads used within each native kernel and elementwise operation,
+// including the calling thread. Defaults to the number of hardware
+// threads.
+void set_native_num_threads(int num_threads);
+
+// Pool shared by the native kernels and the elementwise operations on
+// arrays, or null when running single threaded.
+ThreadPool* get_native_pool();
+
+// Dependency counting scheduler for a DAG of tasks. Each task is
+// launched on the pool as soon as all of its predecessors finish.
+class TaskGraph {
+    public:
+    int add_task(std::function<void()> fn);
+
+    // The task succ cannot start until the task pred has finished.
+    void add_dependency(int pred, int succ);
+
+    int num_tasks() { return fns.size(); }
+
+    // Run all the tasks and wait for them to finish.
+    void run(ThreadPool& pool);
+
+    private:
+    std::vector<std::function<void()>> fns;
+    std::vector<std::vector<int>> succs;
+    std::vector<int> num_preds;
+};
@@ -0,0 +1,198 @@
+#include <cstdlib>
+#include <chrono>
+#include <limits>
+#include "networks/Vgg.h"
+#include "networks/Googlenet.h"
+#include "networks/Resnet.h"
+#include "Graph.h"
+#include "Utils.h"
+
+// Searches the schedules of the Halide convs of a network for each conv
+// shape and adds the fastest to a schedule database. Builds of graphs
+// with Graph::halide_schedule_path pointing at the database use them.
+//
+// Starting from the default schedule the search moves to the fastest
+// schedule differing in one parameter until none is faster.
+
+// Values tried for each parameter, the tiles are clamped to the output.
+static const std::vector<int> tile_x_values = {8, 16, 32, 64, 128};
+static const std::vector<int> tile_y_values = {1, 2, 4, 8, 16, 32};
+static const std::vector<int> channel_block_values = {1, 2, 4, 8, 16, 32, 64};
+static const std::vector<int> vector_width_values = {4, 8, 16};
+static const std::vector<int> unroll_values = {1, 2, 4, 8};
+
+// Values next to the current one in the sorted values up to the limit.
+static std::vector<int> adjacent(std::vector<int> values, int curr,
+                                 int limit) {
+    values.push_back(limit);
+    values.push_back(curr);
+    std::sort(values.begin(), values.end());
+    values.erase(std::unique(values.begin(), values.end()), values.end());
+    values.erase(std::remove_if(values.begin(), values.end(),
+                                [&](int v) { return v > limit; }),
+                 values.end());
+
+    std::vector<int> adj;
+    auto it = std::find(values.begin(), values.end(), curr);
+    if (it != values.end() && it != values.begin()) {
+        adj.push_back(*(it - 1));
+    }
+    if (it != values.end() && it + 1 != values.end()) {
+        adj.push_back(*(it + 1));
+    }
+    return adj;
+}
+
+static std::vector<ConvSchedule> neighbours(const ConvSchedule& s,
+                                            Conv2dOp& op) {
+    std::vector<ConvSchedule> n;
+    for (int v: adjacent(tile_x_values, s.tile_x, op.output_width)) {
+        n.push_back(s);
+        n.back().tile_x = v;
+    }
+    for (int v: adjacent(tile_y_values, s.tile_y, op.output_height)) {
+        n.push_back(s);
+        n.back().tile_y = v;
+    }
+    for (int v: adjacent(channel_block_values, s.channel_block,
+                         op.output_channels)) {
+        n.push_back(s);
+        n.back().channel_block = v;
+    }
+    for (int v: adjacent(vector_width_values, s.vector_width, 16)) {
+        n.push_back(s);
+        n.back().vector_width = v;
+    }
+    for (int v: adjacent(unroll_values, s.unroll, 8)) {
+        n.push_back(s);
+        n.back().unroll = v;
+    }
+    n.push_back(s);
+    n.back().rows_outside_taps = !s.rows_outside_taps;
+    n.push_back(s);
+    n.back().input_at_tile = !s.input_at_tile;
+
+    // Unrolled channels have to divide the block.
+    n.erase(std::remove_if(n.begin(), n.end(), [](const ConvSchedule& c) {
+                               return c.channel_block % c.unroll != 0;
+                           }),
+            n.end());
+    return n;
+}
+
+// Seconds taken by a graph computing a conv of the shape with a schedule,
+// the best of a few runs.
+static double time_schedule(Conv2dOp& op, const ConvSchedule& s) {
+    GaussianGenerator<float> rgen(0.0f, 0.1f);
+    std::vector<int> data_sizes = {op.batch_size, op.input_channels,
+                                   op.input_height, op.input_width};
+    NDArray<float> d(data_sizes);
+    d.initialize(rgen);
+    std::map<std::string, NDArray_t> ins;
+    ins["data"] = d;
+
+    Graph g;
+    int group_id = g.add_group();
+    auto data = std::make_shared<DataOp>(data_sizes);
+    auto conv = std::make_shared<Conv2dOp>(op.output_channels,
+                                           op.filter_height, op.filter_width,
+                                           op.stride_h, op.stride_w, data,
+                                           op.bias);
+    g.add_op("data", data, group_id);
+    g.add_op("conv", conv, group_id);
+    g.group_impl[group_id] = std::make_tuple(OpImpl::HALIDE, TargetArch::CPU);
+    g.halide_schedules.convs[get_conv_layer_shape(op)] = s;
+    g.build_forward({"conv"});
+
+    Params params;
+    for (auto &p: conv->params) {
+        get_ndarray<float>(p).initialize(rgen);
+        params["conv"].push_back(p);
+    }
+    g.set_params(params);
+
+    // The first run allocates the outputs and warms up the caches.
+    g.run(ins);
+    double best = std::numeric_limits<double>::infinity();
+    for (int r = 0; r < 3; r++) {
+        auto start = std::chrono::steady_clock::now();
+        g.run(ins);
+        auto end = std::chrono::steady_clock::now();
+        best = std::min(best,
+                        std::chrono::duration<double>(end - start).count());
+    }
+    return best;
+}
+
+static ConvSchedule tune_conv(Conv2dOp& op) {
+    ConvSchedule best = default_conv_schedule(op);
+    double best_time = time_schedule(op, best);
+    std::cout << "  default: " << best_time * 1000 << " ms" << std::endl;
+
+    bool improved = true;
+    while (improved) {
+        improved = false;
+        ConvSchedule curr = best;
+        for (auto &s: neighbours(curr, op)) {
+            double time = time_schedule(op, s);
+            if (time < best_time) {
+                best = s;
+                best_time = time;
+                improved = true;
+            }
+        }
+    }
+
+    std::cout << "  tuned: " << best_time * 1000 << " ms, tile "
+              << best.tile_x << "x" << best.tile_y << ", channel block "
+              << best.channel_block << ", vector width "
+              << best.vector_width << ", unroll " << best.unroll
+              << (best.rows_outside_taps ? ", rows outside taps" : "")
+              << (best.input_at_tile ? ", input at tile" : "") << std::endl;
+    return best;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 4) {
+        std::cerr << "Usage: " << argv[0]
+                  << " <network> <batch_size> <schedule_db>" << std::endl;
+        return 1;
+    }
+
+    std::string network = argv[1];
+    int batch_size = std::atoi(argv[2]);
+    std::string db_path = argv[3];
+
+    Graph g;
+    if (network == "vgg16") {
+        Vgg16(g, batch_size, 3, 224, 224);
+    } else if (network == "googlenet") {
+        Googlenet(g, batch_size, 3, 224, 224);
+    } else if (network == "resnet50") {
+        Resnet50(g, batch_size, 3, 224, 224);
+    } else {
+        std::cerr << "Unknown network " << network << std::endl;
+        return 1;
+    }
+
+    HalideScheduleDB db;
+    db.load(db_path);
+
+    for (auto &op: g.ops) {
+        auto conv = std::dynamic_pointer_cast<Conv2dOp>(op.second);
+        if (!conv || conv->stride_h != conv->stride_w) {
+            continue;
+        }
+        ConvLayerShape shape = get_conv_layer_shape(*conv);
+        if (db.convs.find(shape) != db.convs.end()) {
+            continue;
+        }
+
+        std::cout << op.first << " " << shape << std::endl;
+        db.convs[shape] = tune_conv(*conv);
+        // Save after every shape so that an interrupted search keeps the
+        // schedules found so far.
+        db.save(db_path);
+    }
+    return 0;
+}
@@ -0,0 +1,179 @@
+#include <algorithm>
+#include "Winograd.h"
+#include "Gemm.h"
+
+// Output tiles are 4x4 and are computed from 6x6 tiles of the input.
+static const int OUT_TILE = 4;
+static const int IN_TILE = 6;
+
+// 1-D transforms applied along the columns and then the rows of a tile.
+// The matrices are those of Lavin and Gray, Fast Algorithms for
+// Convolutional Neural Networks.
+
+// u = G g
+static inline void filter_1d(const float* g, int gs, float* u, int us) {
+    float g0 = g[0], g1 = g[gs], g2 = g[2 * gs];
+    u[0] = g0 * (1.0f/4);
+    u[us] = -(g0 + g1 + g2) * (1.0f/6);
+    u[2 * us] = -(g0 - g1 + g2) * (1.0f/6);
+    u[3 * us] = g0 * (1.0f/24) + g1 * (1.0f/12) + g2 * (1.0f/6);
+    u[4 * us] = g0 * (1.0f/24) - g1 * (1.0f/12) + g2 * (1.0f/6);
+    u[5 * us] = g2;
+}
+
+// v = B^T d
+static inline void input_1d(const float* d, int ds, float* v, int vs) {
+    float d0 = d[0], d1 = d[ds], d2 = d[2 * ds];
+    float d3 = d[3 * ds], d4 = d[4 * ds], d5 = d[5 * ds];
+    v[0] = 4 * d0 - 5 * d2 + d4;
+    v[vs] = -4 * d1 - 4 * d2 + d3 + d4;
+    v[2 * vs] = 4 * d1 - 4 * d2 - d3 + d4;
+    v[3 * vs] = -2 * d1 - d2 + 2 * d3 + d4;
+    v[4 * vs] = 2 * d1 - d2 - 2 * d3 + d4;
+    v[5 * vs] = 4 * d1 - 5 * d3 + d5;
+}
+
+// y = A^T m
+static inline void output_1d(const float* m, int ms, float* y, int ys) {
+    float m0 = m[0], m1 = m[ms], m2 = m[2 * ms];
+    float m3 = m[3 * ms], m4 = m[4 * ms], m5 = m[5 * ms];
+    y[0] = m0 + m1 + m2 + m3 + m4;
+    y[ys] = m1 - m2 + 2 * m3 - 2 * m4;
+    y[2 * ys] = m1 + m2 + 4 * m3 + 4 * m4;
+    y[3 * ys] = m1 - m2 + 8 * m3 - 8 * m4 + m5;
+}
+
+static void parallel_for(ThreadPool* pool, int num,
+                         const std::function<void(int)>& fn) {
+    if (pool && num > 1) {
+        pool->parallel_for(0, num, fn);
+    } else {
+        for (int i = 0; i < num; i++) {
+            fn(i);
+        }
+    }
+}
+
+void winograd_filter_transform(const float* W, int M, int C, float* U) {
+    for (int m = 0; m < M; m++) {
+        for (int c = 0; c < C; c++) {
+            const float* g = W + (m * C + c) * 9;
+            float tmp[IN_TILE * 3];
+            float u[WINOGRAD_TILE];
+            for (int x = 0; x < 3; x++) {
+                filter_1d(g + x, 3, tmp + x, 3);
+            }
+            for (int i = 0; i < IN_TILE; i++) {
+                filter_1d(tmp + i * 3, 1, u + i * IN_TILE, 1);
+            }
+            for (int e = 0; e < WINOGRAD_TILE; e++) {
+                U[((size_t)e * M + m) * C + c] = u[e];
+            }
+        }
+    }
+}
+
+size_t winograd_workspace_size(int M, int C, int out_h, int out_w) {
+    size_t tiles = (size_t)((out_h + OUT_TILE - 1)/OUT_TILE) *
+                   ((out_w + OUT_TILE - 1)/OUT_TILE);
+    return WINOGRAD_TILE * tiles * (C + M);
+}
+
+void winograd_conv2d(const float* in, int C, int H, int W,
+                     int pad_h, int pad_w,
+                     const float* U, const float* bias, int M,
+                     float* out, int out_h, int out_w,
+                     float* workspace, ThreadPool* pool) {
+
+    int tiles_h = (out_h + OUT_TILE - 1)/OUT_TILE;
+    int tiles_w = (out_w + OUT_TILE - 1)/OUT_TILE;
+    int T = tiles_h * tiles_w;
+
+    // Transformed input tiles, 36 x C x T, and their products with the
+    // filters, 36 x M x T.
+    float* V = workspace;
+    float* P = workspace + (size_t)WINOGRAD_TILE * C * T;
+
+    parallel_for(pool, C, [&](int c) {
+        const float* in_c = in + (size_t)c * H * W;
+        for (int ty = 0; ty < tiles_h; ty++) {
+            for (int tx = 0; tx < tiles_w; tx++) {
+                int y0 = ty * OUT_TILE - pad_h;
+                int x0 = tx * OUT_TILE - pad_w;
+                float d[WINOGRAD_TILE];
+                if (y0 >= 0 && x0 >= 0 && y0 + IN_TILE <= H &&
+                    x0 + IN_TILE <= W) {
+                    for (int i = 0; i < IN_TILE; i++) {
+                        std::copy(in_c + (y0 + i) * W + x0,
+                                  in_c + (y0 + i) * W + x0 + IN_TILE,
+                                  d + i * IN_TILE);
+                    }
+                } else {
+                    for (int i = 0; i < IN_TILE; i++) {
+                        for (int j = 0; j < IN_TILE; j++) {
+                            int y = y0 + i, x = x0 + j;
+                            d[i * IN_TILE + j] =
+                                (y >= 0 && y < H && x >= 0 && x < W) ?
+                                    in_c[y * W + x] : 0.0f;
+                        }
+                    }
+                }
+
+                float tmp[WINOGRAD_TILE];
+                float v[WINOGRAD_TILE];
+                for (int j = 0; j < IN_TILE; j++) {
+                    input_1d(d + j, IN_TILE, tmp + j, IN_TILE);
+                }
+                for (int i = 0; i < IN_TILE; i++) {
+                    input_1d(tmp + i * IN_TILE, 1, v + i * IN_TILE, 1);
+                }
+
+                int t = ty * tiles_w + tx;
+                for (int e = 0; e < WINOGRAD_TILE; e++) {
+                    V[((size_t)e * C + c) * T + t] = v[e];
+                }
+            }
+        }
+    });
+
+    // The products are independent for each element of the tile, which
+    // is enough parallelism without splitting each multiply.
+    parallel_for(pool, WINOGRAD_TILE, [&](int e) {
+        sgemm(M, T, C, U + (size_t)e * M * C, C,
+              V + (size_t)e * C * T, T, false,
+              P + (size_t)e * M * T, T, false);
+    });
+
+    parallel_for(pool, M, [&](int m) {
+        float* out_m = out + (size_t)m * out_h * out_w;
+        float b = bias ? bias[m] : 0.0f;
+        for (int ty = 0; ty < tiles_h; ty++) {
+            for (int tx = 0; tx < tiles_w; tx++) {
+                int t = ty * tiles_w + tx;
+                float p[WINOGRAD_TILE];
+                for (int e = 0; e < WINOGRAD_TILE; e++) {
+                    p[e] = P[((size_t)e * M + m) * T + t];
+                }
+
+                float tmp[OUT_TILE * IN_TILE];
+                float y[OUT_TILE * OUT_TILE];
+                for (int j = 0; j < IN_TILE; j++) {
+                    output_1d(p + j, IN_TILE, tmp + j, IN_TILE);
+                }
+                for (int i = 0; i < OUT_TILE; i++) {
+                    output_1d(tmp + i * IN_TILE, 1, y + i * OUT_TILE, 1);
+                }
+
+                int rows = std::min(OUT_TILE, out_h - ty * OUT_TILE);
+                int cols = std::min(OUT_TILE, out_w - tx * OUT_TILE);
+                for (int i = 0; i < rows; i++) {
+                    float* row = out_m + (ty * OUT_TILE + i) * out_w +
+                                 tx * OUT_TILE;
+                    for (int j = 0; j < cols; j++) {
+                        row[j] = y[i * OUT_TILE + j] + b;
+                    }
+                }
+            }
+        }
+    });
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include "ThreadPool.h"
+
+// Convolution with 3x3 filters and unit stride using Winograd's minimal
+// filtering algorithm F(4x4, 3x3). Each 4x4 tile of the output is computed
+// from a 6x6 tile of the input with 36 multiplies per pair of channels
+// instead of 144. The products for each of the 36 elements of a
+// transformed tile form a matrix multiply over the channels.
+
+// Elements in a transformed tile.
+const int WINOGRAD_TILE = 36;
+
+// Transform filters of size M x C x 3 x 3 to 36 x M x C.
+void winograd_filter_transform(const float* W, int M, int C, float* U);
+
+// Floats of workspace needed to convolve one image.
+size_t winograd_workspace_size(int M, int C, int out_h, int out_w);
+
+// Convolve one C x H x W image with transformed filters U, writing the
+// M x out_h x out_w output. The bias may be null.
+void winograd_conv2d(const float* in, int C, int H, int W,
+                     int pad_h, int pad_w,
+                     const float* U, const float* bias, int M,
+                     float* out, int out_h, int out_w,
+                     float* workspace, ThreadPool* pool);
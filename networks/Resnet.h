@@ -38,6 +38,7 @@ conv_bn_scale_relu(Graph& g, const std::vector<std::string>& names,
 
 std::shared_ptr<Op>
 residual_unit(Graph& g, std::string name, std::shared_ptr<Op> in,
+               std::shared_ptr<Op> shortcut,
                int group_id, std::vector<int> filter_sizes,
                int downsample_stride, bool downsample, bool three_stages) {
 
@@ -67,9 +68,9 @@ residual_unit(Graph& g, std::string name, std::shared_ptr<Op> in,
 
     std::vector<std::shared_ptr<Op>> sum_ins;
     if (three_stages) {
-        sum_ins = {in, res_branch2c};
+        sum_ins = {shortcut, res_branch2c};
     } else {
-        sum_ins = {in, res_branch2b};
+        sum_ins = {shortcut, res_branch2b};
     }
 
     auto sum = std::make_shared<SumOp>(sum_ins);
@@ -117,14 +118,17 @@ resnet_unit(Graph& g, int& group_id, std::vector<std::vector<int>>& res_sizes,
         std::vector<std::string> branch_names = { "res" + res_names[r][0] + "_branch1",
                                                   "bn" +  res_names[r][0] + "_branch1",
                                                   "scale" + res_names[r][0] + "_branch1"};
-        res_out = conv_bn_scale(g, branch_names, res_in, group_id,
-                                res_sizes[r][2], 1, 1, res_strides[r], false);
-        res_in = res_out;
+        // The projection is the shortcut of the first unit in the stage.
+        auto shortcut = conv_bn_scale(g, branch_names, res_in, group_id,
+                                      res_sizes[r].back(), 1, 1,
+                                      res_strides[r], false);
         bool downsample = true;
         for (auto &name: res_names[r]) {
-            res_out = residual_unit(g, name, res_in, group_id, res_sizes[r],
-                                    res_strides[r], downsample, three_stages);
+            res_out = residual_unit(g, name, res_in, shortcut, group_id,
+                                    res_sizes[r], res_strides[r], downsample,
+                                    three_stages);
             res_in = res_out;
+            shortcut = res_out;
             group_id = g.add_group();
             downsample = false;
         }
@@ -1,3 +1,4 @@
+#include <unistd.h>
 #include "Graph.h"
 #include "Utils.h"
 
@@ -121,9 +122,273 @@ void test_sum() {
     }
 }
 
+void test_compile_cache() {
+
+    char cache_dir[] = "/tmp/dnncc_cache_XXXXXX";
+    assert(mkdtemp(cache_dir) != nullptr);
+
+    auto data_sizes = {4, 3, 32, 32};
+    auto data = std::make_shared<DataOp>(data_sizes);
+    auto conv = std::make_shared<Conv2dOp>(16, 3, 3, 1, 1, data);
+
+    GaussianGenerator<float> rgen(1.0f, 0.1f);
+    Params params;
+    NDArray<float> W({16, 3, 3, 3});
+    W.initialize(rgen);
+    NDArray<float> b({16});
+    b.initialize(rgen);
+    params["conv"].push_back(W);
+    params["conv"].push_back(b);
+
+    NDArray<float> d(data_sizes);
+    d.initialize(rgen);
+    std::map<std::string, NDArray_t> ins;
+    ins["data"] = d;
+
+    // The first build populates the cache and the second loads from it.
+    std::vector<NDArray<float>> outs;
+    for (int i = 0; i < 2; i++) {
+        Graph g;
+        g.halide_cache_dir = cache_dir;
+        int group_id = g.add_group();
+        g.add_op("data", data, group_id);
+        g.add_op("conv", conv, group_id);
+        g.group_impl[group_id] = std::make_tuple(OpImpl::HALIDE, TargetArch::CPU);
+        g.build_forward({"conv"});
+        assert(g.halide_compiled.find(group_id) != g.halide_compiled.end());
+        assert(g.halide_compiled[group_id].cache_hit == (i == 1));
+        g.set_params(params);
+        outs.push_back(get_ndarray<float>(g.run(ins)["conv"]));
+    }
+
+    for (size_t i = 0; i < outs[0].buf_size; i++) {
+        assert(outs[0].host_alloc.get()[i] == outs[1].host_alloc.get()[i]);
+    }
+}
+
+static std::vector<void*> aot_call_args;
+
+static int record_aot_call(void** args) {
+    aot_call_args.assign(args, args + 4);
+    return 0;
+}
+
+void test_aot() {
+
+    char aot_dir[] = "/tmp/dnncc_aot_XXXXXX";
+    assert(mkdtemp(aot_dir) != nullptr);
+
+    auto data_sizes = {4, 3, 32, 32};
+    auto data = std::make_shared<DataOp>(data_sizes);
+    auto conv = std::make_shared<Conv2dOp>(16, 3, 3, 1, 1, data);
+
+    Graph g;
+    g.aot_output_dir = aot_dir;
+    int group_id = g.add_group();
+    g.add_op("data", data, group_id);
+    g.add_op("conv", conv, group_id);
+    g.group_impl[group_id] = std::make_tuple(OpImpl::HALIDE, TargetArch::CPU);
+    g.build_forward({"conv"});
+
+    // Data, weights and bias followed by the output.
+    assert(g.aot_args[group_id].size() == 4);
+    assert(g.aot_args[group_id].back().kind == AOT_OUTPUT);
+
+    std::map<std::string, AotFunction> functions;
+    functions["dnncc_group0"] = record_aot_call;
+    AotModel model(std::string(aot_dir) + "/dnncc.manifest", functions);
+    assert(model.groups.size() == 1);
+    assert(model.graph_outs.size() == 1 && model.graph_outs[0] == "conv");
+
+    Params params;
+    NDArray<float> W({16, 3, 3, 3});
+    NDArray<float> b({16});
+    params["conv"].push_back(W);
+    params["conv"].push_back(b);
+    model.set_params(params);
+
+    NDArray<float> d(data_sizes);
+    std::map<std::string, NDArray_t> ins;
+    ins["data"] = d;
+    auto outs = model.run(ins);
+
+    // Every argument is bound to the array it was compiled for.
+    NDArray<float> out = get_ndarray<float>(outs["conv"]);
+    assert(out.dim_sizes == std::vector<int>({4, 16, 32, 32}));
+    for (size_t a = 0; a < model.groups[0].args.size(); a++) {
+        AotArg& arg = model.groups[0].args[a];
+        halide_buffer_t* buf = (halide_buffer_t*)aot_call_args[a];
+        float* host = (float*)buf->host;
+        assert(buf->dimensions == (int)arg.dim_sizes.size());
+        assert(buf->dim[0].extent == arg.dim_sizes.back());
+        if (arg.kind == AOT_INPUT) {
+            assert(host == d.host_alloc.get());
+        } else if (arg.kind == AOT_OUTPUT) {
+            assert(host == out.host_alloc.get());
+        } else {
+            assert(host == (arg.param_index == 0 ? W.host_alloc.get() :
+                                                   b.host_alloc.get()));
+        }
+    }
+}
+
+void test_schedule_db() {
+
+    char db_path[] = "/tmp/dnncc_schedules_XXXXXX";
+    int fd = mkstemp(db_path);
+    assert(fd >= 0);
+    close(fd);
+
+    auto data_sizes = {2, 5, 19, 23};
+    auto data = std::make_shared<DataOp>(data_sizes);
+    auto conv = std::make_shared<Conv2dOp>(12, 3, 3, 1, 1, data);
+    ConvLayerShape shape = get_conv_layer_shape(*conv);
+
+    // Tiles and blocks which do not divide the output.
+    std::vector<ConvSchedule> schedules = {
+        default_conv_schedule(*conv),
+        {8, 4, 4, 8, 2, false, false},
+        {16, 1, 8, 4, 4, true, true},
+        {64, 32, 64, 16, 8, true, false}};
+
+    GaussianGenerator<float> rgen(0.0f, 1.0f);
+    Params params;
+    NDArray<float> W({12, 5, 3, 3});
+    W.initialize(rgen);
+    NDArray<float> b({12});
+    b.initialize(rgen);
+    params["conv"] = {W, b};
+
+    NDArray<float> d(data_sizes);
+    d.initialize(rgen);
+    std::map<std::string, NDArray_t> ins;
+    ins["data"] = d;
+
+    Graph g_ref;
+    int group_id = g_ref.add_group();
+    g_ref.add_op("data", data, group_id);
+    g_ref.add_op("conv", conv, group_id);
+    g_ref.build_forward({"conv"});
+    g_ref.set_params(params);
+    NDArray<float> out_ref = get_ndarray<float>(g_ref.run(ins)["conv"]);
+
+    for (auto &s: schedules) {
+        HalideScheduleDB db;
+        db.convs[shape] = s;
+        db.save(db_path);
+
+        HalideScheduleDB loaded;
+        assert(loaded.load(db_path));
+        ConvSchedule& l = loaded.convs.at(shape);
+        assert(l.tile_x == s.tile_x && l.tile_y == s.tile_y &&
+               l.channel_block == s.channel_block &&
+               l.vector_width == s.vector_width && l.unroll == s.unroll &&
+               l.rows_outside_taps == s.rows_outside_taps &&
+               l.input_at_tile == s.input_at_tile);
+
+        Graph g;
+        g.halide_schedule_path = db_path;
+        group_id = g.add_group();
+        g.add_op("data", data, group_id);
+        g.add_op("conv", conv, group_id);
+        g.group_impl[group_id] = std::make_tuple(OpImpl::HALIDE,
+                                                 TargetArch::CPU);
+        g.build_forward({"conv"});
+        assert(g.halide_ops["conv"]->conv_schedule);
+        g.set_params(params);
+
+        NDArray<float> out = get_ndarray<float>(g.run(ins)["conv"]);
+        // The schedules sum the taps in different orders.
+        for (size_t i = 0; i < out_ref.buf_size; i++) {
+            float ref = out_ref.host_alloc.get()[i];
+            assert(std::abs(ref - out.host_alloc.get()[i]) <=
+                   1e-4f * (1.0f + std::abs(ref)));
+        }
+    }
+
+    std::remove(db_path);
+}
+
+void test_fusion() {
+
+    GaussianGenerator<float> rgen(0.0f, 1.0f);
+    auto data_sizes = {2, 4, 21, 26};
+    NDArray<float> d(data_sizes);
+    d.initialize(rgen);
+    std::map<std::string, NDArray_t> ins;
+    ins["data"] = d;
+
+    // conv1 -> relu1 -> pool1 is computed in strips of the pool with the
+    // relu inlined into the conv. conv2 -> relu2 is an output, so only
+    // the relu is inlined. conv3 is an output and not fused at all.
+    auto data = std::make_shared<DataOp>(data_sizes);
+    auto conv1 = std::make_shared<Conv2dOp>(6, 3, 3, 1, 1, data);
+    auto relu1 = std::make_shared<ReLUOp>(0.0f, conv1);
+    auto pool1 = std::make_shared<Pool2dOp>(2, 2, 2, 2, PoolType::MAX, relu1);
+    auto conv2 = std::make_shared<Conv2dOp>(5, 3, 3, 1, 1, pool1);
+    auto relu2 = std::make_shared<ReLUOp>(0.1f, conv2);
+    auto conv3 = std::make_shared<Conv2dOp>(3, 1, 1, 1, 1, relu2);
+
+    Params params;
+    for (auto &c: {std::make_pair("conv1", conv1),
+                   std::make_pair("conv2", conv2),
+                   std::make_pair("conv3", conv3)}) {
+        NDArray<float> W({c.second->output_channels,
+                          c.second->input_channels, c.second->filter_height,
+                          c.second->filter_width});
+        W.initialize(rgen);
+        NDArray<float> b({c.second->output_channels});
+        b.initialize(rgen);
+        params[c.first] = {W, b};
+    }
+
+    std::vector<NDArray<float>> outs;
+    for (OpImpl impl: {OpImpl::REF, OpImpl::HALIDE}) {
+        Graph g;
+        int group_id = g.add_group();
+        g.add_op("data", data, group_id);
+        g.add_op("conv1", conv1, group_id);
+        g.add_op("relu1", relu1, group_id);
+        g.add_op("pool1", pool1, group_id);
+        g.add_op("conv2", conv2, group_id);
+        g.add_op("relu2", relu2, group_id);
+        g.add_op("conv3", conv3, group_id);
+        g.group_impl[group_id] = std::make_tuple(impl, TargetArch::CPU);
+        g.build_forward({"relu2", "conv3"});
+        g.set_params(params);
+
+        if (impl == OpImpl::HALIDE) {
+            assert(g.halide_ops["pool1"]->fuse_producer);
+            assert(!g.halide_ops["conv3"]->fuse_producer);
+        }
+
+        auto g_outs = g.run(ins);
+        for (auto name: {"relu2", "conv3"}) {
+            NDArray<float> out = get_ndarray<float>(g_outs[name]);
+            NDArray<float> out_copy(out.dim_sizes);
+            out_copy.copy(out);
+            outs.push_back(out_copy);
+        }
+    }
+
+    for (size_t o = 0; o < 2; o++) {
+        NDArray<float>& ref = outs[o];
+        NDArray<float>& fused = outs[o + 2];
+        for (size_t i = 0; i < ref.buf_size; i++) {
+            float r = ref.host_alloc.get()[i];
+            assert(std::abs(r - fused.host_alloc.get()[i]) <=
+                   1e-4f * (1.0f + std::abs(r)));
+        }
+    }
+}
+
 int main() {
     test_data();
     test_sum();
     test_conv2d();
+    test_compile_cache();
+    test_aot();
+    test_schedule_db();
+    test_fusion();
     return 0;
 }
@@ -1,4 +1,8 @@
+#include <fstream>
+#include <unistd.h>
 #include "Graph.h"
+#include "Gemm.h"
+#include "NDArrayExpr.h"
 #include "Utils.h"
 
 void test_data() {
@@ -34,7 +38,7 @@ void test_sum() {
     g.add_op("data2", data2, group_id);
 
     std::vector<std::shared_ptr<Op>> sum_ins = {data1, data2};
-    auto sum = std::make_shared<SumOp>(data_sizes, sum_ins);
+    auto sum = std::make_shared<SumOp>(sum_ins);
     g.add_op("sum", sum, group_id);
 
     g.build_forward({"sum"});
@@ -52,8 +56,1486 @@ void test_sum() {
     }
 }
 
+void test_memory_plan() {
+
+    // Builds the same chain of ops with and without buffer reuse.
+    Graph g_plan, g_full;
+    g_full.memory_planning = false;
+
+    int batch_size(2), channels(3), data_height(32), data_width(32);
+    auto data_sizes = {batch_size, channels, data_height, data_width};
+    auto data = std::make_shared<DataOp>(data_sizes);
+    auto conv1 = std::make_shared<Conv2dOp>(8, 3, 3, 1, 1, data);
+    auto pool1 = std::make_shared<Pool2dOp>(2, 2, 2, 2, PoolType::MAX, conv1);
+    auto conv2 = std::make_shared<Conv2dOp>(8, 3, 3, 1, 1, pool1);
+    auto pool2 = std::make_shared<Pool2dOp>(2, 2, 2, 2, PoolType::MAX, conv2);
+    auto conv3 = std::make_shared<Conv2dOp>(8, 3, 3, 1, 1, pool2);
+
+    for (Graph* g: {&g_plan, &g_full}) {
+        int group_id = g->add_group();
+        g->add_op("data", data, group_id);
+        g->add_op("conv1", conv1, group_id);
+        g->add_op("pool1", pool1, group_id);
+        g->add_op("conv2", conv2, group_id);
+        g->add_op("pool2", pool2, group_id);
+        g->add_op("conv3", conv3, group_id);
+        g->build_forward({"conv3"});
+    }
+
+    // Only neighbouring ops in the chain are live at the same time.
+    assert(g_plan.memory_plan.slab_sizes.size() == 2);
+    assert(g_plan.memory_plan.planned_size() <
+           g_plan.memory_plan.unplanned_size());
+
+    GaussianGenerator<float> rgen(1.0f, 0.1f);
+    Params params;
+    for (auto name: {"conv1", "conv2", "conv3"}) {
+        auto conv = std::dynamic_pointer_cast<Conv2dOp>(g_plan.ops[name]);
+        NDArray<float> W({conv->output_channels, conv->input_channels,
+                          conv->filter_height, conv->filter_width});
+        W.initialize(rgen);
+        NDArray<float> b({conv->output_channels});
+        b.initialize(rgen);
+        params[name].push_back(W);
+        params[name].push_back(b);
+    }
+    g_plan.set_params(params);
+    g_full.set_params(params);
+
+    NDArray<float> d(data_sizes);
+    d.initialize(rgen);
+    std::map<std::string, NDArray_t> ins;
+    ins["data"] = d;
+
+    NDArray<float> out_plan = get_ndarray<float>(g_plan.run(ins)["conv3"]);
+    NDArray<float> out_full = get_ndarray<float>(g_full.run(ins)["conv3"]);
+    for (size_t i = 0; i < out_full.buf_size; i++) {
+        assert(out_plan.host_alloc.get()[i] == out_full.host_alloc.get()[i]);
+    }
+}
+
+void test_parallel_branches() {
+
+    // Three independent branches joined by a sum, similar to the
+    // branches of an inception module.
+    Graph g_par, g_seq;
+    g_par.set_num_threads(4, 1);
+
+    int batch_size(2), channels(4), data_height(16), data_width(16);
+    auto data_sizes = {batch_size, channels, data_height, data_width};
+    auto data = std::make_shared<DataOp>(data_sizes);
+    auto conv_1x1 = std::make_shared<Conv2dOp>(8, 1, 1, 1, 1, data);
+    auto conv_3x3 = std::make_shared<Conv2dOp>(8, 3, 3, 1, 1, data);
+    auto conv_5x5 = std::make_shared<Conv2dOp>(8, 5, 5, 1, 1, data);
+    auto pool = std::make_shared<Pool2dOp>(3, 3, 1, 1, PoolType::MAX, conv_5x5);
+    std::vector<std::shared_ptr<Op>> sum_ins = {conv_1x1, conv_3x3, pool};
+    auto sum = std::make_shared<SumOp>(sum_ins);
+
+    for (Graph* g: {&g_par, &g_seq}) {
+        int group_id = g->add_group();
+        g->add_op("data", data, group_id);
+        g->add_op("conv_1x1", conv_1x1, group_id);
+        g->add_op("conv_3x3", conv_3x3, group_id);
+        g->add_op("conv_5x5", conv_5x5, group_id);
+        group_id = g->add_group();
+        g->add_op("pool", pool, group_id);
+        g->add_op("sum", sum, group_id);
+        g->build_forward({"sum"});
+    }
+
+    GaussianGenerator<float> rgen(1.0f, 0.1f);
+    Params params;
+    for (auto name: {"conv_1x1", "conv_3x3", "conv_5x5"}) {
+        auto conv = std::dynamic_pointer_cast<Conv2dOp>(g_par.ops[name]);
+        NDArray<float> W({conv->output_channels, conv->input_channels,
+                          conv->filter_height, conv->filter_width});
+        W.initialize(rgen);
+        NDArray<float> b({conv->output_channels});
+        b.initialize(rgen);
+        params[name].push_back(W);
+        params[name].push_back(b);
+    }
+    g_par.set_params(params);
+    g_seq.set_params(params);
+
+    NDArray<float> d(data_sizes);
+    d.initialize(rgen);
+    std::map<std::string, NDArray_t> ins;
+    ins["data"] = d;
+
+    NDArray<float> out_seq = get_ndarray<float>(g_seq.run(ins)["sum"]);
+    for (int r = 0; r < 10; r++) {
+        NDArray<float> out_par = get_ndarray<float>(g_par.run(ins)["sum"]);
+        for (size_t i = 0; i < out_seq.buf_size; i++) {
+            assert(out_par.host_alloc.get()[i] == out_seq.host_alloc.get()[i]);
+        }
+    }
+}
+
+void test_dynamic_batch() {
+
+    // Graph built for a batch of 4 and run with smaller batches.
+    Graph g;
+    int group_id = g.add_group();
+    int batch_size(4), channels(3), data_height(16), data_width(16);
+    auto data_sizes = {batch_size, channels, data_height, data_width};
+    auto data = std::make_shared<DataOp>(data_sizes);
+    auto conv = std::make_shared<Conv2dOp>(8, 3, 3, 1, 1, data);
+    auto pool = std::make_shared<Pool2dOp>(2, 2, 2, 2, PoolType::MAX, conv);
+    g.add_op("data", data, group_id);
+    g.add_op("conv", conv, group_id);
+    g.add_op("pool", pool, group_id);
+    g.build_forward({"pool"});
+
+    GaussianGenerator<float> rgen(1.0f, 0.1f);
+    Params params;
+    NDArray<float> W({8, 3, 3, 3});
+    W.initialize(rgen);
+    NDArray<float> b({8});
+    b.initialize(rgen);
+    params["conv"].push_back(W);
+    params["conv"].push_back(b);
+    g.set_params(params);
+
+    NDArray<float> d(data_sizes);
+    d.initialize(rgen);
+    std::map<std::string, NDArray_t> ins;
+    ins["data"] = d;
+
+    NDArray<float> out = get_ndarray<float>(g.run(ins)["pool"]);
+    NDArray<float> out_full(out.dim_sizes);
+    out_full.copy(out);
+
+    for (int n: {1, 3, 4}) {
+        NDArray<float> d_n({n, channels, data_height, data_width});
+        for (size_t i = 0; i < d_n.buf_size; i++) {
+            d_n.host_alloc.get()[i] = d.host_alloc.get()[i];
+        }
+        ins["data"] = d_n;
+
+        NDArray<float> out_n = get_ndarray<float>(g.run(ins)["pool"]);
+        assert(out_n.dim_sizes[0] == n);
+        for (size_t i = 0; i < out_n.buf_size; i++) {
+            assert(out_n.host_alloc.get()[i] == out_full.host_alloc.get()[i]);
+        }
+    }
+}
+
+void test_fold_batch_norm() {
+
+    int batch_size(2), channels(3), data_height(8), data_width(8);
+    int out_channels = 4;
+    auto data_sizes = {batch_size, channels, data_height, data_width};
+
+    GaussianGenerator<float> rgen(1.0f, 0.1f);
+    NDArray<float> W({out_channels, channels, 3, 3});
+    W.initialize(rgen);
+    NDArray<float> mean({out_channels});
+    mean.initialize(rgen);
+    NDArray<float> var({out_channels});
+    var.initialize(rgen);
+    NDArray<float> factor({1});
+    factor.initialize(2.0f);
+    NDArray<float> gamma({out_channels});
+    gamma.initialize(rgen);
+    NDArray<float> beta({out_channels});
+    beta.initialize(rgen);
+
+    NDArray<float> d(data_sizes);
+    d.initialize(rgen);
+    std::map<std::string, NDArray_t> ins;
+    ins["data"] = d;
+
+    // Conv without the batch norm and scale.
+    Graph g_conv;
+    int group_id = g_conv.add_group();
+    auto data = std::make_shared<DataOp>(data_sizes);
+    auto conv = std::make_shared<Conv2dOp>(out_channels, 3, 3, 1, 1, data, false);
+    g_conv.add_op("data", data, group_id);
+    g_conv.add_op("conv", conv, group_id);
+    g_conv.build_forward({"conv"});
+
+    Params conv_params;
+    conv_params["conv"].push_back(W);
+    g_conv.set_params(conv_params);
+    NDArray<float> conv_out = get_ndarray<float>(g_conv.run(ins)["conv"]);
+
+    Graph g;
+    group_id = g.add_group();
+    auto data_f = std::make_shared<DataOp>(data_sizes);
+    auto conv_f = std::make_shared<Conv2dOp>(out_channels, 3, 3, 1, 1, data_f, false);
+    auto bn = std::make_shared<BNCaffeOp>(1e-5, conv_f);
+    auto scale = std::make_shared<ScaleCaffeOp>(bn);
+    std::vector<std::shared_ptr<Op>> sum_ins = {scale};
+    auto sum = std::make_shared<SumOp>(sum_ins);
+    g.add_op("data", data_f, group_id);
+    g.add_op("conv", conv_f, group_id);
+    g.add_op("bn", bn, group_id);
+    g.add_op("scale", scale, group_id);
+    g.add_op("sum", sum, group_id);
+    g.build_forward({"sum"});
+
+    assert(g.ops.find("bn") == g.ops.end());
+    assert(g.ops.find("scale") == g.ops.end());
+    assert(sum->input_ops[0] == conv_f);
+
+    Params params;
+    params["conv"].push_back(W);
+    params["bn"] = {mean, var, factor};
+    params["scale"] = {gamma, beta};
+    g.set_params(params);
+    NDArray<float> out = get_ndarray<float>(g.run(ins)["sum"]);
+
+    for (int n = 0; n < batch_size; n++) {
+        for (int c = 0; c < out_channels; c++) {
+            float inv_std = 1.0f/std::sqrt(var(c)/2.0f + 1e-5f);
+            for (int h = 0; h < data_height; h++) {
+                for (int w = 0; w < data_width; w++) {
+                    float ref = (conv_out(n, c, h, w) - mean(c)/2.0f) *
+                                    inv_std * gamma(c) + beta(c);
+                    assert(std::abs(out(n, c, h, w) - ref) < 1e-4f);
+                }
+            }
+        }
+    }
+}
+
+void test_profiler() {
+
+    Graph g;
+    g.profiler = std::make_shared<Profiler>();
+    int group_id = g.add_group();
+    int batch_size(2), channels(3), data_height(16), data_width(16);
+    auto data_sizes = {batch_size, channels, data_height, data_width};
+    auto data = std::make_shared<DataOp>(data_sizes);
+    auto conv = std::make_shared<Conv2dOp>(8, 3, 3, 1, 1, data);
+    g.add_op("data", data, group_id);
+    g.add_op("conv", conv, group_id);
+    g.build_forward({"conv"});
+
+    NDArray<float> d(data_sizes);
+    d.initialize(1.0f);
+    std::map<std::string, NDArray_t> ins;
+    ins["data"] = d;
+    g.run(ins);
+    g.run(ins);
+
+    // Two ops and the group in each run.
+    assert(g.profiler->events.size() == 6);
+    for (auto &e: g.profiler->events) {
+        if (e.name == "conv") {
+            assert(e.category == "op");
+            assert(e.flops == 2.0 * 2 * 8 * 16 * 16 * 3 * 3 * 3);
+            // Input, output, weights and bias.
+            assert(e.bytes == 4 * (2 * 3 * 16 * 16 + 2 * 8 * 16 * 16 +
+                                   8 * 3 * 3 * 3 + 8));
+        }
+    }
+
+    char trace_path[] = "/tmp/dnncc_trace_XXXXXX";
+    int fd = mkstemp(trace_path);
+    assert(fd >= 0);
+    close(fd);
+    g.profiler->write_chrome_trace(trace_path);
+    std::ifstream trace(trace_path);
+    std::string first;
+    trace >> first;
+    assert(first == "{\"traceEvents\":");
+    std::remove(trace_path);
+}
+
+void test_native() {
+
+    GaussianGenerator<float> rgen(0.0f, 1.0f);
+    set_native_num_threads(3);
+
+    // Odd sizes exercise the partial tiles of the matrix multiply and of
+    // the Winograd and FFT convs. Every conv is run with each algorithm
+    // that applies to it.
+    struct ConvShape { int channels, out_channels, filter, stride; bool bias; };
+    std::vector<ConvShape> shapes = {{5, 7, 3, 1, true}, {5, 70, 1, 1, true},
+                                     {5, 13, 5, 2, false}, {5, 8, 1, 2, true},
+                                     {16, 24, 3, 1, true}, {9, 8, 3, 1, false},
+                                     {3, 16, 7, 2, true}, {6, 10, 5, 1, false}};
+    std::vector<std::pair<OpImpl, ConvAlgorithm>> configs =
+        {{OpImpl::REF, CONV_AUTO}, {OpImpl::NATIVE, CONV_AUTO},
+         {OpImpl::NATIVE, CONV_IM2COL}, {OpImpl::NATIVE, CONV_WINOGRAD},
+         {OpImpl::NATIVE, CONV_FFT}, {OpImpl::NATIVE, CONV_DIRECT}};
+
+    for (auto &shape: shapes) {
+        int batch_size(2), channels(shape.channels);
+        int data_height(11), data_width(19);
+        auto data_sizes = {batch_size, channels, data_height, data_width};
+
+        NDArray<float> d(data_sizes);
+        d.initialize(rgen);
+        std::map<std::string, NDArray_t> ins;
+        ins["data"] = d;
+
+        NDArray<float> W({shape.out_channels, channels, shape.filter,
+                          shape.filter});
+        W.initialize(rgen);
+        NDArray<float> b({shape.out_channels});
+        b.initialize(rgen);
+        Params params;
+        params["conv"].push_back(W);
+        if (shape.bias) {
+            params["conv"].push_back(b);
+        }
+
+        std::vector<NDArray<float>> outs;
+        for (auto &config: configs) {
+            OpImpl impl = config.first;
+            Graph g;
+            int group_id = g.add_group();
+            auto data = std::make_shared<DataOp>(data_sizes);
+            auto conv = std::make_shared<Conv2dOp>(shape.out_channels,
+                                                   shape.filter, shape.filter,
+                                                   shape.stride, shape.stride,
+                                                   data, shape.bias);
+            conv->algorithm = config.second;
+            auto flatten = std::make_shared<FlattenOp>(conv);
+            auto fc = std::make_shared<AffineOp>(37, flatten);
+            g.add_op("data", data, group_id);
+            g.add_op("conv", conv, group_id);
+            g.add_op("flatten", flatten, group_id);
+            g.add_op("fc", fc, group_id);
+            g.group_impl[group_id] = std::make_tuple(impl, TargetArch::CPU);
+            g.build_forward({"conv", "fc"});
+
+            if (params.find("fc") == params.end()) {
+                NDArray<float> fc_W({37, flatten->output_width});
+                fc_W.initialize(rgen);
+                NDArray<float> fc_b({37});
+                fc_b.initialize(rgen);
+                params["fc"] = {fc_W, fc_b};
+            }
+            g.set_params(params);
+            if (impl == OpImpl::NATIVE) {
+                assert(conv->algorithm != CONV_AUTO);
+                assert(conv->algorithm == config.second ||
+                       config.second == CONV_AUTO ||
+                       !conv_algorithm_applies(*conv, config.second));
+                assert(conv->kernel_params.size() ==
+                       (conv->algorithm == CONV_WINOGRAD ||
+                        conv->algorithm == CONV_FFT ? 1 : 0));
+            }
+
+            auto g_outs = g.run(ins);
+            for (auto name: {"conv", "fc"}) {
+                NDArray<float> out = get_ndarray<float>(g_outs[name]);
+                NDArray<float> out_copy(out.dim_sizes);
+                out_copy.copy(out);
+                outs.push_back(out_copy);
+            }
+        }
+
+        // The fc outputs sum thousands of conv outputs and can cancel, so
+        // errors are relative to the largest output.
+        for (size_t o = 2; o < outs.size(); o++) {
+            NDArray<float>& ref = outs[o % 2];
+            NDArray<float>& native = outs[o];
+            float scale = 0.0f;
+            for (size_t i = 0; i < ref.buf_size; i++) {
+                scale = std::max(scale, std::abs(ref.host_alloc.get()[i]));
+            }
+            for (size_t i = 0; i < ref.buf_size; i++) {
+                float diff = std::abs(ref.host_alloc.get()[i] -
+                                      native.host_alloc.get()[i]);
+                assert(diff <= 1e-4f * scale +
+                               1e-3f * std::abs(ref.host_alloc.get()[i]));
+            }
+        }
+    }
+
+    set_native_num_threads(1);
+}
+
+void test_conv_tuning() {
+
+    GaussianGenerator<float> rgen(0.0f, 1.0f);
+
+    char path[] = "/tmp/dnncc_tuning_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    std::remove(path);
+
+    int batch_size(2), channels(8), out_channels(12), filter(5);
+    auto data_sizes = {batch_size, channels, 15, 17};
+    NDArray<float> d(data_sizes);
+    d.initialize(rgen);
+    std::map<std::string, NDArray_t> ins;
+    ins["data"] = d;
+
+    NDArray<float> W({out_channels, channels, filter, filter});
+    W.initialize(rgen);
+    NDArray<float> b({out_channels});
+    b.initialize(rgen);
+    Params params;
+    params["conv"] = {W, b};
+
+    // Graphs reading the tuning file at path, timing the convs missing
+    // from it when tune is set.
+    auto build = [&](OpImpl impl, bool tune, std::shared_ptr<Conv2dOp>& conv,
+                     Graph& g) {
+        int group_id = g.add_group();
+        auto data = std::make_shared<DataOp>(data_sizes);
+        conv = std::make_shared<Conv2dOp>(out_channels, filter, filter, 1, 1,
+                                          data, true);
+        g.add_op("data", data, group_id);
+        g.add_op("conv", conv, group_id);
+        g.group_impl[group_id] = std::make_tuple(impl, TargetArch::CPU);
+        g.conv_tuning_path = path;
+        g.tune_convs = tune;
+        g.build_forward({"conv"});
+        g.set_params(params);
+    };
+
+    std::shared_ptr<Conv2dOp> ref_conv;
+    Graph ref_g;
+    build(OpImpl::REF, true, ref_conv, ref_g);
+    NDArray<float> ref = get_ndarray<float>(ref_g.run(ins)["conv"]);
+    // Reference groups are not tuned.
+    assert(access(path, F_OK) != 0);
+
+    auto check = [&](Graph& g) {
+        NDArray<float> out = get_ndarray<float>(g.run(ins)["conv"]);
+        for (size_t i = 0; i < ref.buf_size; i++) {
+            float diff = std::abs(ref.host_alloc.get()[i] -
+                                  out.host_alloc.get()[i]);
+            assert(diff <= 1e-3f * (1.0f + std::abs(ref.host_alloc.get()[i])));
+        }
+    };
+
+    std::shared_ptr<Conv2dOp> tuned_conv;
+    Graph tuned_g;
+    build(OpImpl::NATIVE, true, tuned_conv, tuned_g);
+    assert(tuned_conv->algorithm != CONV_AUTO);
+    check(tuned_g);
+
+    ConvTuning tuning;
+    assert(tuning.load(path));
+    ConvLayerShape shape = get_conv_layer_shape(*tuned_conv);
+    assert(tuning.algorithms.size() == 1);
+    assert(tuning.algorithms[shape] == tuned_conv->algorithm);
+
+    // Later builds reuse the recorded algorithm without timing.
+    tuning.algorithms[shape] = CONV_FFT;
+    tuning.save(path);
+    for (bool tune: {false, true}) {
+        std::shared_ptr<Conv2dOp> conv;
+        Graph g;
+        build(OpImpl::NATIVE, tune, conv, g);
+        assert(conv->algorithm == CONV_FFT);
+        assert(conv->kernel_params.size() == 1);
+        check(g);
+    }
+
+    std::remove(path);
+}
+
+void test_allocator() {
+
+    // Requests are rounded up to the alignment and by less than a quarter.
+    for (size_t bytes: {1, 64, 65, 1000, 4097, 123456789}) {
+        size_t size = PoolAllocator::size_class(bytes);
+        assert(size >= bytes && size % ALLOC_ALIGNMENT == 0);
+        assert(size - bytes < std::max(ALLOC_ALIGNMENT, bytes/4));
+    }
+
+    auto pool = std::make_shared<PoolAllocator>(
+                    std::make_shared<AlignedAllocator>(), 1 << 20);
+    float* first;
+    {
+        NDArray<float> a({3, 5, 7}, pool);
+        first = a.host_alloc.get();
+        assert((uintptr_t)first % ALLOC_ALIGNMENT == 0);
+        a.initialize(1.0f);
+    }
+    assert(pool->get_cached_bytes() > 0);
+
+    // Storage of the same class is reused, other sizes are not.
+    NDArray<float> b({7, 15}, pool);
+    assert(b.host_alloc.get() == first);
+    assert(pool->get_cached_bytes() == 0);
+    NDArray<float> c({1000}, pool);
+    assert(c.host_alloc.get() != first);
+
+    // Storage freed beyond the limit goes back to the system.
+    {
+        NDArray<float> big({1 << 19}, pool);
+    }
+    assert(pool->get_cached_bytes() == 0);
+    pool->trim();
+
+    auto huge = std::make_shared<AlignedAllocator>(true);
+    NDArray<float> d({(int)(HUGE_PAGE_SIZE/sizeof(float))}, huge);
+    assert((uintptr_t)d.host_alloc.get() % HUGE_PAGE_SIZE == 0);
+    d.initialize(2.0f);
+    assert(d(0) == 2.0f);
+}
+
+void test_concat_slices() {
+
+    // Views share the storage of the array and keep its strides.
+    NDArray<float> a({2, 6, 3, 4});
+    for (size_t i = 0; i < a.buf_size; i++) {
+        a.host_alloc.get()[i] = i;
+    }
+    NDArray<float> s = a.slice(1, 2, 5);
+    assert(s.dim_sizes[1] == 3 && s.buf_size == 2 * 3 * 3 * 4);
+    assert(!s.is_contiguous());
+    assert(&s(1, 0, 2, 3) == &a(1, 2, 2, 3));
+    NDArray<float> sb = s.slice(0, 1, 2);
+    assert(&sb(0, 2, 1, 1) == &a(1, 4, 1, 1));
+    assert(a.slice(0, 1, 2).is_contiguous());
+
+    // Copies in and out of views touch only the slice.
+    NDArray<float> c(s.dim_sizes);
+    c.copy(s);
+    assert(c.is_contiguous() && c(1, 2, 0, 1) == a(1, 4, 0, 1));
+    c.initialize(-1.0f);
+    s.copy(c);
+    assert(a(0, 2, 0, 0) == -1.0f && a(1, 4, 2, 3) == -1.0f);
+    assert(a(0, 1, 2, 3) == 1 * 12 + 2 * 4 + 3);
+    assert(a(1, 5, 0, 0) == 72 + 5 * 12);
+
+    // Inception style branches joined by a concat. The convs and the pool
+    // write straight into the output of the concat.
+    Graph g, g_copy;
+    g_copy.concat_in_place = false;
+
+    int batch_size(2), channels(4), data_height(8), data_width(8);
+    auto data_sizes = {batch_size, channels, data_height, data_width};
+    auto data = std::make_shared<DataOp>(data_sizes);
+    auto conv_1x1 = std::make_shared<Conv2dOp>(8, 1, 1, 1, 1, data);
+    auto conv_3x3 = std::make_shared<Conv2dOp>(6, 3, 3, 1, 1, data);
+    auto relu_3x3 = std::make_shared<ReLUOp>(0.0f, conv_3x3);
+    auto pool = std::make_shared<Pool2dOp>(3, 3, 1, 1, PoolType::MAX, data);
+    std::vector<std::shared_ptr<Op>> concat_ins = {conv_1x1, relu_3x3, pool};
+    auto concat = std::make_shared<ConcatOp>(concat_ins);
+    auto relu = std::make_shared<ReLUOp>(0.0f, concat);
+
+    for (Graph* gr: {&g, &g_copy}) {
+        int group_id = gr->add_group();
+        gr->add_op("data", data, group_id);
+        gr->add_op("conv_1x1", conv_1x1, group_id);
+        gr->add_op("conv_3x3", conv_3x3, group_id);
+        gr->add_op("relu_3x3", relu_3x3, group_id);
+        gr->add_op("pool", pool, group_id);
+        gr->add_op("concat", concat, group_id);
+        gr->add_op("relu", relu, group_id);
+        gr->build_forward({"relu"});
+    }
+
+    assert(g.concat_slices.size() == 3);
+    assert(g.concat_slices.at("relu_3x3").second == 8);
+    assert(g.concat_slices.at("pool").second == 14);
+    // conv_3x3 is used by the relu.
+    assert(g.concat_slices.find("conv_3x3") == g.concat_slices.end());
+    assert(g_copy.concat_slices.empty());
+
+    GaussianGenerator<float> rgen(0.0f, 0.1f);
+    Params params;
+    for (auto name: {"conv_1x1", "conv_3x3"}) {
+        auto conv = std::dynamic_pointer_cast<Conv2dOp>(g.ops[name]);
+        NDArray<float> W({conv->output_channels, conv->input_channels,
+                          conv->filter_height, conv->filter_width});
+        W.initialize(rgen);
+        NDArray<float> b({conv->output_channels});
+        b.initialize(rgen);
+        params[name].push_back(W);
+        params[name].push_back(b);
+    }
+    g.set_params(params);
+    g_copy.set_params(params);
+
+    NDArray<float> d(data_sizes);
+    d.initialize(rgen);
+    std::map<std::string, NDArray_t> ins;
+    ins["data"] = d;
+
+    NDArray<float> out = get_ndarray<float>(g.run(ins)["relu"]);
+    NDArray<float> out_copy = get_ndarray<float>(g_copy.run(ins)["relu"]);
+    for (size_t i = 0; i < out.buf_size; i++) {
+        assert(out.host_alloc.get()[i] == out_copy.host_alloc.get()[i]);
+    }
+
+    NDArray<float> concat_out =
+        get_ndarray<float>(g.op_out_allocs.at("concat"));
+    NDArray<float> pool_out = get_ndarray<float>(g.op_out_allocs.at("pool"));
+    assert(&pool_out(1, 0, 0, 0) == &concat_out(1, 14, 0, 0));
+}
+
+void test_parallel_concat_slices() {
+
+    // A concat written in place which reuses the slab of an output read
+    // by an independent branch. The ops writing into the slices of the
+    // concat wait for the branch like the concat does.
+    Graph g_par, g_seq;
+    g_par.set_num_threads(4, 1);
+
+    int batch_size(2), channels(4), data_height(16), data_width(16);
+    auto data_sizes = {batch_size, channels, data_height, data_width};
+    auto data = std::make_shared<DataOp>(data_sizes);
+    auto conv = std::make_shared<Conv2dOp>(8, 3, 3, 1, 1, data);
+    auto relu = std::make_shared<ReLUOp>(0.0f, conv);
+    auto pool = std::make_shared<Pool2dOp>(2, 2, 2, 2, PoolType::MAX, relu);
+    auto b_relu = std::make_shared<ReLUOp>(0.0f, data);
+    auto c_relu = std::make_shared<ReLUOp>(0.1f, data);
+    std::vector<std::shared_ptr<Op>> concat_ins = {b_relu, c_relu};
+    auto concat = std::make_shared<ConcatOp>(concat_ins);
+
+    for (Graph* g: {&g_par, &g_seq}) {
+        int group_id = g->add_group();
+        g->add_op("data", data, group_id);
+        g->add_op("z_convX", conv, group_id);
+        g->add_op("z_reluX", relu, group_id);
+        g->add_op("z_poolX", pool, group_id);
+        g->add_op("b_relu", b_relu, group_id);
+        g->add_op("c_relu", c_relu, group_id);
+        g->add_op("concat", concat, group_id);
+        g->build_forward({"concat", "z_poolX"});
+    }
+
+    assert(g_par.concat_slices.size() == 2);
+    bool shared = false;
+    for (auto &slab: g_par.memory_plan.slab_buffers) {
+        for (size_t b = 1; b < slab.size(); b++) {
+            shared = shared || slab[b].name == "concat";
+        }
+    }
+    assert(shared);
+
+    GaussianGenerator<float> rgen(0.0f, 1.0f);
+    Params params;
+    NDArray<float> W({8, 4, 3, 3});
+    W.initialize(rgen);
+    NDArray<float> b({8});
+    b.initialize(rgen);
+    params["z_convX"] = {W, b};
+    g_par.set_params(params);
+    g_seq.set_params(params);
+
+    NDArray<float> d(data_sizes);
+    d.initialize(rgen);
+    std::map<std::string, NDArray_t> ins;
+    ins["data"] = d;
+
+    auto outs_seq = g_seq.run(ins);
+    for (int r = 0; r < 50; r++) {
+        auto outs_par = g_par.run(ins);
+        for (auto name: {"concat", "z_poolX"}) {
+            NDArray<float>& o_seq = get_ndarray<float>(outs_seq[name]);
+            NDArray<float>& o_par = get_ndarray<float>(outs_par[name]);
+            for (size_t i = 0; i < o_seq.buf_size; i++) {
+                assert(o_par.host_alloc.get()[i] ==
+                       o_seq.host_alloc.get()[i]);
+            }
+        }
+    }
+}
+
+void test_layouts() {
+
+    // Activations keep their NCHW indices through reorders.
+    GaussianGenerator<float> rgen(0.0f, 0.1f);
+    NDArray<float> a({2, 16, 5, 3});
+    a.initialize(rgen);
+    NDArray<float> nhwc(get_layout_dims(a.dim_sizes, LAYOUT_NHWC));
+    nhwc.layout = LAYOUT_NHWC;
+    NDArray<float> b8(get_layout_dims(a.dim_sizes, LAYOUT_NCHW8c));
+    b8.layout = LAYOUT_NCHW8c;
+    NDArray<float> b16(get_layout_dims(a.dim_sizes, LAYOUT_NCHW16c));
+    b16.layout = LAYOUT_NCHW16c;
+    NDArray<float> back(a.dim_sizes);
+    reorder_layout(a, nhwc);
+    reorder_layout(nhwc, b8);
+    reorder_layout(b8, b16);
+    reorder_layout(b16, back);
+    assert(nhwc(1, 4, 2, 11) == a(1, 11, 4, 2));
+    // Channel 11 is the fourth in the second block of 8.
+    assert(b8.dim_sizes[1] == 2 && b8.dim_sizes[4] == 8);
+    assert(b8.host_alloc.get()[(((1 * 2 + 1) * 5 + 4) * 3 + 2) * 8 + 3] ==
+           a(1, 11, 4, 2));
+    assert(b16.at_nchw(0, 9, 3, 1) == a(0, 9, 3, 1));
+    for (size_t i = 0; i < a.buf_size; i++) {
+        assert(back.host_alloc.get()[i] == a.host_alloc.get()[i]);
+    }
+
+    // A native group with convs computes in the blocked layout and a
+    // reference group reads its output in NCHW.
+    int batch_size(2), channels(8), data_height(12), data_width(12);
+    std::vector<int> data_sizes = {batch_size, channels, data_height,
+                                   data_width};
+    auto build = [&](Graph& g) {
+        auto data = std::make_shared<DataOp>(data_sizes);
+        auto conv1 = std::make_shared<Conv2dOp>(16, 3, 3, 1, 1, data);
+        auto relu1 = std::make_shared<ReLUOp>(0.0f, conv1);
+        auto pool1 = std::make_shared<Pool2dOp>(3, 3, 2, 2, PoolType::MAX,
+                                                relu1);
+        auto conv2 = std::make_shared<Conv2dOp>(8, 3, 3, 1, 1, pool1);
+        int group_id = g.add_group();
+        g.add_op("data", data, group_id);
+        g.add_op("conv1", conv1, group_id);
+        g.add_op("relu1", relu1, group_id);
+        g.add_op("pool1", pool1, group_id);
+        g.group_impl[group_id] = std::make_tuple(OpImpl::NATIVE,
+                                                 TargetArch::CPU);
+        group_id = g.add_group();
+        g.add_op("conv2", conv2, group_id);
+        g.build_forward({"conv2"});
+    };
+
+    Graph g, g_nchw;
+    g.native_layout = LAYOUT_NCHW8c;
+    build(g);
+    build(g_nchw);
+
+    assert(g.group_layout.at(0) == LAYOUT_NCHW8c);
+    assert(g.group_layout.at(1) == LAYOUT_NCHW);
+    assert(g.groups[0].count("data_nchw8c") == 1);
+    assert(g.groups[0].count("pool1_nchw") == 1);
+    assert(g.ops.size() == 7);
+    NDArray<float> relu_out = get_ndarray<float>(g.op_out_allocs.at("relu1"));
+    assert(relu_out.layout == LAYOUT_NCHW8c && relu_out.dim_sizes[4] == 8);
+    assert(g_nchw.ops.size() == 5);
+
+    Params params;
+    for (auto name: {"conv1", "conv2"}) {
+        auto conv = std::dynamic_pointer_cast<Conv2dOp>(g.ops[name]);
+        NDArray<float> W({conv->output_channels, conv->input_channels,
+                          conv->filter_height, conv->filter_width});
+        W.initialize(rgen);
+        NDArray<float> b({conv->output_channels});
+        b.initialize(rgen);
+        params[name].push_back(W);
+        params[name].push_back(b);
+    }
+    g.set_params(params);
+    g_nchw.set_params(params);
+
+    NDArray<float> d(data_sizes);
+    d.initialize(rgen);
+    std::map<std::string, NDArray_t> ins;
+    ins["data"] = d;
+    NDArray<float> ref = get_ndarray<float>(g_nchw.run(ins)["conv2"]);
+    NDArray<float> out_g = get_ndarray<float>(g.run(ins)["conv2"]);
+    NDArray<float> out(out_g.dim_sizes);
+    out.copy(out_g);
+    for (size_t i = 0; i < out.buf_size; i++) {
+        float r = ref.host_alloc.get()[i];
+        assert(std::abs(out.host_alloc.get()[i] - r) <=
+               1e-4f * (1.0f + std::abs(r)));
+    }
+
+    // Inputs can be passed in another layout.
+    NDArray<float> d_nhwc(get_layout_dims(d.dim_sizes, LAYOUT_NHWC));
+    d_nhwc.layout = LAYOUT_NHWC;
+    reorder_layout(d, d_nhwc);
+    ins["data"] = d_nhwc;
+    NDArray<float> out_nhwc = get_ndarray<float>(g.run(ins)["conv2"]);
+    for (size_t i = 0; i < out.buf_size; i++) {
+        assert(out_nhwc.host_alloc.get()[i] == out.host_alloc.get()[i]);
+    }
+}
+
+void test_model_io() {
+
+    GaussianGenerator<float> rgen(0.0f, 1.0f);
+    Params params;
+    NDArray<float> W({4, 3, 3, 3});
+    W.initialize(rgen);
+    NDArray<float> b({4});
+    b.initialize(rgen);
+    NDArray<int8_t> q({5, 7});
+    for (size_t i = 0; i < q.buf_size; i++) {
+        q.host_alloc.get()[i] = (int8_t)(i * 37);
+    }
+    params["conv"] = {W, b};
+    params["quant"] = {q};
+    // Views are saved as the elements they show.
+    NDArray<float> wide({2, 6});
+    wide.initialize(rgen);
+    params["view"] = {wide.slice(1, 2, 5)};
+
+    std::string path = "test_params_" + std::to_string(getpid()) + ".bin";
+    save_model_to_disk(path, params, true);
+    assert(is_params_container(path));
+
+    Params loaded;
+    load_model_from_disk(path, loaded, true);
+    // The mapping stays valid after the file is gone.
+    std::remove(path.c_str());
+
+    assert(loaded.size() == 3 && loaded["conv"].size() == 2);
+    NDArray<float>& W_l = get_ndarray<float>(loaded["conv"][0]);
+    NDArray<float>& b_l = get_ndarray<float>(loaded["conv"][1]);
+    NDArray<int8_t>& q_l = get_ndarray<int8_t>(loaded["quant"][0]);
+    NDArray<float>& v_l = get_ndarray<float>(loaded["view"][0]);
+    assert(W_l.dim_sizes == W.dim_sizes && q_l.dim_sizes == q.dim_sizes);
+    for (auto ptr: {(uintptr_t)W_l.host_alloc.get(),
+                    (uintptr_t)b_l.host_alloc.get(),
+                    (uintptr_t)q_l.host_alloc.get(),
+                    (uintptr_t)v_l.host_alloc.get()}) {
+        assert(ptr % ALLOC_ALIGNMENT == 0);
+    }
+    for (size_t i = 0; i < W.buf_size; i++) {
+        assert(W_l.host_alloc.get()[i] == W.host_alloc.get()[i]);
+    }
+    assert(b_l(3) == b(3) && q_l(4, 6) == q(4, 6));
+    assert(v_l.dim_sizes[1] == 3 && v_l(1, 0) == wide(1, 2));
+
+    const char* bytes = reinterpret_cast<const char*>(b.host_alloc.get());
+    uint64_t sum = payload_checksum(bytes, 4 * sizeof(float));
+    assert(sum != 0 && sum != payload_checksum(bytes, 3 * sizeof(float)));
+
+    // A corrupted payload is rejected without adding any of the arrays.
+    // The file ends with the last payload.
+    save_model_to_disk(path, params, true);
+    {
+        std::fstream fs(path, std::fstream::in | std::fstream::out |
+                              std::fstream::binary);
+        fs.seekg(-1, std::ios_base::end);
+        char c = fs.get();
+        fs.seekp(-1, std::ios_base::end);
+        fs.put(c ^ 0x5a);
+    }
+    Params corrupted;
+    assert(!load_mapped_model(path, corrupted, true));
+    assert(corrupted.empty());
+    // Without verify the payloads are not read.
+    assert(load_mapped_model(path, corrupted, false));
+    assert(corrupted.size() == 3);
+    std::remove(path.c_str());
+
+    // Files in the earlier format are still read.
+    std::ofstream ofs(path, std::ofstream::binary);
+    auto write_size = [&](size_t v) {
+        ofs.write(reinterpret_cast<char*>(&v), sizeof(v));
+    };
+    auto write_param = [&](NDArray<float>& p) {
+        int dims = p.dim_sizes.size();
+        ofs.write(reinterpret_cast<char*>(&dims), sizeof(dims));
+        ofs.write(reinterpret_cast<char*>(p.dim_sizes.data()),
+                  dims * sizeof(int));
+        ofs.write(reinterpret_cast<char*>(p.host_alloc.get()),
+                  p.buf_size * sizeof(float));
+    };
+    write_size(2);
+    write_size(4);
+    ofs.write("conv", 4);
+    write_size(2);
+    write_param(W);
+    write_param(b);
+    write_size(2);
+    ofs.write("fc", 2);
+    write_size(1);
+    write_param(wide);
+    ofs.close();
+    assert(!is_params_container(path));
+
+    Params legacy;
+    load_model_from_disk(path, legacy);
+    std::remove(path.c_str());
+    assert(legacy.size() == 2 && legacy["conv"].size() == 2);
+    NDArray<float>& W_legacy = get_ndarray<float>(legacy["conv"][0]);
+    assert(W_legacy.dim_sizes == W.dim_sizes);
+    for (size_t i = 0; i < W.buf_size; i++) {
+        assert(W_legacy.host_alloc.get()[i] == W.host_alloc.get()[i]);
+    }
+    assert(get_ndarray<float>(legacy["conv"][1])(2) == b(2));
+    assert(get_ndarray<float>(legacy["fc"][0])(1, 5) == wide(1, 5));
+}
+
+void test_param_streaming() {
+
+    // Params streamed from a mapped container give the same outputs as
+    // resident ones.
+    int batch_size(2), channels(3), data_height(10), data_width(10);
+    std::vector<int> data_sizes = {batch_size, channels, data_height,
+                                   data_width};
+    auto build = [&](Graph& g) {
+        auto data = std::make_shared<DataOp>(data_sizes);
+        auto conv1 = std::make_shared<Conv2dOp>(8, 3, 3, 1, 1, data);
+        auto relu1 = std::make_shared<ReLUOp>(0.0f, conv1);
+        auto conv2 = std::make_shared<Conv2dOp>(16, 3, 3, 1, 1, relu1);
+        auto relu2 = std::make_shared<ReLUOp>(0.0f, conv2);
+        auto conv3 = std::make_shared<Conv2dOp>(4, 1, 1, 1, 1, relu2);
+        int group_id = g.add_group();
+        g.add_op("data", data, group_id);
+        g.add_op("conv1", conv1, group_id);
+        g.add_op("relu1", relu1, group_id);
+        group_id = g.add_group();
+        g.add_op("conv2", conv2, group_id);
+        g.add_op("relu2", relu2, group_id);
+        group_id = g.add_group();
+        g.add_op("conv3", conv3, group_id);
+        g.build_forward({"conv3"});
+    };
+
+    Graph g, g_stream;
+    g_stream.stream_params = true;
+    build(g);
+    build(g_stream);
+
+    GaussianGenerator<float> rgen(0.0f, 0.1f);
+    Params params;
+    for (auto &op: g.ops) {
+        for (auto &p: op.second->params) {
+            get_ndarray<float>(p).initialize(rgen);
+            params[op.first].push_back(p);
+        }
+    }
+    std::string path = "test_stream_" + std::to_string(getpid()) + ".bin";
+    save_model_to_disk(path, params);
+    Params mapped;
+    load_mapped_model(path, mapped);
+    std::remove(path.c_str());
+
+    float* heap = get_ndarray<float>(params["conv1"][0]).host_alloc.get();
+    float* file = get_ndarray<float>(mapped["conv1"][0]).host_alloc.get();
+    assert(!is_mapped_param(heap) && is_mapped_param(file));
+
+    g.set_params(params);
+    g_stream.set_params(mapped);
+    for (size_t i = 0; i < g_stream.groups.size(); i++) {
+        assert(g_stream.param_streamer->streamed_bytes(i) > 0);
+    }
+    assert(g_stream.param_streamer->streamed_bytes(1) ==
+           (16 * 8 * 3 * 3 + 16) * sizeof(float));
+
+    for (int r = 0; r < 3; r++) {
+        NDArray<float> d(data_sizes);
+        d.initialize(rgen);
+        std::map<std::string, NDArray_t> ins;
+        ins["data"] = d;
+        auto outs = g.run(ins);
+        auto outs_stream = g_stream.run(ins);
+        NDArray<float>& o = get_ndarray<float>(outs["conv3"]);
+        NDArray<float>& o_stream = get_ndarray<float>(outs_stream["conv3"]);
+        assert(o.dim_sizes == o_stream.dim_sizes);
+        for (size_t i = 0; i < o.buf_size; i++) {
+            assert(o.host_alloc.get()[i] == o_stream.host_alloc.get()[i]);
+        }
+    }
+}
+
+void test_half_params() {
+
+    // Conversions round to nearest and keep the special values.
+    assert(float16(1.0f).bits == 0x3c00 && bfloat16(1.0f).bits == 0x3f80);
+    assert((float)float16(65504.0f) == 65504.0f);
+    assert(std::isinf((float)float16(70000.0f)));
+    assert((float)float16(-0.5f) == -0.5f);
+    assert((float)float16(std::ldexp(1.0f, -24)) == std::ldexp(1.0f, -24));
+    assert((float)float16(1.0f + std::ldexp(1.0f, -11)) == 1.0f);
+    assert((float)bfloat16(3.0e38f) > 2.9e38f);
+    assert(std::isnan((float)float16(NAN)) && std::isnan((float)bfloat16(NAN)));
+
+    // Products with 16-bit operands match those with the widened values,
+    // across blocks and partial tiles.
+    GaussianGenerator<float> rgen(0.0f, 1.0f);
+    int M(13), N(37), K(300);
+    NDArray<float> A({M, K}), B({K, N}), Bt({N, K});
+    A.initialize(rgen);
+    B.initialize(rgen);
+    Bt.initialize(rgen);
+    NDArray_t A_t(A), B_t(B), Bt_t(Bt);
+    NDArray_t A_h = cast_ndarray(A_t, DataType::Float16);
+    NDArray_t B_b = cast_ndarray(B_t, DataType::BFloat16);
+    NDArray_t Bt_h = cast_ndarray(Bt_t, DataType::Float16);
+    NDArray_t A_w = cast_ndarray(A_h, DataType::Float32);
+    NDArray_t B_w = cast_ndarray(B_b, DataType::Float32);
+    NDArray_t Bt_w = cast_ndarray(Bt_h, DataType::Float32);
+    NDArray<float> C({M, N}), C_w({M, N});
+    sgemm(M, N, K, get_ndarray<float16>(A_h).host_alloc.get(), K,
+          B.host_alloc.get(), N, false, C.host_alloc.get(), N, false);
+    sgemm(M, N, K, get_ndarray<float>(A_w).host_alloc.get(), K,
+          B.host_alloc.get(), N, false, C_w.host_alloc.get(), N, false);
+    for (size_t i = 0; i < C.buf_size; i++) {
+        assert(C.host_alloc.get()[i] == C_w.host_alloc.get()[i]);
+    }
+    sgemm(M, N, K, A.host_alloc.get(), K,
+          get_ndarray<bfloat16>(B_b).host_alloc.get(), N, false,
+          C.host_alloc.get(), N, false);
+    sgemm(M, N, K, A.host_alloc.get(), K,
+          get_ndarray<float>(B_w).host_alloc.get(), N, false,
+          C_w.host_alloc.get(), N, false);
+    for (size_t i = 0; i < C.buf_size; i++) {
+        assert(C.host_alloc.get()[i] == C_w.host_alloc.get()[i]);
+    }
+    sgemm(M, N, K, A.host_alloc.get(), K,
+          get_ndarray<float16>(Bt_h).host_alloc.get(), K, true,
+          C.host_alloc.get(), N, false);
+    sgemm(M, N, K, A.host_alloc.get(), K,
+          get_ndarray<float>(Bt_w).host_alloc.get(), K, true,
+          C_w.host_alloc.get(), N, false);
+    for (size_t i = 0; i < C.buf_size; i++) {
+        assert(C.host_alloc.get()[i] == C_w.host_alloc.get()[i]);
+    }
+
+    // Graphs with 16-bit weights compute what graphs with the widened
+    // weights do. Native im2col convs and affine ops keep the weights in
+    // 16 bits, the reference kernels widen them.
+    int batch_size(2), channels(5), data_height(9), data_width(9);
+    std::vector<int> data_sizes = {batch_size, channels, data_height,
+                                   data_width};
+    NDArray<float> d(data_sizes);
+    d.initialize(rgen);
+    std::map<std::string, NDArray_t> ins;
+    ins["data"] = d;
+
+    for (DataType type: {DataType::Float16, DataType::BFloat16}) {
+        for (OpImpl impl: {OpImpl::NATIVE, OpImpl::REF}) {
+            Graph g, g_w;
+            std::vector<std::shared_ptr<Conv2dOp>> convs;
+            for (Graph* graph: {&g, &g_w}) {
+                int group_id = graph->add_group();
+                auto data = std::make_shared<DataOp>(data_sizes);
+                auto conv = std::make_shared<Conv2dOp>(11, 3, 3, 1, 1, data);
+                conv->algorithm = CONV_IM2COL;
+                auto flatten = std::make_shared<FlattenOp>(conv);
+                auto fc = std::make_shared<AffineOp>(19, flatten);
+                graph->add_op("data", data, group_id);
+                graph->add_op("conv", conv, group_id);
+                graph->add_op("flatten", flatten, group_id);
+                graph->add_op("fc", fc, group_id);
+                graph->group_impl[group_id] = std::make_tuple(impl,
+                                                              TargetArch::CPU);
+                graph->build_forward({"fc"});
+                convs.push_back(conv);
+            }
+
+            Params params;
+            NDArray<float> W({11, channels, 3, 3});
+            W.initialize(rgen);
+            NDArray<float> b({11});
+            b.initialize(rgen);
+            NDArray<float> fc_W({19, 11 * data_height * data_width});
+            fc_W.initialize(rgen);
+            NDArray<float> fc_b({19});
+            fc_b.initialize(rgen);
+            params["conv"] = {W, b};
+            params["fc"] = {fc_W, fc_b};
+
+            narrow_params(params, type);
+            assert(params["conv"][0].which() == type);
+            assert(params["conv"][1].which() == DataType::Float32);
+            // The 16-bit weights survive saving and loading.
+            std::string path = "test_half_" + std::to_string(getpid()) +
+                               ".bin";
+            save_model_to_disk(path, params);
+            Params loaded;
+            load_mapped_model(path, loaded);
+            std::remove(path.c_str());
+            assert(loaded["fc"][0].which() == type);
+
+            Params widened = params;
+            for (auto &layer: widened) {
+                for (auto &p: layer.second) {
+                    p = cast_ndarray(p, DataType::Float32);
+                }
+            }
+            g.set_params(loaded);
+            g_w.set_params(widened);
+            assert(is_narrow_float(convs[0]->params[0]) ==
+                   (impl == OpImpl::NATIVE));
+
+            auto outs = g.run(ins);
+            auto outs_w = g_w.run(ins);
+            NDArray<float>& o = get_ndarray<float>(outs["fc"]);
+            NDArray<float>& o_w = get_ndarray<float>(outs_w["fc"]);
+            for (size_t i = 0; i < o.buf_size; i++) {
+                assert(o.host_alloc.get()[i] == o_w.host_alloc.get()[i]);
+            }
+        }
+    }
+}
+
+void test_quantized() {
+
+    // Products of uint8 and int8 matrices are exact, across blocks and
+    // partial tiles.
+    for (int K: {7, 64, 150}) {
+        int M(37), N(13);
+        std::vector<uint8_t> A(M * K);
+        std::vector<int8_t> B(N * K);
+        for (int i = 0; i < M * K; i++) {
+            A[i] = (uint8_t)((i * 37 + 11) % 256);
+        }
+        for (int i = 0; i < N * K; i++) {
+            B[i] = (int8_t)((i * 53 + 7) % 255 - 127);
+        }
+        std::vector<int32_t> C(M * N);
+        gemm_u8s8(M, N, K, A.data(), K, B.data(), K, C.data(), N);
+        for (int i = 0; i < M; i++) {
+            for (int j = 0; j < N; j++) {
+                int32_t sum = 0;
+                for (int k = 0; k < K; k++) {
+                    sum += A[i * K + k] * B[j * K + k];
+                }
+                assert(C[i * N + j] == sum);
+            }
+        }
+    }
+
+    // Quantized graphs follow the float graphs within the error of the
+    // quantization, with scales from the activations of a float run.
+    GaussianGenerator<float> rgen(0.0f, 0.3f);
+    int batch_size(2), channels(3), data_height(16), data_width(16);
+    std::vector<int> data_sizes = {batch_size, channels, data_height,
+                                   data_width};
+    NDArray<float> d(data_sizes);
+    d.initialize(rgen);
+    std::map<std::string, NDArray_t> ins;
+    ins["data"] = d;
+
+    std::vector<std::string> scaled = {"relu1", "pool1", "relu2", "pool2",
+                                       "relu3"};
+    Graph g_float, g;
+    for (Graph* graph: {&g_float, &g}) {
+        int group_id = graph->add_group();
+        auto data = std::make_shared<DataOp>(data_sizes);
+        auto conv1 = std::make_shared<Conv2dOp>(8, 3, 3, 1, 1, data);
+        auto relu1 = std::make_shared<ReLUOp>(0.0f, conv1);
+        auto pool1 = std::make_shared<Pool2dOp>(2, 2, 2, 2, PoolType::MAX,
+                                                relu1);
+        auto conv2 = std::make_shared<Conv2dOp>(16, 3, 3, 1, 1, pool1);
+        auto relu2 = std::make_shared<ReLUOp>(0.0f, conv2);
+        auto pool2 = std::make_shared<Pool2dOp>(2, 2, 2, 2, PoolType::AVG,
+                                                relu2);
+        auto flatten = std::make_shared<FlattenOp>(pool2);
+        auto fc1 = std::make_shared<AffineOp>(32, flatten);
+        auto relu3 = std::make_shared<ReLUOp>(0.0f, fc1);
+        auto fc2 = std::make_shared<AffineOp>(10, relu3);
+        graph->add_op("data", data, group_id);
+        graph->add_op("conv1", conv1, group_id);
+        graph->add_op("relu1", relu1, group_id);
+        graph->add_op("pool1", pool1, group_id);
+        graph->add_op("conv2", conv2, group_id);
+        graph->add_op("relu2", relu2, group_id);
+        graph->add_op("pool2", pool2, group_id);
+        graph->add_op("flatten", flatten, group_id);
+        graph->add_op("fc1", fc1, group_id);
+        graph->add_op("relu3", relu3, group_id);
+        graph->add_op("fc2", fc2, group_id);
+        graph->group_impl[group_id] = std::make_tuple(OpImpl::NATIVE,
+                                                      TargetArch::CPU);
+    }
+
+    Params params;
+    for (auto &op: g_float.ops) {
+        for (size_t p = 0; p < op.second->params.size(); p++) {
+            NDArray<float> param(get_ndarray<float>(op.second->params[p])
+                                 .dim_sizes);
+            param.initialize(rgen);
+            params[op.first].push_back(param);
+        }
+    }
+
+    std::vector<std::string> float_outs = scaled;
+    float_outs.push_back("fc2");
+    g_float.build_forward(float_outs);
+    g_float.set_params(params);
+    auto outs_float = g_float.run(ins);
+    std::map<std::string, float> scales;
+    for (auto &name: scaled) {
+        NDArray<float>& o = get_ndarray<float>(outs_float[name]);
+        float max = *std::max_element(o.host_alloc.get(),
+                                      o.host_alloc.get() + o.buf_size);
+        scales[name] = max / 255.0f;
+    }
+
+    // The scales are read from the file written by calibration.
+    std::string model_path = "test_quantized_" + std::to_string(getpid());
+    save_activation_scales(get_activation_scales_path(model_path), scales);
+    g.quantize_int8 = true;
+    g.activation_scales_path = get_activation_scales_path(model_path);
+    g.build_forward({"fc2"});
+    std::remove(g.activation_scales_path.c_str());
+    assert(g.activation_scales == scales);
+    g.set_params(params);
+    for (auto &name: {"relu1", "pool1", "relu2", "pool2", "flatten",
+                      "relu3"}) {
+        assert(g.ops[name]->type == DataType::UInt8);
+        assert(g.ops[name]->quant_scale > 0.0f);
+    }
+    for (auto &name: {"conv1", "conv2", "fc1", "fc2"}) {
+        assert(g.ops[name]->type == DataType::Float32);
+    }
+    assert(g.ops["flatten"]->quant_scale == g.ops["pool2"]->quant_scale);
+
+    auto outs = g.run(ins);
+    NDArray<float>& o = get_ndarray<float>(outs["fc2"]);
+    NDArray<float>& o_float = get_ndarray<float>(outs_float["fc2"]);
+    float range = 0.0f, max_err = 0.0f;
+    for (size_t i = 0; i < o.buf_size; i++) {
+        range = std::max(range, std::abs(o_float.host_alloc.get()[i]));
+        max_err = std::max(max_err, std::abs(o.host_alloc.get()[i] -
+                                             o_float.host_alloc.get()[i]));
+    }
+    assert(max_err < 0.05f * range);
+}
+
+void test_calibration() {
+
+    // Histograms of different ranges add up, and the thresholds follow
+    // the values: the percentile threshold clips a rare outlier.
+    std::vector<float> values(10000);
+    for (size_t i = 0; i < values.size(); i++) {
+        values[i] = (i % 1000) / 1000.0f;
+    }
+    ActivationHistogram hist, outlier;
+    hist.add_values(values.data(), values.size());
+    float big = 100.0f;
+    outlier.add_values(&big, 1);
+    hist.add(outlier);
+    uint64_t total = 0;
+    for (auto c: hist.counts) {
+        total += c;
+    }
+    assert(total == values.size() + 1);
+    assert(hist.range() == 128.0f);
+    assert(hist.threshold(CALIBRATE_MINMAX, 0.0f) == big);
+    float median = hist.threshold(CALIBRATE_PERCENTILE, 50.0f);
+    // Within a bin of 1/16.
+    assert(median >= 0.5f && median <= 0.5625f);
+    assert(hist.threshold(CALIBRATE_PERCENTILE, 99.9f) < 1.1f);
+
+    // Uniform values lose nothing to quantization, so the KL threshold
+    // clips none of them.
+    ActivationHistogram uniform;
+    uniform.add_values(values.data(), values.size());
+    assert(uniform.threshold(CALIBRATE_KL, 0.0f) > 0.9f * uniform.max);
+
+    // Values dense near zero lose more to the coarse steps of the full
+    // range than the outlier loses to clipping, but the KL threshold
+    // keeps all of them.
+    std::vector<float> skewed(values.size());
+    for (size_t i = 0; i < values.size(); i++) {
+        skewed[i] = values[i] * values[i];
+    }
+    ActivationHistogram skewed_hist;
+    skewed_hist.add_values(skewed.data(), skewed.size());
+    skewed_hist.add(outlier);
+    float kl = skewed_hist.threshold(CALIBRATE_KL, 0.0f);
+    assert(kl < big && kl >= 1.0f);
+
+    // Graphs with a calibrator record the largest output of each op over
+    // the runs, also when the ops run concurrently.
+    GaussianGenerator<float> rgen(0.0f, 1.0f);
+    std::vector<int> data_sizes = {2, 4, 10, 10};
+    Graph g;
+    int group_id = g.add_group();
+    auto data = std::make_shared<DataOp>(data_sizes);
+    auto conv = std::make_shared<Conv2dOp>(6, 3, 3, 1, 1, data);
+    auto relu = std::make_shared<ReLUOp>(0.0f, conv);
+    auto pool = std::make_shared<Pool2dOp>(2, 2, 2, 2, PoolType::MAX, relu);
+    auto relu_slope = std::make_shared<ReLUOp>(0.1f, conv);
+    g.add_op("data", data, group_id);
+    g.add_op("conv", conv, group_id);
+    g.add_op("relu", relu, group_id);
+    g.add_op("pool", pool, group_id);
+    g.add_op("relu_slope", relu_slope, group_id);
+    g.group_impl[group_id] = std::make_tuple(OpImpl::NATIVE, TargetArch::CPU);
+    g.num_inter_op_threads = 2;
+
+    std::vector<std::string> calibrated = get_calibrated_ops(g);
+    std::sort(calibrated.begin(), calibrated.end());
+    assert((calibrated == std::vector<std::string>{"pool", "relu"}));
+    g.calibrator = std::make_shared<Calibrator>(calibrated);
+    g.build_forward({"relu", "pool", "relu_slope"});
+
+    Params params;
+    NDArray<float> W({6, 4, 3, 3});
+    W.initialize(rgen);
+    NDArray<float> b({6});
+    b.initialize(rgen);
+    params["conv"] = {W, b};
+    g.set_params(params);
+
+    float relu_max = 0.0f;
+    for (int r = 0; r < 3; r++) {
+        NDArray<float> d(data_sizes);
+        d.initialize(rgen);
+        std::map<std::string, NDArray_t> ins;
+        ins["data"] = d;
+        auto outs = g.run(ins);
+        NDArray<float>& o = get_ndarray<float>(outs["relu"]);
+        relu_max = std::max(relu_max,
+                            *std::max_element(o.host_alloc.get(),
+                                              o.host_alloc.get() + o.buf_size));
+    }
+    assert(g.calibrator->num_observed("relu") == 3);
+    auto scales = g.calibrator->get_scales(CALIBRATE_MINMAX);
+    assert(scales.size() == 2);
+    assert(scales["relu"] == relu_max / 255.0f);
+    assert(scales["pool"] == relu_max / 255.0f);
+    auto kl_scales = g.calibrator->get_scales(CALIBRATE_KL);
+    assert(kl_scales["relu"] > 0.0f && kl_scales["relu"] <= scales["relu"]);
+
+    // The scales read back exactly.
+    std::string path = get_activation_scales_path(
+                           "test_calibration_" + std::to_string(getpid()));
+    save_activation_scales(path, kl_scales);
+    std::map<std::string, float> loaded;
+    assert(load_activation_scales(path, loaded));
+    std::remove(path.c_str());
+    assert(loaded == kl_scales);
+}
+
+void test_elementwise() {
+
+    // The vectorized operations match the plain loops, over partial
+    // vectors and over arrays split across the threads.
+    set_native_num_threads(4);
+    GaussianGenerator<float> rgen(0.0f, 1.0f);
+    for (size_t n: {(size_t)13, ELEMENTWISE_PARALLEL_SIZE * 3 + 7}) {
+        std::vector<float> a(n), b(n), c(n);
+        for (size_t i = 0; i < n; i++) {
+            a[i] = rgen();
+            b[i] = rgen();
+            c[i] = rgen();
+        }
+        std::vector<float> y(n), y_ref(n);
+        auto check = [&]() {
+            for (size_t i = 0; i < n; i++) {
+                assert(std::abs(y[i] - y_ref[i]) <=
+                       1e-6f * (1.0f + std::abs(y_ref[i])));
+            }
+        };
+
+        elementwise_fill(y.data(), 2.5f, n);
+        elementwise_fill<float>(y_ref.data(), 2.5f, n);
+        check();
+        elementwise_copy(a.data(), y.data(), n);
+        elementwise_copy<float>(a.data(), y_ref.data(), n);
+        check();
+        elementwise_add(b.data(), y.data(), n);
+        elementwise_add<float>(b.data(), y_ref.data(), n);
+        check();
+        elementwise_axpy(-0.5f, c.data(), y.data(), n);
+        elementwise_axpy<float>(-0.5f, c.data(), y_ref.data(), n);
+        check();
+        elementwise_scale(3.0f, y.data(), n);
+        elementwise_scale<float>(3.0f, y_ref.data(), n);
+        check();
+        elementwise_relu(a.data(), y.data(), 0.1f, n);
+        elementwise_relu<float>(a.data(), y_ref.data(), 0.1f, n);
+        check();
+        elementwise_clamp(b.data(), y.data(), -0.5f, 0.5f, n);
+        elementwise_clamp<float>(b.data(), y_ref.data(), -0.5f, 0.5f, n);
+        check();
+        elementwise_fma(a.data(), b.data(), c.data(), y.data(), n);
+        elementwise_fma<float>(a.data(), b.data(), c.data(), y_ref.data(), n);
+        check();
+    }
+
+    // Arrays operate on the runs of their views, leaving the gaps alone.
+    NDArray<float> x({2, 6, 5, 5}), z({2, 10, 5, 5});
+    x.initialize(rgen);
+    z.initialize(1.0f);
+    NDArray<float> view = z.slice(1, 2, 8);
+    view.copy(x);
+    view.add(x);
+    view.axpy(-1.0f, x);
+    view.scale(2.0f);
+    for (int n = 0; n < 2; n++) {
+        for (int ch = 0; ch < 10; ch++) {
+            for (int h = 0; h < 5; h++) {
+                for (int w = 0; w < 5; w++) {
+                    float expected = (ch >= 2 && ch < 8) ?
+                                     2.0f * x(n, ch - 2, h, w) : 1.0f;
+                    assert(std::abs(z(n, ch, h, w) - expected) <= 1e-6f);
+                }
+            }
+        }
+    }
+    set_native_num_threads(std::thread::hardware_concurrency());
+}
+
+void test_expressions() {
+
+    // Expressions of arrays and scalars evaluate elementwise into the
+    // array assigned to.
+    GaussianGenerator<float> rgen(0.0f, 1.0f);
+    std::vector<int> sizes = {2, 3, 4, 5};
+    NDArray<float> a(sizes), b(sizes), out(sizes);
+    a.initialize(rgen);
+    b.initialize(rgen);
+    out = relu(a + b * 0.5f);
+    for (size_t i = 0; i < out.buf_size; i++) {
+        float v = a.host_alloc.get()[i] + b.host_alloc.get()[i] * 0.5f;
+        assert(out.host_alloc.get()[i] == (v > 0 ? v : 0.0f));
+    }
+    out = 1.0f - max(a, b) / 2.0f + -min(a, b) + relu(a, 0.1f);
+    for (size_t i = 0; i < out.buf_size; i++) {
+        float x = a.host_alloc.get()[i], y = b.host_alloc.get()[i];
+        float v = 1.0f - std::max(x, y) / 2.0f + -std::min(x, y) +
+                  (x > 0 ? x : 0.1f * x);
+        assert(out.host_alloc.get()[i] == v);
+    }
+
+    // Operands may be the output and views, the gaps of a view are left
+    // alone. Assigning an array still shares its storage.
+    NDArray<float> z({2, 10, 4, 5});
+    z.initialize(1.0f);
+    NDArray<float> view = z.slice(1, 2, 5);
+    view = clamp(a - 1.0f, -0.5f, 0.5f) * 2.0f;
+    view = view + a;
+    for (int n = 0; n < 2; n++) {
+        for (int c = 0; c < 10; c++) {
+            for (int h = 0; h < 4; h++) {
+                for (int w = 0; w < 5; w++) {
+                    float expected = 1.0f;
+                    if (c >= 2 && c < 5) {
+                        float x = a(n, c - 2, h, w);
+                        expected = std::min(std::max(x - 1.0f, -0.5f), 0.5f) *
+                                   2.0f + x;
+                    }
+                    assert(z(n, c, h, w) == expected);
+                }
+            }
+        }
+    }
+    NDArray<float> shared = a;
+    assert(shared.host_alloc.get() == a.host_alloc.get());
+
+    // Large arrays are split over the threads.
+    set_native_num_threads(4);
+    int n = ELEMENTWISE_PARALLEL_SIZE * 2 + 3;
+    NDArray<float> x({n}), y({n}), sum({n});
+    x.initialize(rgen);
+    y.initialize(rgen);
+    sum = max(x, y) + min(x, y);
+    for (int i = 0; i < n; i++) {
+        assert(sum(i) == x(i) + y(i));
+    }
+    set_native_num_threads(std::thread::hardware_concurrency());
+}
+
 int main() {
     test_data();
     test_sum();
+    test_memory_plan();
+    test_parallel_branches();
+    test_dynamic_batch();
+    test_fold_batch_norm();
+    test_profiler();
+    test_native();
+    test_conv_tuning();
+    test_allocator();
+    test_concat_slices();
+    test_parallel_concat_slices();
+    test_layouts();
+    test_model_io();
+    test_param_streaming();
+    test_half_params();
+    test_quantized();
+    test_calibration();
+    test_elementwise();
+    test_expressions();
     return 0;
 }